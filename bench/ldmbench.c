@@ -0,0 +1,197 @@
+/*
+ * Time the metadata phases of d2b on one disk image and count the calls
+ * each phase makes through bdev. Every run is a fresh child process, so the
+ * parser starts from empty lists; the best run is reported. With -t the image
+ * is a trace taken with d2b --trace, replayed from memory; -m serves the
+ * image from memory with the latency and faults of memdev options.
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bdev.h"
+#include "gpt.h"
+#include "ldm.h"
+#include "list.h"
+#include "mbr.h"
+#include "memdev.h"
+#include "trace.h"
+
+enum {
+    PHASE_PROBE = 0,
+    PHASE_DATABASE,
+    PHASE_RESOLVE,
+    NR_PHASES,
+};
+
+static const char *phase_names[NR_PHASES] = { "probe", "database",
+                                              "resolve" };
+
+typedef struct _phase_result {
+    double usec;
+    bdev_stats stats;
+} phase_result;
+
+typedef struct _run_result {
+    int ok;
+    uint32_t nr_partitions;
+    phase_result phases[NR_PHASES];
+} run_result;
+
+static double now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void phase_start(double *start) {
+    bdev_reset_stats();
+    *start = now_usec();
+}
+
+static void phase_end(phase_result *phase, double start) {
+    phase->usec = now_usec() - start;
+    bdev_get_stats(&phase->stats);
+}
+
+/* stdout of the phases is noise here */
+static void quiet(void) {
+    int null = open("/dev/null", O_WRONLY);
+
+    if (null >= 0) {
+        fflush(stdout);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+}
+
+static int replay = 0;
+static const char *memdev_options;
+
+static void run_once(const char *path, run_result *result) {
+    struct list_head entries = LIST_HEAD_INIT(entries);
+    struct list_head *pos;
+    uint64_t start, size;
+    legacy_mbr mbr;
+    double t;
+    int fd;
+
+    memset(result, 0, sizeof(*result));
+
+    fd = replay ? trace_replay(path) : open(path, O_RDONLY);
+    if (fd < 0 || (memdev_options && memdev_attach(fd, memdev_options)))
+        return;
+
+    phase_start(&t);
+    if (read_mbr(fd, &mbr) != MBR_ERROR_OK)
+        return;
+    if (mbr.partition[0].os_type == MBR_PART_EFI_PROTECTIVE) {
+        gpt_header header;
+
+        if (read_gpt_header(fd, &header))
+            return;
+    }
+    phase_end(&result->phases[PHASE_PROBE], t);
+
+    phase_start(&t);
+    if (ldm_read_database(fd))
+        return;
+    phase_end(&result->phases[PHASE_DATABASE], t);
+
+    phase_start(&t);
+    if (ldm_get_logical_disk(&start, &size) || parse_ldm(start, &entries))
+        return;
+    phase_end(&result->phases[PHASE_RESOLVE], t);
+
+    list_for_each(pos, &entries) result->nr_partitions++;
+    result->ok = 1;
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    run_result best, result;
+    int opt, runs = 5, i, p;
+
+    while ((opt = getopt(argc, argv, "s:r:tm:")) != -1) {
+        switch (opt) {
+        case 's':
+            bdev_set_image_sector_size(atoi(optarg));
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 't':
+            replay = 1;
+            break;
+        case 'm':
+            memdev_options = optarg;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1 || runs <= 0) {
+        printf("Usage: ldmbench [-s sector_size] [-r runs] [-t] "
+               "[-m memdev_options] image\n");
+        return 1;
+    }
+
+    memset(&best, 0, sizeof(best));
+    for (i = 0; i < runs; i++) {
+        int pipefd[2], status;
+        pid_t pid;
+
+        if (pipe(pipefd))
+            return 1;
+
+        pid = fork();
+        if (pid == 0) {
+            close(pipefd[0]);
+            quiet();
+            run_once(argv[optind], &result);
+            if (write(pipefd[1], &result, sizeof(result)) != sizeof(result))
+                _exit(1);
+            _exit(0);
+        }
+
+        close(pipefd[1]);
+        if (pid < 0 ||
+            read(pipefd[0], &result, sizeof(result)) != sizeof(result) ||
+            !result.ok) {
+            printf("ldmbench: run %d on %s failed\n", i, argv[optind]);
+            return 1;
+        }
+        close(pipefd[0]);
+        waitpid(pid, &status, 0);
+
+        for (p = 0; p < NR_PHASES; p++) {
+            if (!best.ok || result.phases[p].usec < best.phases[p].usec)
+                best.phases[p] = result.phases[p];
+        }
+        best.nr_partitions = result.nr_partitions;
+        best.ok = 1;
+    }
+
+    printf("%-10s %12s %8s %8s %8s %12s %12s\n", "phase", "usec", "ioctls",
+           "reads", "writes", "bytes read", "bytes written");
+    for (p = 0; p < NR_PHASES; p++) {
+        const phase_result *phase = &best.phases[p];
+
+        printf("%-10s %12.1f %8lu %8lu %8lu %12lu %12lu\n", phase_names[p],
+               phase->usec, phase->stats.ioctls, phase->stats.reads,
+               phase->stats.writes, phase->stats.bytes_read,
+               phase->stats.bytes_written);
+    }
+    printf("%u partitions on this disk, best of %d runs\n", best.nr_partitions,
+           runs);
+
+    return 0;
+}
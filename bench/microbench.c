@@ -0,0 +1,322 @@
+/*
+ * Microbenchmarks of the LDM decoding kernels and the GPT checksum, run over
+ * the VBLK records of a real or generated disk image.
+ *
+ * ldm.c is included directly to reach its static parsers, with malloc and
+ * calloc wrapped to count allocations. Each kernel runs warmup passes over
+ * all records, then timed passes on a pinned CPU; the median pass is
+ * reported per record.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+static uint64_t nr_allocs;
+
+static void *bench_malloc(size_t size) {
+    nr_allocs++;
+    return malloc(size);
+}
+
+static void *bench_calloc(size_t nmemb, size_t size) {
+    nr_allocs++;
+    return calloc(nmemb, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(nmemb, size) bench_calloc(nmemb, size)
+#include "../src/ldm.c"
+#undef malloc
+#undef calloc
+
+#define MAX_PASSES 1001
+
+typedef struct _kernel {
+    const char *name;
+    void (*run)(void);
+    void (*reset)(void); /* untimed, after every pass */
+    uint64_t items;      /* per pass */
+} kernel;
+
+static const uint8_t **records;
+static size_t *records_avail; /* bytes of the database from each record */
+static uint32_t nr_records;
+static uint32_t record_len;
+static gpt_entry *gpt_entries;
+static size_t gpt_entries_size;
+static volatile uint64_t sink;
+
+static double now_nsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the first field of every record is its id */
+static const uint8_t *record_fields(const uint8_t *record) {
+    return record + sizeof(vblk_record);
+}
+
+static void run_var_uint(void) {
+    uint32_t i;
+
+    for (i = 0; i < nr_records; i++)
+        sink += var_uint(record_fields(records[i]));
+}
+
+/* the name follows the id */
+static void run_var_string(void) {
+    uint32_t i;
+
+    for (i = 0; i < nr_records; i++) {
+        const uint8_t *var = record_fields(records[i]);
+        vblk_string str;
+        char *name;
+
+        var += 1 + *var;
+        str.len = *var;
+        str.data = (const char *)var + 1;
+        name = vblk_strdup(&str);
+        if (name) {
+            sink += name[0];
+            free(name);
+        }
+    }
+}
+
+static void run_parse_vblk(void) {
+    uint32_t i;
+
+    for (i = 0; i < nr_records; i++)
+        sink += parse_vblk(records[i], record_len, records_avail[i]);
+}
+
+static void run_uuid_compare(void) {
+    struct list_head *pos;
+
+    list_for_each(pos, &volume_list) {
+        sink += !uuid_compare(list_entry(pos, vblk_volume, list)->guid,
+                              cur_dev_guid);
+    }
+}
+
+static void run_gpt_crc32(void) {
+    sink += crc32(0, (const Bytef *)gpt_entries, gpt_entries_size);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench(const kernel *k, int warmup, int passes) {
+    double times[MAX_PASSES], start;
+    uint64_t allocs;
+    int i;
+
+    if (!k->items)
+        return;
+
+    for (i = 0; i < warmup; i++) {
+        k->run();
+        if (k->reset)
+            k->reset();
+    }
+
+    allocs = nr_allocs;
+    for (i = 0; i < passes; i++) {
+        start = now_nsec();
+        k->run();
+        times[i] = now_nsec() - start;
+        if (k->reset)
+            k->reset();
+    }
+    allocs = nr_allocs - allocs;
+
+    qsort(times, passes, sizeof(double), cmp_double);
+    printf("%-14s %10lu %12.1f %12.1f %12.1f %10.2f\n", k->name, k->items,
+           times[passes / 2] / k->items, times[0] / k->items,
+           times[passes - 1] / k->items,
+           (double)allocs / passes / k->items);
+}
+
+/*
+ * Copy the single-VBLK records of the database, records spread over several
+ * VBLKs are left out.
+ */
+static int capture_records(int fd) {
+    const vmdb *db = NULL;
+    const uint8_t *vblk, *end;
+    tocblock_bitmap_fields bitmap;
+    privhead_fields head_fields;
+    vmdb_fields db_fields;
+    privhead *head;
+    uint8_t *config;
+    uint64_t lba, config_size;
+    tocblock *toc;
+    uint32_t i, max;
+
+    if (ldm_find_privhead(fd, &lba))
+        return -1;
+
+    head = alloc_read_privhead(fd, lba);
+    if (!head)
+        return -1;
+    if (uuid_parse(head->disk_guid, (unsigned char *)&cur_dev_guid) == -1)
+        return -1;
+
+    config = alloc_read_config(fd, head);
+    if (!config)
+        return -1;
+    privhead_decode(head, &head_fields);
+    config_size = head_fields.ldm_config_size * bdev_get_sector_size(fd);
+    end = config + config_size;
+
+    toc = (tocblock *)(config + bdev_get_sector_size(fd) * 2);
+    for (i = 0; i < 2; i++) {
+        if (!memcmp(toc->bitmap[i].name, "config", 6)) {
+            tocblock_bitmap_decode(&toc->bitmap[i], &bitmap);
+            db = (vmdb *)(config + bitmap.start * bdev_get_sector_size(fd));
+        }
+    }
+    if (!db || memcmp(db->magic, "VMDB", 4)) {
+        printf("microbench: not found VMDB\n");
+        return -1;
+    }
+
+    vmdb_decode(db, &db_fields);
+    record_len = db_fields.vblk_size - sizeof(vblk_head);
+    max = config_size / db_fields.vblk_size;
+    records = calloc(max, sizeof(uint8_t *));
+    records_avail = calloc(max, sizeof(size_t));
+    if (!records || !records_avail)
+        return -1;
+
+    for (vblk = (const uint8_t *)db + db_fields.vblk_first_offset;
+         vblk + db_fields.vblk_size <= end && !memcmp(vblk, "VBLK", 4);
+         vblk += db_fields.vblk_size) {
+        const vblk_head *vh = (const vblk_head *)vblk;
+        const vblk_record *rec =
+            (const vblk_record *)(vblk + sizeof(vblk_head));
+        vblk_head_fields head;
+
+        vblk_head_decode(vh, &head);
+        if (head.num_records > 1 || (rec->type & 0x0F) == VBLK_BLACK)
+            continue;
+        records[nr_records] = vblk + sizeof(vblk_head);
+        records_avail[nr_records] = end - records[nr_records];
+        nr_records++;
+    }
+
+    free(head);
+    return 0;
+}
+
+static void capture_gpt(int fd) {
+    gpt_header_fields f;
+    gpt_header header;
+
+    if (read_gpt_header(fd, &header))
+        return;
+
+    gpt_header_decode(&header, &f);
+    gpt_entries_size =
+        (size_t)f.num_partition_entries * f.sizeof_partition_entry;
+    gpt_entries = malloc(gpt_entries_size);
+    if (gpt_entries &&
+        read_gpt_entry(fd, &header, gpt_entries, gpt_entries_size)) {
+        free(gpt_entries);
+        gpt_entries = NULL;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int opt, fd, cpu = -1, warmup = 3, passes = 21;
+    uint32_t nr_volumes = 0;
+    cpu_set_t set;
+    legacy_mbr mbr;
+
+    while ((opt = getopt(argc, argv, "c:w:n:s:")) != -1) {
+        switch (opt) {
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        case 's':
+            bdev_set_image_sector_size(atoi(optarg));
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1 || passes <= 0 || passes > MAX_PASSES) {
+        printf("Usage: microbench [-c cpu] [-w warmup] [-n passes] "
+               "[-s sector_size] image\n");
+        return 1;
+    }
+
+    /* stay on one CPU, the current one unless -c is given */
+    if (cpu < 0)
+        cpu = sched_getcpu();
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set))
+        printf("microbench: failed to pin to cpu %d\n", cpu);
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || read_mbr(fd, &mbr) != MBR_ERROR_OK ||
+        capture_records(fd)) {
+        printf("microbench: failed to read %s\n", argv[optind]);
+        return 1;
+    }
+    if (mbr.partition[0].os_type == MBR_PART_EFI_PROTECTIVE)
+        capture_gpt(fd);
+    close(fd);
+
+    /* uuid_compare runs over the parsed volumes, parse_vblk frees them */
+    run_parse_vblk();
+    {
+        struct list_head *pos;
+        list_for_each(pos, &volume_list) nr_volumes++;
+    }
+
+    {
+        const kernel kernels[] = {
+            { "var_uint", run_var_uint, NULL, nr_records },
+            { "var_string", run_var_string, NULL, nr_records },
+            { "uuid_compare", run_uuid_compare, NULL, nr_volumes },
+            { "parse_vblk", run_parse_vblk, ldm_reset, nr_records },
+            { "gpt_crc32", run_gpt_crc32, NULL, gpt_entries ? 1 : 0 },
+        };
+        unsigned int i;
+
+        printf("%u records, cpu %d, %d warmup and %d timed passes\n",
+               nr_records, cpu, warmup, passes);
+        printf("%-14s %10s %12s %12s %12s %10s\n", "kernel", "items",
+               "ns/item", "min", "max", "allocs");
+        for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+            bench(&kernels[i], warmup, passes);
+    }
+
+    if (gpt_entries)
+        printf("gpt_crc32 covers %zu bytes of entries\n", gpt_entries_size);
+
+    return 0;
+}
@@ -0,0 +1,528 @@
+/*
+ * Write synthetic LDM disk images for benchmarks.
+ *
+ * Every volume is spanned over its extents, which are spread round robin
+ * over the disks of the group. The first disk is written to the image path,
+ * the others to image.1, image.2 and so on. Images are sparse, only the
+ * partition tables and the LDM database are written.
+ */
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+#include <zlib.h>
+
+#include "gpt.h"
+#include "ldm.h"
+#include "mbr.h"
+
+#define VBLK_SIZE 128
+#define VBLK_DATA_SIZE (VBLK_SIZE - sizeof(vblk_head))
+#define VBLK_FIRST_OFFSET 512
+#define VMDB_SECTOR 17 /* start of "config" in the TOCBLOCK */
+#define EXTENT_SIZE (1024 * 1024)
+#define ALIGN_SIZE (1024 * 1024)
+#define GPT_ENTRY_SIZE 128
+#define LONG_NAME_SIZE 200
+
+typedef struct _record {
+    uint8_t data[512];
+    size_t len;
+} record;
+
+typedef struct _disk {
+    char path[4096];
+    uint32_t id;
+    uuid_t guid;
+    uint64_t nr_extents;
+    uint64_t cursor; /* next free sector in the logical disk */
+} disk;
+
+static record *records;
+static uint32_t nr_records;
+static uint32_t nr_blocks;
+
+static uint32_t sector_size = 512;
+static uint32_t nr_volumes = 1;
+static uint32_t nr_extents = 1;
+static uint32_t nr_disks = 1;
+static uint32_t nr_extended = 0;
+static int use_gpt = 0;
+
+static void put_bytes(record *r, const void *p, size_t n) {
+    memcpy(r->data + r->len, p, n);
+    r->len += n;
+}
+
+static void put_zero(record *r, size_t n) {
+    memset(r->data + r->len, 0, n);
+    r->len += n;
+}
+
+static void put_u8(record *r, uint8_t v) {
+    r->data[r->len++] = v;
+}
+
+static void put_be64(record *r, uint64_t v) {
+    v = htobe64(v);
+    put_bytes(r, &v, 8);
+}
+
+/* variable length big endian integer, prefixed by its length */
+static void put_var(record *r, uint64_t v) {
+    int len = 1, i;
+
+    while (len < 8 && (v >> (len * 8)))
+        len++;
+
+    put_u8(r, len);
+    for (i = len - 1; i >= 0; i--)
+        put_u8(r, v >> (i * 8));
+}
+
+static void put_str(record *r, const char *s) {
+    put_u8(r, strlen(s));
+    put_bytes(r, s, strlen(s));
+}
+
+static record *new_record(uint8_t type, uint8_t revision) {
+    record *r = &records[nr_records++];
+    vblk_record *rec = (vblk_record *)r->data;
+
+    memset(r, 0, sizeof(*r));
+    rec->status = 0;
+    rec->flags = 0;
+    rec->type = (revision << 4) | type;
+    r->len = sizeof(vblk_record);
+
+    return r;
+}
+
+static void end_record(record *r) {
+    vblk_record *rec = (vblk_record *)r->data;
+
+    rec->size = htobe32(r->len - sizeof(vblk_record));
+    nr_blocks += (r->len + VBLK_DATA_SIZE - 1) / VBLK_DATA_SIZE;
+}
+
+static void build_database(disk *disks, uint64_t extent_sectors) {
+    uint32_t id = 1, v, e, i;
+    record *r;
+
+    r = new_record(5, 3); /* disk group */
+    put_var(r, id++);
+    put_str(r, "bench-dg");
+    end_record(r);
+
+    for (i = 0; i < nr_disks; i++) {
+        char name[32];
+
+        disks[i].id = id++;
+        r = new_record(4, 4);
+        put_var(r, disks[i].id);
+        snprintf(name, sizeof(name), "Disk%u", i + 1);
+        put_str(r, name);
+        put_bytes(r, disks[i].guid, sizeof(uuid_t));
+        end_record(r);
+    }
+
+    for (v = 0; v < nr_volumes; v++) {
+        uint32_t volume_id = id++, component_id = id++;
+        char name[LONG_NAME_SIZE + 1];
+        uuid_t guid;
+
+        /* long names spread the record over several VBLKs */
+        if (v < nr_extended) {
+            memset(name, 'x', LONG_NAME_SIZE);
+            name[LONG_NAME_SIZE] = '\0';
+            memcpy(name, "Volume", 6);
+            snprintf(name + 6, 12, "%u", v + 1);
+            name[strlen(name)] = '-';
+        } else {
+            snprintf(name, sizeof(name), "Volume%u", v + 1);
+        }
+
+        r = new_record(1, 5);
+        put_var(r, volume_id);
+        put_str(r, name);
+        put_str(r, "gen");
+        put_u8(r, 0);
+        put_bytes(r, "ACTIVE\0\0\0\0\0\0\0\0", 14);
+        put_u8(r, VOLUME_TYPE_GEN);
+        put_u8(r, 0);
+        put_u8(r, v + 1);
+        put_zero(r, 3);
+        put_u8(r, 0);
+        put_var(r, 1);
+        put_zero(r, 16);
+        put_var(r, nr_extents * extent_sectors);
+        put_zero(r, 4);
+        put_u8(r, 0x07);
+        uuid_generate(guid);
+        put_bytes(r, guid, sizeof(uuid_t));
+        end_record(r);
+
+        r = new_record(2, 3);
+        put_var(r, component_id);
+        snprintf(name, sizeof(name), "Volume%u-01", v + 1);
+        put_str(r, name);
+        put_u8(r, 0);
+        put_u8(r, COMPONENT_TYPE_SPANNED);
+        put_zero(r, 4);
+        put_var(r, nr_extents);
+        put_zero(r, 16);
+        put_var(r, volume_id);
+        put_zero(r, 1);
+        end_record(r);
+
+        for (e = 0; e < nr_extents; e++) {
+            disk *d = &disks[(v * nr_extents + e) % nr_disks];
+
+            r = new_record(3, 3);
+            put_var(r, id++);
+            snprintf(name, sizeof(name), "Disk%u-%02u",
+                     (uint32_t)(d - disks) + 1, e + 1);
+            put_str(r, name);
+            put_zero(r, 12);
+            put_be64(r, d->cursor);
+            put_be64(r, e * extent_sectors);
+            put_var(r, extent_sectors);
+            put_var(r, component_id);
+            put_var(r, d->id);
+            end_record(r);
+
+            d->cursor += extent_sectors;
+            d->nr_extents++;
+        }
+    }
+}
+
+static int pwrite_full(int fd, const void *buffer, size_t count,
+                       uint64_t offset) {
+    if (pwrite(fd, buffer, count, offset) != (ssize_t)count) {
+        printf("mkldm: failed to write, errno is %d\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Fill the config: TOCBLOCK in sector 2, VMDB in sector 17 and the VBLKs
+ * after it, records larger than one VBLK are split over several.
+ */
+static void fill_config(uint8_t *config, uint64_t config_sectors) {
+    tocblock *toc = (tocblock *)(config + 2 * sector_size);
+    vmdb *db = (vmdb *)(config + VMDB_SECTOR * sector_size);
+    uint8_t *vblk = (uint8_t *)db + VBLK_FIRST_OFFSET;
+    uint32_t i, group = 1, seq = 1;
+
+    memcpy(toc->magic, "TOCBLOCK", 8);
+    memcpy(toc->bitmap[0].name, "config", 6);
+    toc->bitmap[0].start = htobe64(VMDB_SECTOR);
+    toc->bitmap[0].size = htobe64(config_sectors - VMDB_SECTOR);
+    memcpy(toc->bitmap[1].name, "log", 3);
+
+    memcpy(db->magic, "VMDB", 4);
+    db->vblk_last = htobe32(nr_blocks + VBLK_FIRST_OFFSET / VBLK_SIZE - 1);
+    db->vblk_size = htobe32(VBLK_SIZE);
+    db->vblk_first_offset = htobe32(VBLK_FIRST_OFFSET);
+    db->version_major = htobe16(4);
+    db->version_minor = htobe16(10);
+    strcpy(db->disk_group_name, "bench-dg");
+    db->committed_seq = htobe64(nr_records);
+    db->pending_seq = htobe64(nr_records);
+
+    for (i = 0; i < nr_records; i++, group++) {
+        const record *r = &records[i];
+        uint16_t parts = (r->len + VBLK_DATA_SIZE - 1) / VBLK_DATA_SIZE, p;
+
+        for (p = 0; p < parts; p++, vblk += VBLK_SIZE) {
+            vblk_head *head = (vblk_head *)vblk;
+            size_t len = r->len - p * VBLK_DATA_SIZE;
+
+            if (len > VBLK_DATA_SIZE)
+                len = VBLK_DATA_SIZE;
+
+            memcpy(head->magic, "VBLK", 4);
+            head->sequence_number = htobe32(seq++);
+            head->group_number = htobe32(group);
+            head->record_number = htobe16(p);
+            head->num_records = htobe16(parts);
+            memcpy(vblk + sizeof(vblk_head), r->data + p * VBLK_DATA_SIZE,
+                   len);
+        }
+    }
+}
+
+static void fill_privhead(privhead *head, const disk *d, uint64_t data_start,
+                          uint64_t data_size, uint64_t config_start,
+                          uint64_t config_sectors) {
+    memset(head, 0, sizeof(*head));
+    memcpy(head->magic, "PRIVHEAD", 8);
+    head->version_major = htobe16(2);
+    head->version_minor = htobe16(12);
+    uuid_unparse_lower(d->guid, head->disk_guid);
+    strcpy(head->host_guid, "00000000-0000-0000-0000-000000000000");
+    strcpy(head->disk_group_guid, "11111111-2222-3333-4444-555555555555");
+    strcpy(head->disk_group_name, "bench-dg");
+    head->logical_disk_start = htobe64(data_start);
+    head->logical_disk_size = htobe64(data_size);
+    head->ldm_config_start = htobe64(config_start);
+    head->ldm_config_size = htobe64(config_sectors);
+    head->n_tocs = htobe64(2);
+    head->toc_size = htobe64(2);
+    head->n_configs = htobe32(1);
+    head->n_logs = htobe32(1);
+    head->config_size = htobe64(config_sectors);
+}
+
+static int write_gpt(int fd, const disk *d, uint64_t total, uint64_t meta_start,
+                     uint64_t meta_end, uint64_t data_start,
+                     uint64_t data_size, uint32_t nr_entries) {
+    uint64_t entry_sectors = (uint64_t)nr_entries * GPT_ENTRY_SIZE / sector_size;
+    gpt_entry *entries = calloc(nr_entries, GPT_ENTRY_SIZE);
+    uint8_t *sector = calloc(1, sector_size);
+    gpt_header header;
+    int ret = -1;
+
+    if (!entries || !sector) {
+        printf("mkldm: failed to malloc\n");
+        goto out;
+    }
+
+    uuid_copy(entries[0].type, PARTITION_LDM_METADATA_GUID);
+    uuid_generate(entries[0].guid);
+    entries[0].first_lba = htole64(meta_start);
+    entries[0].last_lba = htole64(meta_end);
+    uuid_copy(entries[1].type, PARTITION_LDM_DATA_GUID);
+    uuid_generate(entries[1].guid);
+    entries[1].first_lba = htole64(data_start);
+    entries[1].last_lba = htole64(data_start + data_size - 1);
+
+    memset(&header, 0, sizeof(header));
+    header.signature = htole64(0x5452415020494645ULL);
+    header.revision = htole32(0x00010000);
+    header.header_size = htole32(sizeof(gpt_header));
+    header.current_lba = htole64(1);
+    header.alternate_lba = htole64(total - 1);
+    header.first_usable_lba = htole64(2 + entry_sectors);
+    header.last_usable_lba = htole64(total - 2 - entry_sectors);
+    uuid_generate(header.disk_guid);
+    header.partition_entry_lba = htole64(2);
+    header.num_partition_entries = htole32(nr_entries);
+    header.sizeof_partition_entry = htole32(GPT_ENTRY_SIZE);
+    header.partition_entry_array_crc32 = htole32(
+        crc32(0, (const Bytef *)entries, nr_entries * GPT_ENTRY_SIZE));
+    header.header_crc32 = htole32(crc32(0, (const Bytef *)&header,
+                                        sizeof(header)));
+
+    memcpy(sector, &header, sizeof(header));
+    if (pwrite_full(fd, sector, sector_size, sector_size) ||
+        pwrite_full(fd, entries, nr_entries * GPT_ENTRY_SIZE,
+                    2 * sector_size))
+        goto out;
+
+    header.header_crc32 = 0;
+    header.current_lba = htole64(total - 1);
+    header.alternate_lba = htole64(1);
+    header.partition_entry_lba = htole64(total - 1 - entry_sectors);
+    header.header_crc32 = htole32(crc32(0, (const Bytef *)&header,
+                                        sizeof(header)));
+
+    memcpy(sector, &header, sizeof(header));
+    if (pwrite_full(fd, sector, sector_size, (total - 1) * sector_size) ||
+        pwrite_full(fd, entries, nr_entries * GPT_ENTRY_SIZE,
+                    (total - 1 - entry_sectors) * sector_size))
+        goto out;
+
+    ret = 0;
+
+out:
+    free(sector);
+    free(entries);
+    return ret;
+}
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+static int write_disk(const disk *d, uint64_t extent_sectors) {
+    uint64_t align = ALIGN_SIZE / sector_size;
+    uint64_t data_size = d->nr_extents * extent_sectors;
+    uint64_t config_bytes, config_sectors, config_start, data_start, total;
+    uint64_t privhead_lba, meta_start = 0;
+    uint32_t nr_entries = 128;
+    uint8_t *config = NULL, *sector = NULL;
+    legacy_mbr *mbr;
+    int fd, ret = -1;
+
+    config_bytes = VMDB_SECTOR * sector_size + VBLK_FIRST_OFFSET +
+                   (uint64_t)(nr_blocks + 1) * VBLK_SIZE;
+    if (config_bytes < ALIGN_SIZE)
+        config_bytes = ALIGN_SIZE;
+    config_sectors = align_up(config_bytes, sector_size) / sector_size;
+
+    if (use_gpt) {
+        uint64_t entry_sectors;
+
+        while (nr_entries < d->nr_extents + 2)
+            nr_entries *= 2;
+        entry_sectors = (uint64_t)nr_entries * GPT_ENTRY_SIZE / sector_size;
+
+        /* the PRIVHEAD is the last sector of the metadata partition */
+        meta_start = align_up(2 + entry_sectors, align);
+        config_start = meta_start;
+        privhead_lba = meta_start + config_sectors;
+        data_start = align_up(privhead_lba + 1, align);
+        total = data_start + data_size + 1 + entry_sectors + 1;
+    } else {
+        data_start = align;
+        privhead_lba = MBR_PRIVHEAD_SECTOR;
+        config_start = data_start + data_size;
+        total = config_start + config_sectors;
+    }
+
+    config = calloc(config_sectors, sector_size);
+    sector = calloc(1, sector_size);
+    if (!config || !sector) {
+        printf("mkldm: failed to malloc\n");
+        goto out;
+    }
+
+    fd = open(d->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("mkldm: failed to open %s, errno is %d\n", d->path, errno);
+        goto out;
+    }
+
+    if (ftruncate(fd, total * sector_size)) {
+        printf("mkldm: failed to resize %s, errno is %d\n", d->path, errno);
+        goto out_close;
+    }
+
+    mbr = (legacy_mbr *)sector;
+    mbr->signature = htole16(MSDOS_MBR_SIGNATURE);
+    mbr->partition[0].os_type =
+        use_gpt ? MBR_PART_EFI_PROTECTIVE : MBR_PART_WINDOWS_LDM;
+    mbr->partition[0].starting_lba = htole32(use_gpt ? 1 : data_start);
+    mbr->partition[0].size_in_lba =
+        htole32(total - 1 > 0xffffffff ? 0xffffffff : total - 1);
+    if (pwrite_full(fd, sector, sector_size, 0))
+        goto out_close;
+
+    if (use_gpt &&
+        write_gpt(fd, d, total, meta_start, privhead_lba, data_start,
+                  data_size, nr_entries))
+        goto out_close;
+
+    memset(sector, 0, sector_size);
+    fill_privhead((privhead *)sector, d, data_start, data_size, config_start,
+                  config_sectors);
+    if (pwrite_full(fd, sector, sector_size, privhead_lba * sector_size))
+        goto out_close;
+
+    fill_config(config, config_sectors);
+    if (pwrite_full(fd, config, config_sectors * sector_size,
+                    config_start * sector_size))
+        goto out_close;
+
+    ret = 0;
+
+out_close:
+    close(fd);
+out:
+    free(sector);
+    free(config);
+    return ret;
+}
+
+static void usage(void) {
+    printf("Usage: mkldm [-g] [-s sector_size] [-v volumes] [-e extents] "
+           "[-d disks] [-x extended] image\n"
+           "  -g  GPT disks instead of MBR\n"
+           "  -s  sector size (default: 512)\n"
+           "  -v  number of volumes (default: 1)\n"
+           "  -e  extents per volume (default: 1)\n"
+           "  -d  disks in the group (default: 1)\n"
+           "  -x  volumes whose records span several VBLKs (default: 0)\n");
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t extent_sectors;
+    disk *disks;
+    uint32_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "gs:v:e:d:x:h")) != -1) {
+        switch (opt) {
+        case 'g':
+            use_gpt = 1;
+            break;
+        case 's':
+            sector_size = atoi(optarg);
+            break;
+        case 'v':
+            nr_volumes = atoi(optarg);
+            break;
+        case 'e':
+            nr_extents = atoi(optarg);
+            break;
+        case 'd':
+            nr_disks = atoi(optarg);
+            break;
+        case 'x':
+            nr_extended = atoi(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1 || sector_size < 512 ||
+        (sector_size & (sector_size - 1)) || !nr_volumes || !nr_extents ||
+        !nr_disks) {
+        usage();
+        return 1;
+    }
+
+    extent_sectors = EXTENT_SIZE / sector_size;
+    records = calloc(1 + nr_disks + nr_volumes * (2 + nr_extents),
+                     sizeof(record));
+    disks = calloc(nr_disks, sizeof(disk));
+    if (!records || !disks) {
+        printf("mkldm: failed to malloc\n");
+        return 1;
+    }
+
+    for (i = 0; i < nr_disks; i++) {
+        if (i)
+            snprintf(disks[i].path, sizeof(disks[i].path), "%s.%u",
+                     argv[optind], i);
+        else
+            snprintf(disks[i].path, sizeof(disks[i].path), "%s",
+                     argv[optind]);
+        uuid_generate(disks[i].guid);
+    }
+
+    build_database(disks, extent_sectors);
+
+    for (i = 0; i < nr_disks; i++) {
+        if (write_disk(&disks[i], extent_sectors))
+            return 1;
+    }
+
+    printf("mkldm: %u disks, %u volumes, %u records in %u vblks\n", nr_disks,
+           nr_volumes, nr_records, nr_blocks);
+
+    free(disks);
+    free(records);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Generate LDM disk images with growing databases and time probe, parse and
+# conversion of each. Run through `make bench`.
+#
+set -e
+
+dir=$(dirname "$0")
+d2b="$dir/../d2b"
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/d2b-bench.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+
+VOLUMES=${VOLUMES:-"1 16 128 1024 4096"}
+SECTOR_SIZES=${SECTOR_SIZES:-"512 4096"}
+RUNS=${RUNS:-5}
+
+for style in mbr gpt; do
+    for sector_size in $SECTOR_SIZES; do
+        for volumes in $VOLUMES; do
+            flags="-s $sector_size -v $volumes -e 2 -d 2 -x $((volumes / 8))"
+            [ $style = gpt ] && flags="-g $flags"
+
+            echo "== $style, $sector_size byte sectors, $volumes volumes"
+            "$dir/mkldm" $flags "$tmp/disk.img"
+            "$dir/ldmbench" -s $sector_size -r $RUNS "$tmp/disk.img"
+
+            # MBR has room for four partitions only
+            if [ $style = gpt ] || [ $volumes -le 4 ]; then
+                cp --sparse=always "$tmp/disk.img" "$tmp/convert.img"
+                start=$(date +%s%N)
+                if "$d2b" -y -s $sector_size "$tmp/convert.img" \
+                    > "$tmp/convert.log" 2>&1; then
+                    end=$(date +%s%N)
+                    echo "convert    $(((end - start) / 1000)) usec end to end"
+                else
+                    echo "convert    failed:"
+                    tail -n 3 "$tmp/convert.log"
+                fi
+            fi
+            echo
+        done
+    done
+done
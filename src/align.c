@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "align.h"
+#include "bdev.h"
+#include "debug.h"
+#include "ldm.h"
+#include "mover.h"
+#include "ntfs.h"
+#include "verify.h"
+#include "volume.h"
+#include "workq.h"
+
+static int overlap(uint64_t a, uint64_t a_size, uint64_t b, uint64_t b_size) {
+    return a < b + b_size && b < a + a_size;
+}
+
+/*
+ * A target is usable if it stays inside the LDM data area and does not touch
+ * the old or the new location of any other partition, so the moves can be
+ * done in any order.
+ */
+static int align_target_fits(struct list_head *new_entries,
+                             const partition_data *part, uint64_t target,
+                             uint64_t area_start, uint64_t area_end) {
+    struct list_head *pos;
+
+    if (target < area_start || target + part->size > area_end)
+        return 0;
+
+    list_for_each(pos, new_entries) {
+        partition_data *other = list_entry(pos, partition_data, list);
+        if (other == part)
+            continue;
+
+        if (overlap(target, part->size, other->old_start, other->size) ||
+            overlap(target, part->size, other->start, other->size))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int align_find_target(struct list_head *new_entries,
+                             const partition_data *part, uint64_t grain,
+                             uint64_t area_start, uint64_t area_end,
+                             uint64_t *target) {
+    uint64_t down = part->start - part->start % grain;
+    uint64_t up = down + grain;
+    int down_fits, up_fits;
+
+    down_fits = align_target_fits(new_entries, part, down, area_start, area_end);
+    up_fits = align_target_fits(new_entries, part, up, area_start, area_end);
+
+    if (down_fits && (!up_fits || part->start - down <= up - part->start)) {
+        *target = down;
+        return 0;
+    }
+
+    if (up_fits) {
+        *target = up;
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Move the partitions of new_entries to the physical block or optimal I/O
+ * grain, within the LDM data area [area_start, area_start + area_size).
+ */
+int align_partitions(int fd, struct list_head *new_entries,
+                     uint64_t area_start, uint64_t area_size) {
+    struct list_head *pos;
+    uint64_t target;
+    uint64_t io_grain = 0, pb_grain;
+    int sector_size, block_size, io_size;
+    int i = 0, moved = 0;
+
+    sector_size = bdev_get_sector_size(fd);
+    block_size = bdev_get_physical_block_size(fd);
+    io_size = bdev_get_optimal_io_size(fd);
+
+    pb_grain = block_size / sector_size;
+    if (io_size > 0 && io_size % block_size == 0)
+        io_grain = io_size / sector_size;
+
+    printf("Info: physical block size %d, optimal io size %d\n", block_size,
+           io_size);
+
+    if (pb_grain <= 1 && io_grain <= 1) {
+        printf("Info: device has no alignment requirement\n");
+        return 0;
+    }
+
+    if (!area_size) {
+        printf("Error: LDM data area is unknown\n");
+        return -1;
+    }
+
+    list_for_each(pos, new_entries) {
+        partition_data *part = list_entry(pos, partition_data, list);
+        int found = 0;
+        i++;
+
+        if (io_grain > 1 && part->start % io_grain)
+            found = !align_find_target(new_entries, part, io_grain, area_start,
+                                       area_start + area_size, &target);
+        if (!found && pb_grain > 1 && part->start % pb_grain)
+            found = !align_find_target(new_entries, part, pb_grain, area_start,
+                                       area_start + area_size, &target);
+
+        if (!found) {
+            if (pb_grain > 1 && part->start % pb_grain)
+                printf("Warning: partition %d at %lu can not be aligned, no "
+                       "free space around it\n",
+                       i - 1, part->start);
+            continue;
+        }
+
+        D("partition %d: %lu -> %lu\n", i - 1, part->start, target);
+        part->start = target;
+        moved++;
+    }
+
+    return moved;
+}
+
+static void align_journal_path(char *path, size_t size, const char *journal,
+                               int index) {
+    snprintf(path, size, "%s.%d", journal, index);
+}
+
+/*
+ * Restrict the copy of a partition to the clusters its file system uses. The
+ * runs are in volume coordinates and are clipped to the extent of the
+ * partition.
+ */
+static int align_allocated_runs(int fd, struct list_head *new_entries,
+                                const partition_data *part,
+                                mover_extent **runs, uint32_t *nr_runs) {
+    uint64_t sector_size = bdev_get_sector_size(fd);
+    uint64_t start = part->offset * sector_size;
+    uint64_t end = start + part->size * sector_size;
+    mover_extent *vol_runs;
+    uint32_t nr_vol_runs, i;
+    volume vol;
+    int ret = -1;
+
+    *runs = NULL;
+    *nr_runs = 0;
+
+    if (volume_open(fd, new_entries, part->volume_id, &vol))
+        return -1;
+
+    if (!ntfs_detect(&vol) ||
+        ntfs_get_allocated_runs(&vol, &vol_runs, &nr_vol_runs))
+        goto out;
+
+    *runs = malloc((nr_vol_runs ? nr_vol_runs : 1) * sizeof(mover_extent));
+    if (!*runs) {
+        printf("Error: failed to malloc\n");
+        free(vol_runs);
+        goto out;
+    }
+
+    for (i = 0; i < nr_vol_runs; i++) {
+        uint64_t run_start = vol_runs[i].offset;
+        uint64_t run_end = run_start + vol_runs[i].length;
+
+        if (run_end <= start || run_start >= end)
+            continue;
+
+        if (run_start < start)
+            run_start = start;
+        if (run_end > end)
+            run_end = end;
+
+        (*runs)[*nr_runs].offset = run_start - start;
+        (*runs)[*nr_runs].length = run_end - run_start;
+        (*nr_runs)++;
+    }
+
+    free(vol_runs);
+    ret = 0;
+
+out:
+    volume_close(&vol);
+    return ret;
+}
+
+/*
+ * Move the partitions whose start changed. With a manifest, every chunk is
+ * read back and compared with the data that was read, and the hashes are
+ * saved in manifest for later audits.
+ */
+int align_move_partitions(int fd, struct list_head *new_entries,
+                          const char *journal, int full_copy,
+                          const char *manifest) {
+    struct list_head *pos;
+    uint64_t sector_size = bdev_get_sector_size(fd);
+    mover_job *jobs;
+    mover_extent **runs;
+    char (*paths)[4096];
+    verify *v = NULL;
+    int nr_parts = 0, i = 0, ret = -1;
+
+    list_for_each(pos, new_entries) {
+        nr_parts++;
+    }
+
+    jobs = calloc(nr_parts, sizeof(mover_job));
+    runs = calloc(nr_parts, sizeof(mover_extent *));
+    paths = calloc(nr_parts, sizeof(*paths));
+    if (!jobs || !runs || !paths) {
+        printf("Error: failed to malloc\n");
+        goto out;
+    }
+
+    if (manifest) {
+        v = verify_create(fd, workq_default_threads());
+        if (!v)
+            goto out;
+    }
+
+    /* all journals are written before the first move changes the disk */
+    list_for_each(pos, new_entries) {
+        partition_data *part = list_entry(pos, partition_data, list);
+        mover_job *job = &jobs[i];
+
+        align_journal_path(paths[i], sizeof(paths[i]), journal, i);
+        job->src_fd = fd;
+        job->dst_fd = fd;
+        job->src_offset = part->old_start * sector_size;
+        job->dst_offset = part->start * sector_size;
+        job->length = part->size * sector_size;
+        job->journal = paths[i];
+        job->verify = v;
+
+        if (part->start != part->old_start && !full_copy &&
+            access(paths[i], F_OK) &&
+            !align_allocated_runs(fd, new_entries, part, &runs[i],
+                                  &job->nr_extents)) {
+            uint64_t used = 0;
+            uint32_t j;
+
+            for (j = 0; j < job->nr_extents; j++)
+                used += runs[i][j].length;
+            job->extents = runs[i];
+
+            printf("Info: partition %d is NTFS, %lu of %lu MiB in use\n", i,
+                   used >> 20, job->length >> 20);
+        }
+
+        if (part->start != part->old_start && mover_prepare(job))
+            goto out;
+
+        i++;
+    }
+
+    i = 0;
+    list_for_each(pos, new_entries) {
+        partition_data *part = list_entry(pos, partition_data, list);
+
+        if (part->start != part->old_start) {
+            printf("Info: moving partition %d from %lu to %lu (%lu sectors)\n",
+                   i, part->old_start, part->start, part->size);
+
+            if (mover_run(&jobs[i])) {
+                printf("Error: failed to move partition %d, rerun to "
+                       "resume\n",
+                       i);
+                goto out;
+            }
+        }
+
+        i++;
+    }
+
+    ret = v ? verify_finish(v, manifest) : 0;
+
+out:
+    verify_destroy(v);
+    for (i = 0; runs && i < nr_parts; i++)
+        free(runs[i]);
+    free(runs);
+    free(jobs);
+    free(paths);
+    return ret;
+}
+
+void align_remove_journals(struct list_head *new_entries, const char *journal) {
+    struct list_head *pos;
+    char path[4096];
+    int i = 0;
+
+    list_for_each(pos, new_entries) {
+        partition_data *part = list_entry(pos, partition_data, list);
+
+        if (part->start != part->old_start) {
+            align_journal_path(path, sizeof(path), journal, i);
+            unlink(path);
+        }
+
+        i++;
+    }
+}
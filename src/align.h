@@ -0,0 +1,15 @@
+#ifndef __ALIGN_H__
+#define __ALIGN_H__
+
+#include <stdint.h>
+
+#include "list.h"
+
+int align_partitions(int fd, struct list_head *new_entries,
+                     uint64_t area_start, uint64_t area_size);
+int align_move_partitions(int fd, struct list_head *new_entries,
+                          const char *journal, int full_copy,
+                          const char *manifest);
+void align_remove_journals(struct list_head *new_entries, const char *journal);
+
+#endif
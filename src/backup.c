@@ -0,0 +1,548 @@
+#include "backup.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bdev.h"
+
+/*
+ * A backup file is a store of snapshots, each the content some sectors of a
+ * disk had before d2b wrote to it. After the file header, records are only
+ * appended: a blob holds the content of one sector, a snapshot lists sectors
+ * by LBA and blob. Blobs are found by a hash of their content and shared by
+ * all snapshots, so the sectors cloned disks or the disks of a group have in
+ * common are stored once. Every record carries a CRC32, and a torn append is
+ * dropped by the next one.
+ */
+#define BACKUP_MAGIC "D2BBACKU"
+#define BACKUP_VERSION 1
+#define BACKUP_NAME_LEN 128
+#define BACKUP_HASH_BITS 12
+
+enum {
+    BACKUP_BLOB = 'B',
+    BACKUP_SNAPSHOT = 'S',
+};
+
+typedef struct _backup_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} __attribute__((__packed__)) backup_header;
+
+/* followed by size bytes, whose CRC32 is crc */
+typedef struct _backup_record {
+    uint8_t type;
+    uint32_t size;
+    uint32_t crc;
+} __attribute__((__packed__)) backup_record;
+
+/* followed by nr_sectors backup_sector */
+typedef struct _backup_snapshot {
+    uint64_t time;
+    uint64_t disk_size;
+    uint32_t sector_size;
+    uint32_t nr_sectors;
+    char name[BACKUP_NAME_LEN];
+} __attribute__((__packed__)) backup_snapshot;
+
+typedef struct _backup_sector {
+    uint64_t lba;
+    uint32_t blob;
+} __attribute__((__packed__)) backup_sector;
+
+typedef struct _backup_blob {
+    uint64_t hash;
+    uint64_t offset; /* of the content in the file */
+    uint32_t size;
+    int32_t next;    /* in the hash chain */
+} backup_blob;
+
+typedef struct _backup_store {
+    int fd;
+    uint64_t end; /* of the last valid record */
+
+    backup_blob *blobs;
+    uint32_t nr_blobs;
+    uint32_t max_blobs;
+    int32_t buckets[1 << BACKUP_HASH_BITS];
+
+    uint64_t *snapshots; /* offsets of their content */
+    uint32_t nr_snapshots;
+} backup_store;
+
+/* FNV-1a */
+static uint64_t hash_sector(const uint8_t *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static int add_blob(backup_store *s, uint64_t hash, uint64_t offset,
+                    uint32_t size) {
+    const uint32_t bucket = hash & ((1 << BACKUP_HASH_BITS) - 1);
+    backup_blob *b;
+
+    if (s->nr_blobs == s->max_blobs) {
+        uint32_t max = s->max_blobs ? s->max_blobs * 2 : 256;
+        backup_blob *blobs = realloc(s->blobs, max * sizeof(backup_blob));
+
+        if (!blobs) {
+            printf("backup: failed to malloc\n");
+            return -1;
+        }
+        s->blobs = blobs;
+        s->max_blobs = max;
+    }
+
+    b = &s->blobs[s->nr_blobs];
+    b->hash = hash;
+    b->offset = offset;
+    b->size = size;
+    b->next = s->buckets[bucket];
+    s->buckets[bucket] = s->nr_blobs;
+
+    return s->nr_blobs++;
+}
+
+static int add_snapshot(backup_store *s, uint64_t offset) {
+    uint64_t *snapshots =
+        realloc(s->snapshots, (s->nr_snapshots + 1) * sizeof(uint64_t));
+
+    if (!snapshots) {
+        printf("backup: failed to malloc\n");
+        return -1;
+    }
+
+    s->snapshots = snapshots;
+    s->snapshots[s->nr_snapshots++] = offset;
+    return 0;
+}
+
+/* a blob with this content, compared in full, or -1 */
+static int find_blob(backup_store *s, const uint8_t *data, uint32_t size,
+                     uint64_t hash, uint8_t *scratch) {
+    int32_t i = s->buckets[hash & ((1 << BACKUP_HASH_BITS) - 1)];
+
+    for (; i >= 0; i = s->blobs[i].next) {
+        const backup_blob *b = &s->blobs[i];
+
+        if (b->hash != hash || b->size != size)
+            continue;
+        if (pread(s->fd, scratch, size, b->offset) == size &&
+            !memcmp(scratch, data, size))
+            return i;
+    }
+
+    return -1;
+}
+
+static void close_store(backup_store *s) {
+    if (!s)
+        return;
+
+    close(s->fd);
+    free(s->blobs);
+    free(s->snapshots);
+    free(s);
+}
+
+/*
+ * Index the blobs and snapshots of the file, up to the first record that is
+ * truncated or fails its CRC.
+ */
+static int load_store(backup_store *s, const char *path, uint64_t size) {
+    backup_header header;
+    backup_record rec;
+    uint64_t offset = sizeof(header);
+    uint8_t *data = NULL;
+
+    if (pread(s->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, BACKUP_MAGIC, sizeof(header.magic)) ||
+        le32toh(header.version) != BACKUP_VERSION) {
+        printf("backup: %s is not a d2b backup\n", path);
+        return -1;
+    }
+
+    while (offset + sizeof(rec) <= size) {
+        uint32_t len;
+        uint8_t *more;
+
+        if (pread(s->fd, &rec, sizeof(rec), offset) != sizeof(rec))
+            break;
+        len = le32toh(rec.size);
+        if (offset + sizeof(rec) + len > size)
+            break;
+
+        more = realloc(data, len ? len : 1);
+        if (!more)
+            break;
+        data = more;
+        if (pread(s->fd, data, len, offset + sizeof(rec)) != len ||
+            crc32(0, data, len) != le32toh(rec.crc))
+            break;
+
+        if (rec.type == BACKUP_BLOB) {
+            if (add_blob(s, hash_sector(data, len), offset + sizeof(rec),
+                         len) < 0)
+                break;
+        } else if (rec.type == BACKUP_SNAPSHOT) {
+            const backup_snapshot *snap = (const backup_snapshot *)data;
+
+            if (len < sizeof(*snap) ||
+                len != sizeof(*snap) + le32toh(snap->nr_sectors) *
+                                           sizeof(backup_sector) ||
+                add_snapshot(s, offset + sizeof(rec)))
+                break;
+        } else {
+            break;
+        }
+
+        offset += sizeof(rec) + len;
+    }
+    free(data);
+
+    if (offset < size)
+        printf("backup: %s is truncated or corrupted after %lu bytes, the "
+               "rest is ignored\n",
+               path, offset);
+
+    s->end = offset;
+    return 0;
+}
+
+static backup_store *open_store(const char *path, int create) {
+    backup_store *s;
+    struct stat st;
+
+    s = calloc(1, sizeof(backup_store));
+    if (!s) {
+        printf("backup: failed to malloc\n");
+        return NULL;
+    }
+    memset(s->buckets, 0xff, sizeof(s->buckets));
+
+    s->fd = open(path, create ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+    if (s->fd < 0 || fstat(s->fd, &st)) {
+        printf("backup: failed to open %s, errno is %d\n", path, errno);
+        free(s);
+        return NULL;
+    }
+
+    if (!st.st_size && create) {
+        backup_header header;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BACKUP_MAGIC, sizeof(header.magic));
+        header.version = htole32(BACKUP_VERSION);
+        if (pwrite(s->fd, &header, sizeof(header), 0) != sizeof(header)) {
+            printf("backup: failed to write %s, errno is %d\n", path, errno);
+            close_store(s);
+            return NULL;
+        }
+        s->end = sizeof(header);
+        return s;
+    }
+
+    if (load_store(s, path, st.st_size)) {
+        close_store(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+/* returns the offset of the content */
+static int64_t append_record(backup_store *s, uint8_t type, const void *data,
+                             uint32_t size) {
+    backup_record rec;
+    uint64_t offset = s->end;
+
+    rec.type = type;
+    rec.size = htole32(size);
+    rec.crc = htole32(crc32(0, data, size));
+
+    if (pwrite(s->fd, &rec, sizeof(rec), offset) != sizeof(rec) ||
+        pwrite(s->fd, data, size, offset + sizeof(rec)) != size) {
+        printf("backup: failed to write, errno is %d\n", errno);
+        return -1;
+    }
+
+    s->end += sizeof(rec) + size;
+    return offset + sizeof(rec);
+}
+
+/*
+ * Append a snapshot of the sectors in ranges, named name, to the backup at
+ * path. Sectors already in the backup are only referenced.
+ */
+int backup_save(int fd, const char *path, const char *name,
+                const backup_range *ranges, int nr_ranges) {
+    const uint32_t sector_size = bdev_get_sector_size(fd);
+    backup_snapshot *snap = NULL;
+    backup_sector *sectors;
+    backup_store *s;
+    uint8_t *buffer = NULL, *scratch = NULL;
+    uint64_t disk_size, total = 0;
+    uint32_t nr = 0, new_blobs = 0;
+    int i, ret = -1;
+
+    if (bdev_get_size(fd, &disk_size)) {
+        printf("backup: failed to get the size of the device\n");
+        return -1;
+    }
+
+    for (i = 0; i < nr_ranges; i++)
+        total += ranges[i].count;
+
+    s = open_store(path, 1);
+    if (!s)
+        return -1;
+
+    /* drop what a torn append left */
+    if (ftruncate(s->fd, s->end)) {
+        printf("backup: failed to truncate %s, errno is %d\n", path, errno);
+        goto out;
+    }
+
+    snap = calloc(1, sizeof(*snap) + total * sizeof(backup_sector));
+    scratch = malloc(sector_size);
+    if (!snap || !scratch) {
+        printf("backup: failed to malloc\n");
+        goto out;
+    }
+    sectors = (backup_sector *)(snap + 1);
+
+    for (i = 0; i < nr_ranges; i++) {
+        const size_t len = ranges[i].count * sector_size;
+        uint8_t *more = realloc(buffer, len);
+        uint64_t j;
+
+        if (!more) {
+            printf("backup: failed to malloc\n");
+            goto out;
+        }
+        buffer = more;
+
+        if (bdev_read_lba(fd, ranges[i].lba, buffer, len) != len) {
+            printf("backup: failed to read lba %lu\n", ranges[i].lba);
+            goto out;
+        }
+
+        for (j = 0; j < ranges[i].count; j++) {
+            const uint8_t *data = buffer + j * sector_size;
+            uint64_t hash = hash_sector(data, sector_size);
+            int blob = find_blob(s, data, sector_size, hash, scratch);
+
+            if (blob < 0) {
+                int64_t offset =
+                    append_record(s, BACKUP_BLOB, data, sector_size);
+
+                if (offset < 0)
+                    goto out;
+                blob = add_blob(s, hash, offset, sector_size);
+                if (blob < 0)
+                    goto out;
+                new_blobs++;
+            }
+
+            sectors[nr].lba = htole64(ranges[i].lba + j);
+            sectors[nr].blob = htole32(blob);
+            nr++;
+        }
+    }
+
+    snap->time = htole64(time(NULL));
+    snap->disk_size = htole64(disk_size);
+    snap->sector_size = htole32(sector_size);
+    snap->nr_sectors = htole32(nr);
+    snprintf(snap->name, sizeof(snap->name), "%s", name);
+
+    if (append_record(s, BACKUP_SNAPSHOT, snap,
+                      sizeof(*snap) + nr * sizeof(backup_sector)) < 0)
+        goto out;
+    if (fsync(s->fd)) {
+        printf("backup: failed to sync %s, errno is %d\n", path, errno);
+        goto out;
+    }
+
+    printf("Info: saved %u sectors of %s as snapshot %u of %s, %u new\n", nr,
+           name, s->nr_snapshots, path, new_blobs);
+    ret = 0;
+
+out:
+    free(scratch);
+    free(buffer);
+    free(snap);
+    close_store(s);
+    return ret;
+}
+
+static int read_snapshot(backup_store *s, uint32_t index,
+                         backup_snapshot *snap, backup_sector **sectors) {
+    uint32_t nr;
+    size_t len;
+
+    if (pread(s->fd, snap, sizeof(*snap), s->snapshots[index]) !=
+        sizeof(*snap))
+        return -1;
+    snap->name[BACKUP_NAME_LEN - 1] = '\0';
+    if (!sectors)
+        return 0;
+
+    nr = le32toh(snap->nr_sectors);
+    len = nr * sizeof(backup_sector);
+    *sectors = malloc(len ? len : 1);
+    if (!*sectors ||
+        pread(s->fd, *sectors, len, s->snapshots[index] + sizeof(*snap)) !=
+            len) {
+        free(*sectors);
+        *sectors = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int backup_list(const char *path) {
+    backup_store *s = open_store(path, 0);
+    uint32_t i;
+
+    if (!s)
+        return -1;
+
+    for (i = 0; i < s->nr_snapshots; i++) {
+        backup_snapshot snap;
+        time_t when;
+        char date[32];
+
+        if (read_snapshot(s, i, &snap, NULL))
+            break;
+
+        when = le64toh(snap.time);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&when));
+        printf("%u %s %s %u sectors\n", i, date, snap.name,
+               le32toh(snap.nr_sectors));
+    }
+    printf("%u snapshots, %u distinct sectors\n", s->nr_snapshots,
+           s->nr_blobs);
+
+    close_store(s);
+    return 0;
+}
+
+/*
+ * Put back the sectors of a snapshot, the last one named name unless an
+ * index is given. Every sector is read and checked before the first write,
+ * then contiguous sectors go out in one write and the device is synced once.
+ */
+int backup_restore(int fd, const char *path, const char *name, int index) {
+    const uint32_t sector_size = bdev_get_sector_size(fd);
+    backup_sector *sectors = NULL;
+    backup_snapshot snap;
+    backup_store *s;
+    uint8_t *buffer = NULL;
+    uint64_t disk_size;
+    uint32_t i, nr;
+    int ret = -1;
+
+    s = open_store(path, 0);
+    if (!s)
+        return -1;
+
+    if (index < 0) {
+        for (i = s->nr_snapshots; i-- > 0;) {
+            if (!read_snapshot(s, i, &snap, NULL) &&
+                !strncmp(snap.name, name, sizeof(snap.name))) {
+                index = i;
+                break;
+            }
+        }
+    }
+    if (index < 0 || index >= s->nr_snapshots) {
+        printf("Error: no snapshot of %s in %s\n", name, path);
+        goto out;
+    }
+
+    if (read_snapshot(s, index, &snap, &sectors)) {
+        printf("backup: failed to read snapshot %d\n", index);
+        goto out;
+    }
+
+    if (bdev_get_size(fd, &disk_size) ||
+        le64toh(snap.disk_size) != disk_size ||
+        le32toh(snap.sector_size) != sector_size) {
+        printf("Error: snapshot %d is of a disk of %lu bytes with %u-byte "
+               "sectors\n",
+               index, le64toh(snap.disk_size), le32toh(snap.sector_size));
+        goto out;
+    }
+
+    nr = le32toh(snap.nr_sectors);
+    buffer = malloc(nr ? (size_t)nr * sector_size : 1);
+    if (!buffer) {
+        printf("backup: failed to malloc\n");
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        uint32_t blob = le32toh(sectors[i].blob);
+
+        if (blob >= s->nr_blobs || s->blobs[blob].size != sector_size ||
+            pread(s->fd, buffer + (size_t)i * sector_size, sector_size,
+                  s->blobs[blob].offset) != sector_size) {
+            printf("backup: snapshot %d refers to a missing sector\n",
+                   index);
+            goto out;
+        }
+    }
+
+    for (i = 0; i < nr;) {
+        uint64_t lba = le64toh(sectors[i].lba);
+        uint32_t run = 1;
+        size_t len;
+
+        while (i + run < nr && le64toh(sectors[i + run].lba) == lba + run)
+            run++;
+
+        len = (size_t)run * sector_size;
+        /* the disk may hold anything, compare with what it holds now */
+        if (bdev_write_lba_diff(fd, lba, buffer + (size_t)i * sector_size,
+                                NULL, len) != len) {
+            printf("Error: failed to write lba %lu, the disk is partially "
+                   "restored\n",
+                   lba);
+            goto out;
+        }
+        i += run;
+    }
+
+    if (fsync(fd)) {
+        printf("Error: failed to sync, errno is %d\n", errno);
+        goto out;
+    }
+
+    printf("Info: restored %u sectors of snapshot %d (%s)\n", nr, index,
+           snap.name);
+    ret = 0;
+
+out:
+    free(buffer);
+    free(sectors);
+    close_store(s);
+    return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef __BACKUP_H__
+#define __BACKUP_H__
+
+#include <stdint.h>
+
+typedef struct _backup_range {
+    uint64_t lba;
+    uint64_t count;
+} backup_range;
+
+int backup_save(int fd, const char *path, const char *name,
+                const backup_range *ranges, int nr_ranges);
+int backup_list(const char *path);
+int backup_restore(int fd, const char *path, const char *name, int snapshot);
+
+#endif
@@ -1,24 +1,322 @@
+#define _GNU_SOURCE
 #include "bdev.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "latency.h"
+#include "probes.h"
+
 #define DEFAULT_SECTOR_SIZE 512
 
+/* sector size of regular files, which have none of their own */
+static int image_sector_size = DEFAULT_SECTOR_SIZE;
+
+static bdev_stats stats;
+
+#define MAX_BACKENDS 1024
+
+/*
+ * The sectors written to a tracked fd, merged into sorted runs, so that what
+ * a conversion changed on a thin or snapshotted LUN can be told exactly.
+ * Every fd has its own, handles converting at once do not mix them.
+ */
+typedef struct _bdev_dirty {
+    bdev_range *ranges;
+    size_t nr, max;
+    uint64_t unchanged; /* sectors bdev_write_lba_diff() left alone */
+} bdev_dirty;
+
+static bdev_dirty *dirty[MAX_BACKENDS];
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bdev_backend *backends[MAX_BACKENDS];
+
+/*
+ * With a deadline, reads and writes of a device run on a helper thread of
+ * the caller, into a buffer of the helper. A caller that waits past the
+ * deadline leaves the helper stuck in the kernel and marks the device
+ * failed, and its later I/O fails at once. A dead path of a multipath
+ * device then costs one deadline, not the whole run. An idle helper exits
+ * and is joined with its caller thread.
+ */
+typedef struct _bdev_helper {
+    pthread_t thread;
+    int fd;
+    int write;
+    uint8_t *data;
+    size_t size; /* of data */
+    size_t count;
+    uint64_t offset;
+    ssize_t ret;
+    int err;
+    int state;
+    int abandoned;
+} bdev_helper;
+
+enum {
+    HELPER_IDLE = 0,
+    HELPER_QUEUED,
+    HELPER_DONE,
+};
+
+/* the file a failed fd had open, a reused fd number is not failed */
+typedef struct _bdev_failure {
+    dev_t dev;
+    ino_t ino;
+    dev_t rdev;
+} bdev_failure;
+
+static unsigned int timeout_ms; /* 0 for no deadline */
+static uint8_t failed[MAX_BACKENDS];
+static bdev_failure failures[MAX_BACKENDS];
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_done; /* on CLOCK_MONOTONIC */
+static pthread_cond_t io_queued = PTHREAD_COND_INITIALIZER;
+static __thread bdev_helper *helper;
+static pthread_key_t helper_key;
+static pthread_once_t helper_once = PTHREAD_ONCE_INIT;
+
+static inline bdev_backend *backend_of(int fd) {
+    return fd >= 0 && fd < MAX_BACKENDS ? backends[fd] : NULL;
+}
+
+int bdev_attach(int fd, bdev_backend *backend) {
+    if (fd < 0 || fd >= MAX_BACKENDS || backends[fd]) {
+        printf("bdev: can not attach a backend to fd %d\n", fd);
+        return -1;
+    }
+
+    backends[fd] = backend;
+    return 0;
+}
+
+bdev_backend *bdev_detach(int fd) {
+    bdev_backend *backend = backend_of(fd);
+
+    if (backend)
+        backends[fd] = NULL;
+    bdev_forget(fd);
+    return backend;
+}
+
+/*
+ * A block device that its reads and writes reach, so the kernel view of its
+ * partitions is affected by what d2b writes.
+ */
+int bdev_is_disk(int fd) {
+    struct stat st;
+
+    if (backend_of(fd))
+        return 0;
+    return fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+/* record the sectors written to fd from now on, afresh */
+void bdev_track_writes(int fd) {
+    if (fd < 0 || fd >= MAX_BACKENDS)
+        return;
+
+    pthread_mutex_lock(&dirty_lock);
+    if (!dirty[fd])
+        dirty[fd] = calloc(1, sizeof(bdev_dirty));
+    if (dirty[fd]) {
+        dirty[fd]->nr = 0;
+        dirty[fd]->unchanged = 0;
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+/* stop recording fd, before it is closed */
+void bdev_untrack_writes(int fd) {
+    if (fd < 0 || fd >= MAX_BACKENDS)
+        return;
+
+    pthread_mutex_lock(&dirty_lock);
+    if (dirty[fd]) {
+        free(dirty[fd]->ranges);
+        free(dirty[fd]);
+        dirty[fd] = NULL;
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+/* add [lba, end) to the dirty runs of d, merging it with those it touches */
+static void add_dirty(bdev_dirty *d, uint64_t lba, uint64_t end) {
+    bdev_range *r = d->ranges;
+    size_t i, j;
+
+    /* writes mostly go up, look for the place from the last run */
+    for (i = d->nr; i > 0 && r[i - 1].lba > end; i--)
+        ;
+    /* the runs from i - 1 down that overlap or touch [lba, end) */
+    for (j = i; j > 0 && r[j - 1].lba + r[j - 1].sectors >= lba; j--)
+        ;
+
+    if (j < i) {
+        if (r[j].lba < lba)
+            lba = r[j].lba;
+        if (r[i - 1].lba + r[i - 1].sectors > end)
+            end = r[i - 1].lba + r[i - 1].sectors;
+        r[j].lba = lba;
+        r[j].sectors = end - lba;
+        memmove(&r[j + 1], &r[i], (d->nr - i) * sizeof(bdev_range));
+        d->nr -= i - j - 1;
+        return;
+    }
+
+    if (d->nr == d->max) {
+        size_t max = d->max ? d->max * 2 : 64;
+
+        r = realloc(d->ranges, max * sizeof(bdev_range));
+        if (!r) {
+            printf("bdev: failed to malloc, the dirty sectors are "
+                   "incomplete\n");
+            return;
+        }
+        d->ranges = r;
+        d->max = max;
+    }
+
+    memmove(&r[i + 1], &r[i], (d->nr - i) * sizeof(bdev_range));
+    r[i].lba = lba;
+    r[i].sectors = end - lba;
+    d->nr++;
+}
+
+/*
+ * Count bytes written at offset of fd by other means than bdev, e.g. moved
+ * data, into the dirty sectors of fd if it is tracked.
+ */
+void bdev_note_write(int fd, uint64_t offset, uint64_t bytes) {
+    uint64_t sector_size;
+
+    if (fd < 0 || fd >= MAX_BACKENDS || !bytes ||
+        !__atomic_load_n(&dirty[fd], __ATOMIC_RELAXED))
+        return;
+
+    sector_size = bdev_get_sector_size(fd);
+    pthread_mutex_lock(&dirty_lock);
+    if (dirty[fd])
+        add_dirty(dirty[fd], offset / sector_size,
+                  (offset + bytes + sector_size - 1) / sector_size);
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+static void note_unchanged(int fd) {
+    if (fd < 0 || fd >= MAX_BACKENDS ||
+        !__atomic_load_n(&dirty[fd], __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&dirty_lock);
+    if (dirty[fd])
+        dirty[fd]->unchanged++;
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+/*
+ * The runs of sectors written to fd, sorted, and the sectors found up to
+ * date instead. The runs stay valid until fd is written or untracked.
+ */
+void bdev_get_dirty(int fd, const bdev_range **ranges, size_t *nr,
+                    uint64_t *unchanged) {
+    *ranges = NULL;
+    *nr = 0;
+    *unchanged = 0;
+    if (fd < 0 || fd >= MAX_BACKENDS)
+        return;
+
+    pthread_mutex_lock(&dirty_lock);
+    if (dirty[fd]) {
+        *ranges = dirty[fd]->ranges;
+        *nr = dirty[fd]->nr;
+        *unchanged = dirty[fd]->unchanged;
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+void bdev_set_image_sector_size(int sector_size) {
+    image_sector_size = sector_size;
+}
+
+void bdev_get_stats(bdev_stats *ret) {
+    *ret = stats;
+}
+
+void bdev_reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+}
+
 int bdev_get_sector_size(int fd) {
+    bdev_backend *backend = backend_of(fd);
     int sector_size;
+
+    if (backend)
+        return backend->sector_size;
+
+    stats.ioctls++;
     if (ioctl(fd, BLKSSZGET, &sector_size) < 0) {
-        sector_size = DEFAULT_SECTOR_SIZE;
+        sector_size = image_sector_size;
     }
 
     return sector_size;
 }
 
+int bdev_get_physical_block_size(int fd) {
+    bdev_backend *backend = backend_of(fd);
+    unsigned int block_size;
+
+    if (backend)
+        return backend->physical_block_size;
+
+    stats.ioctls++;
+    if (ioctl(fd, BLKPBSZGET, &block_size) < 0 || block_size == 0) {
+        return bdev_get_sector_size(fd);
+    }
+
+    return block_size;
+}
+
+int bdev_get_optimal_io_size(int fd) {
+    bdev_backend *backend = backend_of(fd);
+    unsigned int io_size;
+
+    if (backend)
+        return backend->optimal_io_size;
+
+    stats.ioctls++;
+    if (ioctl(fd, BLKIOOPT, &io_size) < 0) {
+        io_size = 0;
+    }
+
+    return io_size;
+}
+
 int bdev_get_size(int fd, uint64_t *bytes) {
+    bdev_backend *backend = backend_of(fd);
+    struct stat st;
+
+    if (backend) {
+        *bytes = backend->size;
+        return 0;
+    }
+
+    /* disk images */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        *bytes = st.st_size;
+        return 0;
+    }
+
 #ifdef BLKGETSIZE64
+    stats.ioctls++;
     if (ioctl(fd, BLKGETSIZE64, bytes) >= 0)
         return 0;
 #endif /* BLKGETSIZE64 */
@@ -26,6 +324,7 @@ int bdev_get_size(int fd, uint64_t *bytes) {
 #ifdef BLKGETSIZE
     unsigned long size;
 
+    stats.ioctls++;
     if (ioctl(fd, BLKGETSIZE, &size) >= 0) {
         *bytes = ((uint64_t)size << 9);
         return 0;
@@ -56,7 +355,306 @@ int bdev_last_lba(int fd, uint64_t *last_lba) {
     return -1;
 }
 
-size_t bdev_read_lba(int fd, uint64_t lba, uint8_t *buffer, size_t count) {
+/* the first line of a sysfs attribute, e.g. /sys/dev/block/8:0/start */
+int bdev_read_sysfs(const char *path, char *buffer, size_t size) {
+    FILE *file = fopen(path, "r");
+    int ret;
+
+    if (!file)
+        return -1;
+
+    ret = fgets(buffer, size, file) ? 0 : -1;
+    fclose(file);
+    return ret;
+}
+
+int bdev_read_sysfs_u64(const char *path, uint64_t *value) {
+    char buffer[32], *end;
+
+    if (bdev_read_sysfs(path, buffer, sizeof(buffer)))
+        return -1;
+
+    *value = strtoull(buffer, &end, 10);
+    return end == buffer ? -1 : 0;
+}
+
+static void *helper_main(void *arg) {
+    bdev_helper *h = arg;
+
+    pthread_mutex_lock(&io_lock);
+    for (;;) {
+        while (h->state != HELPER_QUEUED && !h->abandoned)
+            pthread_cond_wait(&io_queued, &io_lock);
+        if (h->state != HELPER_QUEUED)
+            break;
+        pthread_mutex_unlock(&io_lock);
+
+        if (h->write)
+            h->ret = pwrite(h->fd, h->data, h->count, h->offset);
+        else
+            h->ret = pread(h->fd, h->data, h->count, h->offset);
+        h->err = errno;
+
+        pthread_mutex_lock(&io_lock);
+        h->state = HELPER_DONE;
+        pthread_cond_broadcast(&io_done);
+        if (h->abandoned)
+            break;
+    }
+    pthread_mutex_unlock(&io_lock);
+
+    free(h->data);
+    free(h);
+    return NULL;
+}
+
+/* the caller thread exits: stop its idle helper and wait for it */
+static void helper_exit(void *arg) {
+    bdev_helper *h = arg;
+    pthread_t thread = h->thread;
+
+    pthread_mutex_lock(&io_lock);
+    h->abandoned = 1;
+    pthread_cond_broadcast(&io_queued);
+    pthread_mutex_unlock(&io_lock);
+
+    /* h is freed by the helper */
+    pthread_join(thread, NULL);
+}
+
+static void helper_key_init(void) {
+    pthread_key_create(&helper_key, helper_exit);
+}
+
+static bdev_helper *get_helper(size_t count) {
+    bdev_helper *h = helper;
+
+    if (!h) {
+        pthread_once(&helper_once, helper_key_init);
+        h = calloc(1, sizeof(bdev_helper));
+        if (!h)
+            return NULL;
+        if (pthread_create(&h->thread, NULL, helper_main, h)) {
+            free(h);
+            return NULL;
+        }
+        pthread_setspecific(helper_key, h);
+        helper = h;
+    }
+
+    /* idle, the helper does not touch it; aligned for O_DIRECT fds */
+    if (h->size < count) {
+        uint8_t *data;
+
+        if (posix_memalign((void **)&data, 4096, count))
+            return NULL;
+        free(h->data);
+        h->data = data;
+        h->size = count;
+    }
+
+    return h;
+}
+
+/* fail fd, remembering which file it has open */
+static void set_failed(int fd) {
+    struct stat st;
+
+    memset(&failures[fd], 0, sizeof(bdev_failure));
+    if (!fstat(fd, &st)) {
+        failures[fd].dev = st.st_dev;
+        failures[fd].ino = st.st_ino;
+        failures[fd].rdev = st.st_rdev;
+    }
+    __atomic_store_n(&failed[fd], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Whether fd is failed. A failed fd that was closed and whose number now
+ * belongs to another file starts afresh.
+ */
+static int is_failed(int fd) {
+    struct stat st;
+
+    if (!__atomic_load_n(&failed[fd], __ATOMIC_RELAXED))
+        return 0;
+
+    if (!fstat(fd, &st) && (st.st_dev != failures[fd].dev ||
+                            st.st_ino != failures[fd].ino ||
+                            st.st_rdev != failures[fd].rdev)) {
+        __atomic_store_n(&failed[fd], 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void mark_failed(int fd) {
+    if (!failed[fd])
+        printf("bdev: no answer from fd %d in %u ms, marked failed\n", fd,
+               timeout_ms);
+    set_failed(fd);
+    /* the other callers waiting on fd give up too */
+    pthread_cond_broadcast(&io_done);
+}
+
+/* pread or pwrite of a device, within the deadline */
+static ssize_t timed_io(int fd, int write, uint8_t *buffer, size_t count,
+                        uint64_t offset) {
+    struct timespec deadline;
+    bdev_helper *h;
+    ssize_t ret;
+
+    if (is_failed(fd)) {
+        errno = EIO;
+        return -1;
+    }
+
+    h = get_helper(count);
+    if (!h) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (write)
+        memcpy(h->data, buffer, count);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&io_lock);
+    h->fd = fd;
+    h->write = write;
+    h->count = count;
+    h->offset = offset;
+    h->state = HELPER_QUEUED;
+    pthread_cond_broadcast(&io_queued);
+
+    while (h->state != HELPER_DONE && !failed[fd]) {
+        if (pthread_cond_timedwait(&io_done, &io_lock, &deadline) ==
+            ETIMEDOUT && h->state != HELPER_DONE) {
+            mark_failed(fd);
+            break;
+        }
+    }
+
+    if (h->state != HELPER_DONE) {
+        /* timed out or cancelled, the helper frees itself when it returns */
+        h->abandoned = 1;
+        pthread_detach(h->thread);
+        pthread_setspecific(helper_key, NULL);
+        helper = NULL;
+        pthread_mutex_unlock(&io_lock);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    h->state = HELPER_IDLE;
+    ret = h->ret;
+    errno = h->err;
+    pthread_mutex_unlock(&io_lock);
+
+    if (!write && ret > 0)
+        memcpy(buffer, h->data, ret);
+    return ret;
+}
+
+/*
+ * Give up on reads and writes of a device that take longer than msec, 0 to
+ * wait forever. Set before the I/O starts.
+ */
+void bdev_set_timeout(unsigned int msec) {
+    static int initialized;
+    pthread_condattr_t attr;
+
+    if (!initialized) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&io_done, &attr);
+        pthread_condattr_destroy(&attr);
+        initialized = 1;
+    }
+
+    timeout_ms = msec;
+}
+
+unsigned int bdev_get_timeout(void) {
+    return timeout_ms;
+}
+
+/*
+ * Fail the I/O in flight on fd and all that follows, e.g. when another
+ * device of the same path timed out.
+ */
+void bdev_cancel(int fd) {
+    if (fd < 0 || fd >= MAX_BACKENDS)
+        return;
+
+    pthread_mutex_lock(&io_lock);
+    set_failed(fd);
+    pthread_cond_broadcast(&io_done);
+    pthread_mutex_unlock(&io_lock);
+}
+
+/* a deadline of fd passed, or it was cancelled */
+int bdev_failed(int fd) {
+    if (fd < 0 || fd >= MAX_BACKENDS)
+        return 0;
+    return is_failed(fd);
+}
+
+/* fd is about to be closed, its number starts afresh */
+void bdev_forget(int fd) {
+    if (fd < 0 || fd >= MAX_BACKENDS)
+        return;
+    __atomic_store_n(&failed[fd], 0, __ATOMIC_RELAXED);
+}
+
+static ssize_t do_pread(int fd, uint8_t *buffer, size_t count,
+                        uint64_t offset) {
+    bdev_backend *backend = backend_of(fd);
+
+    if (backend)
+        return backend->pread(backend->priv, buffer, count, offset);
+    if (timeout_ms && fd >= 0 && fd < MAX_BACKENDS)
+        return timed_io(fd, 0, buffer, count, offset);
+    return pread(fd, buffer, count, offset);
+}
+
+static ssize_t do_pwrite(int fd, const uint8_t *buffer, size_t count,
+                         uint64_t offset) {
+    bdev_backend *backend = backend_of(fd);
+
+    if (backend)
+        return backend->pwrite(backend->priv, buffer, count, offset);
+    if (timeout_ms && fd >= 0 && fd < MAX_BACKENDS)
+        return timed_io(fd, 1, (uint8_t *)buffer, count, offset);
+    return pwrite(fd, buffer, count, offset);
+}
+
+/*
+ * pread and pwrite of the fd itself, not of its backend, within the
+ * deadline, for the bulk data that does not go through the sector calls.
+ */
+ssize_t bdev_timed_pread(int fd, void *buffer, size_t count, uint64_t offset) {
+    if (timeout_ms && fd >= 0 && fd < MAX_BACKENDS)
+        return timed_io(fd, 0, buffer, count, offset);
+    return pread(fd, buffer, count, offset);
+}
+
+ssize_t bdev_timed_pwrite(int fd, const void *buffer, size_t count,
+                          uint64_t offset) {
+    if (timeout_ms && fd >= 0 && fd < MAX_BACKENDS)
+        return timed_io(fd, 1, (uint8_t *)buffer, count, offset);
+    return pwrite(fd, buffer, count, offset);
+}
+
+static size_t _bdev_read_lba(int fd, uint64_t lba, uint8_t *buffer,
+                             size_t count) {
     size_t total_read_count = 0;
     uint64_t sector_size;
     uint64_t last_lba;
@@ -70,21 +668,36 @@ size_t bdev_read_lba(int fd, uint64_t lba, uint8_t *buffer, size_t count) {
 
     off_t offset = lba * sector_size;
     while (total_read_count < count) {
+        uint64_t start = latency_start();
         ssize_t ret =
-            pread(fd, buffer + total_read_count, count - total_read_count,
-                  total_read_count + offset);
+            do_pread(fd, buffer + total_read_count, count - total_read_count,
+                     total_read_count + offset);
 
+        latency_end(LATENCY_READ, start);
+        stats.reads++;
         if (ret <= 0) {
             return 0;
         }
 
+        stats.bytes_read += ret;
         total_read_count += ret;
     }
 
     return total_read_count;
 }
 
-size_t bdev_write_lba(int fd, uint64_t lba, uint8_t *buffer, size_t count) {
+size_t bdev_read_lba(int fd, uint64_t lba, uint8_t *buffer, size_t count) {
+    size_t ret;
+
+    PROBE3(read_entry, fd, lba, count);
+    ret = _bdev_read_lba(fd, lba, buffer, count);
+    PROBE4(read_return, fd, lba, count, ret);
+
+    return ret;
+}
+
+static size_t _bdev_write_lba(int fd, uint64_t lba, uint8_t *buffer,
+                              size_t count) {
     size_t total_write_count = 0;
     uint64_t sector_size;
     uint64_t last_lba;
@@ -98,17 +711,113 @@ size_t bdev_write_lba(int fd, uint64_t lba, uint8_t *buffer, size_t count) {
 
     off_t offset = lba * sector_size;
     while (total_write_count < count) {
+        uint64_t start = latency_start();
         ssize_t ret =
-            pwrite(fd, buffer + total_write_count, count - total_write_count,
-                   total_write_count + offset);
+            do_pwrite(fd, buffer + total_write_count,
+                      count - total_write_count, total_write_count + offset);
 
+        latency_end(LATENCY_WRITE, start);
+        stats.writes++;
         if (ret <= 0) {
             printf("Error: failed to write, errno is %d\n", errno);
             return 0;
         }
 
+        stats.bytes_written += ret;
         total_write_count += ret;
     }
 
+    bdev_note_write(fd, offset, total_write_count);
     return total_write_count;
-}
\ No newline at end of file
+}
+
+size_t bdev_write_lba(int fd, uint64_t lba, uint8_t *buffer, size_t count) {
+    size_t ret;
+
+    PROBE3(write_entry, fd, lba, count);
+    ret = _bdev_write_lba(fd, lba, buffer, count);
+    PROBE4(write_return, fd, lba, count, ret);
+
+    return ret;
+}
+
+/*
+ * Write only the sectors of buffer that differ from those on the device: on
+ * thin or snapshotted storage every block written stops being shared with
+ * the snapshots and clones. old is what the sectors are known to hold, e.g.
+ * the copy the probe read and checked against the disk since. Without one,
+ * as for a restore onto a disk of unknown content, they are read first,
+ * and written whole when they can not be read. Returns count when all that
+ * differ are written, as bdev_write_lba() does.
+ */
+size_t bdev_write_lba_diff(int fd, uint64_t lba, uint8_t *buffer,
+                           const uint8_t *old, size_t count) {
+    const size_t sector_size = bdev_get_sector_size(fd);
+    size_t pos = 0, start, len;
+    uint8_t *copy = NULL;
+
+    if (!old) {
+        copy = malloc(count);
+        if (!copy || bdev_read_lba(fd, lba, copy, count) != count) {
+            free(copy);
+            return bdev_write_lba(fd, lba, buffer, count);
+        }
+        old = copy;
+    }
+
+    while (pos < count) {
+        len = count - pos < sector_size ? count - pos : sector_size;
+        if (!memcmp(old + pos, buffer + pos, len)) {
+            stats.sectors_unchanged++;
+            note_unchanged(fd);
+            pos += len;
+            continue;
+        }
+
+        /* a run of sectors that differ, written at once */
+        start = pos;
+        do {
+            pos += len;
+            len = count - pos < sector_size ? count - pos : sector_size;
+        } while (pos < count && memcmp(old + pos, buffer + pos, len));
+
+        if (bdev_write_lba(fd, lba + start / sector_size, buffer + start,
+                           pos - start) != pos - start) {
+            free(copy);
+            return 0;
+        }
+    }
+
+    free(copy);
+    return count;
+}
+
+/*
+ * Hand sectors back to the storage under them: discarded on a block device,
+ * or zeroed when zero is set, so that they read as zeroes afterwards, and
+ * punched out of an image file. The sectors are not counted as written.
+ * Fails with errno EOPNOTSUPP where the device, its backend or the file
+ * system of the image can not discard.
+ */
+int bdev_discard(int fd, uint64_t lba, uint64_t sectors, int zero) {
+    const uint64_t sector_size = bdev_get_sector_size(fd);
+    uint64_t range[2] = { lba * sector_size, sectors * sector_size };
+    struct stat st;
+    int ret;
+
+    if (backend_of(fd)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (fstat(fd, &st))
+        return -1;
+
+    if (S_ISBLK(st.st_mode)) {
+        stats.ioctls++;
+        ret = ioctl(fd, zero ? BLKZEROOUT : BLKDISCARD, range);
+    } else {
+        ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        range[0], range[1]);
+    }
+    return ret ? -1 : 0;
+}
@@ -5,12 +5,79 @@
 #include <stdint.h>
 #include <unistd.h>
 
+/* counters of the calls made through bdev, for benchmarks */
+typedef struct _bdev_stats {
+    uint64_t ioctls;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t sectors_unchanged; /* left alone by bdev_write_lba_diff() */
+} bdev_stats;
+
+/* a run of sectors written to a tracked fd */
+typedef struct _bdev_range {
+    uint64_t lba;
+    uint64_t sectors;
+} bdev_range;
+
+/*
+ * Serves the bdev calls of one fd instead of the device behind it, e.g. a
+ * trace replay. The geometry is fixed when the backend is attached.
+ */
+typedef struct _bdev_backend {
+    int sector_size;
+    int physical_block_size;
+    int optimal_io_size;
+    uint64_t size;
+    ssize_t (*pread)(void *priv, uint8_t *buffer, size_t count,
+                     uint64_t offset);
+    ssize_t (*pwrite)(void *priv, const uint8_t *buffer, size_t count,
+                      uint64_t offset);
+    void *priv;
+} bdev_backend;
+
+int bdev_attach(int fd, bdev_backend *backend);
+bdev_backend *bdev_detach(int fd);
+int bdev_is_disk(int fd);
+
+void bdev_set_image_sector_size(int sector_size);
+void bdev_get_stats(bdev_stats *stats);
+void bdev_reset_stats(void);
+
+void bdev_track_writes(int fd);
+void bdev_untrack_writes(int fd);
+void bdev_note_write(int fd, uint64_t offset, uint64_t bytes);
+void bdev_get_dirty(int fd, const bdev_range **ranges, size_t *nr,
+                    uint64_t *unchanged);
+
+void bdev_set_timeout(unsigned int msec);
+unsigned int bdev_get_timeout(void);
+void bdev_cancel(int fd);
+int bdev_failed(int fd);
+void bdev_forget(int fd);
+ssize_t bdev_timed_pread(int fd, void *buffer, size_t count, uint64_t offset);
+ssize_t bdev_timed_pwrite(int fd, const void *buffer, size_t count,
+                          uint64_t offset);
+
 int bdev_get_sector_size(int fd);
+int bdev_get_physical_block_size(int fd);
+int bdev_get_optimal_io_size(int fd);
 int bdev_get_size(int fd, uint64_t *bytes);
 int bdev_get_sectors(int fd, uint64_t *sectors);
 int bdev_last_lba(int fd, uint64_t *last_lba);
 
+/* sysfs gives partition offsets and sizes in 512-byte units, whatever the
+ * sectors */
+#define BDEV_SYSFS_SECTOR_SIZE 512
+
+int bdev_read_sysfs(const char *path, char *buffer, size_t size);
+int bdev_read_sysfs_u64(const char *path, uint64_t *value);
+
 size_t bdev_read_lba(int fd, uint64_t lba, uint8_t *buffer, size_t count);
 size_t bdev_write_lba(int fd, uint64_t lba, uint8_t *buffer, size_t count);
+size_t bdev_write_lba_diff(int fd, uint64_t lba, uint8_t *buffer,
+                           const uint8_t *old, size_t count);
+int bdev_discard(int fd, uint64_t lba, uint64_t sectors, int zero);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,205 @@
+#include "blkpg.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/blkpg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "bdev.h"
+
+typedef struct _kernel_part {
+    blkpg_part part;
+    char name[NAME_MAX + 1];
+} kernel_part;
+
+/*
+ * The partitions the kernel has for the disk behind fd, from
+ * /sys/dev/block/MAJOR:MINOR/<partition>/{partition,start,size}.
+ */
+static int read_kernel_parts(int fd, kernel_part **ret, int *nr) {
+    kernel_part *parts = NULL;
+    struct dirent *entry;
+    struct stat st;
+    char dir[64], path[PATH_MAX];
+    int max = 0;
+    DIR *sysfs;
+
+    *nr = 0;
+    if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+        return -1;
+
+    snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u", major(st.st_rdev),
+             minor(st.st_rdev));
+    sysfs = opendir(dir);
+    if (!sysfs) {
+        printf("blkpg: failed to open %s, errno is %d\n", dir, errno);
+        return -1;
+    }
+
+    while ((entry = readdir(sysfs))) {
+        kernel_part part;
+        uint64_t number;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s/partition", dir, entry->d_name);
+        if (bdev_read_sysfs_u64(path, &number))
+            continue;
+        part.part.number = number;
+
+        snprintf(path, sizeof(path), "%s/%s/start", dir, entry->d_name);
+        if (bdev_read_sysfs_u64(path, &part.part.start))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/size", dir, entry->d_name);
+        if (bdev_read_sysfs_u64(path, &part.part.size))
+            continue;
+        part.part.start *= BDEV_SYSFS_SECTOR_SIZE;
+        part.part.size *= BDEV_SYSFS_SECTOR_SIZE;
+        snprintf(part.name, sizeof(part.name), "%s", entry->d_name);
+
+        if (*nr == max) {
+            kernel_part *more;
+
+            max = max ? max * 2 : 16;
+            more = realloc(parts, max * sizeof(kernel_part));
+            if (!more) {
+                printf("blkpg: failed to malloc\n");
+                free(parts);
+                closedir(sysfs);
+                return -1;
+            }
+            parts = more;
+        }
+        parts[(*nr)++] = part;
+    }
+
+    closedir(sysfs);
+    *ret = parts;
+    return 0;
+}
+
+static int find_part(const blkpg_part *part, const blkpg_part *parts,
+                     int nr_parts) {
+    int i;
+
+    for (i = 0; i < nr_parts; i++) {
+        if (parts[i].number == part->number &&
+            parts[i].start == part->start && parts[i].size == part->size)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Report the partitions the kernel must drop to reach parts that are
+ * mounted, mapped or otherwise held open exclusively. Returns how many are.
+ */
+int blkpg_check_busy(int fd, const blkpg_part *parts, int nr_parts) {
+    kernel_part *kparts = NULL;
+    char path[PATH_MAX];
+    int i, nr, busy = 0;
+
+    if (read_kernel_parts(fd, &kparts, &nr))
+        return -1;
+
+    for (i = 0; i < nr; i++) {
+        int part_fd;
+
+        if (find_part(&kparts[i].part, parts, nr_parts))
+            continue;
+
+        snprintf(path, sizeof(path), "/dev/%s", kparts[i].name);
+        part_fd = open(path, O_RDONLY | O_EXCL);
+        if (part_fd >= 0) {
+            close(part_fd);
+        } else if (errno == EBUSY) {
+            printf("Error: partition %s is in use, unmount it or remove "
+                   "what holds it first\n",
+                   kparts[i].name);
+            busy++;
+        }
+    }
+
+    free(kparts);
+    return busy;
+}
+
+static int blkpg_ioctl(int fd, int op, const blkpg_part *part) {
+    struct blkpg_partition partition;
+    struct blkpg_ioctl_arg arg;
+
+    memset(&partition, 0, sizeof(partition));
+    partition.pno = part->number;
+    partition.start = part->start;
+    partition.length = part->size;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.op = op;
+    arg.datalen = sizeof(partition);
+    arg.data = &partition;
+
+    return ioctl(fd, BLKPG, &arg);
+}
+
+/*
+ * Make the kernel view of the disk match parts: remove the partitions that
+ * changed or are gone, then add the new ones. Partitions that are the same
+ * in both are not touched, and nothing rescans the whole disk.
+ */
+int blkpg_update(int fd, const blkpg_part *parts, int nr_parts) {
+    kernel_part *kparts = NULL;
+    blkpg_part *current;
+    int i, nr, removed = 0, added = 0, ret = 0;
+
+    if (read_kernel_parts(fd, &kparts, &nr))
+        return -1;
+
+    current = calloc(nr ? nr : 1, sizeof(blkpg_part));
+    if (!current) {
+        printf("blkpg: failed to malloc\n");
+        free(kparts);
+        return -1;
+    }
+    for (i = 0; i < nr; i++)
+        current[i] = kparts[i].part;
+
+    for (i = 0; i < nr; i++) {
+        if (find_part(&current[i], parts, nr_parts))
+            continue;
+        if (blkpg_ioctl(fd, BLKPG_DEL_PARTITION, &current[i])) {
+            printf("blkpg: failed to remove partition %d, errno is %d\n",
+                   current[i].number, errno);
+            ret = -1;
+            continue;
+        }
+        removed++;
+    }
+
+    for (i = 0; i < nr_parts; i++) {
+        if (find_part(&parts[i], current, nr))
+            continue;
+        if (blkpg_ioctl(fd, BLKPG_ADD_PARTITION, &parts[i])) {
+            printf("blkpg: failed to add partition %d, errno is %d\n",
+                   parts[i].number, errno);
+            ret = -1;
+            continue;
+        }
+        added++;
+    }
+
+    printf("Info: %d partitions removed and %d added in the kernel\n",
+           removed, added);
+    free(current);
+    free(kparts);
+    return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef __BLKPG_H__
+#define __BLKPG_H__
+
+#include <stdint.h>
+
+/* a partition as the kernel knows it, in bytes */
+typedef struct _blkpg_part {
+    int number;
+    uint64_t start;
+    uint64_t size;
+} blkpg_part;
+
+int blkpg_check_busy(int fd, const blkpg_part *parts, int nr_parts);
+int blkpg_update(int fd, const blkpg_part *parts, int nr_parts);
+
+#endif
@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include "clone.h"
+
+#include <errno.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* copy_file_range() calls are split so a large extent is not one syscall */
+#define CLONE_CHUNK (64 * 1024 * 1024)
+
+static int copy_range(int in, int out, off_t start, off_t end) {
+    off_t in_off = start, out_off = start;
+
+    while (in_off < end) {
+        size_t len = end - in_off > CLONE_CHUNK ? CLONE_CHUNK : end - in_off;
+        ssize_t ret = copy_file_range(in, &in_off, out, &out_off, len, 0);
+
+        if (ret <= 0) {
+            printf("clone: failed to copy at offset %ld, errno is %d\n",
+                   in_off, ret ? errno : EIO);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the data extents of in with copy_file_range(), which the filesystem
+ * may still share or offload, and leave its holes as holes.
+ */
+static int copy_extents(int in, int out, off_t size, uint64_t *copied) {
+    off_t data = 0, hole;
+
+    if (ftruncate(out, size)) {
+        printf("clone: failed to resize the copy, errno is %d\n", errno);
+        return -1;
+    }
+
+    *copied = 0;
+    while (data < size) {
+        off_t next = lseek(in, data, SEEK_DATA);
+
+        if (next < 0 && errno == ENXIO)
+            break;
+
+        if (next < 0) {
+            /* no SEEK_DATA, copy the rest */
+            hole = size;
+        } else {
+            data = next;
+            hole = lseek(in, data, SEEK_HOLE);
+            if (hole < 0 || hole > size)
+                hole = size;
+        }
+
+        if (copy_range(in, out, data, hole))
+            return -1;
+        *copied += hole - data;
+        data = hole;
+    }
+
+    return 0;
+}
+
+/*
+ * Make out a copy of the image in: a reflink that shares every block with
+ * in where the filesystem supports it (XFS, Btrfs), a copy of its data
+ * extents otherwise. Writes to out never reach in.
+ */
+int clone_image(int in, int out) {
+    struct stat st;
+    uint64_t copied;
+
+    if (fstat(in, &st) || !S_ISREG(st.st_mode)) {
+        printf("clone: only image files can be cloned\n");
+        return -1;
+    }
+
+    if (!ioctl(out, FICLONE, in)) {
+        printf("Info: cloned %lu bytes with a reflink\n", st.st_size);
+        return 0;
+    }
+
+    if (copy_extents(in, out, st.st_size, &copied))
+        return -1;
+
+    printf("Info: no reflink support, copied %lu of %lu bytes\n", copied,
+           st.st_size);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef __CLONE_H__
+#define __CLONE_H__
+
+int clone_image(int in, int out);
+
+#endif
@@ -0,0 +1,734 @@
+#include "d2b.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "align.h"
+#include "backup.h"
+#include "bdev.h"
+#include "blkpg.h"
+#include "gpt.h"
+#include "ldm.h"
+#include "list.h"
+#include "mbr.h"
+
+/* what a probe read, checked again by d2b_check() */
+typedef struct _generation {
+    uint32_t table_crc;
+    uint32_t privhead_seq;
+    uint64_t vmdb_seq;
+} generation;
+
+struct _d2b_dev {
+    int fd;
+    int owns_fd;
+    int table;
+    int realign;
+    legacy_mbr mbr;
+    uint64_t privhead_lba;
+    generation gen;
+    gpt_entry *entries;
+    struct list_head new_entries;
+    /* LDM data area, partitions may be moved within it */
+    uint64_t area_start, area_size;
+
+    d2b_volume *volumes;
+    size_t nr_volumes;
+    d2b_extent *extents;
+    size_t nr_extents;
+};
+
+/* the LDM parser keeps the database it reads in globals */
+static pthread_mutex_t ldm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *errors[] = {
+    [-D2B_OK] = "success",
+    [-D2B_ERR_NOMEM] = "out of memory",
+    [-D2B_ERR_OPEN] = "failed to open the device",
+    [-D2B_ERR_IO] = "I/O error",
+    [-D2B_ERR_NOT_LDM] = "not a dynamic disk",
+    [-D2B_ERR_LDM] = "invalid or unsupported LDM database",
+    [-D2B_ERR_GPT] = "primary and backup GPT do not match",
+    [-D2B_ERR_UNSUPPORTED] = "too many partitions for an MBR disk",
+    [-D2B_ERR_ALIGN] = "failed to align the partitions",
+    [-D2B_ERR_MOVE] = "failed to move the partitions",
+    [-D2B_ERR_STATE] = "the disk is not probed",
+    [-D2B_ERR_STALE] = "the disk changed since it was probed",
+    [-D2B_ERR_BUSY] = "a partition to replace is in use",
+};
+
+const char *d2b_strerror(int err) {
+    if (err > 0 || -err >= sizeof(errors) / sizeof(errors[0]))
+        return "unknown error";
+    return errors[-err];
+}
+
+int d2b_attach(int fd, d2b_dev **ret) {
+    d2b_dev *dev = calloc(1, sizeof(d2b_dev));
+
+    if (!dev)
+        return D2B_ERR_NOMEM;
+
+    dev->fd = fd;
+    INIT_LIST_HEAD(&dev->new_entries);
+    *ret = dev;
+
+    return D2B_OK;
+}
+
+int d2b_open(const char *path, int flags, d2b_dev **ret) {
+    int fd, err;
+
+    fd = open(path, flags & D2B_OPEN_RDONLY ? O_RDONLY : O_RDWR);
+    if (fd < 0)
+        return D2B_ERR_OPEN;
+
+    err = d2b_attach(fd, ret);
+    if (err) {
+        close(fd);
+        return err;
+    }
+
+    (*ret)->owns_fd = 1;
+    return D2B_OK;
+}
+
+static void free_model(d2b_dev *dev) {
+    struct list_head *pos, *next;
+
+    list_for_each_safe(pos, next, &dev->new_entries) {
+        list_del(pos);
+        free(list_entry(pos, partition_data, list));
+    }
+
+    free(dev->entries);
+    free(dev->volumes);
+    free(dev->extents);
+    dev->entries = NULL;
+    dev->volumes = NULL;
+    dev->extents = NULL;
+    dev->nr_volumes = 0;
+    dev->nr_extents = 0;
+    dev->table = D2B_TABLE_NONE;
+    dev->realign = 0;
+}
+
+void d2b_close(d2b_dev *dev) {
+    if (!dev)
+        return;
+
+    free_model(dev);
+    if (dev->owns_fd) {
+        bdev_forget(dev->fd);
+        close(dev->fd);
+    }
+    free(dev);
+}
+
+/* called with ldm_lock held, the lists belong to the last probe */
+static int copy_volumes(d2b_dev *dev) {
+    struct list_head *pos;
+    size_t i = 0;
+
+    list_for_each(pos, ldm_volumes()) dev->nr_volumes++;
+
+    dev->volumes = calloc(dev->nr_volumes ? dev->nr_volumes : 1,
+                          sizeof(d2b_volume));
+    if (!dev->volumes)
+        return D2B_ERR_NOMEM;
+
+    list_for_each(pos, ldm_volumes()) {
+        const vblk_volume *vol = list_entry(pos, vblk_volume, list);
+        d2b_volume *v = &dev->volumes[i++];
+
+        v->id = vol->id;
+        snprintf(v->name, sizeof(v->name), "%s", vol->name);
+        v->type = vol->type;
+        v->part_type = vol->part_type;
+        v->nr_components = vol->num_of_comps;
+        v->size = vol->size;
+    }
+
+    return D2B_OK;
+}
+
+static int copy_extents(d2b_dev *dev) {
+    struct list_head *pos;
+    size_t i = 0;
+
+    free(dev->extents);
+    dev->nr_extents = 0;
+    list_for_each(pos, &dev->new_entries) dev->nr_extents++;
+
+    dev->extents = calloc(dev->nr_extents ? dev->nr_extents : 1,
+                          sizeof(d2b_extent));
+    if (!dev->extents)
+        return D2B_ERR_NOMEM;
+
+    list_for_each(pos, &dev->new_entries) {
+        const partition_data *part = list_entry(pos, partition_data, list);
+        d2b_extent *e = &dev->extents[i++];
+
+        e->volume_id = part->volume_id;
+        e->start = part->start;
+        e->old_start = part->old_start;
+        e->offset = part->offset;
+        e->size = part->size;
+        e->part_type = part->part_type;
+    }
+
+    return D2B_OK;
+}
+
+/*
+ * The MBR, the CRC of the GPT entries and the LDM sequence numbers: a few
+ * sectors that change whenever the table or the disk group does.
+ */
+static int read_generation(d2b_dev *dev, generation *gen) {
+    legacy_mbr mbr;
+
+    if (bdev_read_lba(dev->fd, 0, (uint8_t *)&mbr, sizeof(mbr)) !=
+        sizeof(mbr))
+        return D2B_ERR_IO;
+    gen->table_crc = crc32(0, (const Bytef *)&mbr, sizeof(mbr));
+
+    if (dev->table == D2B_TABLE_GPT) {
+        gpt_header header;
+
+        if (read_main_header(dev->fd, &header) != 0)
+            return D2B_ERR_IO;
+        /* the number and size of the entries, then their CRC */
+        gen->table_crc =
+            crc32(gen->table_crc,
+                  (const Bytef *)&header.num_partition_entries,
+                  sizeof(header.num_partition_entries) +
+                      sizeof(header.sizeof_partition_entry) +
+                      sizeof(header.partition_entry_array_crc32));
+    }
+
+    if (ldm_read_sequence(dev->fd, dev->privhead_lba, &gen->privhead_seq,
+                          &gen->vmdb_seq))
+        return D2B_ERR_LDM;
+
+    return D2B_OK;
+}
+
+/*
+ * Read the partition table and the LDM database, and map the volumes of this
+ * disk onto basic partitions at their current location.
+ */
+int d2b_probe(d2b_dev *dev) {
+    int err = D2B_OK;
+
+    free_model(dev);
+
+    if (read_mbr(dev->fd, &dev->mbr) != MBR_ERROR_OK)
+        return D2B_ERR_IO;
+
+    switch (dev->mbr.partition[0].os_type) {
+    case MBR_PART_EFI_PROTECTIVE:
+        dev->table = D2B_TABLE_GPT;
+        break;
+    case MBR_PART_WINDOWS_LDM:
+        dev->table = D2B_TABLE_MBR;
+        break;
+    default:
+        return D2B_ERR_NOT_LDM;
+    }
+
+    /* read first, a change during the parse shows up in d2b_check() */
+    if (ldm_find_privhead(dev->fd, &dev->privhead_lba))
+        return D2B_ERR_NOT_LDM;
+    err = read_generation(dev, &dev->gen);
+    if (err)
+        return err;
+
+    pthread_mutex_lock(&ldm_lock);
+    ldm_reset();
+    if (dev->table == D2B_TABLE_GPT) {
+        gpt_header header;
+
+        if (read_gpt_ldm(dev->fd, &header, &dev->entries, &dev->new_entries))
+            err = D2B_ERR_LDM;
+    } else if (read_mbr_ldm(dev->fd, &dev->new_entries)) {
+        err = D2B_ERR_LDM;
+    }
+    if (!err)
+        err = copy_volumes(dev);
+    if (!err && ldm_get_logical_disk(&dev->area_start, &dev->area_size))
+        dev->area_start = dev->area_size = 0;
+    pthread_mutex_unlock(&ldm_lock);
+
+    if (!err)
+        err = copy_extents(dev);
+    if (err) {
+        int table = dev->table;
+
+        free_model(dev);
+        dev->table = table;
+    }
+
+    return err;
+}
+
+/*
+ * Tell whether the disk still matches the last probe, with a few sector reads
+ * instead of a parse of the database.
+ */
+int d2b_check(d2b_dev *dev) {
+    generation gen;
+    int err;
+
+    if (!dev->volumes)
+        return D2B_ERR_STATE;
+
+    err = read_generation(dev, &gen);
+    if (err)
+        return err;
+
+    if (memcmp(&gen, &dev->gen, sizeof(gen)))
+        return D2B_ERR_STALE;
+
+    return D2B_OK;
+}
+
+int d2b_table_type(const d2b_dev *dev) {
+    return dev->table;
+}
+
+int d2b_volumes(const d2b_dev *dev, const d2b_volume **volumes, size_t *nr) {
+    if (!dev->volumes)
+        return D2B_ERR_STATE;
+
+    *volumes = dev->volumes;
+    *nr = dev->nr_volumes;
+    return D2B_OK;
+}
+
+int d2b_extents(const d2b_dev *dev, const d2b_extent **extents, size_t *nr) {
+    if (!dev->extents)
+        return D2B_ERR_STATE;
+
+    *extents = dev->extents;
+    *nr = dev->nr_extents;
+    return D2B_OK;
+}
+
+/* both GPT copies must agree before either is rewritten */
+static int check_gpt(int fd, gpt_header *main_header,
+                     gpt_header *second_header) {
+    if (read_main_header(fd, main_header) != 0 ||
+        read_second_header(fd, second_header) != 0)
+        return D2B_ERR_IO;
+
+    if ((main_header->partition_entry_array_crc32 !=
+         second_header->partition_entry_array_crc32) ||
+        (main_header->alternate_lba != second_header->current_lba) ||
+        (main_header->current_lba != second_header->alternate_lba) ||
+        (main_header->header_crc32 != 0) || (second_header->header_crc32 != 0))
+        return D2B_ERR_GPT;
+
+    return D2B_OK;
+}
+
+/*
+ * Place the basic partitions, moved to physical block or optimal I/O
+ * boundaries with D2B_PLAN_ALIGN. Nothing is written yet.
+ */
+int d2b_plan(d2b_dev *dev, int flags) {
+    gpt_header main_header, second_header;
+    int err;
+
+    if (!dev->extents)
+        return D2B_ERR_STATE;
+
+    if (dev->table == D2B_TABLE_MBR && dev->nr_extents > 4)
+        return D2B_ERR_UNSUPPORTED;
+
+    if (dev->table == D2B_TABLE_GPT) {
+        err = check_gpt(dev->fd, &main_header, &second_header);
+        if (err)
+            return err;
+    }
+
+    if ((flags & D2B_PLAN_ALIGN) && !dev->realign) {
+        if (align_partitions(dev->fd, &dev->new_entries, dev->area_start,
+                             dev->area_size) < 0)
+            return D2B_ERR_ALIGN;
+        dev->realign = 1;
+    }
+
+    return copy_extents(dev);
+}
+
+/*
+ * Append the sectors the commit overwrites to the backup at path, as a
+ * snapshot named name: LBA 0 and both GPT headers and entry arrays, and the
+ * PRIVHEAD and database with D2B_BACKUP_LDM.
+ */
+int d2b_backup(d2b_dev *dev, const char *path, const char *name, int flags) {
+    const uint32_t sector_size = bdev_get_sector_size(dev->fd);
+    backup_range ranges[7];
+    int nr = 0, err;
+
+    if (!dev->volumes)
+        return D2B_ERR_STATE;
+
+    ranges[nr++] = (backup_range){ 0, 1 };
+
+    if (dev->table == D2B_TABLE_GPT) {
+        gpt_header main_header, second_header;
+        uint64_t entries_sectors;
+
+        err = check_gpt(dev->fd, &main_header, &second_header);
+        if (err)
+            return err;
+
+        entries_sectors = (le32toh(main_header.num_partition_entries) *
+                               le32toh(main_header.sizeof_partition_entry) +
+                           sector_size - 1) /
+                          sector_size;
+        ranges[nr++] = (backup_range){ le64toh(main_header.current_lba), 1 };
+        ranges[nr++] = (backup_range){
+            le64toh(main_header.partition_entry_lba), entries_sectors
+        };
+        ranges[nr++] = (backup_range){
+            le64toh(second_header.partition_entry_lba), entries_sectors
+        };
+        ranges[nr++] =
+            (backup_range){ le64toh(second_header.current_lba), 1 };
+    }
+
+    if (flags & D2B_BACKUP_LDM) {
+        ldm_disk_info info;
+
+        if (ldm_read_disk_info(dev->fd, &info))
+            return D2B_ERR_LDM;
+        ranges[nr++] = (backup_range){ info.privhead_lba, 1 };
+        ranges[nr++] = (backup_range){ info.config_start, info.config_size };
+    }
+
+    if (backup_save(dev->fd, path, name, ranges, nr))
+        return D2B_ERR_IO;
+
+    return D2B_OK;
+}
+
+/* the GPT entries of the new table, in a copy of those read by the probe */
+static int build_gpt(d2b_dev *dev, const gpt_header *header,
+                     gpt_entry **ret) {
+    const uint32_t nr_entries = le32toh(header->num_partition_entries);
+    gpt_entry zero_entry = { 0 };
+    gpt_entry *entries;
+    struct list_head *pos;
+    uint32_t i;
+
+    entries = malloc(nr_entries * le32toh(header->sizeof_partition_entry));
+    if (!entries)
+        return D2B_ERR_NOMEM;
+    memcpy(entries, dev->entries,
+           nr_entries * le32toh(header->sizeof_partition_entry));
+
+    // clear ldm entry
+    for (i = 0; i < nr_entries; i++) {
+        if (!uuid_compare(entries[i].type, PARTITION_LDM_DATA_GUID) ||
+            !uuid_compare(entries[i].type, PARTITION_LDM_METADATA_GUID)) {
+            memset(&entries[i], 0, sizeof(gpt_entry));
+        }
+    }
+
+    // update entry
+    list_for_each(pos, &dev->new_entries) {
+        partition_data *part = list_entry(pos, partition_data, list);
+
+        for (i = 0; i < nr_entries; i++) {
+            if (!memcmp(&entries[i], &zero_entry, sizeof(gpt_entry))) {
+                gpt_entry *entry = &entries[i];
+                uuid_copy(entry->type, PARTITION_BASIC_DATA_GUID);
+                uuid_generate_random(entry->guid);
+                entry->first_lba = part->start;
+                entry->last_lba = part->start + part->size - 1;
+                entry->flags = 0;
+                memset(entry->name, 0, sizeof(entry->name));
+                break;
+            }
+        }
+    }
+
+    *ret = entries;
+    return D2B_OK;
+}
+
+/*
+ * Write the new table over the one check_gpt() just read. The primary
+ * entries are compared with those of the probe, which were checked against
+ * their CRC, when the primary header still has that CRC. Nothing ever read
+ * the backup entries, they are read back and compared with what the disk
+ * holds.
+ */
+static int commit_gpt(d2b_dev *dev, gpt_header *main_header,
+                      gpt_header *second_header, gpt_entry *entries) {
+    const gpt_entry *old = NULL;
+    uint64_t entries_size;
+    uint32_t crc;
+
+    entries_size = le32toh(main_header->num_partition_entries) *
+                   le32toh(main_header->sizeof_partition_entry);
+    if (crc32(0, (const Bytef *)dev->entries, entries_size) ==
+        le32toh(main_header->partition_entry_array_crc32))
+        old = dev->entries;
+
+    // generate new crc
+    crc = crc32(0, (const Bytef *)entries, entries_size);
+    second_header->partition_entry_array_crc32 = crc;
+    main_header->partition_entry_array_crc32 = crc;
+
+    // save the backup first, the primary still describes the old layout
+    if (write_gpt_entry(dev->fd, second_header, entries, NULL,
+                        entries_size) != entries_size ||
+        write_gpt_header(dev->fd, second_header) != sizeof(gpt_header) ||
+        write_gpt_entry(dev->fd, main_header, entries, old, entries_size) !=
+            entries_size ||
+        write_gpt_header(dev->fd, main_header) != sizeof(gpt_header))
+        return D2B_ERR_IO;
+
+    return D2B_OK;
+}
+
+static void build_mbr(d2b_dev *dev, legacy_mbr *mbr) {
+    struct list_head *pos;
+    int i = 0;
+
+    *mbr = dev->mbr;
+    list_for_each(pos, &dev->new_entries) {
+        partition_data *part = list_entry(pos, partition_data, list);
+
+        mbr_partition *mbr_part = &(mbr->partition[i++]);
+        mbr_part->boot_indicator = 0x0;
+        calcCHS(part->start, &mbr_part->start_track, &mbr_part->start_head,
+                &mbr_part->start_sector);
+        mbr_part->os_type = part->part_type;
+        calcCHS(part->start + part->size, &mbr_part->end_track,
+                &mbr_part->end_head, &mbr_part->end_sector);
+        mbr_part->starting_lba = part->start;
+        mbr_part->size_in_lba = part->size;
+    }
+}
+
+static int commit_mbr(d2b_dev *dev, legacy_mbr *mbr) {
+    if (write_mbr(dev->fd, mbr) != sizeof(legacy_mbr))
+        return D2B_ERR_IO;
+
+    return D2B_OK;
+}
+
+/* the partitions of the new table, numbered as the kernel numbers them */
+static int table_partitions(d2b_dev *dev, const gpt_entry *entries,
+                            uint32_t nr_entries, const legacy_mbr *mbr,
+                            blkpg_part **ret, int *nr) {
+    const uint64_t sector_size = bdev_get_sector_size(dev->fd);
+    blkpg_part *parts;
+    uint32_t i;
+
+    if (dev->table == D2B_TABLE_MBR)
+        nr_entries = sizeof(mbr->partition) / sizeof(mbr->partition[0]);
+
+    parts = calloc(nr_entries ? nr_entries : 1, sizeof(blkpg_part));
+    if (!parts)
+        return D2B_ERR_NOMEM;
+
+    *nr = 0;
+    for (i = 0; i < nr_entries; i++) {
+        blkpg_part *part = &parts[*nr];
+
+        if (dev->table == D2B_TABLE_GPT) {
+            if (uuid_is_null(entries[i].type))
+                continue;
+            part->start = le64toh(entries[i].first_lba) * sector_size;
+            part->size = (le64toh(entries[i].last_lba) -
+                          le64toh(entries[i].first_lba) + 1) *
+                         sector_size;
+        } else {
+            if (!mbr->partition[i].os_type ||
+                !mbr->partition[i].size_in_lba)
+                continue;
+            part->start = mbr->partition[i].starting_lba * sector_size;
+            part->size = mbr->partition[i].size_in_lba * sector_size;
+        }
+        part->number = i + 1;
+        (*nr)++;
+    }
+
+    *ret = parts;
+    return D2B_OK;
+}
+
+/* sectors [start, end) that are in use */
+typedef struct _used_range {
+    uint64_t start;
+    uint64_t end;
+} used_range;
+
+static int compare_used(const void *a, const void *b) {
+    const used_range *ua = a, *ub = b;
+
+    return ua->start < ub->start ? -1 : ua->start > ub->start;
+}
+
+/*
+ * Discard the sectors the new table leaves free: the old LDM database and
+ * every gap, over the whole disk less the partitions of the table and its
+ * own structures. Those are the headers and entries outside the usable LBAs
+ * on GPT; on MBR everything before the first partition, where boot loaders
+ * and their tools keep data of their own. The table is flushed first,
+ * discarded sectors are gone even if the new table never reaches the disk.
+ * A device that can not discard is left as it is.
+ */
+static int reclaim_free(d2b_dev *dev, const gpt_header *header,
+                        const blkpg_part *parts, int nr_parts, int zero) {
+    const uint64_t sector_size = bdev_get_sector_size(dev->fd);
+    uint64_t disk_sectors, cur = 0, sectors = 0;
+    used_range *used;
+    int i, nr = 0, runs = 0, err = D2B_OK;
+
+    if (!nr_parts) {
+        printf("Warning: the new table has no partition, nothing "
+               "reclaimed\n");
+        return D2B_OK;
+    }
+    if (bdev_get_sectors(dev->fd, &disk_sectors))
+        return D2B_ERR_IO;
+    if (fsync(dev->fd))
+        return D2B_ERR_IO;
+
+    used = calloc(nr_parts + 2, sizeof(used_range));
+    if (!used)
+        return D2B_ERR_NOMEM;
+
+    for (i = 0; i < nr_parts; i++) {
+        used[nr].start = parts[i].start / sector_size;
+        used[nr].end = (parts[i].start + parts[i].size + sector_size - 1) /
+                       sector_size;
+        nr++;
+    }
+    qsort(used, nr, sizeof(used_range), compare_used);
+
+    if (dev->table == D2B_TABLE_GPT) {
+        used[nr++] = (used_range){ 0, le64toh(header->first_usable_lba) };
+        used[nr++] = (used_range){ le64toh(header->last_usable_lba) + 1,
+                                   disk_sectors };
+    } else {
+        used[nr++] = (used_range){ 0, used[0].start };
+    }
+    qsort(used, nr, sizeof(used_range), compare_used);
+
+    for (i = 0; i <= nr && cur < disk_sectors; i++) {
+        uint64_t start = i < nr ? used[i].start : disk_sectors;
+
+        if (start > disk_sectors)
+            start = disk_sectors;
+        if (start > cur) {
+            if (bdev_discard(dev->fd, cur, start - cur, zero)) {
+                if (errno != EOPNOTSUPP) {
+                    printf("Error: failed to discard sectors %lu-%lu, errno "
+                           "is %d\n",
+                           cur, start - 1, errno);
+                    err = D2B_ERR_IO;
+                }
+                break;
+            }
+            sectors += start - cur;
+            runs++;
+        }
+        if (i < nr && used[i].end > cur)
+            cur = used[i].end;
+    }
+
+    if (runs)
+        printf("Info: reclaimed %lu sectors in %d runs\n", sectors, runs);
+    free(used);
+    return err;
+}
+
+/*
+ * Move the partitions of an aligned plan, journaled in journal.<n>, then
+ * replace the LDM partitions with basic ones. The new table is built from
+ * what the probe read, so the disk must still match it, and the table is
+ * validated before any data moves.
+ */
+int d2b_commit(d2b_dev *dev, const char *journal, int flags) {
+    gpt_header main_header, second_header;
+    gpt_entry *entries = NULL;
+    uint32_t nr_entries = 0;
+    legacy_mbr mbr;
+    blkpg_part *parts = NULL;
+    char manifest[4096];
+    int nr_parts = 0, disk, err;
+
+    err = d2b_check(dev);
+    if (!err)
+        err = d2b_plan(dev, 0);
+    if (err)
+        return err;
+
+    if (!journal)
+        journal = D2B_DEFAULT_JOURNAL;
+    snprintf(manifest, sizeof(manifest), "%s" D2B_MANIFEST_EXT, journal);
+
+    if (dev->table == D2B_TABLE_GPT) {
+        err = check_gpt(dev->fd, &main_header, &second_header);
+        if (!err)
+            err = build_gpt(dev, &main_header, &entries);
+        nr_entries = le32toh(main_header.num_partition_entries);
+    } else {
+        build_mbr(dev, &mbr);
+    }
+    if (err)
+        return err;
+
+    /* the kernel drops the old partitions after the commit, none may be busy */
+    disk = bdev_is_disk(dev->fd);
+    if (disk || flags & D2B_COMMIT_RECLAIM) {
+        err = table_partitions(dev, entries, nr_entries, &mbr, &parts,
+                               &nr_parts);
+        if (!err && disk && blkpg_check_busy(dev->fd, parts, nr_parts) > 0)
+            err = D2B_ERR_BUSY;
+        if (err)
+            goto out;
+    }
+
+    if (dev->realign &&
+        align_move_partitions(dev->fd, &dev->new_entries, journal,
+                              flags & D2B_COMMIT_FULL_COPY,
+                              flags & D2B_COMMIT_VERIFY ? manifest : NULL)) {
+        err = D2B_ERR_MOVE;
+        goto out;
+    }
+
+    if (dev->table == D2B_TABLE_GPT)
+        err = commit_gpt(dev, &main_header, &second_header, entries);
+    else
+        err = commit_mbr(dev, &mbr);
+
+    if (!err && dev->realign)
+        align_remove_journals(&dev->new_entries, journal);
+
+    if (!err && disk && blkpg_update(dev->fd, parts, nr_parts))
+        printf("Warning: the kernel still has some of the old partitions, "
+               "run partprobe or reboot\n");
+
+    if (!err && flags & D2B_COMMIT_RECLAIM)
+        err = reclaim_free(dev, &main_header, parts, nr_parts,
+                           flags & D2B_COMMIT_RECLAIM_ZERO);
+
+out:
+    free(parts);
+    free(entries);
+    return err;
+}
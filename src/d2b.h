@@ -0,0 +1,113 @@
+#ifndef __D2B_H__
+#define __D2B_H__
+
+/*
+ * libd2b: probe a dynamic disk and convert it to a basic disk from within a
+ * process. Every call returns D2B_OK or a negative D2B_ERR_* code; handles
+ * may be used from different threads, one thread per handle at a time.
+ *
+ *   d2b_open() or d2b_attach()  get a handle on a disk
+ *   d2b_probe()                 read the partition table and LDM database
+ *   d2b_plan()                  place the basic partitions, optionally aligned
+ *   d2b_backup()                save the sectors d2b_commit() overwrites
+ *   d2b_commit()                move data if needed and write the new table
+ *
+ * d2b_check() tells whether a probed handle still describes the disk, so a
+ * long-running process can keep handles and probe again only on a change.
+ * d2b_commit() checks it first and fails with D2B_ERR_STALE when the disk
+ * changed since the probe.
+ *
+ * Handles are independent, except for what the library keeps per process:
+ * probes of different handles take turns on the LDM parser, and the I/O
+ * counters, the I/O deadline and the log handler are shared. Diagnostics go
+ * to the handler of d2b_set_log(), by default nowhere, never to stdout.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#define D2B_DEFAULT_JOURNAL "d2b-align.journal"
+/* appended to the journal path for the manifest of a verified move */
+#define D2B_MANIFEST_EXT ".manifest"
+#define D2B_NAME_LEN 64
+
+enum {
+    D2B_OK = 0,
+    D2B_ERR_NOMEM = -1,
+    D2B_ERR_OPEN = -2,
+    D2B_ERR_IO = -3,
+    D2B_ERR_NOT_LDM = -4,
+    D2B_ERR_LDM = -5,
+    D2B_ERR_GPT = -6,
+    D2B_ERR_UNSUPPORTED = -7,
+    D2B_ERR_ALIGN = -8,
+    D2B_ERR_MOVE = -9,
+    D2B_ERR_STATE = -10,
+    D2B_ERR_STALE = -11,
+    D2B_ERR_BUSY = -12,
+};
+
+enum {
+    D2B_TABLE_NONE = 0,
+    D2B_TABLE_MBR,
+    D2B_TABLE_GPT,
+};
+
+/* d2b_open() flags */
+#define D2B_OPEN_RDONLY 0x1
+
+/* d2b_plan() flags */
+#define D2B_PLAN_ALIGN 0x1
+
+/* d2b_commit() flags */
+#define D2B_COMMIT_FULL_COPY 0x1
+#define D2B_COMMIT_VERIFY 0x2 /* read moved data back, see D2B_MANIFEST_EXT */
+/* hand the sectors outside the new partitions back to the storage */
+#define D2B_COMMIT_RECLAIM 0x4
+#define D2B_COMMIT_RECLAIM_ZERO 0x8 /* with RECLAIM, zero instead of discard */
+
+/* d2b_backup() flags */
+#define D2B_BACKUP_LDM 0x1
+
+typedef struct _d2b_dev d2b_dev;
+
+/* text is a line of diagnostics or part of one, with its newline */
+typedef void (*d2b_log_fn)(void *arg, const char *text);
+
+typedef struct _d2b_volume {
+    uint32_t id;
+    char name[D2B_NAME_LEN];
+    uint8_t type;
+    uint8_t part_type;
+    uint32_t nr_components;
+    uint64_t size; /* in sectors */
+} d2b_volume;
+
+/* one basic partition of the plan, in sectors */
+typedef struct _d2b_extent {
+    uint32_t volume_id;
+    uint64_t start;
+    uint64_t old_start; /* data location before realignment */
+    uint64_t offset;    /* within the volume */
+    uint64_t size;
+    uint8_t part_type;
+} d2b_extent;
+
+const char *d2b_strerror(int err);
+void d2b_set_log(d2b_log_fn fn, void *arg);
+
+int d2b_open(const char *path, int flags, d2b_dev **dev);
+int d2b_attach(int fd, d2b_dev **dev);
+void d2b_close(d2b_dev *dev);
+
+int d2b_probe(d2b_dev *dev);
+int d2b_check(d2b_dev *dev);
+int d2b_table_type(const d2b_dev *dev);
+int d2b_volumes(const d2b_dev *dev, const d2b_volume **volumes, size_t *nr);
+
+int d2b_plan(d2b_dev *dev, int flags);
+int d2b_extents(const d2b_dev *dev, const d2b_extent **extents, size_t *nr);
+
+int d2b_backup(d2b_dev *dev, const char *path, const char *name, int flags);
+int d2b_commit(d2b_dev *dev, const char *journal, int flags);
+
+#endif
@@ -0,0 +1,592 @@
+#include "daemon.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "d2b.h"
+#include "latency.h"
+#include "list.h"
+#include "throttle.h"
+#include "workq.h"
+
+/*
+ * Requests are lines of text on a Unix socket:
+ *
+ *   probe PATH                               the volumes of the disk
+ *   plan PATH [align]                        the basic partitions it would get
+ *   convert PATH [align] [full-copy] [journal=FILE]
+ *   metrics                                  counters, Prometheus text format
+ *   throttle [RATE [IOPS]]                   show or change the move limits
+ *
+ * Every answer starts with "ok" or "error CODE MESSAGE" and ends with an
+ * empty line. An HTTP GET is answered with the metrics, so a scraper can read
+ * them through curl --unix-socket or a socket proxy.
+ *
+ * A connection is served by one worker, requests on a device are serialized
+ * by its lock, and probed devices are kept: a repeat request only checks the
+ * table and the LDM sequence numbers before answering from memory.
+ */
+#define DAEMON_BACKLOG 16
+#define DAEMON_IDLE_SEC 30 /* then a connection is closed, freeing a worker */
+
+enum {
+    OP_PROBE = 0,
+    OP_PLAN,
+    OP_CONVERT,
+    NR_OPS,
+};
+
+static const char *op_names[NR_OPS] = { "probe", "plan", "convert" };
+
+/* upper bounds of the request duration buckets */
+#define NR_BUCKETS 7
+static const uint64_t bucket_nsec[NR_BUCKETS] = {
+    10000ULL,     100000ULL,     1000000ULL,    10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL,
+};
+static const char *bucket_names[NR_BUCKETS] = {
+    "1e-05", "0.0001", "0.001", "0.01", "0.1", "1", "10",
+};
+
+typedef struct _daemon_metrics {
+    uint64_t requests[NR_OPS][2];         /* succeeded, failed */
+    uint64_t buckets[NR_OPS][NR_BUCKETS]; /* not cumulative */
+    uint64_t duration_nsec[NR_OPS];
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t open_devices;
+    uint64_t in_flight;
+    uint64_t connections;
+} daemon_metrics;
+
+static daemon_metrics metrics;
+
+typedef struct _cached_dev {
+    struct list_head list;
+    char *path;
+    pthread_mutex_t lock; /* one request on the device at a time */
+    d2b_dev *dev;
+    int probed;
+    int aligned; /* the model was moved by an aligned plan */
+} cached_dev;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head cache = LIST_HEAD_INIT(cache);
+
+typedef struct _daemon_conn {
+    struct list_head list;
+    int fd;
+} daemon_conn;
+
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head conns = LIST_HEAD_INIT(conns);
+
+static volatile sig_atomic_t stopping;
+
+static const char *table_names[] = {
+    [D2B_TABLE_NONE] = "none",
+    [D2B_TABLE_MBR] = "mbr",
+    [D2B_TABLE_GPT] = "gpt",
+};
+
+static uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void add(uint64_t *counter, int64_t value) {
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static cached_dev *get_device(const char *path) {
+    struct list_head *pos;
+    cached_dev *cd;
+
+    pthread_mutex_lock(&cache_lock);
+    list_for_each(pos, &cache) {
+        cd = list_entry(pos, cached_dev, list);
+        if (!strcmp(cd->path, path))
+            goto out;
+    }
+
+    cd = calloc(1, sizeof(cached_dev));
+    if (cd && !(cd->path = strdup(path))) {
+        free(cd);
+        cd = NULL;
+    }
+    if (cd) {
+        pthread_mutex_init(&cd->lock, NULL);
+        list_add_tail(&cd->list, &cache);
+    }
+
+out:
+    pthread_mutex_unlock(&cache_lock);
+    return cd;
+}
+
+/* called with cd->lock held, probes unless the model still matches the disk */
+static int load_device(cached_dev *cd) {
+    int err;
+
+    if (!cd->dev) {
+        err = d2b_open(cd->path, 0, &cd->dev);
+        if (err == D2B_ERR_OPEN)
+            err = d2b_open(cd->path, D2B_OPEN_RDONLY, &cd->dev);
+        if (err) {
+            cd->dev = NULL;
+            return err;
+        }
+        add(&metrics.open_devices, 1);
+        cd->probed = 0;
+    }
+
+    if (cd->probed && d2b_check(cd->dev) == D2B_OK) {
+        add(&metrics.cache_hits, 1);
+        return D2B_OK;
+    }
+
+    add(&metrics.cache_misses, 1);
+    cd->probed = 0;
+    cd->aligned = 0;
+    err = d2b_probe(cd->dev);
+    if (err) {
+        /* opened again next time, the device may have been replaced */
+        d2b_close(cd->dev);
+        cd->dev = NULL;
+        add(&metrics.open_devices, -1);
+        return err;
+    }
+
+    cd->probed = 1;
+    return D2B_OK;
+}
+
+static void put_volumes(FILE *out, const d2b_dev *dev) {
+    const d2b_volume *volumes;
+    size_t i, nr;
+
+    if (d2b_volumes(dev, &volumes, &nr))
+        return;
+
+    for (i = 0; i < nr; i++)
+        fprintf(out, "volume %u %s %u 0x%02x %u %lu\n", volumes[i].id,
+                volumes[i].name, volumes[i].type, volumes[i].part_type,
+                volumes[i].nr_components, volumes[i].size);
+}
+
+static void put_extents(FILE *out, const d2b_dev *dev) {
+    const d2b_extent *extents;
+    size_t i, nr;
+
+    if (d2b_extents(dev, &extents, &nr))
+        return;
+
+    for (i = 0; i < nr; i++)
+        fprintf(out, "extent %u %lu %lu %lu %lu 0x%02x\n",
+                extents[i].volume_id, extents[i].start, extents[i].old_start,
+                extents[i].offset, extents[i].size, extents[i].part_type);
+}
+
+static int do_request(FILE *out, int op, const char *path, int align,
+                      int full_copy, const char *journal) {
+    cached_dev *cd = get_device(path);
+    int err;
+
+    if (!cd)
+        return D2B_ERR_NOMEM;
+
+    pthread_mutex_lock(&cd->lock);
+
+    /* an aligned plan moved the partitions of the model, start over */
+    if (cd->aligned && !align)
+        cd->probed = 0;
+
+    err = load_device(cd);
+    if (!err && op != OP_PROBE) {
+        err = d2b_plan(cd->dev, align ? D2B_PLAN_ALIGN : 0);
+        if (!err && align)
+            cd->aligned = 1;
+    }
+    if (!err && op == OP_CONVERT) {
+        err = d2b_commit(cd->dev, journal,
+                         full_copy ? D2B_COMMIT_FULL_COPY : 0);
+        cd->probed = 0;
+    }
+
+    if (!err) {
+        fprintf(out, "ok %s\n", table_names[d2b_table_type(cd->dev)]);
+        if (op == OP_PROBE)
+            put_volumes(out, cd->dev);
+        else
+            put_extents(out, cd->dev);
+    }
+
+    pthread_mutex_unlock(&cd->lock);
+    return err;
+}
+
+static void record(int op, int err, uint64_t start) {
+    uint64_t nsec = latency_start() - start;
+    int i;
+
+    add(&metrics.requests[op][err ? 1 : 0], 1);
+    add(&metrics.duration_nsec[op], nsec);
+    for (i = 0; i < NR_BUCKETS; i++) {
+        if (nsec <= bucket_nsec[i]) {
+            add(&metrics.buckets[op][i], 1);
+            break;
+        }
+    }
+}
+
+static void put_metrics(FILE *out) {
+    static const char *results[2] = { "ok", "error" };
+    int op, i;
+
+    fprintf(out, "# HELP d2b_requests_total Requests by operation and "
+                 "result.\n"
+                 "# TYPE d2b_requests_total counter\n");
+    for (op = 0; op < NR_OPS; op++) {
+        for (i = 0; i < 2; i++)
+            fprintf(out, "d2b_requests_total{op=\"%s\",result=\"%s\"} %lu\n",
+                    op_names[op], results[i], load(&metrics.requests[op][i]));
+    }
+
+    fprintf(out, "# HELP d2b_request_duration_seconds Time to answer a "
+                 "request.\n"
+                 "# TYPE d2b_request_duration_seconds histogram\n");
+    for (op = 0; op < NR_OPS; op++) {
+        uint64_t count = load(&metrics.requests[op][0]) +
+                         load(&metrics.requests[op][1]);
+        uint64_t cumulative = 0;
+
+        for (i = 0; i < NR_BUCKETS; i++) {
+            cumulative += load(&metrics.buckets[op][i]);
+            fprintf(out,
+                    "d2b_request_duration_seconds_bucket{op=\"%s\","
+                    "le=\"%s\"} %lu\n",
+                    op_names[op], bucket_names[i], cumulative);
+        }
+        fprintf(out,
+                "d2b_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} "
+                "%lu\n"
+                "d2b_request_duration_seconds_sum{op=\"%s\"} %.6f\n"
+                "d2b_request_duration_seconds_count{op=\"%s\"} %lu\n",
+                op_names[op], count, op_names[op],
+                load(&metrics.duration_nsec[op]) / 1e9, op_names[op], count);
+    }
+
+    fprintf(out,
+            "# HELP d2b_cache_hits_total Requests answered from a cached "
+            "probe.\n"
+            "# TYPE d2b_cache_hits_total counter\n"
+            "d2b_cache_hits_total %lu\n"
+            "# HELP d2b_cache_misses_total Requests that probed the disk.\n"
+            "# TYPE d2b_cache_misses_total counter\n"
+            "d2b_cache_misses_total %lu\n"
+            "# HELP d2b_open_devices Devices kept open with their probe.\n"
+            "# TYPE d2b_open_devices gauge\n"
+            "d2b_open_devices %lu\n"
+            "# HELP d2b_requests_in_flight Requests being answered.\n"
+            "# TYPE d2b_requests_in_flight gauge\n"
+            "d2b_requests_in_flight %lu\n"
+            "# HELP d2b_connections_total Connections accepted.\n"
+            "# TYPE d2b_connections_total counter\n"
+            "d2b_connections_total %lu\n",
+            load(&metrics.cache_hits), load(&metrics.cache_misses),
+            load(&metrics.open_devices), load(&metrics.in_flight),
+            load(&metrics.connections));
+}
+
+/* a rate of 0 lifts the limit, the moves already running follow at once */
+static void handle_throttle(FILE *out, char **save) {
+    char *rate = strtok_r(NULL, " \t\r\n", save);
+    char *iops = strtok_r(NULL, " \t\r\n", save);
+    uint64_t bytes_per_sec, old_rate;
+    uint32_t ops;
+    char *end;
+
+    throttle_get(&old_rate, &ops);
+    bytes_per_sec = old_rate;
+    if (rate && throttle_parse_rate(rate, &bytes_per_sec))
+        goto usage;
+    if (iops) {
+        ops = strtoul(iops, &end, 10);
+        if (*end || strtok_r(NULL, " \t\r\n", save))
+            goto usage;
+    }
+
+    if (rate)
+        throttle_set(bytes_per_sec, ops);
+    fprintf(out, "ok\nthrottle %lu %u\n\n", bytes_per_sec, ops);
+    return;
+
+usage:
+    fprintf(out, "error usage throttle [RATE [IOPS]]\n\n");
+}
+
+static void handle_line(FILE *out, char *line) {
+    const char *journal = NULL;
+    char *save = NULL, *cmd, *path, *arg;
+    int op, align = 0, full_copy = 0, err;
+    uint64_t start;
+
+    cmd = strtok_r(line, " \t\r\n", &save);
+    if (!cmd)
+        return;
+
+    if (!strcmp(cmd, "metrics")) {
+        fprintf(out, "ok\n");
+        put_metrics(out);
+        fprintf(out, "\n");
+        return;
+    }
+
+    if (!strcmp(cmd, "throttle")) {
+        handle_throttle(out, &save);
+        return;
+    }
+
+    for (op = 0; op < NR_OPS; op++) {
+        if (!strcmp(cmd, op_names[op]))
+            break;
+    }
+
+    path = strtok_r(NULL, " \t\r\n", &save);
+    if (op == NR_OPS || !path)
+        goto usage;
+
+    while ((arg = strtok_r(NULL, " \t\r\n", &save))) {
+        if (op != OP_PROBE && !strcmp(arg, "align"))
+            align = 1;
+        else if (op == OP_CONVERT && !strcmp(arg, "full-copy"))
+            full_copy = 1;
+        else if (op == OP_CONVERT && !strncmp(arg, "journal=", 8))
+            journal = arg + 8;
+        else
+            goto usage;
+    }
+
+    add(&metrics.in_flight, 1);
+    start = latency_start();
+    err = do_request(out, op, path, align, full_copy, journal);
+    record(op, err, start);
+    add(&metrics.in_flight, -1);
+
+    if (err)
+        fprintf(out, "error %d %s\n", err, d2b_strerror(err));
+    fprintf(out, "\n");
+    return;
+
+usage:
+    fprintf(out, "error usage probe PATH | plan PATH [align] | convert PATH "
+                 "[align] [full-copy] [journal=FILE] | metrics | "
+                 "throttle [RATE [IOPS]]\n\n");
+}
+
+/* the request line is read, skip the headers and answer with the metrics */
+static void handle_http(FILE *in, FILE *out) {
+    char *line = NULL;
+    size_t len = 0;
+
+    while (getline(&line, &len, in) > 0 && strcmp(line, "\r\n") &&
+           strcmp(line, "\n"))
+        ;
+    free(line);
+
+    fprintf(out, "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Connection: close\r\n\r\n");
+    put_metrics(out);
+}
+
+static void serve(void *arg) {
+    daemon_conn *conn = arg;
+    int out_fd = dup(conn->fd);
+    FILE *in = fdopen(conn->fd, "r");
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    char *line = NULL;
+    size_t len = 0;
+
+    while (in && out && getline(&line, &len, in) > 0) {
+        if (!strncmp(line, "GET ", 4)) {
+            handle_http(in, out);
+            break;
+        }
+        handle_line(out, line);
+        if (fflush(out))
+            break;
+    }
+    free(line);
+
+    pthread_mutex_lock(&conns_lock);
+    list_del(&conn->list);
+    pthread_mutex_unlock(&conns_lock);
+
+    if (out)
+        fclose(out);
+    else if (out_fd >= 0)
+        close(out_fd);
+    if (in)
+        fclose(in);
+    else
+        close(conn->fd);
+    free(conn);
+}
+
+static void stop(int sig) {
+    stopping = 1;
+}
+
+/* a socket left by a daemon that died is removed, a live one is not */
+static int bind_socket(int fd, const struct sockaddr_un *addr) {
+    int probe;
+
+    if (!bind(fd, (const struct sockaddr *)addr, sizeof(*addr)))
+        return 0;
+    if (errno != EADDRINUSE)
+        return -1;
+
+    probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0)
+        return -1;
+    if (!connect(probe, (const struct sockaddr *)addr, sizeof(*addr))) {
+        close(probe);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    close(probe);
+
+    unlink(addr->sun_path);
+    return bind(fd, (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+/* wake up the workers waiting for a request, running ones finish theirs */
+static void close_connections(void) {
+    struct list_head *pos;
+
+    pthread_mutex_lock(&conns_lock);
+    list_for_each(pos, &conns) {
+        shutdown(list_entry(pos, daemon_conn, list)->fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&conns_lock);
+}
+
+static void free_cache(void) {
+    struct list_head *pos, *next;
+
+    list_for_each_safe(pos, next, &cache) {
+        cached_dev *cd = list_entry(pos, cached_dev, list);
+
+        list_del(pos);
+        d2b_close(cd->dev);
+        pthread_mutex_destroy(&cd->lock);
+        free(cd->path);
+        free(cd);
+    }
+}
+
+/*
+ * Serve requests on the socket at path with nr_threads workers until SIGINT
+ * or SIGTERM. Connections beyond the workers wait in the queue.
+ */
+int daemon_run(const char *path, int nr_threads) {
+    struct timeval idle = { .tv_sec = DAEMON_IDLE_SEC };
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    sigset_t signals, old;
+    workq *wq = NULL;
+    int fd, ret = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("daemon: socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind_socket(fd, &addr) || chmod(path, 0600) ||
+        listen(fd, DAEMON_BACKLOG)) {
+        printf("daemon: failed to listen on %s, errno is %d\n", path, errno);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the signals must interrupt accept(), not a worker */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old);
+    wq = workq_create(nr_threads, nr_threads);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!wq)
+        goto out;
+
+    printf("Info: listening on %s with %d workers\n", path, nr_threads);
+    fflush(stdout);
+
+    while (!stopping) {
+        daemon_conn *conn;
+        int cfd = accept(fd, NULL, NULL);
+
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("daemon: failed to accept, errno is %d\n", errno);
+            goto out;
+        }
+
+        conn = malloc(sizeof(daemon_conn));
+        if (!conn) {
+            close(cfd);
+            continue;
+        }
+        conn->fd = cfd;
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        add(&metrics.connections, 1);
+
+        pthread_mutex_lock(&conns_lock);
+        list_add_tail(&conn->list, &conns);
+        pthread_mutex_unlock(&conns_lock);
+
+        if (workq_submit(wq, serve, conn)) {
+            pthread_mutex_lock(&conns_lock);
+            list_del(&conn->list);
+            pthread_mutex_unlock(&conns_lock);
+            close(cfd);
+            free(conn);
+        }
+    }
+
+    printf("Info: stopping\n");
+    ret = 0;
+
+out:
+    close(fd);
+    unlink(path);
+    if (wq) {
+        close_connections();
+        workq_wait(wq);
+        workq_destroy(wq);
+    }
+    free_cache();
+    return ret;
+}
@@ -0,0 +1,8 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#define DAEMON_DEFAULT_SOCKET "/run/d2b.sock"
+
+int daemon_run(const char *path, int nr_threads);
+
+#endif
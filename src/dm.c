@@ -0,0 +1,617 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "dm.h"
+#include "ldm.h"
+#include "list.h"
+
+#define DM_CONTROL "/dev/mapper/control"
+#define DM_BUFFER_SIZE (64 * 1024)
+
+static dm_target *dm_add_target(dm_device *dev, uint64_t start,
+                                uint64_t length, const char *type,
+                                uint32_t nr_legs) {
+    dm_target *targets, *t;
+    uint32_t i;
+
+    targets = realloc(dev->targets, (dev->nr_targets + 1) * sizeof(dm_target));
+    if (!targets) {
+        printf("dm: failed to malloc\n");
+        return NULL;
+    }
+    dev->targets = targets;
+
+    t = &targets[dev->nr_targets];
+    memset(t, 0, sizeof(*t));
+    t->legs = calloc(nr_legs, sizeof(dm_leg));
+    if (!t->legs) {
+        printf("dm: failed to malloc\n");
+        return NULL;
+    }
+
+    t->start = start;
+    t->length = length;
+    t->type = type;
+    t->nr_legs = nr_legs;
+    for (i = 0; i < nr_legs; i++)
+        t->legs[i].sub = -1;
+    dev->nr_targets++;
+
+    return t;
+}
+
+static void dm_free_device(dm_device *dev) {
+    uint32_t i;
+
+    for (i = 0; i < dev->nr_targets; i++)
+        free(dev->targets[i].legs);
+    free(dev->targets);
+    dev->targets = NULL;
+    dev->nr_targets = 0;
+}
+
+/*
+ * Append a finished device to the plan, which takes over its targets.
+ */
+static int dm_plan_add(dm_plan *plan, dm_device *dev) {
+    dm_device *devices;
+
+    devices =
+        realloc(plan->devices, (plan->nr_devices + 1) * sizeof(dm_device));
+    if (!devices) {
+        printf("dm: failed to malloc\n");
+        return -1;
+    }
+
+    plan->devices = devices;
+    plan->devices[plan->nr_devices] = *dev;
+    dev->targets = NULL;
+    dev->nr_targets = 0;
+
+    return plan->nr_devices++;
+}
+
+static const dm_disk *dm_find_disk(const dm_disk *disks, int nr_disks,
+                                   uint32_t disk_id) {
+    struct list_head *pos;
+    int i;
+
+    list_for_each(pos, ldm_disks()) {
+        vblk_disk *disk = list_entry(pos, vblk_disk, list);
+        if (disk->id != disk_id)
+            continue;
+
+        for (i = 0; i < nr_disks; i++) {
+            if (!uuid_compare(disks[i].guid, disk->guid))
+                return &disks[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int dm_cmp_index(const void *a, const void *b) {
+    const vblk_partition *pa = *(vblk_partition *const *)a;
+    const vblk_partition *pb = *(vblk_partition *const *)b;
+
+    return pa->index < pb->index ? -1 : pa->index > pb->index;
+}
+
+static int dm_cmp_offset(const void *a, const void *b) {
+    const vblk_partition *pa = *(vblk_partition *const *)a;
+    const vblk_partition *pb = *(vblk_partition *const *)b;
+
+    return pa->volume_offset < pb->volume_offset
+               ? -1
+               : pa->volume_offset > pb->volume_offset;
+}
+
+/*
+ * Collect the partitions of a component, in column order for striped and
+ * RAID-5 components, in volume order for spanned ones.
+ */
+static int dm_collect_parts(uint32_t component_id, int by_index,
+                            vblk_partition ***parts, uint32_t *nr) {
+    struct list_head *pos;
+    uint32_t count = 0;
+
+    list_for_each(pos, ldm_partitions()) {
+        if (list_entry(pos, vblk_partition, list)->component_id ==
+            component_id)
+            count++;
+    }
+
+    *nr = 0;
+    *parts = malloc((count ? count : 1) * sizeof(vblk_partition *));
+    if (!*parts) {
+        printf("dm: failed to malloc\n");
+        return -1;
+    }
+
+    list_for_each(pos, ldm_partitions()) {
+        vblk_partition *part = list_entry(pos, vblk_partition, list);
+        if (part->component_id == component_id)
+            (*parts)[(*nr)++] = part;
+    }
+
+    qsort(*parts, *nr, sizeof(vblk_partition *),
+          by_index ? dm_cmp_index : dm_cmp_offset);
+
+    return 0;
+}
+
+/*
+ * Build the targets of a spanned or striped component, every partition has
+ * to be on one of the given disks.
+ */
+static int dm_component_targets(const dm_plan *plan, const dm_disk *disks,
+                                int nr_disks, const vblk_component *com,
+                                dm_device *dev) {
+    int striped = com->type == COMPONENT_TYPE_STRIPED;
+    vblk_partition **parts;
+    dm_target *t = NULL;
+    uint32_t nr, i;
+    int ret = -1;
+
+    if (com->type != COMPONENT_TYPE_STRIPED &&
+        com->type != COMPONENT_TYPE_SPANNED) {
+        printf("dm: component %s has unexpected type %d\n", com->name,
+               com->type);
+        return -1;
+    }
+
+    if (dm_collect_parts(com->id, striped, &parts, &nr))
+        return -1;
+
+    if (!nr) {
+        printf("dm: component %s has no partitions\n", com->name);
+        goto out;
+    }
+
+    if (striped) {
+        if (nr != com->columns)
+            printf("Info: component %s has %u of %u columns\n", com->name,
+                   nr, com->columns);
+
+        t = dm_add_target(dev, 0, 0, "striped", nr);
+        if (!t)
+            goto out;
+        t->chunk = com->chunk_size * plan->scale;
+    }
+
+    for (i = 0; i < nr; i++) {
+        const dm_disk *disk = dm_find_disk(disks, nr_disks, parts[i]->disk_id);
+        uint64_t size = parts[i]->size * plan->scale;
+        dm_leg *leg;
+
+        if (!disk) {
+            printf("Info: partition %s is on a disk that was not given\n",
+                   parts[i]->name);
+            goto out;
+        }
+
+        if (striped) {
+            leg = &t->legs[i];
+            t->length += size;
+        } else {
+            t = dm_add_target(dev, parts[i]->volume_offset * plan->scale, size,
+                              "linear", 1);
+            if (!t)
+                goto out;
+            leg = &t->legs[0];
+        }
+
+        leg->path = disk->path;
+        leg->offset = (disk->data_start + parts[i]->start) * plan->scale;
+    }
+
+    ret = 0;
+
+out:
+    free(parts);
+    return ret;
+}
+
+static int dm_build_simple(dm_plan *plan, const dm_disk *disks, int nr_disks,
+                           const vblk_volume *vol, dm_device *dev) {
+    struct list_head *pos;
+
+    list_for_each(pos, ldm_components()) {
+        vblk_component *com = list_entry(pos, vblk_component, list);
+        if (com->volume_id == vol->id)
+            return dm_component_targets(plan, disks, nr_disks, com, dev);
+    }
+
+    printf("dm: volume %s has no components\n", vol->name);
+    return -1;
+}
+
+/*
+ * A mirror is a raid1 over one sub-device per component. Components on
+ * missing disks become missing legs, the kernel runs the mirror degraded.
+ */
+static int dm_build_mirror(dm_plan *plan, const dm_disk *disks, int nr_disks,
+                           const vblk_volume *vol, dm_device *dev) {
+    struct list_head *pos;
+    uint32_t nr = 0, missing = 0;
+    dm_target *t;
+
+    t = dm_add_target(dev, 0, vol->size * plan->scale, "raid",
+                      vol->num_of_comps);
+    if (!t)
+        return -1;
+    t->level = "raid1";
+
+    list_for_each(pos, ldm_components()) {
+        vblk_component *com = list_entry(pos, vblk_component, list);
+        dm_device sub;
+        int index;
+
+        if (com->volume_id != vol->id || nr == t->nr_legs)
+            continue;
+
+        memset(&sub, 0, sizeof(sub));
+        snprintf(sub.name, sizeof(sub.name), "ldm_%s_c%u", vol->name,
+                 com->id);
+
+        if (dm_component_targets(plan, disks, nr_disks, com, &sub) ||
+            (index = dm_plan_add(plan, &sub)) < 0) {
+            dm_free_device(&sub);
+            missing++;
+        } else {
+            t->legs[nr].sub = index;
+        }
+        nr++;
+    }
+
+    if (nr < t->nr_legs)
+        printf("Info: mirror %s has %u of %u components\n", vol->name, nr,
+               t->nr_legs);
+
+    if (missing >= nr) {
+        printf("Info: no component of mirror %s is available\n", vol->name);
+        return -1;
+    }
+
+    t->nr_legs = nr;
+    return 0;
+}
+
+/*
+ * RAID-5 is a raid5_ls over one linear sub-device per column, at most one
+ * column may be missing.
+ */
+static int dm_build_raid5(dm_plan *plan, const dm_disk *disks, int nr_disks,
+                          const vblk_volume *vol, dm_device *dev) {
+    vblk_component *com = NULL;
+    vblk_partition **parts;
+    struct list_head *pos;
+    uint32_t nr, i, missing = 0;
+    dm_target *t;
+    int ret = -1;
+
+    list_for_each(pos, ldm_components()) {
+        com = list_entry(pos, vblk_component, list);
+        if (com->volume_id == vol->id)
+            break;
+        com = NULL;
+    }
+
+    if (!com || com->type != COMPONENT_TYPE_RAID) {
+        printf("dm: volume %s has no RAID-5 component\n", vol->name);
+        return -1;
+    }
+
+    if (dm_collect_parts(com->id, 1, &parts, &nr))
+        return -1;
+
+    t = dm_add_target(dev, 0, vol->size * plan->scale, "raid", nr);
+    if (!t)
+        goto out;
+    t->level = "raid5_ls";
+    t->chunk = com->chunk_size * plan->scale;
+
+    for (i = 0; i < nr; i++) {
+        const dm_disk *disk = dm_find_disk(disks, nr_disks, parts[i]->disk_id);
+        dm_device sub;
+        dm_target *st;
+        int index;
+
+        if (!disk) {
+            missing++;
+            continue;
+        }
+
+        memset(&sub, 0, sizeof(sub));
+        snprintf(sub.name, sizeof(sub.name), "ldm_%s_p%u", vol->name,
+                 parts[i]->id);
+
+        st = dm_add_target(&sub, 0, parts[i]->size * plan->scale, "linear",
+                           1);
+        if (!st) {
+            dm_free_device(&sub);
+            goto out;
+        }
+        st->legs[0].path = disk->path;
+        st->legs[0].offset =
+            (disk->data_start + parts[i]->start) * plan->scale;
+
+        index = dm_plan_add(plan, &sub);
+        if (index < 0) {
+            dm_free_device(&sub);
+            goto out;
+        }
+        t->legs[i].sub = index;
+    }
+
+    if (nr < com->columns || missing > 1) {
+        printf("Info: RAID-5 %s misses %u of %u columns\n", vol->name,
+               com->columns - nr + missing, com->columns);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    free(parts);
+    return ret;
+}
+
+int dm_build_plan(const dm_disk *disks, int nr_disks, dm_plan *plan) {
+    struct list_head *pos;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->scale = disks[0].sector_size / DM_SECTOR_SIZE;
+    if (!plan->scale)
+        plan->scale = 1;
+
+    list_for_each(pos, ldm_volumes()) {
+        vblk_volume *vol = list_entry(pos, vblk_volume, list);
+        uint32_t mark = plan->nr_devices;
+        dm_device dev;
+        int ret;
+
+        memset(&dev, 0, sizeof(dev));
+        snprintf(dev.name, sizeof(dev.name), "ldm_%s", vol->name);
+        dev.volume = 1;
+
+        if (vol->type == VOLUME_TYPE_RAID5)
+            ret = dm_build_raid5(plan, disks, nr_disks, vol, &dev);
+        else if (vol->num_of_comps > 1)
+            ret = dm_build_mirror(plan, disks, nr_disks, vol, &dev);
+        else
+            ret = dm_build_simple(plan, disks, nr_disks, vol, &dev);
+
+        if (ret || dm_plan_add(plan, &dev) < 0) {
+            printf("Info: skipped volume %s\n", vol->name);
+            dm_free_device(&dev);
+            while (plan->nr_devices > mark)
+                dm_free_device(&plan->devices[--plan->nr_devices]);
+        }
+    }
+
+    if (!plan->nr_devices) {
+        printf("Error: no volume can be mapped\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int dm_append(char *buffer, size_t size, size_t *len, const char *fmt,
+                     ...) {
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = vsnprintf(buffer + *len, size - *len, fmt, args);
+    va_end(args);
+
+    if (ret < 0 || (size_t)ret >= size - *len)
+        return -1;
+
+    *len += ret;
+    return 0;
+}
+
+/*
+ * Print a leg, sub-devices are referred to by name in a script and by
+ * device number once loaded.
+ */
+static int dm_append_leg(const dm_plan *plan, const dm_leg *leg, int loaded,
+                         char *buffer, size_t size, size_t *len) {
+    const dm_device *sub;
+
+    if (leg->sub < 0)
+        return dm_append(buffer, size, len, " %s", leg->path ? leg->path : "-");
+
+    sub = &plan->devices[leg->sub];
+    if (loaded)
+        return dm_append(buffer, size, len, " %u:%u", major(sub->dev),
+                         minor(sub->dev));
+
+    return dm_append(buffer, size, len, " /dev/mapper/%s", sub->name);
+}
+
+static int dm_format_params(const dm_plan *plan, const dm_target *t,
+                            int loaded, char *buffer, size_t size) {
+    size_t len = 0;
+    uint32_t i;
+
+    buffer[0] = '\0';
+
+    if (!strcmp(t->type, "striped") &&
+        dm_append(buffer, size, &len, "%u %lu", t->nr_legs, t->chunk))
+        return -1;
+
+    /*
+     * raid1 and raid5 legs have no metadata device, and nosync keeps the
+     * kernel from resyncing them: the members are only mapped, not written
+     */
+    if (!strcmp(t->type, "raid") &&
+        dm_append(buffer, size, &len, "%s 2 %lu nosync %u", t->level,
+                  t->chunk, t->nr_legs))
+        return -1;
+
+    for (i = 0; i < t->nr_legs; i++) {
+        const dm_leg *leg = &t->legs[i];
+
+        if (!strcmp(t->type, "raid") && dm_append(buffer, size, &len, " -"))
+            return -1;
+        if (dm_append_leg(plan, leg, loaded, buffer, size, &len))
+            return -1;
+        if (strcmp(t->type, "raid") &&
+            dm_append(buffer, size, &len, " %lu", leg->offset))
+            return -1;
+    }
+
+    /* linear has no leading count, drop the separator */
+    if (buffer[0] == ' ')
+        memmove(buffer, buffer + 1, len);
+
+    return 0;
+}
+
+void dm_print_plan(const dm_plan *plan) {
+    char params[4096];
+    uint32_t i, j;
+
+    for (i = 0; i < plan->nr_devices; i++) {
+        const dm_device *dev = &plan->devices[i];
+
+        printf("dmsetup create --readonly %s <<'EOF'\n", dev->name);
+        for (j = 0; j < dev->nr_targets; j++) {
+            const dm_target *t = &dev->targets[j];
+
+            if (dm_format_params(plan, t, 0, params, sizeof(params))) {
+                printf("# table of %s is too large\n", dev->name);
+                continue;
+            }
+            printf("%lu %lu %s %s\n", t->start, t->length, t->type, params);
+        }
+        printf("EOF\n");
+    }
+}
+
+static void dm_init_ioctl(struct dm_ioctl *io, size_t size, const char *name) {
+    memset(io, 0, size);
+    io->version[0] = DM_VERSION_MAJOR;
+    io->data_size = size;
+    io->data_start = sizeof(struct dm_ioctl);
+    snprintf(io->name, sizeof(io->name), "%s", name);
+}
+
+/*
+ * Create the device, load its table read-only and resume it, which makes
+ * the table live.
+ */
+static int dm_load_device(int ctl, dm_plan *plan, dm_device *dev,
+                          uint8_t *buffer) {
+    struct dm_ioctl *io = (struct dm_ioctl *)buffer;
+    size_t pos = sizeof(struct dm_ioctl);
+    uint32_t i;
+
+    dm_init_ioctl(io, sizeof(struct dm_ioctl), dev->name);
+    if (ioctl(ctl, DM_DEV_CREATE, io)) {
+        printf("dm: failed to create %s, errno is %d\n", dev->name, errno);
+        return -1;
+    }
+    dev->dev = io->dev;
+
+    dm_init_ioctl(io, DM_BUFFER_SIZE, dev->name);
+    io->flags = DM_READONLY_FLAG;
+    for (i = 0; i < dev->nr_targets; i++) {
+        struct dm_target_spec *spec = (struct dm_target_spec *)(buffer + pos);
+        const dm_target *t = &dev->targets[i];
+        char *params = (char *)(spec + 1);
+        size_t next;
+
+        if (pos + sizeof(*spec) >= DM_BUFFER_SIZE ||
+            dm_format_params(plan, t, 1, params,
+                             DM_BUFFER_SIZE - pos - sizeof(*spec))) {
+            printf("dm: table of %s is too large\n", dev->name);
+            goto error;
+        }
+
+        spec->sector_start = t->start;
+        spec->length = t->length;
+        strncpy(spec->target_type, t->type, sizeof(spec->target_type) - 1);
+
+        /* the next spec starts 8-byte aligned after the parameters */
+        next = (sizeof(*spec) + strlen(params) + 1 + 7) & ~(size_t)7;
+        spec->next = next;
+        pos += next;
+    }
+    io->target_count = dev->nr_targets;
+    io->data_size = pos;
+
+    if (ioctl(ctl, DM_TABLE_LOAD, io)) {
+        printf("dm: failed to load table of %s, errno is %d\n", dev->name,
+               errno);
+        goto error;
+    }
+
+    dm_init_ioctl(io, sizeof(struct dm_ioctl), dev->name);
+    if (ioctl(ctl, DM_DEV_SUSPEND, io)) {
+        printf("dm: failed to resume %s, errno is %d\n", dev->name, errno);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    dm_init_ioctl(io, sizeof(struct dm_ioctl), dev->name);
+    ioctl(ctl, DM_DEV_REMOVE, io);
+    return -1;
+}
+
+int dm_load_plan(dm_plan *plan) {
+    uint8_t *buffer;
+    uint32_t i;
+    int ctl, ret = 0;
+
+    ctl = open(DM_CONTROL, O_RDWR);
+    if (ctl < 0) {
+        printf("Error: failed to open %s, errno is %d\n", DM_CONTROL, errno);
+        return -1;
+    }
+
+    buffer = malloc(DM_BUFFER_SIZE);
+    if (!buffer) {
+        printf("Error: failed to malloc\n");
+        close(ctl);
+        return -1;
+    }
+
+    for (i = 0; i < plan->nr_devices; i++) {
+        dm_device *dev = &plan->devices[i];
+
+        if (dm_load_device(ctl, plan, dev, buffer)) {
+            ret = -1;
+            break;
+        }
+        printf("Info: created /dev/mapper/%s (%u:%u)\n", dev->name,
+               major(dev->dev), minor(dev->dev));
+    }
+
+    free(buffer);
+    close(ctl);
+    return ret;
+}
+
+void dm_free_plan(dm_plan *plan) {
+    uint32_t i;
+
+    for (i = 0; i < plan->nr_devices; i++)
+        dm_free_device(&plan->devices[i]);
+    free(plan->devices);
+    plan->devices = NULL;
+    plan->nr_devices = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __DM_H__
+#define __DM_H__
+
+#include <linux/dm-ioctl.h>
+#include <stdint.h>
+#include <uuid/uuid.h>
+
+/* device-mapper tables are always in 512-byte sectors */
+#define DM_SECTOR_SIZE 512
+
+typedef struct _dm_disk {
+    const char *path;
+    uuid_t guid;
+    uint64_t data_start; /* start of the LDM logical disk, in disk sectors */
+    int sector_size;
+} dm_disk;
+
+typedef struct _dm_leg {
+    const char *path; /* disk, or NULL when missing or a sub-device */
+    int sub;          /* index of the sub-device in the plan, or -1 */
+    uint64_t offset;
+} dm_leg;
+
+typedef struct _dm_target {
+    uint64_t start;
+    uint64_t length;
+    const char *type;  /* "linear", "striped" or "raid" */
+    const char *level; /* raid level, e.g. "raid1" or "raid5_ls" */
+    uint64_t chunk;
+    uint32_t nr_legs;
+    dm_leg *legs;
+} dm_target;
+
+typedef struct _dm_device {
+    char name[DM_NAME_LEN];
+    uint32_t nr_targets;
+    dm_target *targets;
+    int volume;   /* a volume, not a sub-device of one */
+    uint64_t dev; /* device number, once loaded */
+} dm_device;
+
+/* devices in creation order, sub-devices before their users */
+typedef struct _dm_plan {
+    uint32_t nr_devices;
+    dm_device *devices;
+    uint64_t scale; /* DM sectors per LDM sector */
+} dm_plan;
+
+int dm_build_plan(const dm_disk *disks, int nr_disks, dm_plan *plan);
+void dm_print_plan(const dm_plan *plan);
+int dm_load_plan(dm_plan *plan);
+void dm_free_plan(dm_plan *plan);
+
+#endif
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "export.h"
+#include "mover.h"
+#include "ntfs.h"
+#include "verify.h"
+#include "volume.h"
+#include "workq.h"
+
+/*
+ * Reopen the device with O_DIRECT so the large reads of the export bypass the
+ * page cache. The parser keeps the buffered descriptor.
+ */
+static int export_open_direct(int fd) {
+    char path[64];
+    struct stat st;
+    int direct_fd;
+
+    if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+        return -1;
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    direct_fd = open(path, O_RDONLY | O_DIRECT);
+
+    return direct_fd;
+}
+
+static double export_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int export_volume(int fd, struct list_head *new_entries, uint32_t volume_id,
+                  const char *path, int full_copy, const char *manifest) {
+    mover_extent *runs = NULL;
+    uint32_t nr_runs = 0, i;
+    mover_stats stats = { 0 };
+    uint64_t sector_size, size;
+    double start_time, elapsed;
+    verify *v = NULL;
+    int out_fd, src_fd, ret = -1;
+    volume vol;
+
+    if (volume_open(fd, new_entries, volume_id, &vol))
+        return -1;
+
+    sector_size = vol.sector_size;
+    size = vol.size * sector_size;
+
+    if (!full_copy && ntfs_detect(&vol) &&
+        !ntfs_get_allocated_runs(&vol, &runs, &nr_runs)) {
+        uint64_t used = 0;
+        for (i = 0; i < nr_runs; i++)
+            used += runs[i].length;
+        printf("Info: volume %u is NTFS, %lu of %lu MiB in use\n", volume_id,
+               used >> 20, size >> 20);
+    }
+
+    out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        printf("Error: failed to open %s, errno is %d\n", path, errno);
+        goto out;
+    }
+
+    if (ftruncate(out_fd, size)) {
+        printf("Error: failed to resize %s, errno is %d\n", path, errno);
+        goto out_close;
+    }
+
+    /* the image is read back chunk by chunk while the export runs */
+    if (manifest) {
+        v = verify_create(out_fd, workq_default_threads());
+        if (!v)
+            goto out_close;
+    }
+
+    src_fd = export_open_direct(fd);
+    if (src_fd < 0)
+        src_fd = fd;
+
+    start_time = export_now();
+    for (i = 0; i < vol.nr_extents; i++) {
+        const volume_extent *ext = &vol.extents[i];
+        uint64_t ext_start = ext->offset * sector_size;
+        uint64_t ext_end = ext_start + ext->size * sector_size;
+        mover_extent *ext_runs = NULL;
+        uint32_t nr_ext_runs = 0, j;
+        mover_job job;
+
+        memset(&job, 0, sizeof(job));
+        job.src_fd = src_fd;
+        job.dst_fd = out_fd;
+        job.src_offset = ext->start * sector_size;
+        job.dst_offset = ext_start;
+        job.length = ext_end - ext_start;
+        job.flags = MOVER_SPARSE | MOVER_OFFLOAD;
+        job.stats = &stats;
+        job.verify = v;
+
+        /* unallocated clusters stay holes in the image */
+        if (runs) {
+            ext_runs = malloc((nr_runs ? nr_runs : 1) * sizeof(mover_extent));
+            if (!ext_runs) {
+                printf("Error: failed to malloc\n");
+                ret = -1;
+                break;
+            }
+
+            for (j = 0; j < nr_runs; j++) {
+                uint64_t run_start = runs[j].offset;
+                uint64_t run_end = run_start + runs[j].length;
+
+                if (run_end <= ext_start || run_start >= ext_end)
+                    continue;
+                if (run_start < ext_start)
+                    run_start = ext_start;
+                if (run_end > ext_end)
+                    run_end = ext_end;
+
+                ext_runs[nr_ext_runs].offset = run_start - ext_start;
+                ext_runs[nr_ext_runs].length = run_end - run_start;
+                nr_ext_runs++;
+            }
+
+            job.extents = ext_runs;
+            job.nr_extents = nr_ext_runs;
+        }
+
+        ret = mover_run(&job);
+        free(ext_runs);
+        if (ret) {
+            printf("Error: failed to export extent %u of volume %u\n", i,
+                   volume_id);
+            break;
+        }
+    }
+
+    if (!ret && v)
+        ret = verify_finish(v, manifest);
+
+    if (!ret && fsync(out_fd)) {
+        printf("Error: failed to sync %s, errno is %d\n", path, errno);
+        ret = -1;
+    }
+
+    elapsed = export_now() - start_time;
+    if (!ret)
+        printf("Info: exported %lu MiB in %.1fs (%.1f MiB/s), %lu MiB "
+               "written, %lu MiB offloaded, %lu MiB of zeros skipped\n",
+               size >> 20, elapsed,
+               elapsed > 0 ? (stats.bytes_read + stats.bytes_offloaded) /
+                                 1048576.0 / elapsed
+                           : 0,
+               stats.bytes_written >> 20, stats.bytes_offloaded >> 20,
+               stats.bytes_zero >> 20);
+
+    if (src_fd != fd)
+        close(src_fd);
+out_close:
+    verify_destroy(v);
+    close(out_fd);
+out:
+    free(runs);
+    volume_close(&vol);
+    return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef __EXPORT_H__
+#define __EXPORT_H__
+
+#include <stdint.h>
+
+#include "list.h"
+
+int export_volume(int fd, struct list_head *new_entries, uint32_t volume_id,
+                  const char *path, int full_copy, const char *manifest);
+int export_volume_zstd(int fd, struct list_head *new_entries,
+                       uint32_t volume_id, const char *path, int full_copy,
+                       int level, int nr_threads);
+
+#endif
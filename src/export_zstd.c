@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "export.h"
+
+#ifdef HAVE_ZSTD
+
+#include <endian.h>
+#include <zstd.h>
+
+#include "mover.h"
+#include "ntfs.h"
+#include "throttle.h"
+#include "volume.h"
+#include "workq.h"
+
+/*
+ * Seekable zstd format: independent frames followed by a skippable frame with
+ * the compressed and decompressed size of every frame.
+ */
+#define SEEKABLE_FRAME_SIZE (2 * 1024 * 1024)
+#define SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_MAGIC 0x8F92EAB1
+#define SEEKABLE_FOOTER_SIZE 9
+
+typedef struct _seek_entry {
+    uint32_t compressed_size;
+    uint32_t decompressed_size;
+} __attribute__((__packed__)) seek_entry;
+
+typedef struct _zframe {
+    ZSTD_CCtx *cctx;
+    uint8_t *src;
+    size_t src_size;
+    uint8_t *dst;
+    size_t dst_capacity;
+    size_t dst_size;
+
+    int busy;
+    int error;
+    pthread_mutex_t *lock;
+    pthread_cond_t *done;
+} zframe;
+
+static void zframe_compress(void *arg) {
+    zframe *frame = arg;
+    size_t ret = ZSTD_compress2(frame->cctx, frame->dst, frame->dst_capacity,
+                                frame->src, frame->src_size);
+
+    pthread_mutex_lock(frame->lock);
+    if (ZSTD_isError(ret)) {
+        printf("export: zstd failed: %s\n", ZSTD_getErrorName(ret));
+        frame->error = 1;
+    } else {
+        frame->dst_size = ret;
+    }
+    frame->busy = 0;
+    pthread_cond_broadcast(frame->done);
+    pthread_mutex_unlock(frame->lock);
+}
+
+static int write_full(int fd, const void *buffer, size_t count) {
+    const uint8_t *p = buffer;
+
+    while (count > 0) {
+        ssize_t ret = write(fd, p, count);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            printf("Error: failed to write, errno is %d\n", errno);
+            return -1;
+        }
+        p += ret;
+        count -= ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Fill a frame with volume data. Ranges NTFS does not use are not read and
+ * compress to nothing as zeros.
+ */
+static int zframe_fill(const volume *vol, const mover_extent *runs,
+                       uint32_t nr_runs, uint32_t *run, uint64_t offset,
+                       uint8_t *buffer, size_t count) {
+    uint64_t end = offset + count;
+    uint32_t i;
+
+    if (!runs)
+        return volume_read(vol, offset, buffer, count);
+
+    memset(buffer, 0, count);
+    while (*run < nr_runs && runs[*run].offset + runs[*run].length <= offset)
+        (*run)++;
+
+    for (i = *run; i < nr_runs && runs[i].offset < end; i++) {
+        uint64_t start = runs[i].offset > offset ? runs[i].offset : offset;
+        uint64_t stop = runs[i].offset + runs[i].length < end
+                            ? runs[i].offset + runs[i].length
+                            : end;
+
+        if (volume_read(vol, start, buffer + (start - offset), stop - start))
+            return -1;
+    }
+
+    return 0;
+}
+
+int export_volume_zstd(int fd, struct list_head *new_entries,
+                       uint32_t volume_id, const char *path, int full_copy,
+                       int level, int nr_threads) {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+    mover_extent *runs = NULL;
+    uint32_t nr_runs = 0, run = 0;
+    seek_entry *table = NULL;
+    zframe *frames = NULL;
+    uint64_t size, nr_frames, index, written = 0;
+    int depth, out_fd = -1, ret = -1, i;
+    workq *wq = NULL;
+    volume vol;
+
+    if (volume_open(fd, new_entries, volume_id, &vol))
+        return -1;
+
+    size = vol.size * vol.sector_size;
+    nr_frames = (size + SEEKABLE_FRAME_SIZE - 1) / SEEKABLE_FRAME_SIZE;
+
+    if (!full_copy && ntfs_detect(&vol) &&
+        !ntfs_get_allocated_runs(&vol, &runs, &nr_runs))
+        printf("Info: volume %u is NTFS, unused clusters are stored as zeros\n",
+               volume_id);
+
+    if (nr_threads <= 0)
+        nr_threads = workq_default_threads();
+    depth = nr_threads * 2;
+
+    table = calloc(nr_frames ? nr_frames : 1, sizeof(seek_entry));
+    frames = calloc(depth, sizeof(zframe));
+    if (!table || !frames) {
+        printf("Error: failed to malloc\n");
+        goto out;
+    }
+
+    for (i = 0; i < depth; i++) {
+        zframe *frame = &frames[i];
+
+        frame->lock = &lock;
+        frame->done = &done;
+        frame->dst_capacity = ZSTD_compressBound(SEEKABLE_FRAME_SIZE);
+        frame->cctx = ZSTD_createCCtx();
+        if (posix_memalign((void **)&frame->src, 4096, SEEKABLE_FRAME_SIZE) ||
+            !(frame->dst = malloc(frame->dst_capacity)) || !frame->cctx) {
+            printf("Error: failed to malloc\n");
+            goto out;
+        }
+
+        ZSTD_CCtx_setParameter(frame->cctx, ZSTD_c_compressionLevel, level);
+        ZSTD_CCtx_setParameter(frame->cctx, ZSTD_c_checksumFlag, 1);
+    }
+
+    wq = workq_create(nr_threads, depth);
+    if (!wq)
+        goto out;
+
+    out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        printf("Error: failed to open %s, errno is %d\n", path, errno);
+        goto out;
+    }
+
+    /* frames are read in order, compressed in parallel, written in order */
+    for (index = 0; index < nr_frames + depth; index++) {
+        zframe *frame = &frames[index % depth];
+
+        if (index >= depth) {
+            uint64_t n = index - depth;
+
+            pthread_mutex_lock(&lock);
+            while (frame->busy)
+                pthread_cond_wait(&done, &lock);
+            pthread_mutex_unlock(&lock);
+
+            if (frame->error ||
+                write_full(out_fd, frame->dst, frame->dst_size))
+                goto out;
+
+            table[n].compressed_size = htole32(frame->dst_size);
+            table[n].decompressed_size = htole32(frame->src_size);
+            written += frame->dst_size;
+        }
+
+        if (index >= nr_frames)
+            continue;
+
+        frame->src_size = size - index * SEEKABLE_FRAME_SIZE;
+        if (frame->src_size > SEEKABLE_FRAME_SIZE)
+            frame->src_size = SEEKABLE_FRAME_SIZE;
+
+        throttle_wait(frame->src_size);
+        if (zframe_fill(&vol, runs, nr_runs, &run,
+                        index * SEEKABLE_FRAME_SIZE, frame->src,
+                        frame->src_size))
+            goto out;
+
+        frame->busy = 1;
+        if (workq_submit(wq, zframe_compress, frame))
+            goto out;
+    }
+
+    {
+        uint32_t head[2] = {
+            htole32(SEEKABLE_SKIPPABLE_MAGIC),
+            htole32(nr_frames * sizeof(seek_entry) + SEEKABLE_FOOTER_SIZE),
+        };
+        uint8_t footer[SEEKABLE_FOOTER_SIZE];
+        uint32_t value;
+
+        value = htole32(nr_frames);
+        memcpy(footer, &value, 4);
+        footer[4] = 0; /* no checksums, frames carry their own */
+        value = htole32(SEEKABLE_MAGIC);
+        memcpy(footer + 5, &value, 4);
+
+        if (write_full(out_fd, head, sizeof(head)) ||
+            write_full(out_fd, table, nr_frames * sizeof(seek_entry)) ||
+            write_full(out_fd, footer, sizeof(footer)))
+            goto out;
+    }
+
+    if (fsync(out_fd)) {
+        printf("Error: failed to sync %s, errno is %d\n", path, errno);
+        goto out;
+    }
+
+    printf("Info: exported %lu MiB into %lu MiB, %lu frames, %d threads\n",
+           size >> 20, written >> 20, nr_frames, nr_threads);
+    ret = 0;
+
+out:
+    if (wq) {
+        workq_wait(wq);
+        workq_destroy(wq);
+    }
+    if (out_fd >= 0)
+        close(out_fd);
+    for (i = 0; frames && i < depth; i++) {
+        ZSTD_freeCCtx(frames[i].cctx);
+        free(frames[i].src);
+        free(frames[i].dst);
+    }
+    free(frames);
+    free(table);
+    free(runs);
+    volume_close(&vol);
+    return ret;
+}
+
+#else
+
+int export_volume_zstd(int fd, struct list_head *new_entries,
+                       uint32_t volume_id, const char *path, int full_copy,
+                       int level, int nr_threads) {
+    printf("Error: d2b is built without zstd, rebuild with make ZSTD=1\n");
+    return -1;
+}
+
+#endif /* HAVE_ZSTD */
@@ -5,11 +5,13 @@
 
 #include "bdev.h"
 #include "gpt.h"
+#include "stats.h"
 
 #define GPT_HEADER_SIGNATURE 0x5452415020494645ULL
 
 int _read_header(int fd, gpt_header *header, uint64_t lba) {
-    uint32_t crc, orig_crc32;
+    gpt_header_fields f;
+    uint32_t crc;
 
     if (bdev_read_lba(fd, lba, (uint8_t *)header, sizeof(gpt_header)) !=
         sizeof(gpt_header)) {
@@ -18,27 +20,25 @@ int _read_header(int fd, gpt_header *header, uint64_t lba) {
         return -1;
     }
 
-    if (le64toh(header->signature) != GPT_HEADER_SIGNATURE) {
+    gpt_header_decode(header, &f);
+    if (f.signature != GPT_HEADER_SIGNATURE) {
         printf("Error: GPT header signature is wrong\n");
         return -1;
     }
 
-    if (le32toh(header->header_size) > bdev_get_sector_size(fd)) {
-        printf("Error: GPT header size is too large: %d\n",
-               le32toh(header->header_size));
+    if (f.header_size > bdev_get_sector_size(fd)) {
+        printf("Error: GPT header size is too large: %d\n", f.header_size);
         return -1;
     }
 
-    if (le32toh(header->header_size) < sizeof(gpt_header)) {
-        printf("Error: GPT header size is too small: %d\n",
-               le32toh(header->header_size));
+    if (f.header_size < sizeof(gpt_header)) {
+        printf("Error: GPT header size is too small: %d\n", f.header_size);
         return -1;
     }
 
-    orig_crc32 = le32toh(header->header_crc32);
     header->header_crc32 = 0;
-    crc = crc32(0, (const void *)header, le32toh(header->header_size));
-    if (orig_crc32 != crc) {
+    crc = crc32(0, (const void *)header, f.header_size);
+    if (f.header_crc32 != crc) {
         printf("Error: GPT header CRC is wrong\n");
         return -1;
     }
@@ -62,7 +62,7 @@ int read_second_header(int fd, gpt_header *header) {
     return _read_header(fd, header, lba);
 }
 
-int read_gpt_header(int fd, gpt_header *header) {
+static int _read_gpt_header(int fd, gpt_header *header) {
     int is_alternate_lba = 0;
     uint64_t lba = GPT_PRIMARY_PARTITION_TABLE_LBA;
 
@@ -86,18 +86,31 @@ start:
     return 0;
 }
 
-int read_gpt_entry(int fd, gpt_header *header, gpt_entry *entries,
-                   uint64_t entry_size) {
+int read_gpt_header(int fd, gpt_header *header) {
+    stats_timer timer;
+    int ret;
+
+    stats_phase_begin(&timer);
+    ret = _read_gpt_header(fd, header);
+    stats_phase_end(&timer, STATS_GPT);
+
+    return ret;
+}
+
+static int _read_gpt_entry(int fd, gpt_header *header, gpt_entry *entries,
+                           uint64_t entry_size) {
+    gpt_header_fields f;
     uint32_t crc;
 
-    if (bdev_read_lba(fd, le64toh(header->partition_entry_lba),
-                      (uint8_t *)entries, entry_size) != entry_size) {
+    gpt_header_decode(header, &f);
+    if (bdev_read_lba(fd, f.partition_entry_lba, (uint8_t *)entries,
+                      entry_size) != entry_size) {
         printf("Error: failed to read lba\n");
         return -1;
     }
 
     crc = crc32(0, (const Bytef *)entries, entry_size);
-    if (crc != le32toh(header->partition_entry_array_crc32)) {
+    if (crc != f.partition_entry_array_crc32) {
         printf("Error: GPT entries CRC is wrong\n");
         return -1;
     }
@@ -105,15 +118,51 @@ int read_gpt_entry(int fd, gpt_header *header, gpt_entry *entries,
     return 0;
 }
 
+int read_gpt_entry(int fd, gpt_header *header, gpt_entry *entries,
+                   uint64_t entry_size) {
+    stats_timer timer;
+    int ret;
+
+    stats_phase_begin(&timer);
+    ret = _read_gpt_entry(fd, header, entries, entry_size);
+    stats_phase_end(&timer, STATS_GPT);
+
+    return ret;
+}
+
 int write_gpt_header(int fd, gpt_header *header) {
-    uint32_t crc = crc32(0, (const void *)header, le32toh(header->header_size));
-    header->header_crc32 = crc;
-    return bdev_write_lba(fd, header->current_lba, (uint8_t *)header,
-                          sizeof(gpt_header));
+    gpt_header_fields f;
+    stats_timer timer;
+    int ret;
+
+    gpt_header_decode(header, &f);
+    header->header_crc32 = 0;
+    header->header_crc32 =
+        htole32(crc32(0, (const void *)header, f.header_size));
+    stats_phase_begin(&timer);
+    ret = bdev_write_lba(fd, f.current_lba, (uint8_t *)header,
+                         sizeof(gpt_header));
+    stats_phase_end(&timer, STATS_WRITE);
+
+    return ret;
 }
 
+/*
+ * Write the entries, only the sectors that differ from old, what the array
+ * is known to hold, or from the disk when old is NULL.
+ */
 int write_gpt_entry(int fd, gpt_header *header, gpt_entry *entries,
-                    uint64_t entry_size) {
-    return bdev_write_lba(fd, header->partition_entry_lba, (uint8_t *)entries,
-                          entry_size);
+                    const gpt_entry *old, uint64_t entry_size) {
+    gpt_header_fields f;
+    stats_timer timer;
+    int ret;
+
+    gpt_header_decode(header, &f);
+    stats_phase_begin(&timer);
+    /* usually two entries change, the other sectors stay shared */
+    ret = bdev_write_lba_diff(fd, f.partition_entry_lba, (uint8_t *)entries,
+                              (const uint8_t *)old, entry_size);
+    stats_phase_end(&timer, STATS_WRITE);
+
+    return ret;
 }
\ No newline at end of file
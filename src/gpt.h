@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <uuid/uuid.h>
 
+#include "schema.h"
+
 #define GPT_PRIMARY_PARTITION_TABLE_LBA 1
 
 static const uuid_t PARTITION_BASIC_DATA_GUID = { 0xA2, 0xA0, 0xD0, 0xEB,
@@ -28,6 +30,22 @@ typedef struct _gpt_header {
     uint32_t partition_entry_array_crc32;
 } __attribute__((__packed__)) gpt_header;
 
+#define GPT_HEADER_FIELDS(X)                                                   \
+    X(64, signature)                                                           \
+    X(32, revision)                                                            \
+    X(32, header_size)                                                         \
+    X(32, header_crc32)                                                        \
+    X(64, current_lba)                                                         \
+    X(64, alternate_lba)                                                       \
+    X(64, first_usable_lba)                                                    \
+    X(64, last_usable_lba)                                                     \
+    X(64, partition_entry_lba)                                                 \
+    X(32, num_partition_entries)                                               \
+    X(32, sizeof_partition_entry)                                              \
+    X(32, partition_entry_array_crc32)
+
+SCHEMA_HEADER(gpt_header, GPT_HEADER_FIELDS, LE)
+
 typedef struct _gpt_entry {
     uuid_t type;
     uuid_t guid;
@@ -45,6 +63,6 @@ int read_gpt_entry(int fd, gpt_header *header, gpt_entry *entries,
 
 int write_gpt_header(int fd, gpt_header *header);
 int write_gpt_entry(int fd, gpt_header *header, gpt_entry *entries,
-                    uint64_t entry_size);
+                    const gpt_entry *old, uint64_t entry_size);
 
 #endif
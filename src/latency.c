@@ -0,0 +1,109 @@
+#include "latency.h"
+
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* bucket i counts latencies in [2^(i-1), 2^i) nsec, bucket 0 counts zero */
+#define NR_BUCKETS 65
+
+typedef struct _histogram {
+    uint64_t count;
+    uint64_t buckets[NR_BUCKETS];
+} histogram;
+
+static const char *op_names[NR_LATENCY_OPS] = { "read", "write", "vblk" };
+
+static histogram histograms[NR_LATENCY_OPS];
+
+uint64_t latency_start(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void latency_end(int op, uint64_t start) {
+    uint64_t nsec = latency_start() - start;
+    int bucket = nsec ? 64 - __builtin_clzll(nsec) : 0;
+
+    __atomic_add_fetch(&histograms[op].count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histograms[op].buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/* append a number to buf, printf is not async-signal-safe */
+static size_t put_u64(char *buf, size_t len, uint64_t value) {
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (n)
+        buf[len++] = digits[--n];
+
+    return len;
+}
+
+static size_t put_str(char *buf, size_t len, const char *str) {
+    size_t n = strlen(str);
+
+    memcpy(buf + len, str, n);
+    return len + n;
+}
+
+/*
+ * Write the non-empty buckets of every histogram, one line per bucket with
+ * its lower bound in nsec. Safe to call from a signal handler.
+ */
+void latency_dump(int fd) {
+    char line[128];
+    size_t len;
+    int op, i;
+
+    for (op = 0; op < NR_LATENCY_OPS; op++) {
+        const histogram *h = &histograms[op];
+
+        len = put_str(line, 0, "d2b latency ");
+        len = put_str(line, len, op_names[op]);
+        len = put_str(line, len, ": ");
+        len = put_u64(line, len, h->count);
+        len = put_str(line, len, " ops\n");
+        if (write(fd, line, len) < 0)
+            return;
+
+        for (i = 0; i < NR_BUCKETS; i++) {
+            if (!h->buckets[i])
+                continue;
+
+            len = put_str(line, 0, "  >= ");
+            len = put_u64(line, len, i ? 1ULL << (i - 1) : 0);
+            len = put_str(line, len, " nsec: ");
+            len = put_u64(line, len, h->buckets[i]);
+            len = put_str(line, len, "\n");
+            if (write(fd, line, len) < 0)
+                return;
+        }
+    }
+}
+
+static void latency_signal(int sig) {
+    latency_dump(STDERR_FILENO);
+}
+
+/*
+ * Dump the histograms to stderr on SIGUSR1, e.g. while a move is running on
+ * a slow device.
+ */
+void latency_install(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = latency_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
@@ -0,0 +1,19 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+
+/* operations with a latency histogram */
+enum {
+    LATENCY_READ = 0,
+    LATENCY_WRITE,
+    LATENCY_VBLK,
+    NR_LATENCY_OPS,
+};
+
+uint64_t latency_start(void);
+void latency_end(int op, uint64_t start);
+void latency_dump(int fd);
+void latency_install(void);
+
+#endif
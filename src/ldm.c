@@ -7,22 +7,11 @@
 
 #include "bdev.h"
 #include "debug.h"
+#include "latency.h"
 #include "ldm.h"
 #include "mbr.h"
-
-enum {
-    VBLK_BLACK = 0,
-    VBLK_VOLUME,
-    VBLK_COMPONENT,
-    VBLK_PARTITION,
-    VBLK_DISK,
-    VBLK_DISK_GROUP,
-};
-
-enum {
-    VOLUME_TYPE_GEN = 0x3,
-    VOLUME_TYPE_RAID5 = 0x4,
-};
+#include "probes.h"
+#include "stats.h"
 
 enum {
     VOLUME_FLAG_ID1 = 0x08,
@@ -31,12 +20,6 @@ enum {
     VOLUME_FLAG_DRIVE_HINT = 0x02,
 };
 
-enum {
-    COMPONENT_TYPE_STRIPED = 0x1,
-    COMPONENT_TYPE_SPANNED = 0x2,
-    COMPONENT_TYPE_RAID = 0x3
-};
-
 enum {
     COMPONENT_FLAG_ENABLE = 0x10,
 };
@@ -46,6 +29,8 @@ enum {
 };
 
 static uuid_t cur_dev_guid;
+static uint64_t cur_logical_disk_start;
+static uint64_t cur_logical_disk_size;
 static struct list_head ext_vblk_list = LIST_HEAD_INIT(ext_vblk_list);
 
 static struct list_head volume_list = LIST_HEAD_INIT(volume_list);
@@ -54,249 +39,260 @@ static struct list_head partition_list = LIST_HEAD_INIT(partition_list);
 static struct list_head disk_list = LIST_HEAD_INIT(disk_list);
 static struct list_head disk_group_list = LIST_HEAD_INIT(disk_group_list);
 
-static int parse_var_uint64_t(const uint8_t **const var, uint64_t *ret) {
-    uint8_t len = **var;
-    (*var)++;
-
-    if (len > sizeof(uint64_t)) {
-        printf("ldm: found %d bytes integer\n", len);
-        return -1;
+/*
+ * The layout of each VBLK record type and revision, in disk order, as
+ * F(kind, flag, name). A field with a flag is only there when the record
+ * has that flag. Every layout becomes a decoder of its own below, with the
+ * fields unrolled, so adding a revision adds a decoder and a case to the
+ * dispatch, and costs the others nothing.
+ *
+ * kinds: VAR32 and VAR64, a length byte and a big-endian integer; STRING, a
+ * length byte and the bytes, kept in place; SKIPVAR, the same, unused;
+ * SKIP, a number of bytes; U8; BE64; GUID, 16 bytes kept in place.
+ */
+#define VOLUME_FIELDS(F)                                                       \
+    F(VAR32, 0, id)                                                            \
+    F(STRING, 0, name)                                                         \
+    F(SKIPVAR, 0, type1)                                                       \
+    F(SKIPVAR, 0, unknown)                                                     \
+    F(SKIP, 0, 14) /* state */                                                 \
+    F(U8, 0, type)                                                             \
+    F(SKIP, 0, 5) /* unknown, volume number, zeros */                          \
+    F(U8, 0, flags)                                                            \
+    F(VAR32, 0, children)                                                      \
+    F(SKIP, 0, 16) /* log commit id, id or zeros */                            \
+    F(VAR64, 0, size)                                                          \
+    F(SKIP, 0, 4) /* zeros */                                                  \
+    F(U8, 0, part_type)                                                        \
+    F(GUID, 0, guid)                                                           \
+    F(STRING, VOLUME_FLAG_ID1, id1)                                            \
+    F(STRING, VOLUME_FLAG_ID2, id2)                                            \
+    F(VAR64, VOLUME_FLAG_SIZE, size1)                                          \
+    F(STRING, VOLUME_FLAG_DRIVE_HINT, hint)
+
+#define COMPONENT_FIELDS(F)                                                    \
+    F(VAR32, 0, id)                                                            \
+    F(STRING, 0, name)                                                         \
+    F(SKIPVAR, 0, state)                                                       \
+    F(U8, 0, type)                                                             \
+    F(SKIP, 0, 4) /* zeros */                                                  \
+    F(VAR32, 0, children)                                                      \
+    F(SKIP, 0, 16) /* commit id, zeros */                                      \
+    F(VAR32, 0, parent_id)                                                     \
+    F(SKIP, 0, 1) /* zeros */                                                  \
+    F(VAR64, COMPONENT_FLAG_ENABLE, chunk_size)                                \
+    F(VAR32, COMPONENT_FLAG_ENABLE, columns)
+
+#define PARTITION_FIELDS(F)                                                    \
+    F(VAR32, 0, id)                                                            \
+    F(STRING, 0, name)                                                         \
+    F(SKIP, 0, 12) /* zeros, commit id */                                      \
+    F(BE64, 0, start)                                                          \
+    F(BE64, 0, offset)                                                         \
+    F(VAR64, 0, size)                                                          \
+    F(VAR32, 0, parent_id)                                                     \
+    F(VAR32, 0, disk_id)                                                       \
+    F(VAR32, PARTITION_FLAG_INDEX, index)
+
+/* revision 3 has the disk GUID as a string, revision 4 as 16 bytes */
+#define DISK_V3_FIELDS(F)                                                      \
+    F(VAR32, 0, id)                                                            \
+    F(STRING, 0, name)                                                         \
+    F(STRING, 0, guid)
+
+#define DISK_V4_FIELDS(F)                                                      \
+    F(VAR32, 0, id)                                                            \
+    F(STRING, 0, name)                                                         \
+    F(GUID, 0, guid)
+
+#define DISK_GROUP_FIELDS(F)                                                   \
+    F(VAR32, 0, id)                                                            \
+    F(STRING, 0, name)
+
+/* the layout of each type and revision, and what is done with a record */
+#define VBLK_LAYOUTS(L)                                                        \
+    L(VBLK_VOLUME, 5, volume)                                                  \
+    L(VBLK_COMPONENT, 3, component)                                            \
+    L(VBLK_PARTITION, 3, partition)                                            \
+    L(VBLK_DISK, 3, disk_v3)                                                   \
+    L(VBLK_DISK, 4, disk_v4)                                                   \
+    L(VBLK_DISK_GROUP, 3, disk_group)                                          \
+    L(VBLK_DISK_GROUP, 4, disk_group)
+
+typedef struct _vblk_string {
+    const char *data;
+    uint8_t len;
+} vblk_string;
+
+#define VBLK_MEMBER_VAR32(name) uint32_t name;
+#define VBLK_MEMBER_VAR64(name) uint64_t name;
+#define VBLK_MEMBER_STRING(name) vblk_string name;
+#define VBLK_MEMBER_SKIPVAR(name)
+#define VBLK_MEMBER_SKIP(bytes)
+#define VBLK_MEMBER_U8(name) uint8_t name;
+#define VBLK_MEMBER_BE64(name) uint64_t name;
+#define VBLK_MEMBER_GUID(name) const uint8_t *name;
+#define VBLK_MEMBER(kind, flag, name) VBLK_MEMBER_##kind(name)
+
+/* the most bytes a field can take */
+#define VBLK_MAX_VAR32(name) (1 + sizeof(uint32_t))
+#define VBLK_MAX_VAR64(name) (1 + sizeof(uint64_t))
+#define VBLK_MAX_STRING(name) (1 + UINT8_MAX)
+#define VBLK_MAX_SKIPVAR(name) (1 + UINT8_MAX)
+#define VBLK_MAX_SKIP(bytes) (bytes)
+#define VBLK_MAX_U8(name) 1
+#define VBLK_MAX_BE64(name) sizeof(uint64_t)
+#define VBLK_MAX_GUID(name) sizeof(uuid_t)
+#define VBLK_MAX(kind, flag, name) +VBLK_MAX_##kind(name)
+
+/* a length byte too long for the integer is the only bad field */
+#define VBLK_DECODE_VAR32(name)                                                \
+    if (*p > sizeof(uint32_t))                                                 \
+        goto bad_int;                                                          \
+    f.name = var_uint(p);                                                      \
+    p += 1 + *p;
+#define VBLK_DECODE_VAR64(name)                                                \
+    if (*p > sizeof(uint64_t))                                                 \
+        goto bad_int;                                                          \
+    f.name = var_uint(p);                                                      \
+    p += 1 + *p;
+#define VBLK_DECODE_STRING(name)                                               \
+    f.name.len = *p;                                                           \
+    f.name.data = (const char *)p + 1;                                         \
+    p += 1 + *p;
+#define VBLK_DECODE_SKIPVAR(name) p += 1 + *p;
+#define VBLK_DECODE_SKIP(bytes) p += (bytes);
+#define VBLK_DECODE_U8(name) f.name = *p++;
+/* records are byte packed, the field may sit at any address */
+#define VBLK_DECODE_BE64(name)                                                 \
+    memcpy(&f.name, p, sizeof(uint64_t));                                      \
+    f.name = be64toh(f.name);                                                  \
+    p += sizeof(uint64_t);
+#define VBLK_DECODE_GUID(name)                                                 \
+    f.name = p;                                                                \
+    p += sizeof(uuid_t);
+/* the flag is a constant, 0 leaves no test behind */
+#define VBLK_DECODE(kind, flag, name)                                          \
+    if (!(flag) || (flags & (flag))) {                                         \
+        VBLK_DECODE_##kind(name)                                               \
     }
 
-    *ret = 0;
-    for (; len > 0; len--) {
-        *ret <<= 8;
-        *ret += **var;
-        (*var)++;
+/*
+ * layout##_fields, and parse_##layout(), which decodes a record of len bytes
+ * with avail bytes readable from data and hands it to add_##layout(). Where
+ * the widest record of the layout fits in avail, which is nearly always,
+ * the fields are read straight from the database. Only the end is checked,
+ * once: a record that ran past len is dropped.
+ */
+#define VBLK_DECODER(layout, FIELDS)                                           \
+    typedef struct _##layout##_fields {                                        \
+        FIELDS(VBLK_MEMBER)                                                    \
+    } layout##_fields;                                                         \
+                                                                               \
+    static int add_##layout(const layout##_fields *f);                         \
+                                                                               \
+    static int parse_##layout(const uint8_t *data, size_t len, size_t avail,   \
+                              uint8_t flags) {                                 \
+        uint8_t padded[0 FIELDS(VBLK_MAX)];                                    \
+        const uint8_t *p = data;                                               \
+        layout##_fields f;                                                     \
+                                                                               \
+        if (avail < sizeof(padded)) {                                          \
+            memcpy(padded, data, avail);                                       \
+            memset(padded + avail, 0, sizeof(padded) - avail);                 \
+            p = data = padded;                                                 \
+        }                                                                      \
+                                                                               \
+        memset(&f, 0, sizeof(f));                                              \
+        FIELDS(VBLK_DECODE)                                                    \
+                                                                               \
+        if (p - data > len) {                                                  \
+            printf("ldm: " #layout " record is longer than its VBLK\n");       \
+            return -1;                                                         \
+        }                                                                      \
+        return add_##layout(&f);                                               \
+                                                                               \
+    bad_int:                                                                   \
+        printf("ldm: found %d bytes integer\n", *p);                           \
+        return -1;                                                             \
     }
 
-    return 0;
-}
-
-static int parse_var_uint32_t(const uint8_t **const var, uint32_t *ret) {
-    uint8_t len = **var;
-    (*var)++;
-
-    if (len > sizeof(uint32_t)) {
-        printf("ldm: found %d bytes integer\n", len);
-        return -1;
-    }
+/* the big-endian integer of a VAR32 or VAR64 field, its length checked */
+static inline uint64_t var_uint(const uint8_t *p) {
+    uint64_t ret = 0;
+    uint8_t len = *p++;
 
-    *ret = 0;
-    for (; len > 0; len--) {
-        *ret <<= 8;
-        *ret += **var;
-        (*var)++;
-    }
+    for (; len > 0; len--)
+        ret = ret << 8 | *p++;
 
-    return 0;
+    return ret;
 }
 
-static int parse_var_string(const uint8_t **const var, char **ret) {
-    uint8_t len = **var;
-    (*var)++;
+static char *vblk_strdup(const vblk_string *str) {
+    char *ret = calloc(str->len + 1, sizeof(uint8_t));
 
-    *ret = calloc(len + 1, sizeof(uint8_t));
-    if (!*ret) {
+    if (!ret) {
         printf("ldm: failed to invoke calloc\n");
-        return -1;
+        return NULL;
     }
 
-    memcpy(*ret, *var, len);
-    (*var) += len;
-
-    return 0;
+    memcpy(ret, str->data, str->len);
+    return ret;
 }
 
-static inline void parse_var_skip(const uint8_t **const var) {
-    uint8_t len = **var;
-    (*var)++;
-    (*var) += len;
-}
-
-static int parse_vblk_volume(const uint8_t *vblk_data, const uint8_t revision,
-                             uint8_t field_flags) {
-    uint32_t id;
-    char *name;
-    uint8_t type;
-    uint8_t flags;
-    uint32_t numOfChildren;
-    uint64_t size, size1 = 0;
-    uint8_t partitionType;
-    uuid_t guid;
-    char *id1 = NULL, *id2 = NULL, *driveHint = NULL;
-
-    if (revision != 5) {
-        printf("ldm: not support volume revision: %hhu\n", revision);
-        return -1;
-    }
-
-    /* volume id */
-    if (parse_var_uint32_t(&vblk_data, &id))
-        return -1;
-
-    /* volume name */
-    if (parse_var_string(&vblk_data, &name))
-        return -1;
-
-    /* volume type 1 */
-    parse_var_skip(&vblk_data);
+VBLK_DECODER(volume, VOLUME_FIELDS)
+VBLK_DECODER(component, COMPONENT_FIELDS)
+VBLK_DECODER(partition, PARTITION_FIELDS)
+VBLK_DECODER(disk_v3, DISK_V3_FIELDS)
+VBLK_DECODER(disk_v4, DISK_V4_FIELDS)
+VBLK_DECODER(disk_group, DISK_GROUP_FIELDS)
 
-    /* unknown */
-    parse_var_skip(&vblk_data);
+static int add_volume(const volume_fields *f) {
+    vblk_volume *volume;
 
-    /* volume state */
-    vblk_data += 14;
-
-    /* volume type 2 */
-    type = *(uint8_t *)vblk_data;
-    vblk_data++;
-    if (type != VOLUME_TYPE_GEN && type != VOLUME_TYPE_RAID5) {
-        printf("ldm: not support volume type: %d\n", type);
-        free(name);
+    if (f->type != VOLUME_TYPE_GEN && f->type != VOLUME_TYPE_RAID5) {
+        printf("ldm: not support volume type: %d\n", f->type);
         return -1;
     }
 
-    /* unknown */
-    vblk_data++;
-
-    /* volume number */
-    vblk_data++;
-
-    /* zeros */
-    vblk_data += 3;
-
-    /* volume flags */
-    flags = *(uint8_t *)vblk_data;
-    vblk_data++;
-
-    /* number of children */
-    if (parse_var_uint32_t(&vblk_data, &numOfChildren))
-        return -1;
-
-    /* log commit id */
-    vblk_data += 8;
-
-    /* id? or 0x00 */
-    vblk_data += 8;
-
-    /* size */
-    if (parse_var_uint64_t(&vblk_data, &size))
-        return -1;
-
-    /* zeros */
-    vblk_data += 4;
-
-    /* partition type */
-    partitionType = *(uint8_t *)vblk_data;
-    vblk_data++;
-
-    /* guid */
-    uuid_copy(guid, vblk_data);
-    vblk_data += sizeof(uuid_t);
-
-    if (field_flags & VOLUME_FLAG_ID1) {
-        if (parse_var_string(&vblk_data, &id1))
-            return -1;
-    } else if (field_flags & VOLUME_FLAG_ID2) {
-        if (parse_var_string(&vblk_data, &id2))
-            return -1;
-    } else if (field_flags & VOLUME_FLAG_SIZE) {
-        if (parse_var_uint64_t(&vblk_data, &size1))
-            return -1;
-    } else if (field_flags & VOLUME_FLAG_DRIVE_HINT) {
-        if (parse_var_string(&vblk_data, &driveHint))
-            return -1;
-    }
-
-    D("volume: %s\n"
+    D("volume: %.*s\n"
       "  ID: %d \n"
       "  Type: %d\n"
       "  Flags: %d\n"
       "  Children: %d\n"
       "  Size: %lu \n"
       "  Partition Type: %d \n"
-      "  ID1: %s\n"
-      "  ID2: %s\n"
       "  Size1: %lu \n"
-      "  Hint: %s\n\n",
-      name, id, type, flags, numOfChildren, size, partitionType, id1, id2,
-      size1, driveHint);
-
-    vblk_volume *volume = malloc(sizeof(vblk_volume));
-    volume->id = id;
-    volume->name = name;
-    volume->type = type;
-    volume->flags = flags;
-    volume->num_of_comps = numOfChildren;
-    volume->size = size;
-    volume->part_type = partitionType;
-    uuid_copy(volume->guid, guid);
-    volume->hint = driveHint;
-
-    list_add(&(volume->list), &volume_list);
-    return 0;
-}
-
-static int parse_vblk_component(const uint8_t *vblk_data,
-                                const uint8_t revision, uint8_t field_flags) {
-    uint32_t id;
-    char *name;
-    uint8_t type;
-    uint32_t numOfChildren;
-    uint32_t parentID;
-    uint64_t chunkSize = 0;
-    uint32_t columns = 0;
-
-    if (revision != 3) {
-        printf("ldm: not support component revision: %hhu\n", revision);
-        return -1;
-    }
-
-    /* component id */
-    if (parse_var_uint32_t(&vblk_data, &id))
-        return -1;
-
-    /* component name */
-    if (parse_var_string(&vblk_data, &name))
-        return -1;
+      "  Hint: %.*s\n\n",
+      f->name.len, f->name.data, f->id, f->type, f->flags, f->children,
+      f->size, f->part_type, f->size1, f->hint.len, f->hint.data);
 
-    /* component state */
-    parse_var_skip(&vblk_data);
-
-    /* component type */
-    type = *((uint8_t *)vblk_data);
-    vblk_data++;
-    if (type != COMPONENT_TYPE_SPANNED) {
-        printf("ldm: not support component type: %d\n", type);
+    volume = calloc(1, sizeof(vblk_volume));
+    if (!volume) {
+        printf("ldm: failed to malloc\n");
         return -1;
     }
+    volume->id = f->id;
+    volume->name = vblk_strdup(&f->name);
+    volume->type = f->type;
+    volume->flags = f->flags;
+    volume->num_of_comps = f->children;
+    volume->size = f->size;
+    volume->part_type = f->part_type;
+    uuid_copy(volume->guid, f->guid);
+    volume->hint = f->hint.data ? vblk_strdup(&f->hint) : NULL;
 
-    /* zeros */
-    vblk_data += 4;
-
-    /* number of children */
-    if (parse_var_uint32_t(&vblk_data, &numOfChildren))
-        return -1;
-
-    /* commit id */
-    vblk_data += 8;
+    list_add(&(volume->list), &volume_list);
+    return 0;
+}
 
-    /* zeros1 */
-    vblk_data += 8;
+static int add_component(const component_fields *f) {
+    vblk_component *component;
 
-    /* parent id */
-    if (parse_var_uint32_t(&vblk_data, &parentID))
+    if (f->type != COMPONENT_TYPE_STRIPED &&
+        f->type != COMPONENT_TYPE_SPANNED && f->type != COMPONENT_TYPE_RAID) {
+        printf("ldm: not support component type: %d\n", f->type);
         return -1;
-
-    /* zeros2 */
-    vblk_data++;
-
-    if (field_flags & COMPONENT_FLAG_ENABLE) {
-        if (parse_var_uint64_t(&vblk_data, &chunkSize))
-            return -1;
-        if (parse_var_uint32_t(&vblk_data, &columns))
-            return -1;
     }
 
     D("Component:\n"
@@ -306,71 +302,29 @@ static int parse_vblk_component(const uint8_t *vblk_data,
       "  Parts: %d\n"
       "  Chunk Size: %lu\n"
       "  Columns: %d\n\n",
-      id, parentID, type, numOfChildren, chunkSize, columns);
+      f->id, f->parent_id, f->type, f->children, f->chunk_size, f->columns);
 
-    vblk_component *component = malloc(sizeof(vblk_component));
-    component->id = id;
-    component->name = name;
-    component->type = type;
-    component->num_of_parts = numOfChildren;
-    component->volume_id = parentID;
-    component->chunk_size = chunkSize;
-    component->columns = columns;
+    component = calloc(1, sizeof(vblk_component));
+    if (!component) {
+        printf("ldm: failed to malloc\n");
+        return -1;
+    }
+    component->id = f->id;
+    component->name = vblk_strdup(&f->name);
+    component->type = f->type;
+    component->num_of_parts = f->children;
+    component->volume_id = f->parent_id;
+    component->chunk_size = f->chunk_size;
+    component->columns = f->columns;
 
     list_add(&(component->list), &component_list);
-
     return 0;
 }
 
-static int parse_vblk_partition(const uint8_t *vblk_data,
-                                const uint8_t revision, uint8_t field_flags) {
-    uint32_t id;
-    char *name;
-    uint64_t start;
-    uint64_t offset;
-    uint64_t size;
-    uint32_t parentID, diskID;
-    uint32_t index = 0;
-
-    if (revision != 3) {
-        printf("ldm: not support partition revision: %hhu\n", revision);
-        return -1;
-    }
-
-    /* partition id */
-    if (parse_var_uint32_t(&vblk_data, &id))
-        return -1;
-
-    /* partition name */
-    if (parse_var_string(&vblk_data, &name))
-        return -1;
-
-    /* zeros */
-    vblk_data += 4;
-
-    /* commit id */
-    vblk_data += 8;
-
-    start = be64toh(*(uint64_t *)vblk_data);
-    vblk_data += 8;
-    offset = be64toh(*(uint64_t *)vblk_data);
-    vblk_data += 8;
-
-    if (parse_var_uint64_t(&vblk_data, &size))
-        return -1;
-
-    if (parse_var_uint32_t(&vblk_data, &parentID))
-        return -1;
-
-    if (parse_var_uint32_t(&vblk_data, &diskID))
-        return -1;
-
-    if (field_flags & PARTITION_FLAG_INDEX) {
-        if (parse_var_uint32_t(&vblk_data, &index))
-            return -1;
-    }
+static int add_partition(const partition_fields *f) {
+    vblk_partition *part;
 
-    D("Partition: %s\n"
+    D("Partition: %.*s\n"
       "  ID: %d\n"
       "  Parent ID: %d\n"
       "  Disk ID: %d\n"
@@ -378,172 +332,181 @@ static int parse_vblk_partition(const uint8_t *vblk_data,
       "  Start: %lu\n"
       "  Vol Offset: %lu\n"
       "  Size: %lu\n\n",
-      name, id, parentID, diskID, index, start, offset, size);
-
-    vblk_partition *part = malloc(sizeof(vblk_partition));
-    part->id = id;
-    part->name = name;
-    part->start = start;
-    part->volume_offset = offset;
-    part->size = size;
-    part->component_id = parentID;
-    part->disk_id = diskID;
-    part->index = index;
+      f->name.len, f->name.data, f->id, f->parent_id, f->disk_id, f->index,
+      f->start, f->offset, f->size);
 
-    list_add(&(part->list), &partition_list);
+    part = calloc(1, sizeof(vblk_partition));
+    if (!part) {
+        printf("ldm: failed to malloc\n");
+        return -1;
+    }
+    part->id = f->id;
+    part->name = vblk_strdup(&f->name);
+    part->start = f->start;
+    part->volume_offset = f->offset;
+    part->size = f->size;
+    part->component_id = f->parent_id;
+    part->disk_id = f->disk_id;
+    part->index = f->index;
 
+    list_add(&(part->list), &partition_list);
     return 0;
 }
 
-static int parse_vblk_disk(const uint8_t *vblk_data, const uint8_t revision,
-                           uint8_t field_flags) {
-    uint32_t id;
-    char *name;
-    uuid_t guid;
-
-    /* disk id */
-    if (parse_var_uint32_t(&vblk_data, &id))
-        return -1;
-
-    /* disk name */
-    if (parse_var_string(&vblk_data, &name))
-        return -1;
-
-    if (revision == 3) {
-        char *idStr;
-        if (parse_var_string(&vblk_data, &idStr))
-            return -1;
-        if (uuid_parse(idStr, (unsigned char *)&guid) == -1) {
-            printf("ldm: disk %d has invalid guid: %s\n", id, idStr);
-            return -1;
-        }
-        free(idStr);
-    } else if (revision == 4) {
-        uuid_copy(guid, vblk_data);
-        vblk_data += sizeof(uuid_t);
-    } else {
-        printf("ldm: not support disk revision: %hhu\n", revision);
-        return -1;
-    }
-
+static int add_disk(uint32_t id, const vblk_string *name, const uuid_t guid) {
+    vblk_disk *disk;
     char out[64] = { 0 };
-    uuid_unparse_lower((unsigned char *)&guid, out);
-    D("Disk: %s\n"
+
+    uuid_unparse_lower(guid, out);
+    D("Disk: %.*s\n"
       "  ID: %u\n"
       "  GUID: %s\n\n",
-      name, id, out);
+      name->len, name->data, id, out);
 
-    vblk_disk *disk = malloc(sizeof(vblk_disk));
+    disk = calloc(1, sizeof(vblk_disk));
+    if (!disk) {
+        printf("ldm: failed to malloc\n");
+        return -1;
+    }
     disk->id = id;
-    disk->name = name;
+    disk->name = vblk_strdup(name);
     uuid_copy(disk->guid, guid);
 
     list_add(&(disk->list), &disk_list);
-
     return 0;
 }
 
-static int parse_vblk_disk_group(const uint8_t *vblk_data,
-                                 const uint8_t revision, uint8_t field_flags) {
-    uint32_t id;
-    char *name;
+static int add_disk_v3(const disk_v3_fields *f) {
+    char str[UINT8_MAX + 1];
+    uuid_t guid;
 
-    if (revision != 3 && revision != 4) {
-        printf("ldm: not support disk group revision: %hhu\n", revision);
+    memcpy(str, f->guid.data, f->guid.len);
+    str[f->guid.len] = '\0';
+    if (uuid_parse(str, guid) == -1) {
+        printf("ldm: disk %d has invalid guid: %s\n", f->id, str);
         return -1;
     }
 
-    /* partition id */
-    if (parse_var_uint32_t(&vblk_data, &id))
-        return -1;
+    return add_disk(f->id, &f->name, guid);
+}
 
-    /* partition name */
-    if (parse_var_string(&vblk_data, &name))
-        return -1;
+static int add_disk_v4(const disk_v4_fields *f) {
+    return add_disk(f->id, &f->name, f->guid);
+}
 
-    D("Disk Group: %s\n"
+static int add_disk_group(const disk_group_fields *f) {
+    vblk_disk_group *dg;
+
+    D("Disk Group: %.*s\n"
       "  ID: %u\n\n",
-      name, id);
+      f->name.len, f->name.data, f->id);
 
-    vblk_disk_group *dg = malloc(sizeof(vblk_disk_group));
-    dg->id = id;
-    dg->name = name;
+    dg = calloc(1, sizeof(vblk_disk_group));
+    if (!dg) {
+        printf("ldm: failed to malloc\n");
+        return -1;
+    }
+    dg->id = f->id;
+    dg->name = vblk_strdup(&f->name);
 
     list_add(&(dg->list), &disk_group_list);
-
     return 0;
 }
 
-static int parse_vblk(const void *vblk_data) {
+static const char *vblk_type_names[] = { "black", "volume", "component",
+                                         "partition", "disk", "disk group" };
+
+/*
+ * One switch on the whole type byte, revision and type, picks the decoder;
+ * nothing after it looks at the revision again.
+ */
+static int _parse_vblk(const void *vblk_data, size_t len, size_t avail) {
     const vblk_record *const rec = vblk_data;
+    const uint8_t *data = vblk_data + sizeof(vblk_record);
     uint8_t type = rec->type & 0x0F;
     uint8_t revision = (rec->type & 0xF0) >> 4;
 
-    vblk_data += sizeof(vblk_record);
+    len -= sizeof(vblk_record);
+    avail -= sizeof(vblk_record);
 
-    switch (type) {
-    case VBLK_BLACK:
-        break;
-    case VBLK_VOLUME:
-        if (parse_vblk_volume(vblk_data, revision, rec->flags))
-            return -1;
-        break;
-    case VBLK_COMPONENT:
-        if (parse_vblk_component(vblk_data, revision, rec->flags))
-            return -1;
-        break;
-    case VBLK_PARTITION:
-        if (parse_vblk_partition(vblk_data, revision, rec->flags))
-            return -1;
-        break;
-    case VBLK_DISK:
-        if (parse_vblk_disk(vblk_data, revision, rec->flags))
-            return -1;
-        break;
-    case VBLK_DISK_GROUP:
-        if (parse_vblk_disk_group(vblk_data, revision, rec->flags))
-            return -1;
-        break;
-    default:
-        return -1;
-        break;
+    switch (rec->type) {
+#define VBLK_CASE(type, revision, layout)                                      \
+    case (revision) << 4 | (type):                                             \
+        return parse_##layout(data, len, avail, rec->flags);
+        VBLK_LAYOUTS(VBLK_CASE)
+#undef VBLK_CASE
     }
 
-    return 0;
+    if (type == VBLK_BLACK)
+        return 0;
+    if (type <= VBLK_DISK_GROUP)
+        printf("ldm: not support %s revision: %hhu\n", vblk_type_names[type],
+               revision);
+    return -1;
 }
 
-static int read_vblks(int fd, const vmdb *const db) {
-    const void *vblk = (void *)db + be32toh(db->vblk_first_offset);
-    const uint32_t vblk_size = be32toh(db->vblk_size);
-    const uint32_t vblk_data_size = vblk_size - (sizeof(vblk_head));
+/* a record of len bytes, with avail bytes of the database readable */
+static int parse_vblk(const void *vblk_data, size_t len, size_t avail) {
+    const vblk_record *const rec = vblk_data;
+    uint64_t start = latency_start();
+    int ret;
 
-    struct list_head *pos;
+    ret = _parse_vblk(vblk_data, len, avail);
+    latency_end(LATENCY_VBLK, start);
+    PROBE3(vblk_parse, rec->type & 0x0F, (rec->type & 0xF0) >> 4, ret);
+
+    return ret;
+}
+
+/*
+ * Parse the VBLKs of the database up to the end of the config. A record that
+ * does not fit in one VBLK is spread over several with the same group number
+ * and is parsed once all of its parts are collected.
+ */
+static int read_vblks(int fd, const vmdb *const db, const void *end) {
+    struct list_head *pos, *next;
     vblk_extended *ext_vblk;
+    uint32_t vblk_data_size;
+    vmdb_fields db_fields;
+    const void *vblk;
+
+    vmdb_decode(db, &db_fields);
+    if (db_fields.vblk_size < sizeof(vblk_head) + sizeof(vblk_record)) {
+        printf("ldm: VBLK size %u is too small\n", db_fields.vblk_size);
+        return -1;
+    }
+    vblk = (void *)db + db_fields.vblk_first_offset;
+    vblk_data_size = db_fields.vblk_size - sizeof(vblk_head);
 
-    for (;;) {
+    while (vblk + db_fields.vblk_size <= end) {
         const vblk_head *const head = vblk;
+        vblk_head_fields head_fields;
+        uint16_t record_number, num_records;
+
+        vblk_head_decode(head, &head_fields);
+        record_number = head_fields.record_number;
+        num_records = head_fields.num_records;
+
         if (memcmp(head->magic, "VBLK", 4) != 0)
             break;
 
-        if (be16toh(head->num_records) > 0 &&
-            be16toh(head->record_number) >= be16toh(head->num_records)) {
+        if (num_records > 0 && record_number >= num_records) {
             printf("ldm: vblk record not valid\n");
             return -1;
         }
 
         vblk += sizeof(vblk_head);
 
-        if (be16toh(head->num_records) > 1) {
+        if (num_records > 1) {
             int found = 0;
 
-            printf("head has %d records\n", be16toh(head->num_records));
+            D("head has %d records\n", num_records);
 
             list_for_each(pos, &ext_vblk_list) {
                 ext_vblk = list_entry(pos, vblk_extended, list);
                 if (ext_vblk->group_number == head->group_number) {
                     ext_vblk->num_records_found++;
-                    memcpy(ext_vblk->data[be16toh(head->record_number) *
-                                           vblk_data_size],
+                    memcpy(ext_vblk->data + record_number * vblk_data_size,
                            vblk, vblk_data_size);
                     found = 1;
                     break;
@@ -552,29 +515,55 @@ static int read_vblks(int fd, const vmdb *const db) {
 
             if (!found) {
                 vblk_extended *new_ext_vblk = malloc(sizeof(vblk_extended));
+                if (!new_ext_vblk) {
+                    printf("ldm: failed to malloc\n");
+                    return -1;
+                }
                 new_ext_vblk->group_number = head->group_number;
-                new_ext_vblk->num_records = be16toh(head->num_records);
+                new_ext_vblk->num_records = num_records;
                 new_ext_vblk->num_records_found = 1;
-                new_ext_vblk->data =
-                    malloc(be16toh(head->num_records * vblk_data_size));
-                memcpy(new_ext_vblk->data[be16toh(head->record_number) *
-                                          vblk_data_size],
+                new_ext_vblk->data = calloc(num_records, vblk_data_size);
+                if (!new_ext_vblk->data) {
+                    printf("ldm: failed to malloc\n");
+                    free(new_ext_vblk);
+                    return -1;
+                }
+                memcpy(new_ext_vblk->data + record_number * vblk_data_size,
                        vblk, vblk_data_size);
 
                 list_add(&(new_ext_vblk->list), &ext_vblk_list);
             }
         } else {
-            parse_vblk(vblk);
+            stats_count_vblk(((const vblk_record *)vblk)->type & 0x0F, 0);
+            parse_vblk(vblk, vblk_data_size, end - vblk);
         }
 
         vblk += vblk_data_size;
     }
 
+    list_for_each_safe(pos, next, &ext_vblk_list) {
+        ext_vblk = list_entry(pos, vblk_extended, list);
+        if (ext_vblk->num_records_found == ext_vblk->num_records) {
+            stats_count_vblk(((vblk_record *)ext_vblk->data)->type & 0x0F, 1);
+            parse_vblk(ext_vblk->data,
+                       (size_t)ext_vblk->num_records * vblk_data_size,
+                       (size_t)ext_vblk->num_records * vblk_data_size);
+        } else
+            printf("ldm: vblk group %u is incomplete\n",
+                   be32toh(ext_vblk->group_number));
+
+        list_del(pos);
+        free(ext_vblk->data);
+        free(ext_vblk);
+    }
+
     return 0;
 }
 
 static privhead *alloc_read_privhead(int fd, uint64_t lba) {
     privhead *header;
+    stats_timer timer;
+    size_t count;
 
     header = malloc(sizeof(privhead));
     if (!header) {
@@ -582,8 +571,10 @@ static privhead *alloc_read_privhead(int fd, uint64_t lba) {
         return header;
     }
 
-    if (bdev_read_lba(fd, lba, (uint8_t *)header, sizeof(*header)) !=
-        sizeof(*header)) {
+    stats_phase_begin(&timer);
+    count = bdev_read_lba(fd, lba, (uint8_t *)header, sizeof(*header));
+    stats_phase_end(&timer, STATS_PRIVHEAD);
+    if (count != sizeof(*header)) {
         printf("ldm: failed to read privheader\n");
         free(header);
         return NULL;
@@ -604,11 +595,12 @@ static privhead *alloc_read_privhead(int fd, uint64_t lba) {
     return header;
 }
 
-static uint8_t *alloc_read_config(int fd, privhead *header) {
+static uint8_t *read_config_at(int fd, uint64_t config_start,
+                               uint64_t config_sectors) {
     uint8_t *config = NULL;
-    uint64_t config_start = be64toh(header->ldm_config_start);
-    uint64_t config_size =
-        be64toh(header->ldm_config_size) * bdev_get_sector_size(fd);
+    uint64_t config_size = config_sectors * bdev_get_sector_size(fd);
+    stats_timer timer;
+    size_t count;
 
     config = malloc(config_size);
     if (!config) {
@@ -616,7 +608,10 @@ static uint8_t *alloc_read_config(int fd, privhead *header) {
         return NULL;
     }
 
-    if (bdev_read_lba(fd, config_start, config, config_size) != config_size) {
+    stats_phase_begin(&timer);
+    count = bdev_read_lba(fd, config_start, config, config_size);
+    stats_phase_end(&timer, STATS_CONFIG);
+    if (count != config_size) {
         printf("ldm: failed to read config\n");
         free(config);
         return NULL;
@@ -625,60 +620,103 @@ static uint8_t *alloc_read_config(int fd, privhead *header) {
     return config;
 }
 
-static int read_ldm(int fd, uint64_t lba, privhead **head) {
+static uint8_t *alloc_read_config(int fd, privhead *header) {
+    privhead_fields f;
+
+    privhead_decode(header, &f);
+    return read_config_at(fd, f.ldm_config_start, f.ldm_config_size);
+}
+
+/* find the VMDB through the TOCBLOCK and parse the VBLKs after it */
+static int parse_config(int fd, uint8_t *config, uint64_t config_sectors) {
     int i;
-    uint8_t *config;
     tocblock *toc_block;
-    tocblock_bitmap *bitmap;
+    tocblock_bitmap_fields bitmap;
     vmdb *db = NULL;
+    stats_timer timer;
+
+    toc_block = config + bdev_get_sector_size(fd) * 2;
+    if (memcmp(toc_block->magic, "TOCBLOCK", 8) != 0) {
+        printf("ldm: not found TOCBLOCK\n");
+        return -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (!memcmp(toc_block->bitmap[i].name, "config", 6)) {
+            tocblock_bitmap_decode(&toc_block->bitmap[i], &bitmap);
+            db = config + bitmap.start * bdev_get_sector_size(fd);
+            break;
+        }
+    }
+
+    if (!db || memcmp(db->magic, "VMDB", 4)) {
+        printf("ldm: not found VMDB\n");
+        return -1;
+    }
+
+    stats_phase_begin(&timer);
+    read_vblks(fd, db, config + config_sectors * bdev_get_sector_size(fd));
+    stats_phase_end(&timer, STATS_VBLK);
+
+    return 0;
+}
+
+static int read_ldm(int fd, uint64_t lba, privhead **head) {
+    privhead_fields f;
+    uint8_t *config;
+    int ret;
 
     *head = alloc_read_privhead(fd, lba);
-    if (!head) {
+    if (!*head) {
         return -1;
     }
 
     if (uuid_parse((*head)->disk_guid, (unsigned char *)&cur_dev_guid) == -1) {
         printf("ldm: disk has invalid guid: %s\n", (*head)->disk_guid);
+        free(*head);
+        *head = NULL;
         return -1;
     }
 
+    privhead_decode(*head, &f);
+    cur_logical_disk_start = f.logical_disk_start;
+    cur_logical_disk_size = f.logical_disk_size;
+
     config = alloc_read_config(fd, *head);
     if (!config) {
-        free(head);
+        free(*head);
+        *head = NULL;
         return -1;
     }
 
-    toc_block = config + bdev_get_sector_size(fd) * 2;
-    if (memcmp(toc_block->magic, "TOCBLOCK", 8) != 0) {
-        printf("ldm: not found TOCBLOCK\n");
-        free(config);
-        free(head);
-        return -1;
+    ret = parse_config(fd, config, f.ldm_config_size);
+    free(config);
+    if (ret) {
+        free(*head);
+        *head = NULL;
     }
 
-    for (i = 0; i < 2; i++) {
-        bitmap = &toc_block->bitmap[i];
-        if (!memcmp(bitmap->name, "config", 6)) {
-            db = config + be64toh(bitmap->start) * bdev_get_sector_size(fd);
-            break;
-        }
-    }
+    return ret;
+}
 
-    if (!db || !memcpy(db->magic, "VMDB", 4)) {
-        printf("ldm: not found VMDB\n");
-        free(config);
-        free(head);
-        return -1;
-    }
+/*
+ * Parse the database at config_start without a PRIVHEAD, e.g. one found by
+ * a scan of the disk. The volumes are then in the lists of ldm_volumes() and
+ * the others, but not mapped onto this disk.
+ */
+int ldm_read_config(int fd, uint64_t config_start, uint64_t config_sectors) {
+    uint8_t *config = read_config_at(fd, config_start, config_sectors);
+    int ret;
 
-    read_vblks(fd, db);
+    if (!config)
+        return -1;
 
+    ret = parse_config(fd, config, config_sectors);
     free(config);
-
-    return 0;
+    return ret;
 }
 
-int parse_ldm(uint64_t start, struct list_head *new_entries) {
+static int resolve_partitions(uint64_t start, struct list_head *new_entries) {
     struct list_head *pos;
 
     vblk_disk *disk;
@@ -737,6 +775,14 @@ int parse_ldm(uint64_t start, struct list_head *new_entries) {
             return -1;
         }
 
+        /* only a single spanned component maps onto plain partitions */
+        if (com->type != COMPONENT_TYPE_SPANNED || vol->num_of_comps != 1) {
+            printf("ldm: volume %s is striped, mirrored or RAID-5 and can "
+                   "not be converted, use d2b dm to access it\n",
+                   vol->name);
+            return -1;
+        }
+
         if (vol && com && partition) {
             D("Data start: %lu, Start: %lu, Offset: %lu, "
               "Size: %lu, Partition Type: %d, "
@@ -746,9 +792,11 @@ int parse_ldm(uint64_t start, struct list_head *new_entries) {
 
             partition_data *entry = malloc(sizeof(partition_data));
             entry->start = start + partition->start;
+            entry->old_start = entry->start;
             entry->offset = partition->volume_offset;
             entry->size = partition->size;
             entry->part_type = vol->part_type;
+            entry->volume_id = vol->id;
             list_add(&(entry->list), new_entries);
         }
     }
@@ -756,6 +804,269 @@ int parse_ldm(uint64_t start, struct list_head *new_entries) {
     return 0;
 }
 
+int parse_ldm(uint64_t start, struct list_head *new_entries) {
+    stats_timer timer;
+    int ret;
+
+    stats_phase_begin(&timer);
+    ret = resolve_partitions(start, new_entries);
+    stats_phase_end(&timer, STATS_RESOLVE);
+
+    return ret;
+}
+
+/*
+ * Look up a volume by its name, e.g. "Volume1", or by its id.
+ */
+int ldm_find_volume(const char *name, uint32_t *id) {
+    struct list_head *pos;
+    char *end;
+    unsigned long num = strtoul(name, &end, 10);
+
+    list_for_each(pos, &volume_list) {
+        vblk_volume *vol = list_entry(pos, vblk_volume, list);
+        if (!strcmp(vol->name, name) || (*end == '\0' && vol->id == num)) {
+            *id = vol->id;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void ldm_print_volumes(void) {
+    struct list_head *pos;
+
+    list_for_each(pos, &volume_list) {
+        vblk_volume *vol = list_entry(pos, vblk_volume, list);
+        printf("volume %u name=%s size=%lu part type=%d hint=%s\n", vol->id,
+               vol->name, vol->size, vol->part_type,
+               vol->hint ? vol->hint : "");
+    }
+}
+
+int ldm_get_logical_disk(uint64_t *start, uint64_t *size) {
+    if (!cur_logical_disk_size)
+        return -1;
+
+    *start = cur_logical_disk_start;
+    *size = cur_logical_disk_size;
+    return 0;
+}
+
+/*
+ * Find the PRIVHEAD: sector 6 on MBR disks, the last sector of the LDM
+ * metadata partition on GPT disks.
+ */
+int ldm_find_privhead(int fd, uint64_t *lba) {
+    legacy_mbr mbr;
+    gpt_header header;
+    gpt_entry *entries;
+    uint64_t pt_size;
+    uint32_t i;
+    int ret = -1;
+
+    if (read_mbr(fd, &mbr) != MBR_ERROR_OK) {
+        printf("ldm: failed to read mbr\n");
+        return -1;
+    }
+
+    if (mbr.partition[0].os_type == MBR_PART_WINDOWS_LDM) {
+        *lba = MBR_PRIVHEAD_SECTOR;
+        return 0;
+    }
+
+    if (mbr.partition[0].os_type != MBR_PART_EFI_PROTECTIVE) {
+        printf("ldm: not a dynamic disk\n");
+        return -1;
+    }
+
+    if (read_gpt_header(fd, &header))
+        return -1;
+
+    pt_size = le32toh(header.num_partition_entries) *
+              le32toh(header.sizeof_partition_entry);
+    entries = malloc(pt_size);
+    if (!entries) {
+        printf("ldm: failed to malloc\n");
+        return -1;
+    }
+
+    if (read_gpt_entry(fd, &header, entries, pt_size) == 0) {
+        for (i = 0; i < le32toh(header.num_partition_entries); i++) {
+            if (!uuid_compare(entries[i].type, PARTITION_LDM_METADATA_GUID)) {
+                *lba = le64toh(entries[i].last_lba);
+                ret = 0;
+                break;
+            }
+        }
+    }
+
+    if (ret)
+        printf("ldm: not found ldm metadata partition\n");
+
+    free(entries);
+    return ret;
+}
+
+int ldm_read_disk_info(int fd, ldm_disk_info *info) {
+    privhead_fields f;
+    privhead *head;
+    uint64_t lba;
+
+    if (ldm_find_privhead(fd, &lba))
+        return -1;
+
+    head = alloc_read_privhead(fd, lba);
+    if (!head)
+        return -1;
+
+    if (uuid_parse(head->disk_guid, info->guid) == -1) {
+        printf("ldm: disk has invalid guid: %s\n", head->disk_guid);
+        free(head);
+        return -1;
+    }
+
+    privhead_decode(head, &f);
+    info->logical_disk_start = f.logical_disk_start;
+    info->logical_disk_size = f.logical_disk_size;
+    info->privhead_lba = lba;
+    info->config_start = f.ldm_config_start;
+    info->config_size = f.ldm_config_size;
+    free(head);
+
+    return 0;
+}
+
+/*
+ * Read the sequence numbers bumped by every change of the disk group: that of
+ * the PRIVHEAD at lba and the committed one of the VMDB. Only the PRIVHEAD,
+ * the TOCBLOCK and the VMDB sectors are read, not the whole database.
+ */
+int ldm_read_sequence(int fd, uint64_t lba, uint32_t *privhead_seq,
+                      uint64_t *vmdb_seq) {
+    const uint32_t sector_size = bdev_get_sector_size(fd);
+    tocblock_bitmap_fields bitmap;
+    privhead_fields head_fields;
+    vmdb_fields db_fields;
+    privhead *head;
+    tocblock *toc_block;
+    vmdb *db;
+    uint8_t *sector;
+    uint64_t config_start, db_lba = 0;
+    int i, ret = -1;
+
+    head = alloc_read_privhead(fd, lba);
+    if (!head)
+        return -1;
+
+    sector = malloc(sector_size);
+    if (!sector) {
+        printf("ldm: failed to malloc\n");
+        free(head);
+        return -1;
+    }
+
+    privhead_decode(head, &head_fields);
+    config_start = head_fields.ldm_config_start;
+    if (bdev_read_lba(fd, config_start + 2, sector, sector_size) !=
+        sector_size) {
+        printf("ldm: failed to read TOCBLOCK\n");
+        goto out;
+    }
+
+    toc_block = (tocblock *)sector;
+    if (memcmp(toc_block->magic, "TOCBLOCK", 8) != 0) {
+        printf("ldm: not found TOCBLOCK\n");
+        goto out;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (!memcmp(toc_block->bitmap[i].name, "config", 6)) {
+            tocblock_bitmap_decode(&toc_block->bitmap[i], &bitmap);
+            db_lba = config_start + bitmap.start;
+            break;
+        }
+    }
+
+    db = (vmdb *)sector;
+    if (!db_lba ||
+        bdev_read_lba(fd, db_lba, sector, sector_size) != sector_size ||
+        memcmp(db->magic, "VMDB", 4) != 0) {
+        printf("ldm: not found VMDB\n");
+        goto out;
+    }
+
+    vmdb_decode(db, &db_fields);
+    *privhead_seq = head_fields.unknown_sequence;
+    *vmdb_seq = db_fields.committed_seq;
+    ret = 0;
+
+out:
+    free(sector);
+    free(head);
+    return ret;
+}
+
+/*
+ * Read the disk group database without mapping it onto this disk, every disk
+ * of the group carries the same copy.
+ */
+int ldm_read_database(int fd) {
+    privhead *head = NULL;
+    uint64_t lba;
+
+    if (ldm_find_privhead(fd, &lba) || read_ldm(fd, lba, &head))
+        return -1;
+
+    free(head);
+    return 0;
+}
+
+static void free_vblks(struct list_head *head, size_t offset) {
+    struct list_head *pos, *next;
+
+    list_for_each_safe(pos, next, head) {
+        list_del(pos);
+        free(*(char **)((uint8_t *)pos + offset));
+        free(pos);
+    }
+}
+
+/*
+ * Forget the database read last, so that the next one starts from empty
+ * lists.
+ */
+void ldm_reset(void) {
+    struct list_head *pos;
+
+    list_for_each(pos, &volume_list) {
+        free(list_entry(pos, vblk_volume, list)->hint);
+    }
+
+    free_vblks(&volume_list, offsetof(vblk_volume, name));
+    free_vblks(&component_list, offsetof(vblk_component, name));
+    free_vblks(&partition_list, offsetof(vblk_partition, name));
+    free_vblks(&disk_list, offsetof(vblk_disk, name));
+    free_vblks(&disk_group_list, offsetof(vblk_disk_group, name));
+}
+
+struct list_head *ldm_volumes(void) {
+    return &volume_list;
+}
+
+struct list_head *ldm_components(void) {
+    return &component_list;
+}
+
+struct list_head *ldm_partitions(void) {
+    return &partition_list;
+}
+
+struct list_head *ldm_disks(void) {
+    return &disk_list;
+}
+
 int read_gpt_ldm(int fd, gpt_header *header, gpt_entry **entries,
                  struct list_head *new_entries) {
     privhead *head = NULL;
@@ -800,7 +1111,7 @@ int read_gpt_ldm(int fd, gpt_header *header, gpt_entry **entries,
         goto error;
     }
 
-    if (parse_ldm(be64toh(head->logical_disk_start), new_entries)) {
+    if (parse_ldm(cur_logical_disk_start, new_entries)) {
         goto error;
     }
 
@@ -830,7 +1141,7 @@ int read_mbr_ldm(int fd, struct list_head *new_entries) {
         goto error;
     }
 
-    if (parse_ldm(be64toh(head->logical_disk_start), new_entries)) {
+    if (parse_ldm(cur_logical_disk_start, new_entries)) {
         goto error;
     }
 
@@ -7,6 +7,7 @@
 #include "gpt.h"
 #include "list.h"
 #include "mbr.h"
+#include "schema.h"
 
 #define MBR_PRIVHEAD_SECTOR 6
 
@@ -20,13 +21,36 @@ static const uuid_t PARTITION_LDM_DATA_GUID = { 0xA0, 0x60, 0x9B, 0xAF,
                                                 0xBC, 0x68, 0x33, 0x11,
                                                 0x71, 0x4A, 0x69, 0xAD };
 
+/* record types, the low nibble of the VBLK record type */
+enum {
+    VBLK_BLACK = 0,
+    VBLK_VOLUME,
+    VBLK_COMPONENT,
+    VBLK_PARTITION,
+    VBLK_DISK,
+    VBLK_DISK_GROUP,
+};
+
+enum {
+    VOLUME_TYPE_GEN = 0x3,
+    VOLUME_TYPE_RAID5 = 0x4,
+};
+
+enum {
+    COMPONENT_TYPE_STRIPED = 0x1,
+    COMPONENT_TYPE_SPANNED = 0x2,
+    COMPONENT_TYPE_RAID = 0x3
+};
+
 typedef struct _partition_data {
     struct list_head list;
 
     uint64_t start;
+    uint64_t old_start; /* data location before realignment */
     uint64_t offset;
     uint64_t size;
     uint8_t part_type;
+    uint32_t volume_id;
 } partition_data;
 
 typedef struct _vblk_volume {
@@ -110,6 +134,14 @@ typedef struct _vblk_head {
     uint16_t num_records;
 } __attribute__((__packed__)) vblk_head;
 
+#define VBLK_HEAD_FIELDS(X)                                                    \
+    X(32, sequence_number)                                                     \
+    X(32, group_number)                                                        \
+    X(16, record_number)                                                       \
+    X(16, num_records)
+
+SCHEMA_HEADER(vblk_head, VBLK_HEAD_FIELDS, BE)
+
 typedef struct _vmdb {
     char magic[4]; // "VMDB"
 
@@ -141,6 +173,18 @@ typedef struct _vmdb {
     uint64_t last_accessed;
 } __attribute__((__packed__)) vmdb;
 
+#define VMDB_FIELDS(X)                                                         \
+    X(32, vblk_last)                                                           \
+    X(32, vblk_size)                                                           \
+    X(32, vblk_first_offset)                                                   \
+    X(16, update_status)                                                       \
+    X(16, version_major)                                                       \
+    X(16, version_minor)                                                       \
+    X(64, committed_seq)                                                       \
+    X(64, pending_seq)
+
+SCHEMA_HEADER(vmdb, VMDB_FIELDS, BE)
+
 typedef struct _tocblock_bitmap {
     char name[8];
     uint16_t flags1;
@@ -149,6 +193,14 @@ typedef struct _tocblock_bitmap {
     uint64_t flags2;
 } __attribute__((__packed__)) tocblock_bitmap;
 
+#define TOCBLOCK_BITMAP_FIELDS(X)                                              \
+    X(16, flags1)                                                              \
+    X(64, start)                                                               \
+    X(64, size)                                                                \
+    X(64, flags2)
+
+SCHEMA_HEADER(tocblock_bitmap, TOCBLOCK_BITMAP_FIELDS, BE)
+
 typedef struct _tocblock {
     char magic[8]; // "TOCBLOCK"
 
@@ -198,8 +250,49 @@ typedef struct _privhead {
 
 } __attribute__((__packed__)) privhead;
 
+#define PRIVHEAD_FIELDS(X)                                                     \
+    X(32, unknown_sequence)                                                    \
+    X(16, version_major)                                                       \
+    X(16, version_minor)                                                       \
+    X(64, logical_disk_start)                                                  \
+    X(64, logical_disk_size)                                                   \
+    X(64, ldm_config_start)                                                    \
+    X(64, ldm_config_size)                                                     \
+    X(64, n_tocs)                                                              \
+    X(64, toc_size)                                                            \
+    X(32, n_configs)                                                           \
+    X(32, n_logs)                                                              \
+    X(64, config_size)                                                         \
+    X(64, log_size)
+
+SCHEMA_HEADER(privhead, PRIVHEAD_FIELDS, BE)
+
+typedef struct _ldm_disk_info {
+    uuid_t guid;
+    uint64_t logical_disk_start;
+    uint64_t logical_disk_size;
+    uint64_t privhead_lba;
+    uint64_t config_start; /* the database, TOCBLOCK to logs */
+    uint64_t config_size;
+} ldm_disk_info;
+
+int parse_ldm(uint64_t start, struct list_head *new_entries);
 int read_mbr_ldm(int fd, struct list_head *new_entries);
 int read_gpt_ldm(int fd, gpt_header *header, gpt_entry **entries,
                  struct list_head *new_entries);
+int ldm_get_logical_disk(uint64_t *start, uint64_t *size);
+int ldm_find_volume(const char *name, uint32_t *id);
+void ldm_print_volumes(void);
+int ldm_find_privhead(int fd, uint64_t *lba);
+int ldm_read_sequence(int fd, uint64_t lba, uint32_t *privhead_seq,
+                      uint64_t *vmdb_seq);
+int ldm_read_disk_info(int fd, ldm_disk_info *info);
+int ldm_read_database(int fd);
+int ldm_read_config(int fd, uint64_t config_start, uint64_t config_sectors);
+void ldm_reset(void);
+struct list_head *ldm_volumes(void);
+struct list_head *ldm_components(void);
+struct list_head *ldm_partitions(void);
+struct list_head *ldm_disks(void);
 
 #endif /* __LDM_H__ */
\ No newline at end of file
@@ -0,0 +1,495 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ldmfs.h"
+
+#ifdef HAVE_FUSE
+
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+
+#include "list.h"
+#include "workq.h"
+
+/*
+ * Every volume of the plan is a read-only file. Reads go through a cache of
+ * LDMFS_CACHE_CHUNKS chunks, and a sequential reader gets a readahead window
+ * that doubles on every sequential read up to LDMFS_READAHEAD_MAX chunks,
+ * loaded by worker threads while the reader consumes the current chunk.
+ */
+#define LDMFS_CHUNK_SIZE (1024 * 1024)
+#define LDMFS_CACHE_CHUNKS 64
+#define LDMFS_READAHEAD_MAX 16
+#define LDMFS_THREADS 4
+
+enum {
+    LDMFS_CHUNK_EMPTY = 0,
+    LDMFS_CHUNK_LOADING,
+    LDMFS_CHUNK_READY,
+};
+
+typedef struct _ldmfs_chunk {
+    struct list_head lru;
+
+    int file;
+    uint64_t index;
+    int state;
+    int refs;
+    int error;
+    uint8_t *data;
+} ldmfs_chunk;
+
+typedef struct _ldmfs_file {
+    const dm_device *dev;
+    const char *name;
+    uint64_t size;
+
+    uint64_t next_offset; /* where a sequential read continues */
+    uint32_t window;      /* readahead, chunks */
+    uint64_t ahead;       /* first chunk not prefetched yet */
+} ldmfs_file;
+
+static const dm_plan *cur_plan;
+static const dm_disk *cur_disks;
+static const int *cur_fds;
+static int cur_nr_disks;
+
+static ldmfs_file *files;
+static int nr_files;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_changed = PTHREAD_COND_INITIALIZER;
+static struct list_head cache_lru = LIST_HEAD_INIT(cache_lru);
+static ldmfs_chunk cache[LDMFS_CACHE_CHUNKS];
+static workq *cache_wq;
+
+static int ldmfs_disk_fd(const char *path) {
+    int i;
+
+    for (i = 0; i < cur_nr_disks; i++) {
+        if (cur_disks[i].path == path)
+            return cur_fds[i];
+    }
+
+    return -1;
+}
+
+static int ldmfs_pread(int fd, uint8_t *buffer, size_t count,
+                       uint64_t offset) {
+    while (count > 0) {
+        ssize_t ret = pread(fd, buffer, count, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -EIO;
+        buffer += ret;
+        offset += ret;
+        count -= ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Translate a range of a device to its disks the way the kernel target
+ * would, and read it. Mirrors are read from their first present leg.
+ */
+static int ldmfs_map_read(const dm_device *dev, uint64_t offset,
+                          uint8_t *buffer, size_t count) {
+    while (count > 0) {
+        const dm_target *t = NULL;
+        const dm_leg *leg;
+        uint64_t rel, len, phys;
+        uint32_t i;
+        int ret;
+
+        for (i = 0; i < dev->nr_targets; i++) {
+            uint64_t start = dev->targets[i].start * DM_SECTOR_SIZE;
+            uint64_t end = start + dev->targets[i].length * DM_SECTOR_SIZE;
+
+            if (offset >= start && offset < end) {
+                t = &dev->targets[i];
+                break;
+            }
+        }
+
+        if (!t)
+            return -EIO;
+
+        rel = offset - t->start * DM_SECTOR_SIZE;
+        len = t->length * DM_SECTOR_SIZE - rel;
+        if (len > count)
+            len = count;
+
+        if (!strcmp(t->type, "raid")) {
+            for (i = 0; i < t->nr_legs && t->legs[i].sub < 0; i++)
+                ;
+            if (i == t->nr_legs)
+                return -EIO;
+
+            ret = ldmfs_map_read(&cur_plan->devices[t->legs[i].sub], rel,
+                                 buffer, len);
+        } else {
+            if (!strcmp(t->type, "striped")) {
+                uint64_t chunk = t->chunk * DM_SECTOR_SIZE;
+                uint64_t stripe = rel / chunk;
+
+                leg = &t->legs[stripe % t->nr_legs];
+                if (len > chunk - rel % chunk)
+                    len = chunk - rel % chunk;
+                phys = leg->offset * DM_SECTOR_SIZE +
+                       stripe / t->nr_legs * chunk + rel % chunk;
+            } else {
+                leg = &t->legs[0];
+                phys = leg->offset * DM_SECTOR_SIZE + rel;
+            }
+
+            ret = ldmfs_pread(ldmfs_disk_fd(leg->path), buffer, len, phys);
+        }
+
+        if (ret)
+            return ret;
+
+        buffer += len;
+        offset += len;
+        count -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Find a cached chunk, or claim the least recently used idle chunk for it.
+ * Called with cache_lock held, returns NULL when every chunk is busy.
+ */
+static ldmfs_chunk *ldmfs_lookup(int file, uint64_t index, int *hit) {
+    ldmfs_chunk *victim = NULL;
+    struct list_head *pos;
+
+    list_for_each(pos, &cache_lru) {
+        ldmfs_chunk *chunk = list_entry(pos, ldmfs_chunk, lru);
+
+        if (chunk->state != LDMFS_CHUNK_EMPTY && chunk->file == file &&
+            chunk->index == index) {
+            list_del(&chunk->lru);
+            list_add(&chunk->lru, &cache_lru);
+            *hit = 1;
+            return chunk;
+        }
+
+        if (!chunk->refs && chunk->state != LDMFS_CHUNK_LOADING)
+            victim = chunk;
+    }
+
+    *hit = 0;
+    if (victim) {
+        victim->file = file;
+        victim->index = index;
+        victim->state = LDMFS_CHUNK_LOADING;
+        victim->error = 0;
+        list_del(&victim->lru);
+        list_add(&victim->lru, &cache_lru);
+    }
+
+    return victim;
+}
+
+static void ldmfs_load(void *arg) {
+    ldmfs_chunk *chunk = arg;
+    const ldmfs_file *f = &files[chunk->file];
+    uint64_t offset = chunk->index * LDMFS_CHUNK_SIZE;
+    size_t length = LDMFS_CHUNK_SIZE;
+    int ret;
+
+    if (length > f->size - offset)
+        length = f->size - offset;
+
+    ret = ldmfs_map_read(f->dev, offset, chunk->data, length);
+
+    pthread_mutex_lock(&cache_lock);
+    chunk->error = ret;
+    chunk->state = ret ? LDMFS_CHUNK_EMPTY : LDMFS_CHUNK_READY;
+    pthread_cond_broadcast(&cache_changed);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static ldmfs_chunk *ldmfs_get(int file, uint64_t index, int *error) {
+    ldmfs_chunk *chunk;
+    int hit;
+
+    pthread_mutex_lock(&cache_lock);
+    while (!(chunk = ldmfs_lookup(file, index, &hit)))
+        pthread_cond_wait(&cache_changed, &cache_lock);
+    chunk->refs++;
+
+    if (!hit) {
+        pthread_mutex_unlock(&cache_lock);
+        ldmfs_load(chunk);
+        pthread_mutex_lock(&cache_lock);
+    }
+
+    while (chunk->state == LDMFS_CHUNK_LOADING)
+        pthread_cond_wait(&cache_changed, &cache_lock);
+
+    if (chunk->state != LDMFS_CHUNK_READY) {
+        *error = chunk->error ? chunk->error : -EIO;
+        chunk->refs--;
+        pthread_cond_broadcast(&cache_changed);
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return chunk;
+}
+
+static void ldmfs_put(ldmfs_chunk *chunk) {
+    pthread_mutex_lock(&cache_lock);
+    chunk->refs--;
+    pthread_cond_broadcast(&cache_changed);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Grow the readahead window of a sequential reader and start loading the
+ * chunks in it, any other access resets the window.
+ */
+static void ldmfs_readahead(int file, uint64_t offset, size_t size) {
+    ldmfs_file *f = &files[file];
+    uint64_t first, last, index;
+
+    pthread_mutex_lock(&cache_lock);
+    if (offset <= f->next_offset &&
+        offset + LDMFS_CHUNK_SIZE >= f->next_offset) {
+        f->window = f->window ? f->window * 2 : 1;
+        if (f->window > LDMFS_READAHEAD_MAX)
+            f->window = LDMFS_READAHEAD_MAX;
+    } else {
+        f->window = 0;
+        f->ahead = 0;
+    }
+    f->next_offset = offset + size;
+
+    first = (offset + size - 1) / LDMFS_CHUNK_SIZE + 1;
+    if (first < f->ahead)
+        first = f->ahead;
+    last = (offset + size - 1) / LDMFS_CHUNK_SIZE + f->window;
+    if (last > (f->size - 1) / LDMFS_CHUNK_SIZE)
+        last = (f->size - 1) / LDMFS_CHUNK_SIZE;
+    if (last >= first)
+        f->ahead = last + 1;
+    pthread_mutex_unlock(&cache_lock);
+
+    for (index = first; index <= last; index++) {
+        ldmfs_chunk *chunk;
+        int hit;
+
+        pthread_mutex_lock(&cache_lock);
+        chunk = ldmfs_lookup(file, index, &hit);
+        pthread_mutex_unlock(&cache_lock);
+
+        if (!chunk)
+            break;
+        if (!hit && (!cache_wq || workq_submit(cache_wq, ldmfs_load, chunk)))
+            ldmfs_load(chunk);
+    }
+}
+
+static int ldmfs_find(const char *path) {
+    int i;
+
+    for (i = 0; i < nr_files; i++) {
+        if (path[0] == '/' && !strcmp(path + 1, files[i].name))
+            return i;
+    }
+
+    return -1;
+}
+
+static void *ldmfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    cfg->kernel_cache = 1;
+
+    /* after fuse_main has daemonized, threads do not survive the fork */
+    cache_wq = workq_create(LDMFS_THREADS, LDMFS_READAHEAD_MAX);
+
+    return NULL;
+}
+
+static int ldmfs_getattr(const char *path, struct stat *st,
+                         struct fuse_file_info *fi) {
+    int file;
+
+    memset(st, 0, sizeof(*st));
+    if (!strcmp(path, "/")) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+
+    file = ldmfs_find(path);
+    if (file < 0)
+        return -ENOENT;
+
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = files[file].size;
+    st->st_blksize = LDMFS_CHUNK_SIZE;
+
+    return 0;
+}
+
+static int ldmfs_readdir(const char *path, void *buffer,
+                         fuse_fill_dir_t filler, off_t offset,
+                         struct fuse_file_info *fi,
+                         enum fuse_readdir_flags flags) {
+    int i;
+
+    if (strcmp(path, "/"))
+        return -ENOENT;
+
+    filler(buffer, ".", NULL, 0, 0);
+    filler(buffer, "..", NULL, 0, 0);
+    for (i = 0; i < nr_files; i++)
+        filler(buffer, files[i].name, NULL, 0, 0);
+
+    return 0;
+}
+
+static int ldmfs_open(const char *path, struct fuse_file_info *fi) {
+    int file = ldmfs_find(path);
+
+    if (file < 0)
+        return -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+
+    fi->fh = file;
+    fi->keep_cache = 1;
+
+    return 0;
+}
+
+static int ldmfs_read(const char *path, char *buffer, size_t size,
+                      off_t offset, struct fuse_file_info *fi) {
+    int file = fi->fh, error = 0;
+    const ldmfs_file *f = &files[file];
+    size_t done = 0;
+
+    if (offset >= f->size)
+        return 0;
+    if (size > f->size - offset)
+        size = f->size - offset;
+
+    ldmfs_readahead(file, offset, size);
+
+    while (done < size) {
+        uint64_t pos = offset + done;
+        size_t within = pos % LDMFS_CHUNK_SIZE;
+        size_t len = LDMFS_CHUNK_SIZE - within;
+        ldmfs_chunk *chunk;
+
+        if (len > size - done)
+            len = size - done;
+
+        chunk = ldmfs_get(file, pos / LDMFS_CHUNK_SIZE, &error);
+        if (!chunk)
+            return done ? done : error;
+
+        memcpy(buffer + done, chunk->data + within, len);
+        ldmfs_put(chunk);
+        done += len;
+    }
+
+    return done;
+}
+
+static const struct fuse_operations ldmfs_ops = {
+    .init = ldmfs_init,
+    .getattr = ldmfs_getattr,
+    .readdir = ldmfs_readdir,
+    .open = ldmfs_open,
+    .read = ldmfs_read,
+};
+
+int ldmfs_mount(const dm_plan *plan, const dm_disk *disks, const int *fds,
+                int nr_disks, int argc, char *argv[]) {
+    uint32_t i, j;
+    int ret = -1;
+
+    cur_plan = plan;
+    cur_disks = disks;
+    cur_fds = fds;
+    cur_nr_disks = nr_disks;
+
+    files = calloc(plan->nr_devices, sizeof(ldmfs_file));
+    if (!files) {
+        printf("Error: failed to malloc\n");
+        return -1;
+    }
+
+    for (i = 0; i < plan->nr_devices; i++) {
+        const dm_device *dev = &plan->devices[i];
+        ldmfs_file *f = &files[nr_files];
+        int supported = 1;
+
+        if (!dev->volume)
+            continue;
+
+        for (j = 0; j < dev->nr_targets; j++) {
+            const dm_target *t = &dev->targets[j];
+
+            if ((t->level && strcmp(t->level, "raid1")) ||
+                (!strcmp(t->type, "striped") && !t->chunk))
+                supported = 0;
+            if ((t->start + t->length) * DM_SECTOR_SIZE > f->size)
+                f->size = (t->start + t->length) * DM_SECTOR_SIZE;
+        }
+
+        if (!supported || !f->size) {
+            printf("Info: %s is not exposed, RAID-5 needs d2b dm\n",
+                   dev->name);
+            f->size = 0;
+            continue;
+        }
+
+        f->dev = dev;
+        f->name = dev->name + strlen("ldm_");
+        nr_files++;
+    }
+
+    for (i = 0; i < LDMFS_CACHE_CHUNKS; i++) {
+        if (posix_memalign((void **)&cache[i].data, 4096, LDMFS_CHUNK_SIZE)) {
+            printf("Error: failed to malloc\n");
+            goto out;
+        }
+        list_add_tail(&cache[i].lru, &cache_lru);
+    }
+
+    ret = fuse_main(argc, argv, &ldmfs_ops, NULL);
+
+    if (cache_wq) {
+        workq_wait(cache_wq);
+        workq_destroy(cache_wq);
+    }
+
+out:
+    for (i = 0; i < LDMFS_CACHE_CHUNKS; i++)
+        free(cache[i].data);
+    free(files);
+    return ret;
+}
+
+#else
+
+int ldmfs_mount(const dm_plan *plan, const dm_disk *disks, const int *fds,
+                int nr_disks, int argc, char *argv[]) {
+    printf("Error: d2b is built without fuse, rebuild with make FUSE=1\n");
+    return -1;
+}
+
+#endif /* HAVE_FUSE */
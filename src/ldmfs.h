@@ -0,0 +1,9 @@
+#ifndef __LDMFS_H__
+#define __LDMFS_H__
+
+#include "dm.h"
+
+int ldmfs_mount(const dm_plan *plan, const dm_disk *disks, const int *fds,
+                int nr_disks, int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,83 @@
+#include "d2b.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The modules print their diagnostics with printf(), which the compiler may
+ * turn into puts() or putchar(). libd2b is linked with the LOGFLAGS of the
+ * Makefile, which send those calls here, and the text goes to the handler
+ * of d2b_set_log() or nowhere, never to the stdout of the caller. The d2b
+ * command is linked without them and prints as before.
+ */
+static d2b_log_fn log_fn;
+static void *log_arg;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Hand the text the library prints to fn, a line or part of one at a time,
+ * NULL to drop it. Calls of fn are serialized.
+ */
+void d2b_set_log(d2b_log_fn fn, void *arg) {
+    pthread_mutex_lock(&log_lock);
+    log_fn = fn;
+    log_arg = arg;
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void log_text(const char *text) {
+    pthread_mutex_lock(&log_lock);
+    if (log_fn)
+        log_fn(log_arg, text);
+    pthread_mutex_unlock(&log_lock);
+}
+
+int __wrap_printf(const char *format, ...) {
+    char buffer[256], *text = buffer;
+    va_list ap;
+    int len;
+
+    va_start(ap, format);
+    len = vsnprintf(buffer, sizeof(buffer), format, ap);
+    va_end(ap);
+    if (len < 0)
+        return len;
+
+    /* a long message, e.g. a dmsetup table */
+    if ((size_t)len >= sizeof(buffer)) {
+        text = malloc(len + 1);
+        if (!text)
+            return -1;
+        va_start(ap, format);
+        vsnprintf(text, len + 1, format, ap);
+        va_end(ap);
+    }
+
+    log_text(text);
+    if (text != buffer)
+        free(text);
+    return len;
+}
+
+int __wrap_puts(const char *s) {
+    size_t len = strlen(s);
+    char *text = malloc(len + 2);
+
+    if (!text)
+        return EOF;
+    memcpy(text, s, len);
+    memcpy(text + len, "\n", 2);
+    log_text(text);
+    free(text);
+    return len + 1;
+}
+
+int __wrap_putchar(int c) {
+    char text[2] = { (char)c, '\0' };
+
+    log_text(text);
+    return (unsigned char)c;
+}
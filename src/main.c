@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <linux/fs.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,238 +11,1015 @@
 #include <unistd.h>
 #include <zlib.h>
 
+#include "align.h"
+#include "backup.h"
+#include "bdev.h"
+#include "clone.h"
+#include "d2b.h"
+#include "daemon.h"
+#include "dm.h"
+#include "export.h"
 #include "gpt.h"
+#include "latency.h"
 #include "ldm.h"
+#include "ldmfs.h"
 #include "list.h"
 #include "mbr.h"
+#include "memdev.h"
+#include "scan.h"
+#include "spindle.h"
+#include "stats.h"
+#include "throttle.h"
+#include "trace.h"
+#include "verify.h"
+#include "workq.h"
 
-int saveGPT(int fd, gpt_entry *entries, struct list_head *new_entries) {
+static int realign = 0;
+static int full_copy = 0;
+static int verify_moves = 0;
+static int reclaim = 0; /* D2B_COMMIT_RECLAIM flags */
+static const char *align_journal = D2B_DEFAULT_JOURNAL;
+static int assume_yes = 0;
+static const char *backup_path = NULL;
+static int backup_ldm = 0;
+static const char *clone_path = NULL;
+static int trace_fd = -1;
+static int memdev_fd = -1;
+
+/*
+ * Ask for "yes" on stdin, unless -y was given.
+ */
+static int confirm(void) {
     char input[128];
-    int i;
-    int isOK = 1;
-    gpt_header main_header, second_header;
-    gpt_entry zero_entry = { 0 };
-    uint64_t entries_size;
-    uint32_t crc;
 
-    if (read_main_header(fd, &main_header) != 0 ||
-        read_second_header(fd, &second_header) != 0) {
-        printf("Error: failed to read main header or secondary header\n");
+    if (assume_yes)
+        return 1;
+    if (scanf("%127s", input) != 1)
+        return 0;
+
+    return !strcmp(input, "yes");
+}
+
+static void print_partition(int i, const d2b_extent *part) {
+    printf("partion %d start=%lu end=%lu size=%lu part type=%d", i,
+           part->start, part->start + part->size - 1, part->size,
+           part->part_type);
+    if (part->start != part->old_start)
+        printf(" (moved from %lu)", part->old_start);
+    printf("\n");
+}
+
+/*
+ * The sectors written to the device, those that no longer share blocks with
+ * the snapshots and clones of a thin LUN.
+ */
+static void print_dirty(int fd) {
+    const bdev_range *ranges;
+    uint64_t total = 0, unchanged;
+    size_t i, nr;
+
+    bdev_get_dirty(fd, &ranges, &nr, &unchanged);
+    for (i = 0; i < nr; i++)
+        total += ranges[i].sectors;
+
+    printf("Info: wrote %lu sectors in %zu runs, %lu were already up to "
+           "date\n",
+           total, nr, unchanged);
+    for (i = 0; i < nr; i++)
+        printf("  lba %lu-%lu\n", ranges[i].lba,
+               ranges[i].lba + ranges[i].sectors - 1);
+}
+
+/*
+ * Convert a probed disk: place the partitions, show them and write the new
+ * table once confirmed.
+ */
+static int convert(d2b_dev *d, int fd, const char *dev) {
+    const d2b_extent *extents;
+    size_t i, nr_extents;
+    int err;
+
+    err = d2b_plan(d, realign ? D2B_PLAN_ALIGN : 0);
+    if (err == D2B_ERR_UNSUPPORTED) {
+        d2b_extents(d, &extents, &nr_extents);
+        printf("Error: found %zu partitions, currently does not support "
+               "extended partitions.\n",
+               nr_extents);
+        return err;
+    }
+    if (err) {
+        printf("Error: %s.\n", d2b_strerror(err));
+        return err;
+    }
+
+    d2b_extents(d, &extents, &nr_extents);
+    for (i = 0; i < nr_extents; i++)
+        print_partition(i, &extents[i]);
+
+    printf("Warning, are you sure to save the new partition table shown above? "
+           "(yes or no)\n");
+    if (!confirm()) {
+        printf("exit.\n");
+        exit(0);
+    }
+
+    if (backup_path) {
+        err = d2b_backup(d, backup_path, dev,
+                         backup_ldm ? D2B_BACKUP_LDM : 0);
+        if (err) {
+            printf("Error: failed to back up the table, %s.\n",
+                   d2b_strerror(err));
+            return err;
+        }
+    }
+
+    err = d2b_commit(d, align_journal,
+                     (full_copy ? D2B_COMMIT_FULL_COPY : 0) |
+                         (verify_moves ? D2B_COMMIT_VERIFY : 0) | reclaim);
+    if (err)
+        printf("Error: %s.\n", d2b_strerror(err));
+    /* what was written, partly written too */
+    print_dirty(fd);
+
+    return err;
+}
+
+/*
+ * Read the LDM database of a device without changing anything.
+ */
+static int probe_ldm(int fd, const char *dev, struct list_head *new_entries) {
+    legacy_mbr mbr;
+    int ret;
+
+    if (read_mbr(fd, &mbr) != MBR_ERROR_OK) {
+        printf("Error: failed to read mbr\n");
         return -1;
     }
 
-    if ((main_header.partition_entry_array_crc32 !=
-         second_header.partition_entry_array_crc32) ||
-        (main_header.alternate_lba != second_header.current_lba) ||
-        (main_header.current_lba != second_header.alternate_lba) ||
-        (main_header.header_crc32 != 0) || (second_header.header_crc32 != 0)) {
-        printf("Error: gpt header not match");
+    switch (mbr.partition[0].os_type) {
+    case MBR_PART_EFI_PROTECTIVE: {
+        gpt_header header;
+        gpt_entry *entries = NULL;
+
+        ret = read_gpt_ldm(fd, &header, &entries, new_entries);
+        if (entries)
+            free(entries);
+    } break;
+    case MBR_PART_WINDOWS_LDM:
+        ret = read_mbr_ldm(fd, new_entries);
+        break;
+    default:
+        printf("Info: Device %s is not a valid LDM disk\n", dev);
         return -1;
     }
 
-    // clear ldm entry
-    for (i = 0; i < le32toh(main_header.num_partition_entries); i++) {
-        if (!uuid_compare(entries[i].type, PARTITION_LDM_DATA_GUID) ||
-            !uuid_compare(entries[i].type, PARTITION_LDM_METADATA_GUID)) {
-            memset(&entries[i], 0, sizeof(gpt_entry));
+    if (ret)
+        printf("Error: read ldm info failed.\n");
+
+    return ret;
+}
+
+static void free_entries(struct list_head *new_entries) {
+    struct list_head *pos, *next;
+
+    list_for_each_safe(pos, next, new_entries) {
+        partition_data *part = list_entry(pos, partition_data, list);
+        free(part);
+    }
+}
+
+/* --limit, --iops and --ioprio, for the commands that read data in bulk */
+static int throttle_option(int opt, const char *arg) {
+    uint64_t bytes_per_sec;
+    uint32_t iops;
+
+    throttle_get(&bytes_per_sec, &iops);
+    switch (opt) {
+    case 'W':
+        if (throttle_parse_rate(arg, &bytes_per_sec)) {
+            printf("Error: bad rate %s, e.g. 50M for 50 MiB/s\n", arg);
+            return -1;
         }
+        break;
+    case 'O':
+        iops = atoi(arg);
+        break;
+    case 'P':
+        return throttle_set_ioprio(arg);
     }
 
-    // update entry
-    struct list_head *pos;
-    i = 0;
-    list_for_each(pos, new_entries) {
-        partition_data *part = list_entry(pos, partition_data, list);
-        printf("partion %d start=%lu size=%lu part type=%d\n", i++, part->start,
-               part->size, part->part_type);
+    throttle_set(bytes_per_sec, iops);
+    return 0;
+}
+
+static int cmd_export(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "full-copy", no_argument, NULL, 'f' },
+        { "zstd", optional_argument, NULL, 'z' },
+        { "threads", required_argument, NULL, 't' },
+        { "verify", required_argument, NULL, 'V' },
+        { "limit", required_argument, NULL, 'W' },
+        { "iops", required_argument, NULL, 'O' },
+        { "ioprio", required_argument, NULL, 'P' },
+        { "timeout", required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 },
+    };
+    struct list_head new_entries = LIST_HEAD_INIT(new_entries);
+    const char *manifest = NULL;
+    uint32_t volume_id;
+    int opt, fd, ret = -1;
+    int zstd_level = 0, nr_threads = 0;
+
+    while ((opt = getopt_long(argc, argv, "fz::t:", long_options, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 'f':
+            full_copy = 1;
+            break;
+        case 'z':
+            zstd_level = optarg ? atoi(optarg) : 3;
+            break;
+        case 'V':
+            manifest = optarg;
+            break;
+        case 't':
+            nr_threads = atoi(optarg);
+            break;
+        case 'D':
+            bdev_set_timeout(atoi(optarg));
+            break;
+        case 'W':
+        case 'O':
+        case 'P':
+            if (throttle_option(opt, optarg))
+                return -1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
     }
 
-    printf("Warning, are you sure to save the new partition table shown above? "
-           "(yes or no)\n");
-    scanf("%s", input);
-    if (strcmp(input, "yes")) {
-        printf("exit.\n");
-        exit(0);
+    if (optind != argc - 3 || (manifest && zstd_level)) {
+        printf("Usage: d2b export [-f] [-z[level]] [-t threads] [--limit RATE] "
+               "[--iops N]\n"
+               "                  [--ioprio CLASS] [--verify MANIFEST] "
+               "[--timeout MSEC]\n"
+               "                  /dev/device volume image\n"
+               "  --verify does not go with -z\n");
+        return -1;
     }
 
-    i = 0;
-    list_for_each(pos, new_entries) {
-        partition_data *part = list_entry(pos, partition_data, list);
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1) {
+        printf("Error: failed to open %s, errno is %d\n", argv[optind], errno);
+        return -1;
+    }
 
-        for (i = 0; i < le32toh(main_header.num_partition_entries); i++) {
-            if (!memcmp(&entries[i], &zero_entry, sizeof(gpt_entry))) {
-                gpt_entry *entry = &entries[i];
-                uuid_copy(entry->type, PARTITION_BASIC_DATA_GUID);
-                uuid_generate_random(entry->guid);
-                entry->first_lba = part->start;
-                entry->last_lba = part->start + part->size - 1;
-                entry->flags = 0;
-                int a = sizeof(entry->name);
-                memset(entry->name, 0, sizeof(entry->name));
-                break;
-            }
+    if (!probe_ldm(fd, argv[optind], &new_entries)) {
+        if (ldm_find_volume(argv[optind + 1], &volume_id)) {
+            printf("Error: not found volume %s, volumes are:\n",
+                   argv[optind + 1]);
+            ldm_print_volumes();
+        } else if (zstd_level) {
+            ret = export_volume_zstd(fd, &new_entries, volume_id,
+                                     argv[optind + 2], full_copy, zstd_level,
+                                     nr_threads);
+        } else {
+            ret = export_volume(fd, &new_entries, volume_id, argv[optind + 2],
+                                full_copy, manifest);
         }
     }
 
-    // generate new crc
-    entries_size = le32toh(main_header.num_partition_entries) *
-                   le32toh(main_header.sizeof_partition_entry);
-    crc = crc32(0, (const Bytef *)entries, entries_size);
-    second_header.partition_entry_array_crc32 = crc;
-    main_header.partition_entry_array_crc32 = crc;
+    free_entries(&new_entries);
+    close(fd);
+
+    return ret;
+}
+
+/*
+ * Open the disks of a group and build the mapping of its volumes. Every disk
+ * carries the same database, members on disks that are not given are mapped
+ * as missing where redundancy allows.
+ */
+static int open_disk_group(int nr_disks, char *paths[], dm_disk **disks,
+                           int **fds, dm_plan *plan) {
+    int i;
 
-    // save
-    if (write_gpt_entry(fd, &second_header, entries, entries_size) !=
-        entries_size) {
-        printf("Error: failed to save alternate entries\n");
+    *disks = calloc(nr_disks, sizeof(dm_disk));
+    *fds = calloc(nr_disks, sizeof(int));
+    if (!*disks || !*fds) {
+        printf("Error: failed to malloc\n");
         return -1;
     }
 
-    if (write_gpt_header(fd, &second_header) != sizeof(gpt_header)) {
-        printf("Error: failed to save alternate header\n");
+    for (i = 0; i < nr_disks; i++)
+        (*fds)[i] = -1;
+
+    for (i = 0; i < nr_disks; i++) {
+        dm_disk *disk = &(*disks)[i];
+        ldm_disk_info info;
+
+        disk->path = paths[i];
+        (*fds)[i] = open(disk->path, O_RDONLY);
+        if ((*fds)[i] == -1) {
+            printf("Error: failed to open %s, errno is %d\n", disk->path,
+                   errno);
+            return -1;
+        }
+
+        if (ldm_read_disk_info((*fds)[i], &info)) {
+            printf("Info: Device %s is not a valid LDM disk\n", disk->path);
+            return -1;
+        }
+
+        uuid_copy(disk->guid, info.guid);
+        disk->data_start = info.logical_disk_start;
+        disk->sector_size = bdev_get_sector_size((*fds)[i]);
+    }
+
+    if (ldm_read_database((*fds)[0])) {
+        printf("Error: read ldm info failed.\n");
         return -1;
     }
 
-    if (write_gpt_entry(fd, &main_header, entries, entries_size) !=
-        entries_size) {
-        printf("Error: failed to save main entries\n");
+    return dm_build_plan(*disks, nr_disks, plan);
+}
+
+static void close_disk_group(int nr_disks, dm_disk *disks, int *fds) {
+    int i;
+
+    for (i = 0; fds && i < nr_disks; i++) {
+        if (fds[i] >= 0) {
+            bdev_forget(fds[i]);
+            close(fds[i]);
+        }
+    }
+    free(fds);
+    free(disks);
+}
+
+/*
+ * Map the volumes of a disk group with device-mapper, the disks are left
+ * untouched.
+ */
+static int cmd_dm(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "load", no_argument, NULL, 'l' },
+        { "timeout", required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 },
+    };
+    dm_disk *disks = NULL;
+    int *fds = NULL;
+    int opt, load = 0, nr_disks, ret = -1;
+    dm_plan plan;
+
+    while ((opt = getopt_long(argc, argv, "l", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'l':
+            load = 1;
+            break;
+        case 'D':
+            bdev_set_timeout(atoi(optarg));
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind >= argc) {
+        printf("Usage: d2b dm [-l] [--timeout MSEC] /dev/device "
+               "[/dev/device...]\n");
         return -1;
     }
 
-    if (write_gpt_header(fd, &main_header) != sizeof(gpt_header)) {
-        printf("Error: failed to save main header\n");
+    nr_disks = argc - optind;
+    if (!open_disk_group(nr_disks, argv + optind, &disks, &fds, &plan)) {
+        if (load) {
+            ret = dm_load_plan(&plan);
+        } else {
+            dm_print_plan(&plan);
+            ret = 0;
+        }
+        dm_free_plan(&plan);
+    }
+
+    close_disk_group(nr_disks, disks, fds);
+    return ret;
+}
+
+/*
+ * Mount the volumes of a disk group as read-only files with FUSE, for hosts
+ * where device-mapper is not available.
+ */
+static int cmd_mount(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "foreground", no_argument, NULL, 'f' },
+        { "options", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 },
+    };
+    char *fuse_argv[6];
+    char options[256];
+    const char *extra = NULL;
+    dm_disk *disks = NULL;
+    int *fds = NULL;
+    int opt, foreground = 0, nr_disks, fuse_argc = 0, ret = -1;
+    dm_plan plan;
+
+    while ((opt = getopt_long(argc, argv, "fo:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            foreground = 1;
+            break;
+        case 'o':
+            extra = optarg;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind >= argc - 1) {
+        printf("Usage: d2b mount [-f] [-o options] /dev/device "
+               "[/dev/device...] mountpoint\n");
         return -1;
     }
 
-    return 0;
+    snprintf(options, sizeof(options), "ro%s%s", extra ? "," : "",
+             extra ? extra : "");
+    fuse_argv[fuse_argc++] = "d2b";
+    fuse_argv[fuse_argc++] = argv[argc - 1];
+    fuse_argv[fuse_argc++] = "-o";
+    fuse_argv[fuse_argc++] = options;
+    if (foreground)
+        fuse_argv[fuse_argc++] = "-f";
+    fuse_argv[fuse_argc] = NULL;
+
+    nr_disks = argc - optind - 1;
+    if (!open_disk_group(nr_disks, argv + optind, &disks, &fds, &plan)) {
+        ret = ldmfs_mount(&plan, disks, fds, nr_disks, fuse_argc, fuse_argv);
+        dm_free_plan(&plan);
+    }
+
+    close_disk_group(nr_disks, disks, fds);
+    return ret;
 }
 
-int saveMBR(int fd, legacy_mbr *mbr, struct list_head *new_entries) {
-    char input[128];
-    int i = 0;
-    struct list_head *pos;
+/*
+ * Serve probe, plan and convert requests on a Unix socket, keeping the probed
+ * disks between requests.
+ */
+static int cmd_daemon(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "socket", required_argument, NULL, 's' },
+        { "threads", required_argument, NULL, 't' },
+        { "limit", required_argument, NULL, 'W' },
+        { "iops", required_argument, NULL, 'O' },
+        { "ioprio", required_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *path = DAEMON_DEFAULT_SOCKET;
+    int opt, nr_threads = 0;
 
-    list_for_each(pos, new_entries) {
-        partition_data *part = list_entry(pos, partition_data, list);
-        printf("partion %d start=%lu end=%lu size=%lu part type=%d\n", i++,
-               part->start, part->start + part->size - 1, part->size,
-               part->part_type);
+    while ((opt = getopt_long(argc, argv, "s:t:", long_options, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 's':
+            path = optarg;
+            break;
+        case 't':
+            nr_threads = atoi(optarg);
+            break;
+        case 'W':
+        case 'O':
+        case 'P':
+            if (throttle_option(opt, optarg))
+                return -1;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
     }
 
-    if (i > 4) {
-        printf("Error: found %d partitions, currently does not support "
-               "extended partitions.\n",
-               i);
+    if (optind != argc) {
+        printf("Usage: d2b daemon [-s socket] [-t threads] [--limit RATE] "
+               "[--iops N]\n"
+               "                  [--ioprio CLASS]\n");
         return -1;
     }
 
-    printf("Warning, are you sure to save the new partition table shown above? "
-           "(yes or no)\n");
-    scanf("%s", input);
-    if (strcmp(input, "yes")) {
-        printf("exit.\n");
-        exit(0);
+    if (nr_threads <= 0)
+        nr_threads = workq_default_threads();
+
+    return daemon_run(path, nr_threads);
+}
+
+/*
+ * Put back the sectors saved by --backup, by default the last snapshot taken
+ * of the same device.
+ */
+static int cmd_restore(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "list", no_argument, NULL, 'l' },
+        { "snapshot", required_argument, NULL, 's' },
+        { "name", required_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *name = NULL;
+    int opt, fd, list = 0, snapshot = -1, ret;
+
+    while ((opt = getopt_long(argc, argv, "ls:n:", long_options, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 'l':
+            list = 1;
+            break;
+        case 's':
+            snapshot = atoi(optarg);
+            break;
+        case 'n':
+            name = optarg;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
     }
 
-    i = 0;
-    list_for_each(pos, new_entries) {
-        partition_data *part = list_entry(pos, partition_data, list);
+    if (list && optind == argc - 1)
+        return backup_list(argv[optind]);
 
-        mbr_partition *mbr_part = &(mbr->partition[i++]);
-        mbr_part->boot_indicator = 0x0;
-        calcCHS(part->start, &mbr_part->start_track, &mbr_part->start_head,
-                &mbr_part->start_sector);
-        mbr_part->os_type = part->part_type;
-        calcCHS(part->start + part->size, &mbr_part->end_track,
-                &mbr_part->end_head, &mbr_part->end_sector);
-        mbr_part->starting_lba = part->start;
-        mbr_part->size_in_lba = part->size;
+    if (optind != argc - 2) {
+        printf("Usage: d2b restore [-s snapshot] [-n name] backup "
+               "/dev/device\n"
+               "       d2b restore -l backup\n");
+        return -1;
     }
 
-    if (write_mbr(fd, mbr) != sizeof(legacy_mbr)) {
-        printf("Error: failed to save mbr.\n");
+    fd = open(argv[optind + 1], O_RDWR);
+    if (fd == -1) {
+        printf("Error: failed to open %s, errno is %d\n", argv[optind + 1],
+               errno);
         return -1;
     }
 
-    return 0;
+    bdev_track_writes(fd);
+    ret = backup_restore(fd, argv[optind], name ? name : argv[optind + 1],
+                         snapshot);
+    print_dirty(fd);
+    bdev_untrack_writes(fd);
+    close(fd);
+
+    return ret;
 }
 
-int main(int argc, char *argv[]) {
-    char input[128];
-    if (argc != 2) {
-        printf("Usage: b2c /dev/device\n");
+/*
+ * Look for LDM databases by their signatures over the whole disk, for when
+ * the PRIVHEAD or the partition that holds it is damaged.
+ */
+static int cmd_scan(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "streams", required_argument, NULL, 's' },
+        { "timeout", required_argument, NULL, 'D' },
+        { "limit", required_argument, NULL, 'W' },
+        { "iops", required_argument, NULL, 'O' },
+        { "ioprio", required_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 },
+    };
+    int opt, i, nr_disks, *fds, nr_threads = 0, streams = 0, ret = -1;
+
+    while ((opt = getopt_long(argc, argv, "t:s:", long_options, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 't':
+            nr_threads = atoi(optarg);
+            break;
+        case 's':
+            streams = atoi(optarg);
+            break;
+        case 'D':
+            bdev_set_timeout(atoi(optarg));
+            break;
+        case 'W':
+        case 'O':
+        case 'P':
+            if (throttle_option(opt, optarg))
+                return -1;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    if (optind >= argc) {
+        printf("Usage: d2b scan [-t threads] [-s streams] [--timeout MSEC] "
+               "[--limit RATE]\n"
+               "                [--iops N] [--ioprio CLASS] /dev/device "
+               "[/dev/device...]\n");
         return -1;
     }
 
-    printf("Warning, please use other tools to save the partition table "
-           "first!!!\n");
-    printf("continue? (yes or no)\n");
-    scanf("%s", input);
-    if (strcmp(input, "yes")) {
-        printf("exit.\n");
-        return 0;
+    nr_disks = argc - optind;
+    if (streams <= 0)
+        streams = SPINDLE_DEFAULT_STREAMS;
+    /* by default, enough workers to keep every disk busy */
+    if (nr_threads <= 0) {
+        nr_threads = workq_default_threads();
+        if (nr_threads < nr_disks * streams)
+            nr_threads = nr_disks * streams;
+    }
+
+    fds = calloc(nr_disks, sizeof(int));
+    if (!fds) {
+        printf("Error: failed to malloc\n");
+        return -1;
     }
 
-    char *dev = argv[1];
+    for (i = 0; i < nr_disks; i++) {
+        fds[i] = open(argv[optind + i], O_RDONLY);
+        if (fds[i] == -1) {
+            printf("Error: failed to open %s, errno is %d\n", argv[optind + i],
+                   errno);
+            goto out;
+        }
+    }
 
-    extern int errno;
-    legacy_mbr mbr;
+    ret = scan_disks(fds, argv + optind, nr_disks, nr_threads, streams);
 
-    struct list_head new_entries = LIST_HEAD_INIT(new_entries);
-    struct list_head *pos, *next;
+out:
+    while (i--) {
+        bdev_forget(fds[i]);
+        close(fds[i]);
+    }
+    free(fds);
+
+    return ret;
+}
+
+/*
+ * Check a target against the manifest of the export or move that wrote it,
+ * all of it or a range of its chunks.
+ */
+static int cmd_verify(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "range", required_argument, NULL, 'r' },
+        { "limit", required_argument, NULL, 'W' },
+        { "iops", required_argument, NULL, 'O' },
+        { "ioprio", required_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 },
+    };
+    uint64_t first = 0, count = 0;
+    int opt, fd, nr_threads = 0, ret;
+    char *end;
+
+    while ((opt = getopt_long(argc, argv, "t:r:", long_options, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 't':
+            nr_threads = atoi(optarg);
+            break;
+        case 'r':
+            first = strtoull(optarg, &end, 10);
+            if (*end == ':')
+                count = strtoull(end + 1, &end, 10);
+            if (*end)
+                optind = argc + 1;
+            break;
+        case 'W':
+        case 'O':
+        case 'P':
+            if (throttle_option(opt, optarg))
+                return -1;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    if (optind != argc - 2) {
+        printf("Usage: d2b verify [-t threads] [-r first[:count]] manifest "
+               "/dev/device|image\n");
+        return -1;
+    }
 
-    // open device
-    const int fd = open(dev, O_RDWR);
+    if (nr_threads <= 0)
+        nr_threads = workq_default_threads();
+
+    fd = open(argv[optind + 1], O_RDONLY);
     if (fd == -1) {
-        printf("Error: failed to open %s, errno is %d\n", dev, errno);
+        printf("Error: failed to open %s, errno is %d\n", argv[optind + 1],
+               errno);
         return -1;
     }
 
-    // read mbr first
-    if (read_mbr(fd, &mbr) != MBR_ERROR_OK) {
-        printf("Error: failed to read mbr\n");
+    ret = verify_audit(fd, argv[optind], nr_threads, first, count);
+    close(fd);
+
+    return ret;
+}
+
+/*
+ * Replace the fd of an image by one of a clone of it at path, which the
+ * conversion then writes instead.
+ */
+static int open_clone(int fd, const char *path) {
+    struct stat in_st, out_st;
+    int out;
+
+    out = open(path, O_RDWR | O_CREAT, 0644);
+    if (out == -1) {
+        printf("Error: failed to create %s, errno is %d\n", path, errno);
         return -1;
     }
 
-    switch (mbr.partition[0].os_type) {
-    case MBR_PART_EFI_PROTECTIVE: {
-        printf("Info: Device %s use GPT\n", dev);
-        gpt_header header;
-        gpt_entry *entries = NULL;
+    if (fstat(fd, &in_st) || fstat(out, &out_st) ||
+        (in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino)) {
+        printf("Error: %s is the image itself\n", path);
+        goto error;
+    }
 
-        if (read_gpt_ldm(fd, &header, &entries, &new_entries)) {
-            printf("Error: read gpt ldm info failed.\n");
-        } else {
-            if (saveGPT(fd, entries, &new_entries)) {
-                printf("Error: save gpt failed.\n");
+    if (ftruncate(out, 0) || clone_image(fd, out))
+        goto error;
+
+    close(fd);
+    return out;
+
+error:
+    close(out);
+    return -1;
+}
+
+static void close_trace(void) {
+    trace_close(trace_fd);
+}
+
+static void close_memdev(void) {
+    memdev_detach(memdev_fd);
+}
+
+static void print_stats(void) {
+    stats_print_json(stderr);
+}
+
+static void usage(void) {
+    printf("Usage: d2b [options] /dev/device\n"
+           "       d2b export [-f] [-z[level]] [-t threads] /dev/device volume "
+           "image\n"
+           "       d2b dm [-l] /dev/device [/dev/device...]\n"
+           "       d2b mount [-f] [-o options] /dev/device [/dev/device...] "
+           "mountpoint\n"
+           "       d2b daemon [-s socket] [-t threads]\n"
+           "       d2b restore [-l] [-s snapshot] [-n name] backup "
+           "[/dev/device]\n"
+           "       d2b scan [-t threads] [-s streams] /dev/device "
+           "[/dev/device...]\n"
+           "       d2b verify [-t threads] [-r first[:count]] manifest "
+           "/dev/device|image\n"
+           "  export, scan, verify and daemon also take --limit, --iops and "
+           "--ioprio\n"
+           "  dm, scan and export also take --timeout\n"
+           "  -a, --align          move misaligned partitions to physical "
+           "block/optimal io boundaries\n"
+           "  -j, --journal FILE   journal used to resume an interrupted move "
+           "(default: " D2B_DEFAULT_JOURNAL ")\n"
+           "  -f, --full-copy      move every sector, not only the clusters "
+           "used by NTFS\n"
+           "      --verify         read moved data back and compare it, the "
+           "hashes go to\n"
+           "                       the journal path + " D2B_MANIFEST_EXT "\n"
+           "      --reclaim[=zero] discard the sectors left outside the new "
+           "partitions,\n"
+           "                       or zero them\n"
+           "  -y, --yes            do not ask for confirmation\n"
+           "  -b, --backup FILE    save the sectors to be overwritten into "
+           "FILE first\n"
+           "      --backup-ldm     with --backup, save the LDM database "
+           "too\n"
+           "  -c, --clone FILE     convert a reflink clone or copy of the "
+           "image in FILE,\n"
+           "                       the image is left untouched\n"
+           "  -s, --sector-size N  sector size of a disk image (default: "
+           "512)\n"
+           "      --stats json     print per-phase statistics to stderr at "
+           "exit\n"
+           "      --trace FILE     record the sectors read and written into "
+           "FILE\n"
+           "      --replay         the device is a trace, served from "
+           "memory\n"
+           "      --memdev OPTS    serve the device from memory with injected "
+           "faults,\n"
+           "                       --memdev help lists the options\n"
+           "      --limit RATE     read at most RATE bytes/s when moving "
+           "data, e.g. 50M\n"
+           "      --iops N         issue at most N reads/s when moving data\n"
+           "      --ioprio CLASS   I/O priority: idle, be or be:0-7\n"
+           "      --timeout MSEC   fail a device that does not answer a read "
+           "or write in\n"
+           "                       MSEC milliseconds (default: wait)\n"
+           "  SIGUSR2 lifts the limits until the next SIGUSR2\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "align", no_argument, NULL, 'a' },
+        { "journal", required_argument, NULL, 'j' },
+        { "full-copy", no_argument, NULL, 'f' },
+        { "yes", no_argument, NULL, 'y' },
+        { "backup", required_argument, NULL, 'b' },
+        { "backup-ldm", no_argument, NULL, 'L' },
+        { "clone", required_argument, NULL, 'c' },
+        { "verify", no_argument, NULL, 'V' },
+        { "reclaim", optional_argument, NULL, 'C' },
+        { "sector-size", required_argument, NULL, 's' },
+        { "stats", required_argument, NULL, 'S' },
+        { "trace", required_argument, NULL, 'T' },
+        { "replay", no_argument, NULL, 'R' },
+        { "memdev", required_argument, NULL, 'M' },
+        { "limit", required_argument, NULL, 'W' },
+        { "iops", required_argument, NULL, 'O' },
+        { "ioprio", required_argument, NULL, 'P' },
+        { "timeout", required_argument, NULL, 'D' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *trace_path = NULL, *memdev_options = NULL;
+    int opt, replay = 0;
+
+    latency_install();
+    throttle_install();
+
+    if (argc > 1 && !strcmp(argv[1], "export"))
+        return cmd_export(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "dm"))
+        return cmd_dm(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "mount"))
+        return cmd_mount(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "daemon"))
+        return cmd_daemon(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "restore"))
+        return cmd_restore(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "scan"))
+        return cmd_scan(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "verify"))
+        return cmd_verify(argc - 1, argv + 1);
+
+    while ((opt = getopt_long(argc, argv, "aj:fyb:c:s:h", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            realign = 1;
+            break;
+        case 'j':
+            align_journal = optarg;
+            break;
+        case 'f':
+            full_copy = 1;
+            break;
+        case 'y':
+            assume_yes = 1;
+            break;
+        case 'b':
+            backup_path = optarg;
+            break;
+        case 'L':
+            backup_ldm = 1;
+            break;
+        case 'c':
+            clone_path = optarg;
+            break;
+        case 'V':
+            verify_moves = 1;
+            break;
+        case 'C':
+            if (optarg && strcmp(optarg, "zero")) {
+                printf("Error: unknown reclaim mode %s\n", optarg);
+                return -1;
+            }
+            reclaim = D2B_COMMIT_RECLAIM |
+                      (optarg ? D2B_COMMIT_RECLAIM_ZERO : 0);
+            break;
+        case 's':
+            bdev_set_image_sector_size(atoi(optarg));
+            break;
+        case 'S':
+            if (strcmp(optarg, "json")) {
+                printf("Error: unknown stats format %s\n", optarg);
+                return -1;
             }
+            stats_enable();
+            atexit(print_stats);
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'R':
+            replay = 1;
+            break;
+        case 'M':
+            if (!strcmp(optarg, "help")) {
+                memdev_usage();
+                return 0;
+            }
+            memdev_options = optarg;
+            break;
+        case 'D':
+            bdev_set_timeout(atoi(optarg));
+            break;
+        case 'W':
+        case 'O':
+        case 'P':
+            if (throttle_option(opt, optarg))
+                return -1;
+            break;
+        default:
+            usage();
+            return -1;
         }
+    }
 
-        if (entries)
-            free(entries);
-    } break;
-    case MBR_PART_WINDOWS_LDM: {
-        printf("Info: Device %s use MBR\n", dev);
+    if (optind != argc - 1) {
+        usage();
+        return -1;
+    }
 
-        if (read_mbr_ldm(fd, &new_entries)) {
-            printf("Error: read mbr ldm info failed.\n");
-        } else {
-            if (saveMBR(fd, &mbr, &new_entries)) {
-                printf("Error: save mbr failed.\n");
-            }
+    if (!backup_path && !clone_path) {
+        printf("Warning, please use other tools to save the partition table "
+               "first, or --backup!!!\n");
+        printf("continue? (yes or no)\n");
+        if (!confirm()) {
+            printf("exit.\n");
+            return 0;
         }
-    } break;
-    default:
-        printf("Info: Device %s is not a valid LDM disk\n", dev);
+    }
+
+    char *dev = argv[optind];
+    d2b_dev *d;
+    int err;
+
+    // open device, read-only when nothing must reach it
+    int fd = replay ? trace_replay(dev)
+                    : open(dev, memdev_options || clone_path ? O_RDONLY
+                                                             : O_RDWR);
+    if (fd == -1) {
+        if (!replay)
+            printf("Error: failed to open %s, errno is %d\n", dev, errno);
         return -1;
     }
 
-    list_for_each_safe(pos, next, &new_entries) {
-        partition_data *part = list_entry(pos, partition_data, list);
-        free(part);
+    if (clone_path) {
+        fd = open_clone(fd, clone_path);
+        if (fd == -1)
+            return -1;
+        dev = (char *)clone_path;
+    }
+
+    if (replay || trace_path) {
+        trace_fd = fd;
+        atexit(close_trace);
+    }
+    if (trace_path && trace_capture(fd, trace_path))
+        return -1;
+
+    if (memdev_options) {
+        if (memdev_attach(fd, memdev_options))
+            return -1;
+        memdev_fd = fd;
+        atexit(close_memdev);
+    }
+
+    bdev_track_writes(fd);
+    if (d2b_attach(fd, &d)) {
+        printf("Error: failed to malloc\n");
+        return -1;
+    }
+
+    err = d2b_probe(d);
+    switch (d2b_table_type(d)) {
+    case D2B_TABLE_GPT:
+        printf("Info: Device %s use GPT\n", dev);
+        break;
+    case D2B_TABLE_MBR:
+        printf("Info: Device %s use MBR\n", dev);
+        break;
     }
 
+    if (err == D2B_ERR_NOT_LDM)
+        printf("Info: Device %s is not a valid LDM disk\n", dev);
+    else if (err)
+        printf("Error: read ldm info failed, %s.\n", d2b_strerror(err));
+    else
+        err = convert(d, fd, dev);
+
+    d2b_close(d);
+    bdev_untrack_writes(fd);
     close(fd);
 
-    return 0;
-}
\ No newline at end of file
+    return err ? -1 : 0;
+}
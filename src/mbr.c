@@ -4,8 +4,9 @@
 
 #include "bdev.h"
 #include "mbr.h"
+#include "stats.h"
 
-int read_mbr(int fd, legacy_mbr *mbr) {
+static int _read_mbr(int fd, legacy_mbr *mbr) {
     uint32_t i;
 
     size_t count = 0;
@@ -30,8 +31,26 @@ int read_mbr(int fd, legacy_mbr *mbr) {
     return MBR_ERROR_OK;
 }
 
+int read_mbr(int fd, legacy_mbr *mbr) {
+    stats_timer timer;
+    int ret;
+
+    stats_phase_begin(&timer);
+    ret = _read_mbr(fd, mbr);
+    stats_phase_end(&timer, STATS_PROBE);
+
+    return ret;
+}
+
 int write_mbr(int fd, legacy_mbr *mbr) {
-    return bdev_write_lba(fd, 0, (uint8_t *)mbr, sizeof(legacy_mbr));
+    stats_timer timer;
+    int ret;
+
+    stats_phase_begin(&timer);
+    ret = bdev_write_lba(fd, 0, (uint8_t *)mbr, sizeof(legacy_mbr));
+    stats_phase_end(&timer, STATS_WRITE);
+
+    return ret;
 }
 
 void calcCHS(uint64_t lba, uint8_t *cylinder, uint8_t *heads,
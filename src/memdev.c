@@ -0,0 +1,293 @@
+#include "memdev.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bdev.h"
+
+#define MAX_EIO_RANGES 8
+
+typedef struct _lba_range {
+    uint64_t first;
+    uint64_t last;
+} lba_range;
+
+typedef struct _memdev {
+    bdev_backend backend;
+    uint8_t *data;
+
+    uint64_t latency_usec;  /* per call */
+    uint64_t bandwidth;     /* bytes per second, 0 is unlimited */
+    size_t short_io;        /* most bytes per call, 0 is unlimited */
+    uint32_t torn_write;    /* the write that is torn, 1 is the first */
+    lba_range eio[MAX_EIO_RANGES];
+    int nr_eio;
+    char *save_path;
+
+    uint32_t nr_writes;
+    int failed;             /* set by a torn write, every write fails after */
+} memdev;
+
+void memdev_usage(void) {
+    printf("memdev options, comma separated:\n"
+           "  latency=USEC     delay of every read and write\n"
+           "  bw=MBPS          bandwidth cap\n"
+           "  short=BYTES      most bytes a single read or write transfers\n"
+           "  eio=LBA[-LBA]    fail reads and writes of these sectors, up to "
+           "%d ranges\n"
+           "  torn=N           write only the first half of the Nth write, "
+           "then fail every write\n"
+           "  sector=BYTES     sector size (default: that of the device)\n"
+           "  save=FILE        write the final content to FILE\n",
+           MAX_EIO_RANGES);
+}
+
+static void delay(const memdev *dev, size_t count) {
+    uint64_t nsec = dev->latency_usec * 1000;
+    struct timespec ts;
+
+    if (dev->bandwidth)
+        nsec += count * 1000000000ULL / dev->bandwidth;
+    if (!nsec)
+        return;
+
+    ts.tv_sec = nsec / 1000000000ULL;
+    ts.tv_nsec = nsec % 1000000000ULL;
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+/*
+ * Clamp a transfer to the device and the short I/O limit, and fail it if it
+ * touches a sector that returns EIO.
+ */
+static ssize_t prepare(memdev *dev, size_t count, uint64_t offset) {
+    const uint32_t sector_size = dev->backend.sector_size;
+    uint64_t first, last;
+    int i;
+
+    if (offset >= dev->backend.size)
+        return 0;
+    if (count > dev->backend.size - offset)
+        count = dev->backend.size - offset;
+    if (dev->short_io && count > dev->short_io)
+        count = dev->short_io;
+
+    first = offset / sector_size;
+    last = (offset + count - 1) / sector_size;
+    for (i = 0; i < dev->nr_eio; i++) {
+        if (first <= dev->eio[i].last && last >= dev->eio[i].first) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    delay(dev, count);
+    return count;
+}
+
+static ssize_t memdev_pread(void *priv, uint8_t *buffer, size_t count,
+                            uint64_t offset) {
+    memdev *dev = priv;
+    ssize_t ret = prepare(dev, count, offset);
+
+    if (ret > 0)
+        memcpy(buffer, dev->data + offset, ret);
+    return ret;
+}
+
+static ssize_t memdev_pwrite(void *priv, const uint8_t *buffer, size_t count,
+                             uint64_t offset) {
+    memdev *dev = priv;
+    ssize_t ret;
+
+    if (dev->failed) {
+        errno = EIO;
+        return -1;
+    }
+
+    ret = prepare(dev, count, offset);
+    if (ret <= 0)
+        return ret;
+
+    if (++dev->nr_writes == dev->torn_write) {
+        /* the device dies half way, at a sector boundary */
+        size_t half = ret / 2;
+
+        half -= half % dev->backend.sector_size;
+        memcpy(dev->data + offset, buffer, half);
+        dev->failed = 1;
+        printf("memdev: write %u torn after %zu of %zd bytes at offset "
+               "%lu\n",
+               dev->nr_writes, half, ret, offset);
+        errno = EIO;
+        return -1;
+    }
+
+    memcpy(dev->data + offset, buffer, ret);
+    return ret;
+}
+
+static int parse_range(const char *value, lba_range *range) {
+    char *end;
+
+    range->first = strtoull(value, &end, 0);
+    range->last = range->first;
+    if (*end == '-')
+        range->last = strtoull(end + 1, &end, 0);
+
+    return *end || range->last < range->first ? -1 : 0;
+}
+
+static int parse_options(memdev *dev, char *options) {
+    char *opt, *save = NULL;
+
+    for (opt = strtok_r(options, ",", &save); opt;
+         opt = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(opt, '=');
+
+        if (!value)
+            goto invalid;
+        *value++ = '\0';
+
+        if (!strcmp(opt, "latency")) {
+            dev->latency_usec = strtoull(value, NULL, 0);
+        } else if (!strcmp(opt, "bw")) {
+            dev->bandwidth = strtoull(value, NULL, 0) * 1000000;
+        } else if (!strcmp(opt, "short")) {
+            dev->short_io = strtoull(value, NULL, 0);
+        } else if (!strcmp(opt, "torn")) {
+            dev->torn_write = strtoul(value, NULL, 0);
+        } else if (!strcmp(opt, "sector")) {
+            dev->backend.sector_size = atoi(value);
+            if (dev->backend.sector_size <= 0)
+                goto invalid;
+        } else if (!strcmp(opt, "save")) {
+            free(dev->save_path);
+            dev->save_path = strdup(value);
+        } else if (!strcmp(opt, "eio")) {
+            if (dev->nr_eio == MAX_EIO_RANGES ||
+                parse_range(value, &dev->eio[dev->nr_eio]))
+                goto invalid;
+            dev->nr_eio++;
+        } else {
+            goto invalid;
+        }
+    }
+
+    return 0;
+
+invalid:
+    printf("memdev: invalid option %s\n", opt);
+    memdev_usage();
+    return -1;
+}
+
+/*
+ * Serve the bdev calls of fd from a private mapping of it: reads come from
+ * the device until a sector is written, writes never reach it.
+ */
+int memdev_attach(int fd, const char *options) {
+    memdev *dev;
+    char *copy;
+    uint64_t size;
+
+    dev = calloc(1, sizeof(memdev));
+    copy = strdup(options);
+    if (!dev || !copy) {
+        printf("memdev: failed to malloc\n");
+        goto error;
+    }
+
+    dev->backend.sector_size = bdev_get_sector_size(fd);
+    dev->backend.physical_block_size = bdev_get_physical_block_size(fd);
+    dev->backend.optimal_io_size = bdev_get_optimal_io_size(fd);
+    if (parse_options(dev, copy))
+        goto error;
+
+    if (bdev_get_size(fd, &size) || !size) {
+        printf("memdev: failed to get the size of the device\n");
+        goto error;
+    }
+    dev->backend.size = size;
+
+    dev->data =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (dev->data == MAP_FAILED) {
+        printf("memdev: failed to map the device, errno is %d\n", errno);
+        dev->data = NULL;
+        goto error;
+    }
+
+    dev->backend.pread = memdev_pread;
+    dev->backend.pwrite = memdev_pwrite;
+    dev->backend.priv = dev;
+    if (bdev_attach(fd, &dev->backend))
+        goto error;
+
+    free(copy);
+    return 0;
+
+error:
+    if (dev && dev->data)
+        munmap(dev->data, dev->backend.size);
+    if (dev)
+        free(dev->save_path);
+    free(copy);
+    free(dev);
+    return -1;
+}
+
+/* write the content, with the sectors still zero left as holes */
+static void save(const memdev *dev) {
+    const uint32_t sector_size = dev->backend.sector_size;
+    static const uint8_t zero[4096];
+    uint64_t offset;
+    int fd;
+
+    fd = open(dev->save_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, dev->backend.size)) {
+        printf("memdev: failed to create %s, errno is %d\n", dev->save_path,
+               errno);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    for (offset = 0; offset < dev->backend.size; offset += sector_size) {
+        size_t len = dev->backend.size - offset;
+
+        if (len > sector_size)
+            len = sector_size;
+        if (len <= sizeof(zero) && !memcmp(dev->data + offset, zero, len))
+            continue;
+        if (pwrite(fd, dev->data + offset, len, offset) != len) {
+            printf("memdev: failed to write %s, errno is %d\n",
+                   dev->save_path, errno);
+            break;
+        }
+    }
+
+    close(fd);
+}
+
+void memdev_detach(int fd) {
+    bdev_backend *backend = bdev_detach(fd);
+    memdev *dev;
+
+    if (!backend)
+        return;
+
+    dev = backend->priv;
+    if (dev->save_path)
+        save(dev);
+    free(dev->save_path);
+    munmap(dev->data, dev->backend.size);
+    free(dev);
+}
@@ -0,0 +1,13 @@
+#ifndef __MEMDEV_H__
+#define __MEMDEV_H__
+
+/*
+ * In-memory device over a copy-on-write mapping of a disk or image, with
+ * injected latency, bandwidth caps, short I/O, EIO and torn writes. The
+ * options are a comma separated list, e.g. "latency=500,eio=1-33".
+ */
+int memdev_attach(int fd, const char *options);
+void memdev_detach(int fd);
+void memdev_usage(void);
+
+#endif
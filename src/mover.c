@@ -0,0 +1,752 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bdev.h"
+#include "debug.h"
+#include "mover.h"
+#include "throttle.h"
+
+#define MOVER_JOURNAL_MAGIC "D2BMOVE1"
+#define MOVER_JOURNAL_SLOT_OFFSET 4096
+#define MOVER_CHECKPOINT_INTERVAL 64
+#define MOVER_NO_SLOT UINT64_MAX
+
+typedef struct _mover_journal_head {
+    char magic[8]; // "D2BMOVE1"
+
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t length;
+    uint32_t chunk_size;
+    uint32_t slot_length;
+    uint32_t nr_extents; /* stored behind the head */
+    uint32_t extents_crc32;
+
+    uint64_t done; /* chunks durably written, in processing order */
+    uint64_t slot; /* chunk saved in the slot, MOVER_NO_SLOT if none */
+    uint32_t slot_crc32;
+    uint32_t head_crc32;
+} __attribute__((__packed__)) mover_journal_head;
+
+typedef struct _mover_chunk {
+    uint64_t offset; /* relative to the start of the move */
+    uint32_t length;
+    uint8_t *data;
+    int error;
+} mover_chunk;
+
+typedef struct _mover {
+    const mover_job *job;
+    mover_extent *chunks; /* in disk order */
+    uint64_t nr_chunks;
+    int backward;
+    int same_device;
+    int sparse;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    mover_chunk ring[MOVER_QUEUE_DEPTH];
+    uint64_t head; /* next chunk to read */
+    uint64_t tail; /* next chunk to write */
+    int stop;
+
+    int journal_fd;
+    mover_journal_head journal;
+    uint64_t pending_lo, pending_hi; /* sources written since checkpoint */
+} mover;
+
+static int pread_full(int fd, uint8_t *buffer, size_t count, uint64_t offset) {
+    size_t total = 0;
+
+    while (total < count) {
+        ssize_t ret = bdev_timed_pread(fd, buffer + total, count - total,
+                                       offset + total);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+
+        total += ret;
+    }
+
+    return 0;
+}
+
+static int pwrite_full(int fd, const uint8_t *buffer, size_t count,
+                       uint64_t offset) {
+    size_t total = 0;
+
+    while (total < count) {
+        ssize_t ret = bdev_timed_pwrite(fd, buffer + total, count - total,
+                                        offset + total);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+
+        total += ret;
+    }
+
+    bdev_note_write(fd, offset, count);
+    return 0;
+}
+
+typedef uint64_t mover_vec __attribute__((vector_size(32), aligned(1)));
+
+/*
+ * Check a buffer for zeros. The vector type lets the compiler use the
+ * widest registers of the target, 256 bytes are or-ed before each test.
+ */
+int mover_is_zero(const uint8_t *buffer, size_t count) {
+    const mover_vec *v = (const mover_vec *)buffer;
+    size_t i, n = count / (8 * sizeof(mover_vec));
+
+    for (i = 0; i < n; i++, v += 8) {
+        mover_vec acc = v[0] | v[1] | v[2] | v[3] | v[4] | v[5] | v[6] | v[7];
+        if (acc[0] | acc[1] | acc[2] | acc[3])
+            return 0;
+    }
+
+    for (i = n * 8 * sizeof(mover_vec); i < count; i++) {
+        if (buffer[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+static void mover_chunk_range(const mover *m, uint64_t index, uint64_t *offset,
+                              uint32_t *length) {
+    uint64_t k = m->backward ? m->nr_chunks - 1 - index : index;
+
+    *offset = m->chunks[k].offset;
+    *length = m->chunks[k].length;
+}
+
+/*
+ * Split the extents into chunks of at most MOVER_CHUNK_SIZE bytes. Extents
+ * separated by small gaps share a chunk, one larger I/O is cheaper than
+ * several small ones.
+ */
+static int mover_build_chunks(mover *m, const mover_extent *extents,
+                              uint32_t nr_extents) {
+    const mover_extent whole = { 0, m->job->length };
+    uint64_t capacity = 0, i;
+
+    if (!extents) {
+        extents = &whole;
+        nr_extents = 1;
+    }
+
+    for (i = 0; i < nr_extents; i++)
+        capacity += extents[i].length / MOVER_CHUNK_SIZE + 1;
+
+    free(m->chunks);
+    m->nr_chunks = 0;
+    m->chunks = malloc(capacity * sizeof(mover_extent));
+    if (!m->chunks) {
+        printf("mover: failed to malloc\n");
+        return -1;
+    }
+
+    for (i = 0; i < nr_extents; i++) {
+        uint64_t offset = extents[i].offset;
+        uint64_t end = offset + extents[i].length;
+
+        if (end > m->job->length || (i > 0 && offset < extents[i - 1].offset)) {
+            printf("mover: invalid extent %lu+%lu\n", offset,
+                   extents[i].length);
+            return -1;
+        }
+
+        while (offset < end) {
+            mover_extent *last =
+                m->nr_chunks ? &m->chunks[m->nr_chunks - 1] : NULL;
+            uint64_t len = end - offset;
+
+            if (last && offset >= last->offset + last->length &&
+                offset - (last->offset + last->length) <= MOVER_MERGE_GAP &&
+                offset + len - last->offset <= MOVER_CHUNK_SIZE) {
+                last->length = offset + len - last->offset;
+                break;
+            }
+
+            if (len > MOVER_CHUNK_SIZE)
+                len = MOVER_CHUNK_SIZE;
+
+            m->chunks[m->nr_chunks].offset = offset;
+            m->chunks[m->nr_chunks].length = len;
+            m->nr_chunks++;
+            offset += len;
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t mover_slot_offset(const mover_journal_head *jh) {
+    uint64_t size = (uint64_t)jh->nr_extents * sizeof(mover_extent);
+
+    return MOVER_JOURNAL_SLOT_OFFSET + (size + 4095) / 4096 * 4096;
+}
+
+static inline int ranges_overlap(uint64_t a, uint64_t a_len, uint64_t b,
+                                 uint64_t b_len) {
+    return a < b + b_len && b < a + a_len;
+}
+
+static int same_device(int fd1, int fd2) {
+    struct stat st1, st2;
+
+    if (fd1 == fd2)
+        return 1;
+
+    if (fstat(fd1, &st1) || fstat(fd2, &st2))
+        return 1;
+
+    if (S_ISBLK(st1.st_mode) && S_ISBLK(st2.st_mode))
+        return st1.st_rdev == st2.st_rdev;
+
+    return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+static void *mover_reader(void *arg) {
+    mover *m = arg;
+    const mover_job *job = m->job;
+
+    pthread_mutex_lock(&m->lock);
+    while (!m->stop && m->head < m->nr_chunks) {
+        if (m->head - m->tail >= MOVER_QUEUE_DEPTH) {
+            pthread_cond_wait(&m->cond, &m->lock);
+            continue;
+        }
+
+        mover_chunk *chunk = &m->ring[m->head % MOVER_QUEUE_DEPTH];
+        mover_chunk_range(m, m->head, &chunk->offset, &chunk->length);
+        pthread_mutex_unlock(&m->lock);
+
+        throttle_wait(chunk->length);
+        chunk->error = pread_full(job->src_fd, chunk->data, chunk->length,
+                                  job->src_offset + chunk->offset)
+                           ? errno
+                           : 0;
+
+        pthread_mutex_lock(&m->lock);
+        m->head++;
+        pthread_cond_broadcast(&m->cond);
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    return NULL;
+}
+
+static int journal_write_head(mover *m) {
+    m->journal.head_crc32 =
+        crc32(0, (const Bytef *)&m->journal,
+              offsetof(mover_journal_head, head_crc32));
+
+    if (pwrite_full(m->journal_fd, (const uint8_t *)&m->journal,
+                    sizeof(m->journal), 0) ||
+        fdatasync(m->journal_fd)) {
+        printf("mover: failed to update journal, errno is %d\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int mover_checkpoint(mover *m, uint64_t done) {
+    if (fdatasync(m->job->dst_fd)) {
+        printf("mover: failed to sync, errno is %d\n", errno);
+        return -1;
+    }
+
+    m->pending_lo = m->pending_hi = 0;
+    if (m->journal_fd < 0)
+        return 0;
+
+    m->journal.done = done;
+    return journal_write_head(m);
+}
+
+static int mover_save_slot(mover *m, uint64_t index, const mover_chunk *chunk) {
+    if (pwrite_full(m->journal_fd, chunk->data, chunk->length,
+                    mover_slot_offset(&m->journal)) ||
+        fdatasync(m->journal_fd)) {
+        printf("mover: failed to save chunk to journal, errno is %d\n", errno);
+        return -1;
+    }
+
+    m->journal.slot = index;
+    m->journal.slot_length = chunk->length;
+    m->journal.slot_crc32 = crc32(0, chunk->data, chunk->length);
+    return journal_write_head(m);
+}
+
+static int journal_create(mover *m) {
+    const mover_job *job = m->job;
+    mover_journal_head *jh = &m->journal;
+    const mover_extent *extents = m->chunks;
+
+    memset(jh, 0, sizeof(*jh));
+    memcpy(jh->magic, MOVER_JOURNAL_MAGIC, sizeof(jh->magic));
+    jh->src_offset = job->src_offset;
+    jh->dst_offset = job->dst_offset;
+    jh->length = job->length;
+    jh->chunk_size = MOVER_CHUNK_SIZE;
+    jh->nr_extents = m->nr_chunks;
+    jh->extents_crc32 =
+        crc32(0, (const Bytef *)extents, m->nr_chunks * sizeof(mover_extent));
+    jh->done = 0;
+    jh->slot = MOVER_NO_SLOT;
+
+    if (pwrite_full(m->journal_fd, (const uint8_t *)extents,
+                    m->nr_chunks * sizeof(mover_extent),
+                    MOVER_JOURNAL_SLOT_OFFSET)) {
+        printf("mover: failed to write journal, errno is %d\n", errno);
+        return -1;
+    }
+
+    return journal_write_head(m);
+}
+
+/*
+ * The chunks stored in an existing journal replace the ones of the job: the
+ * extents of a partly moved volume can not be computed again from its data.
+ */
+static int journal_load_chunks(mover *m) {
+    mover_journal_head *jh = &m->journal;
+    uint64_t size = (uint64_t)jh->nr_extents * sizeof(mover_extent);
+    mover_extent *chunks = malloc(size ? size : 1);
+
+    if (!chunks) {
+        printf("mover: failed to malloc\n");
+        return -1;
+    }
+
+    if (pread_full(m->journal_fd, (uint8_t *)chunks, size,
+                   MOVER_JOURNAL_SLOT_OFFSET) ||
+        crc32(0, (const Bytef *)chunks, size) != jh->extents_crc32) {
+        printf("mover: journal %s has damaged extents\n", m->job->journal);
+        free(chunks);
+        return -1;
+    }
+
+    free(m->chunks);
+    m->chunks = chunks;
+    m->nr_chunks = jh->nr_extents;
+    return 0;
+}
+
+/*
+ * A chunk that was saved to the journal because it overlaps its own source
+ * is written back from the journal, its source may be partially overwritten.
+ * The chunk goes through the first buffer of the ring.
+ */
+static int journal_replay_slot(mover *m) {
+    const mover_job *job = m->job;
+    mover_journal_head *jh = &m->journal;
+    mover_chunk *chunk = &m->ring[0];
+
+    if (jh->slot == MOVER_NO_SLOT || jh->slot != jh->done ||
+        jh->done >= m->nr_chunks)
+        return 0;
+
+    mover_chunk_range(m, jh->slot, &chunk->offset, &chunk->length);
+    if (chunk->length != jh->slot_length ||
+        pread_full(m->journal_fd, chunk->data, chunk->length,
+                   mover_slot_offset(jh)) ||
+        crc32(0, chunk->data, chunk->length) != jh->slot_crc32) {
+        printf("mover: journal %s has a damaged chunk\n", job->journal);
+        return -1;
+    }
+
+    D("replay chunk %lu from journal\n", jh->slot);
+    if (pwrite_full(job->dst_fd, chunk->data, chunk->length,
+                    job->dst_offset + chunk->offset)) {
+        printf("mover: failed to write, errno is %d\n", errno);
+        return -1;
+    }
+
+    return mover_checkpoint(m, jh->done + 1);
+}
+
+/*
+ * Open the journal and return the first chunk that still has to be copied.
+ * The saved chunk of an interrupted move is replayed only when replay is
+ * set, with the ring allocated; otherwise the journal is only checked.
+ */
+static int mover_open_journal(mover *m, uint64_t *start, int replay) {
+    const mover_job *job = m->job;
+    mover_journal_head *jh = &m->journal;
+    ssize_t ret;
+
+    *start = 0;
+    m->journal_fd = -1;
+    if (!job->journal)
+        return 0;
+
+    m->journal_fd = open(job->journal, O_RDWR | O_CREAT, 0600);
+    if (m->journal_fd < 0) {
+        printf("mover: failed to open journal %s, errno is %d\n", job->journal,
+               errno);
+        return -1;
+    }
+
+    ret = pread(m->journal_fd, jh, sizeof(*jh), 0);
+    if (ret == 0)
+        return journal_create(m);
+
+    if (ret != sizeof(*jh) ||
+        memcmp(jh->magic, MOVER_JOURNAL_MAGIC, sizeof(jh->magic)) ||
+        jh->head_crc32 != crc32(0, (const Bytef *)jh,
+                                offsetof(mover_journal_head, head_crc32))) {
+        printf("mover: journal %s is corrupted\n", job->journal);
+        return -1;
+    }
+
+    if (jh->src_offset != job->src_offset ||
+        jh->dst_offset != job->dst_offset || jh->length != job->length ||
+        jh->chunk_size != MOVER_CHUNK_SIZE) {
+        printf("mover: journal %s belongs to another move\n", job->journal);
+        return -1;
+    }
+
+    if (journal_load_chunks(m))
+        return -1;
+
+    if (!replay)
+        return 0;
+
+    if (journal_replay_slot(m))
+        return -1;
+
+    if (jh->done > 0 && jh->done < m->nr_chunks)
+        printf("Info: resuming move at chunk %lu of %lu\n", jh->done,
+               m->nr_chunks);
+
+    *start = jh->done;
+    return 0;
+}
+
+/*
+ * Write the non-zero blocks of a chunk and punch holes for the zero ones.
+ */
+static int mover_write_sparse(mover *m, const mover_chunk *chunk,
+                              uint64_t dst) {
+    mover_stats *stats = m->job->stats;
+    uint32_t pos = 0;
+
+    while (pos < chunk->length) {
+        uint32_t len = 0;
+        int zero = mover_is_zero(chunk->data + pos,
+                                 chunk->length - pos < MOVER_SPARSE_BLOCK
+                                     ? chunk->length - pos
+                                     : MOVER_SPARSE_BLOCK);
+
+        while (pos + len < chunk->length) {
+            uint32_t block = chunk->length - pos - len < MOVER_SPARSE_BLOCK
+                                 ? chunk->length - pos - len
+                                 : MOVER_SPARSE_BLOCK;
+            if (mover_is_zero(chunk->data + pos + len, block) != zero)
+                break;
+            len += block;
+        }
+
+        if (zero && !fallocate(m->job->dst_fd,
+                               FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                               dst + pos, len)) {
+            bdev_note_write(m->job->dst_fd, dst + pos, len);
+            if (stats)
+                stats->bytes_zero += len;
+        } else {
+            if (pwrite_full(m->job->dst_fd, chunk->data + pos, len,
+                            dst + pos)) {
+                printf("mover: failed to write, errno is %d\n", errno);
+                return -1;
+            }
+            if (stats)
+                stats->bytes_written += len;
+        }
+
+        pos += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Write one chunk. When the source and target share a device the journal
+ * invariant is kept: a chunk is never written over a source range that an
+ * unjournaled, not yet checkpointed chunk still needs after a crash.
+ */
+static int mover_write_chunk(mover *m, uint64_t index, mover_chunk *chunk) {
+    const mover_job *job = m->job;
+    uint64_t src = job->src_offset + chunk->offset;
+    uint64_t dst = job->dst_offset + chunk->offset;
+
+    if (m->same_device && m->journal_fd >= 0) {
+        if (m->pending_hi > m->pending_lo &&
+            ranges_overlap(dst, chunk->length, m->pending_lo,
+                           m->pending_hi - m->pending_lo)) {
+            if (mover_checkpoint(m, index))
+                return -1;
+        }
+
+        if (ranges_overlap(dst, chunk->length, src, chunk->length)) {
+            if (m->journal.done != index && mover_checkpoint(m, index))
+                return -1;
+            if (mover_save_slot(m, index, chunk))
+                return -1;
+        }
+    }
+
+    if (m->sparse) {
+        if (mover_write_sparse(m, chunk, dst))
+            return -1;
+    } else {
+        if (pwrite_full(job->dst_fd, chunk->data, chunk->length, dst)) {
+            printf("mover: failed to write, errno is %d\n", errno);
+            return -1;
+        }
+        if (job->stats)
+            job->stats->bytes_written += chunk->length;
+    }
+
+    if (job->stats)
+        job->stats->bytes_read += chunk->length;
+
+    if (m->pending_hi == m->pending_lo) {
+        m->pending_lo = src;
+        m->pending_hi = src + chunk->length;
+    } else {
+        if (src < m->pending_lo)
+            m->pending_lo = src;
+        if (src + chunk->length > m->pending_hi)
+            m->pending_hi = src + chunk->length;
+    }
+
+    if (m->journal_fd >= 0 && (index + 1) % MOVER_CHECKPOINT_INTERVAL == 0)
+        return mover_checkpoint(m, index + 1);
+
+    return 0;
+}
+
+/*
+ * Copy the data segments of a chunk with copy_file_range, which lets the
+ * file system share blocks (reflink) or copy them without a round trip
+ * through user space. Holes of the source are skipped.
+ */
+static int mover_offload_chunk(mover *m, uint64_t index) {
+    const mover_job *job = m->job;
+    uint64_t offset, end;
+    uint32_t length;
+
+    mover_chunk_range(m, index, &offset, &length);
+    end = offset + length;
+    throttle_wait(length);
+
+    while (offset < end) {
+        off_t data = lseek(job->src_fd, job->src_offset + offset, SEEK_DATA);
+        off_t hole;
+
+        if (data < 0 && errno == ENXIO)
+            break;
+        if (data < 0)
+            data = job->src_offset + offset;
+        if (data >= (off_t)(job->src_offset + end))
+            break;
+
+        hole = lseek(job->src_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > (off_t)(job->src_offset + end))
+            hole = job->src_offset + end;
+
+        loff_t in = data;
+        loff_t out = job->dst_offset + (data - job->src_offset);
+        while (in < hole) {
+            ssize_t ret = copy_file_range(job->src_fd, &in, job->dst_fd, &out,
+                                          hole - in, 0);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return -1;
+
+            bdev_note_write(job->dst_fd, out - ret, ret);
+            if (job->stats)
+                job->stats->bytes_offloaded += ret;
+        }
+
+        offset = hole - job->src_offset;
+    }
+
+    return 0;
+}
+
+static int mover_can_offload(const mover_job *job) {
+    struct stat st;
+
+    return (job->flags & MOVER_OFFLOAD) && !fstat(job->src_fd, &st) &&
+           S_ISREG(st.st_mode) && !fstat(job->dst_fd, &st) &&
+           S_ISREG(st.st_mode);
+}
+
+static int mover_init(mover *m, const mover_job *job) {
+    struct stat st;
+
+    memset(m, 0, sizeof(*m));
+    m->job = job;
+    m->journal_fd = -1;
+    m->same_device = same_device(job->src_fd, job->dst_fd);
+    m->backward = m->same_device && job->dst_offset > job->src_offset &&
+                  job->dst_offset < job->src_offset + job->length;
+    m->sparse = (job->flags & MOVER_SPARSE) && !fstat(job->dst_fd, &st) &&
+                S_ISREG(st.st_mode);
+
+    return mover_build_chunks(m, job->extents, job->nr_extents);
+}
+
+/*
+ * Create the journal of a move without copying anything, so the extents of
+ * all moves are recorded before the first one changes the disk. An existing
+ * journal is only checked, mover_run() replays its saved chunk.
+ */
+int mover_prepare(const mover_job *job) {
+    mover m;
+    uint64_t start;
+    int ret;
+
+    if (!job->journal)
+        return 0;
+
+    ret = mover_init(&m, job);
+    if (!ret)
+        ret = mover_open_journal(&m, &start, 0);
+
+    if (m.journal_fd >= 0)
+        close(m.journal_fd);
+    free(m.chunks);
+    return ret;
+}
+
+int mover_run(const mover_job *job) {
+    mover m;
+    pthread_t reader;
+    uint64_t start, index, leaf;
+    int i, ret = -1;
+
+    if (job->length == 0 ||
+        (job->src_offset == job->dst_offset &&
+         same_device(job->src_fd, job->dst_fd)))
+        return 0;
+
+    if (mover_init(&m, job))
+        goto out;
+
+    for (i = 0; i < MOVER_QUEUE_DEPTH; i++) {
+        if (posix_memalign((void **)&m.ring[i].data, 4096, MOVER_CHUNK_SIZE)) {
+            printf("mover: failed to malloc\n");
+            goto out;
+        }
+    }
+
+    if (mover_open_journal(&m, &start, 1))
+        goto out;
+
+    /* chunks moved before a resume are only read back */
+    for (index = 0; job->verify && index < start; index++) {
+        uint64_t offset, leaf;
+        uint32_t length;
+
+        mover_chunk_range(&m, index, &offset, &length);
+        if (verify_begin_chunk(job->verify, job->dst_offset + offset, NULL,
+                               length, &leaf) ||
+            verify_end_chunk(job->verify, leaf))
+            goto out;
+    }
+
+    /*
+     * Fall back to the pipeline at the first chunk the kernel refuses. A
+     * verified move needs the data in memory, it does not offload.
+     */
+    if (!m.same_device && !job->verify && mover_can_offload(job)) {
+        while (start < m.nr_chunks && !mover_offload_chunk(&m, start))
+            start++;
+        if (start < m.nr_chunks)
+            D("copy_file_range failed at chunk %lu, errno is %d\n", start,
+              errno);
+    }
+
+    if (start >= m.nr_chunks) {
+        ret = mover_checkpoint(&m, m.nr_chunks);
+        goto out;
+    }
+
+    pthread_mutex_init(&m.lock, NULL);
+    pthread_cond_init(&m.cond, NULL);
+    m.head = m.tail = start;
+
+    if (pthread_create(&reader, NULL, mover_reader, &m)) {
+        printf("mover: failed to create reader thread\n");
+        goto out_destroy;
+    }
+
+    for (index = start; index < m.nr_chunks; index++) {
+        mover_chunk *chunk = &m.ring[index % MOVER_QUEUE_DEPTH];
+
+        pthread_mutex_lock(&m.lock);
+        while (m.head == index)
+            pthread_cond_wait(&m.cond, &m.lock);
+        pthread_mutex_unlock(&m.lock);
+
+        if (chunk->error) {
+            printf("mover: failed to read, errno is %d\n", chunk->error);
+            break;
+        }
+
+        /* the chunk is hashed while it is written */
+        if (job->verify &&
+            verify_begin_chunk(job->verify, job->dst_offset + chunk->offset,
+                               chunk->data, chunk->length, &leaf))
+            break;
+
+        if (mover_write_chunk(&m, index, chunk))
+            break;
+
+        if (job->verify && verify_end_chunk(job->verify, leaf))
+            break;
+
+        pthread_mutex_lock(&m.lock);
+        m.tail++;
+        pthread_cond_broadcast(&m.cond);
+        pthread_mutex_unlock(&m.lock);
+    }
+
+    pthread_mutex_lock(&m.lock);
+    m.stop = 1;
+    pthread_cond_broadcast(&m.cond);
+    pthread_mutex_unlock(&m.lock);
+    pthread_join(reader, NULL);
+
+    if (index == m.nr_chunks && !mover_checkpoint(&m, m.nr_chunks))
+        ret = 0;
+
+out_destroy:
+    pthread_cond_destroy(&m.cond);
+    pthread_mutex_destroy(&m.lock);
+out:
+    if (m.journal_fd >= 0)
+        close(m.journal_fd);
+    for (i = 0; i < MOVER_QUEUE_DEPTH; i++)
+        free(m.ring[i].data);
+    free(m.chunks);
+
+    return ret;
+}
@@ -0,0 +1,55 @@
+#ifndef __MOVER_H__
+#define __MOVER_H__
+
+#include <stdint.h>
+
+#include "verify.h"
+
+#define MOVER_CHUNK_SIZE (4 * 1024 * 1024)
+#define MOVER_QUEUE_DEPTH 4
+#define MOVER_MERGE_GAP (64 * 1024)
+#define MOVER_SPARSE_BLOCK 4096
+
+enum {
+    MOVER_SPARSE = 0x1,  /* punch holes for zero blocks in a file target */
+    MOVER_OFFLOAD = 0x2, /* let the kernel copy between files */
+};
+
+typedef struct _mover_stats {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t bytes_zero;      /* zero blocks turned into holes */
+    uint64_t bytes_offloaded; /* copied by copy_file_range */
+} mover_stats;
+
+typedef struct _mover_extent {
+    uint64_t offset; /* bytes, relative to the start of the move */
+    uint64_t length;
+} mover_extent;
+
+typedef struct _mover_job {
+    int src_fd;
+    int dst_fd;
+    uint64_t src_offset; /* bytes */
+    uint64_t dst_offset; /* bytes */
+    uint64_t length;     /* bytes */
+
+    /* sorted ranges to copy, NULL copies everything */
+    const mover_extent *extents;
+    uint32_t nr_extents;
+
+    /* journal file used to resume an interrupted move, may be NULL */
+    const char *journal;
+
+    uint32_t flags;
+    mover_stats *stats; /* may be NULL */
+
+    /* hashes the chunks and reads them back from dst_fd, may be NULL */
+    verify *verify;
+} mover_job;
+
+int mover_is_zero(const uint8_t *buffer, size_t count);
+int mover_prepare(const mover_job *job);
+int mover_run(const mover_job *job);
+
+#endif
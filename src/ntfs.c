@@ -0,0 +1,386 @@
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ntfs.h"
+
+#define NTFS_OEM_ID "NTFS    "
+#define NTFS_BOOT_SIGNATURE 0xAA55
+#define NTFS_FIXUP_STRIDE 512
+
+#define NTFS_ATTR_ATTRIBUTE_LIST 0x20
+#define NTFS_ATTR_DATA 0x80
+#define NTFS_ATTR_END 0xFFFFFFFF
+
+typedef struct _ntfs_run {
+    uint64_t vcn;
+    uint64_t lcn;
+    uint64_t length; /* clusters, lcn is not valid for sparse runs */
+    int sparse;
+} ntfs_run;
+
+typedef struct _ntfs_extents {
+    mover_extent *runs;
+    uint32_t count;
+    uint32_t capacity;
+} ntfs_extents;
+
+static int ntfs_read_boot(const volume *vol, ntfs_boot_sector *bs) {
+    uint16_t bytes_per_sector;
+
+    if (volume_read(vol, 0, (uint8_t *)bs, sizeof(*bs)))
+        return -1;
+
+    if (memcmp(bs->oem_id, NTFS_OEM_ID, sizeof(bs->oem_id)) ||
+        le16toh(bs->signature) != NTFS_BOOT_SIGNATURE)
+        return -1;
+
+    bytes_per_sector = le16toh(bs->bytes_per_sector);
+    if (bytes_per_sector < 256 || bytes_per_sector > 4096 ||
+        (bytes_per_sector & (bytes_per_sector - 1)) ||
+        bs->sectors_per_cluster == 0)
+        return -1;
+
+    return 0;
+}
+
+static uint64_t ntfs_cluster_size(const ntfs_boot_sector *bs) {
+    uint64_t sectors = bs->sectors_per_cluster;
+
+    /* clusters above 64KiB are stored as a negative power of two */
+    if (sectors > 0x80)
+        sectors = 1ULL << (256 - sectors);
+
+    return sectors * le16toh(bs->bytes_per_sector);
+}
+
+static uint64_t ntfs_record_size(const ntfs_boot_sector *bs,
+                                 uint64_t cluster_size) {
+    if (bs->clusters_per_mft_record > 0)
+        return bs->clusters_per_mft_record * cluster_size;
+
+    return 1ULL << -bs->clusters_per_mft_record;
+}
+
+int ntfs_detect(const volume *vol) {
+    ntfs_boot_sector bs;
+
+    return !ntfs_read_boot(vol, &bs);
+}
+
+static int ntfs_apply_fixups(uint8_t *record, uint64_t record_size) {
+    ntfs_record_header *rh = (ntfs_record_header *)record;
+    uint16_t usa_offset = le16toh(rh->usa_offset);
+    uint16_t usa_count = le16toh(rh->usa_count);
+    uint16_t *usa, *pos;
+    uint16_t i;
+
+    if (usa_count == 0 || usa_offset + usa_count * 2 > record_size ||
+        (usa_count - 1) * NTFS_FIXUP_STRIDE > record_size)
+        return -1;
+
+    usa = (uint16_t *)(record + usa_offset);
+    for (i = 1; i < usa_count; i++) {
+        pos = (uint16_t *)(record + i * NTFS_FIXUP_STRIDE - 2);
+        if (*pos != usa[0])
+            return -1;
+        *pos = usa[i];
+    }
+
+    return 0;
+}
+
+static int ntfs_decode_runs(const uint8_t *mp, const uint8_t *end,
+                            ntfs_run **runs, uint32_t *nr_runs) {
+    uint32_t capacity = 16;
+    uint64_t vcn = 0;
+    int64_t lcn = 0;
+
+    *nr_runs = 0;
+    *runs = malloc(capacity * sizeof(ntfs_run));
+    if (!*runs)
+        return -1;
+
+    while (mp < end && *mp) {
+        uint8_t length_size = *mp & 0x0F;
+        uint8_t offset_size = *mp >> 4;
+        uint64_t length = 0;
+        int64_t delta = 0;
+        int i;
+
+        mp++;
+        if (length_size == 0 || length_size > 8 || offset_size > 8 ||
+            mp + length_size + offset_size > end)
+            goto error;
+
+        for (i = 0; i < length_size; i++)
+            length |= (uint64_t)mp[i] << (i * 8);
+        mp += length_size;
+
+        for (i = 0; i < offset_size; i++)
+            delta |= (uint64_t)mp[i] << (i * 8);
+        /* the offset is a signed little endian number */
+        if (offset_size && offset_size < 8 && (mp[offset_size - 1] & 0x80))
+            delta -= 1LL << (offset_size * 8);
+        mp += offset_size;
+
+        if (*nr_runs == capacity) {
+            ntfs_run *tmp = realloc(*runs, capacity * 2 * sizeof(ntfs_run));
+            if (!tmp)
+                goto error;
+            *runs = tmp;
+            capacity *= 2;
+        }
+
+        lcn += delta;
+        (*runs)[*nr_runs].vcn = vcn;
+        (*runs)[*nr_runs].lcn = lcn;
+        (*runs)[*nr_runs].length = length;
+        (*runs)[*nr_runs].sparse = offset_size == 0;
+        (*nr_runs)++;
+        vcn += length;
+    }
+
+    return 0;
+
+error:
+    printf("ntfs: invalid mapping pairs\n");
+    free(*runs);
+    *runs = NULL;
+    return -1;
+}
+
+static int ntfs_read_nonresident(const volume *vol, const ntfs_attr_header *ah,
+                                 const uint8_t *attr_end, uint64_t cluster_size,
+                                 uint8_t *data, uint64_t data_size) {
+    ntfs_run *runs;
+    uint32_t nr_runs, i;
+    const uint8_t *mp =
+        (const uint8_t *)ah + le16toh(ah->nonres.mapping_pairs_offset);
+
+    if (ntfs_decode_runs(mp, attr_end, &runs, &nr_runs))
+        return -1;
+
+    for (i = 0; i < nr_runs; i++) {
+        uint64_t offset = runs[i].vcn * cluster_size;
+        uint64_t length = runs[i].length * cluster_size;
+
+        if (offset >= data_size)
+            break;
+        if (length > data_size - offset)
+            length = data_size - offset;
+
+        if (runs[i].sparse) {
+            memset(data + offset, 0, length);
+        } else if (volume_read(vol, runs[i].lcn * cluster_size, data + offset,
+                               length)) {
+            free(runs);
+            return -1;
+        }
+    }
+
+    free(runs);
+    return 0;
+}
+
+/*
+ * Read $Bitmap, the sixth record of the MFT. The first records are always
+ * stored in the first extent of the MFT, so the MFT runs are not needed.
+ */
+static uint8_t *ntfs_read_bitmap(const volume *vol, const ntfs_boot_sector *bs,
+                                 uint64_t *bitmap_size) {
+    uint64_t cluster_size = ntfs_cluster_size(bs);
+    uint64_t record_size = ntfs_record_size(bs, cluster_size);
+    uint64_t max_size =
+        vol->size * vol->sector_size / cluster_size / 8 + cluster_size;
+    uint8_t *record, *bitmap = NULL;
+    const uint8_t *attr, *end;
+    ntfs_record_header *rh;
+
+    if (record_size < sizeof(ntfs_record_header) || record_size > 65536)
+        return NULL;
+
+    record = malloc(record_size);
+    if (!record) {
+        printf("ntfs: failed to malloc\n");
+        return NULL;
+    }
+
+    if (volume_read(vol,
+                    le64toh(bs->mft_lcn) * cluster_size +
+                        NTFS_MFT_RECORD_BITMAP * record_size,
+                    record, record_size))
+        goto out;
+
+    rh = (ntfs_record_header *)record;
+    if (memcmp(rh->magic, "FILE", 4) || ntfs_apply_fixups(record, record_size)) {
+        printf("ntfs: $Bitmap record is damaged\n");
+        goto out;
+    }
+
+    attr = record + le16toh(rh->attrs_offset);
+    end = record + (le32toh(rh->bytes_in_use) < record_size
+                        ? le32toh(rh->bytes_in_use)
+                        : record_size);
+
+    while (attr + 8 <= end) {
+        const ntfs_attr_header *ah = (const ntfs_attr_header *)attr;
+        uint32_t type = le32toh(ah->type);
+        uint32_t length = le32toh(ah->length);
+
+        if (type == NTFS_ATTR_END)
+            break;
+        if (length < 16 || attr + length > end)
+            break;
+
+        if (type == NTFS_ATTR_ATTRIBUTE_LIST) {
+            printf("ntfs: $Bitmap has an attribute list, not supported\n");
+            goto out;
+        }
+
+        if (type == NTFS_ATTR_DATA && ah->name_length == 0) {
+            if (ah->non_resident) {
+                *bitmap_size = le64toh(ah->nonres.data_size);
+                if (*bitmap_size > max_size)
+                    break;
+                bitmap = malloc(*bitmap_size);
+                if (bitmap &&
+                    ntfs_read_nonresident(vol, ah, attr + length, cluster_size,
+                                          bitmap, *bitmap_size)) {
+                    free(bitmap);
+                    bitmap = NULL;
+                }
+            } else {
+                uint16_t offset = le16toh(ah->res.value_offset);
+                *bitmap_size = le32toh(ah->res.value_length);
+                if (offset + *bitmap_size <= length) {
+                    bitmap = malloc(*bitmap_size);
+                    if (bitmap)
+                        memcpy(bitmap, attr + offset, *bitmap_size);
+                }
+            }
+            break;
+        }
+
+        attr += length;
+    }
+
+    if (!bitmap)
+        printf("ntfs: failed to read $Bitmap\n");
+
+out:
+    free(record);
+    return bitmap;
+}
+
+static int ntfs_add_extent(ntfs_extents *ext, uint64_t offset,
+                           uint64_t length) {
+    if (ext->count > 0) {
+        mover_extent *last = &ext->runs[ext->count - 1];
+        if (last->offset + last->length == offset) {
+            last->length += length;
+            return 0;
+        }
+    }
+
+    if (ext->count == ext->capacity) {
+        uint32_t capacity = ext->capacity ? ext->capacity * 2 : 256;
+        mover_extent *tmp = realloc(ext->runs, capacity * sizeof(mover_extent));
+        if (!tmp) {
+            printf("ntfs: failed to malloc\n");
+            return -1;
+        }
+        ext->runs = tmp;
+        ext->capacity = capacity;
+    }
+
+    ext->runs[ext->count].offset = offset;
+    ext->runs[ext->count].length = length;
+    ext->count++;
+    return 0;
+}
+
+/*
+ * Build the list of allocated byte ranges of an NTFS volume from $Bitmap. The
+ * sectors behind the last cluster, which hold the backup boot sector, are
+ * always included.
+ */
+int ntfs_get_allocated_runs(const volume *vol, mover_extent **runs,
+                            uint32_t *nr_runs) {
+    ntfs_boot_sector bs;
+    ntfs_extents ext = { 0 };
+    uint64_t cluster_size, nr_clusters, bitmap_size, volume_size;
+    uint64_t cluster = 0, run_start = 0;
+    uint8_t *bitmap;
+    int in_run = 0;
+
+    if (ntfs_read_boot(vol, &bs))
+        return -1;
+
+    cluster_size = ntfs_cluster_size(&bs);
+    volume_size = vol->size * vol->sector_size;
+    nr_clusters = le64toh(bs.total_sectors) * le16toh(bs.bytes_per_sector) /
+                  cluster_size;
+    if (nr_clusters * cluster_size > volume_size) {
+        printf("ntfs: file system is larger than the volume\n");
+        return -1;
+    }
+
+    bitmap = ntfs_read_bitmap(vol, &bs, &bitmap_size);
+    if (!bitmap)
+        return -1;
+
+    if (bitmap_size * 8 < nr_clusters) {
+        printf("ntfs: $Bitmap is too small\n");
+        free(bitmap);
+        return -1;
+    }
+
+    while (cluster < nr_clusters) {
+        /* skip whole words that do not change the run state */
+        if (cluster % 64 == 0 && cluster + 64 <= nr_clusters) {
+            uint64_t word = le64toh(*(uint64_t *)(bitmap + cluster / 8));
+            if ((!in_run && word == 0) || (in_run && word == UINT64_MAX)) {
+                cluster += 64;
+                continue;
+            }
+        }
+
+        int bit = (bitmap[cluster / 8] >> (cluster % 8)) & 1;
+        if (bit && !in_run) {
+            run_start = cluster;
+            in_run = 1;
+        } else if (!bit && in_run) {
+            if (ntfs_add_extent(&ext, run_start * cluster_size,
+                                (cluster - run_start) * cluster_size))
+                goto error;
+            in_run = 0;
+        }
+        cluster++;
+    }
+
+    if (in_run) {
+        if (ntfs_add_extent(&ext, run_start * cluster_size,
+                            (nr_clusters - run_start) * cluster_size))
+            goto error;
+    }
+
+    if (nr_clusters * cluster_size < volume_size &&
+        ntfs_add_extent(&ext, nr_clusters * cluster_size,
+                        volume_size - nr_clusters * cluster_size))
+        goto error;
+
+    D("ntfs: %lu clusters, %u allocated runs\n", nr_clusters, ext.count);
+
+    free(bitmap);
+    *runs = ext.runs;
+    *nr_runs = ext.count;
+    return 0;
+
+error:
+    free(bitmap);
+    free(ext.runs);
+    return -1;
+}
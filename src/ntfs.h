@@ -0,0 +1,75 @@
+#ifndef __NTFS_H__
+#define __NTFS_H__
+
+#include <stdint.h>
+
+#include "mover.h"
+#include "volume.h"
+
+#define NTFS_MFT_RECORD_BITMAP 6
+
+typedef struct _ntfs_boot_sector {
+    uint8_t jump[3];
+    char oem_id[8]; // "NTFS    "
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint8_t unused1[7];
+    uint8_t media_descriptor;
+    uint8_t unused2[18];
+    uint64_t total_sectors;
+    uint64_t mft_lcn;
+    uint64_t mft_mirror_lcn;
+    int8_t clusters_per_mft_record;
+    uint8_t unused3[3];
+    int8_t clusters_per_index_record;
+    uint8_t unused4[3];
+    uint64_t serial_number;
+    uint32_t checksum;
+    uint8_t boot_code[426];
+    uint16_t signature;
+} __attribute__((__packed__)) ntfs_boot_sector;
+
+typedef struct _ntfs_record_header {
+    char magic[4]; // "FILE"
+    uint16_t usa_offset;
+    uint16_t usa_count;
+    uint64_t lsn;
+    uint16_t sequence_number;
+    uint16_t link_count;
+    uint16_t attrs_offset;
+    uint16_t flags;
+    uint32_t bytes_in_use;
+    uint32_t bytes_allocated;
+} __attribute__((__packed__)) ntfs_record_header;
+
+typedef struct _ntfs_attr_header {
+    uint32_t type;
+    uint32_t length;
+    uint8_t non_resident;
+    uint8_t name_length;
+    uint16_t name_offset;
+    uint16_t flags;
+    uint16_t instance;
+    union {
+        struct {
+            uint32_t value_length;
+            uint16_t value_offset;
+        } __attribute__((__packed__)) res;
+        struct {
+            uint64_t lowest_vcn;
+            uint64_t highest_vcn;
+            uint16_t mapping_pairs_offset;
+            uint8_t compression_unit;
+            uint8_t reserved[5];
+            uint64_t allocated_size;
+            uint64_t data_size;
+            uint64_t initialized_size;
+        } __attribute__((__packed__)) nonres;
+    };
+} __attribute__((__packed__)) ntfs_attr_header;
+
+int ntfs_detect(const volume *vol);
+int ntfs_get_allocated_runs(const volume *vol, mover_extent **runs,
+                            uint32_t *nr_runs);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/*
+ * USDT probes of the "d2b" provider, for bpftrace and perf. They are nops in
+ * the binary when sys/sdt.h is available and compiled out otherwise.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(d2b, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(d2b, name, a, b, c, d)
+#else
+#define PROBE3(name, a, b, c)                                                  \
+    do {                                                                       \
+        (void)(a);                                                             \
+        (void)(b);                                                             \
+        (void)(c);                                                             \
+    } while (0)
+#define PROBE4(name, a, b, c, d)                                               \
+    do {                                                                       \
+        (void)(a);                                                             \
+        (void)(b);                                                             \
+        (void)(c);                                                             \
+        (void)(d);                                                             \
+    } while (0)
+#endif
+
+#endif
@@ -0,0 +1,603 @@
+#include "scan.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bdev.h"
+#include "ldm.h"
+#include "spindle.h"
+#include "throttle.h"
+
+/*
+ * Find LDM databases by their signatures when the PRIVHEAD that points to
+ * them is lost. Every disk is read in large chunks, in order, through the
+ * spindle scheduler, so a shelf of disks is read in parallel without too
+ * many streams on one of them. Every signature starts a sector, so a scan is
+ * one 64-bit load and a few compares per sector, far below the cost of the
+ * read.
+ */
+#define SCAN_CHUNK (8 * 1024 * 1024)
+#define SCAN_KEEP 512 /* bytes kept of a PRIVHEAD, TOCBLOCK or VMDB */
+#define SCAN_MAX_CANDIDATES 8
+/* used when no PRIVHEAD tells the size of a database */
+#define SCAN_CONFIG_SECTORS 2048
+/* chunks of a disk queued at once, the scheduler caps those running */
+#define SCAN_QUEUED_CHUNKS 4
+
+enum {
+    SCAN_PRIVHEAD = 0,
+    SCAN_TOCBLOCK,
+    SCAN_VMDB,
+    SCAN_VBLK,
+    NR_SCAN_TYPES,
+};
+
+static const char *type_names[NR_SCAN_TYPES] = { "PRIVHEAD", "TOCBLOCK",
+                                                 "VMDB", "VBLK" };
+
+typedef struct _scan_hit {
+    uint64_t lba;
+    int type;
+    uint8_t *data; /* NULL for VBLK */
+} scan_hit;
+
+typedef struct _scan_hits {
+    scan_hit *hits;
+    uint32_t nr;
+    uint32_t max;
+} scan_hits;
+
+typedef struct _scan_buffer {
+    uint8_t *data;
+    int busy;
+} scan_buffer;
+
+typedef struct _scan_disk {
+    int fd;
+    const char *path;
+    uint32_t sector_size;
+    uint64_t size;
+    uint64_t sectors;
+    uint64_t next_lba; /* first sector not queued yet */
+    uint64_t skipped;  /* sectors that failed to read */
+    struct timespec end;
+    int chunks_running;
+    int failed;
+    int timed_out; /* a read missed its deadline */
+
+    pthread_mutex_t lock;
+    scan_hits hits;
+} scan_disk;
+
+/* a chunk of a disk, queued again for the next one when it is done */
+typedef struct _scan_job {
+    spindle *sched;
+    scan_disk *disk;
+    uint64_t lba;
+    uint64_t sectors;
+} scan_job;
+
+typedef struct _scan_candidate {
+    uint64_t config_start;
+    uint64_t config_sectors;
+    int privheads;          /* PRIVHEAD copies pointing to it */
+    const scan_hit *toc;
+    const scan_hit *vmdb;
+    uint32_t vblks;         /* sectors starting with a VBLK */
+    int score;
+} scan_candidate;
+
+static uint64_t sig_privhead, sig_tocblock;
+static uint32_t sig_vmdb, sig_vblk;
+
+static scan_buffer *buffers;
+static int nr_buffers;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_free = PTHREAD_COND_INITIALIZER;
+
+static struct timespec start;
+
+static int add_hit(scan_hits *h, uint64_t lba, int type, const uint8_t *data,
+                   uint32_t sector_size) {
+    scan_hit *hit;
+
+    if (h->nr == h->max) {
+        uint32_t max = h->max ? h->max * 2 : 64;
+        scan_hit *hits = realloc(h->hits, max * sizeof(scan_hit));
+
+        if (!hits)
+            return -1;
+        h->hits = hits;
+        h->max = max;
+    }
+
+    hit = &h->hits[h->nr];
+    hit->lba = lba;
+    hit->type = type;
+    hit->data = NULL;
+    if (type != SCAN_VBLK) {
+        hit->data = malloc(SCAN_KEEP);
+        if (!hit->data)
+            return -1;
+        memcpy(hit->data, data,
+               sector_size < SCAN_KEEP ? sector_size : SCAN_KEEP);
+    }
+
+    h->nr++;
+    return 0;
+}
+
+static void free_hits(scan_hits *h) {
+    while (h->nr)
+        free(h->hits[--h->nr].data);
+    free(h->hits);
+    memset(h, 0, sizeof(*h));
+}
+
+static int scan_chunk(scan_disk *disk, const uint8_t *data, uint64_t lba,
+                      size_t len) {
+    const uint32_t sector_size = disk->sector_size;
+    scan_hits local = { 0 };
+    size_t off;
+    uint32_t i;
+    int err = 0;
+
+    for (off = 0; off + sizeof(uint64_t) <= len && !err; off += sector_size) {
+        const uint8_t *sector = data + off;
+        const uint64_t sector_lba = lba + off / sector_size;
+        uint64_t word;
+
+        memcpy(&word, sector, sizeof(word));
+        if (word == sig_privhead)
+            err = add_hit(&local, sector_lba, SCAN_PRIVHEAD, sector,
+                          sector_size);
+        else if (word == sig_tocblock)
+            err = add_hit(&local, sector_lba, SCAN_TOCBLOCK, sector,
+                          sector_size);
+        else if ((uint32_t)word == sig_vmdb)
+            err = add_hit(&local, sector_lba, SCAN_VMDB, sector, sector_size);
+        else if ((uint32_t)word == sig_vblk)
+            err = add_hit(&local, sector_lba, SCAN_VBLK, sector, sector_size);
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    for (i = 0; i < local.nr && !err; i++) {
+        scan_hit *hit = &local.hits[i];
+
+        err = add_hit(&disk->hits, hit->lba, hit->type, hit->data,
+                      sector_size);
+    }
+    pthread_mutex_unlock(&disk->lock);
+
+    free_hits(&local);
+    return err;
+}
+
+static scan_buffer *get_buffer(void) {
+    scan_buffer *buf = NULL;
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    while (!buf) {
+        for (i = 0; i < nr_buffers && !buf; i++) {
+            if (!buffers[i].busy)
+                buf = &buffers[i];
+        }
+        if (!buf)
+            pthread_cond_wait(&pool_free, &pool_lock);
+    }
+    buf->busy = 1;
+    pthread_mutex_unlock(&pool_lock);
+
+    return buf;
+}
+
+static void put_buffer(scan_buffer *buf) {
+    pthread_mutex_lock(&pool_lock);
+    buf->busy = 0;
+    pthread_cond_signal(&pool_free);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* claim the next chunk of the disk for job, 0 when the disk is done */
+static int next_chunk(scan_job *job) {
+    scan_disk *disk = job->disk;
+    int more = 0;
+
+    pthread_mutex_lock(&disk->lock);
+    if (disk->next_lba < disk->sectors && !disk->failed &&
+        !disk->timed_out) {
+        job->lba = disk->next_lba;
+        job->sectors = SCAN_CHUNK / disk->sector_size;
+        if (job->sectors > disk->sectors - job->lba)
+            job->sectors = disk->sectors - job->lba;
+        disk->next_lba += job->sectors;
+        disk->chunks_running++;
+        more = 1;
+    }
+    pthread_mutex_unlock(&disk->lock);
+
+    return more;
+}
+
+static void chunk_done(scan_disk *disk, int err) {
+    pthread_mutex_lock(&disk->lock);
+    if (err)
+        disk->failed = 1;
+    if (!--disk->chunks_running)
+        clock_gettime(CLOCK_MONOTONIC, &disk->end);
+    pthread_mutex_unlock(&disk->lock);
+}
+
+static void scan_job_run(void *arg) {
+    scan_job *job = arg;
+    scan_disk *disk = job->disk;
+    size_t len = job->sectors * disk->sector_size;
+    scan_buffer *buf = get_buffer();
+    int err = 0;
+
+    throttle_wait(len);
+    /* a damaged disk is what the scan is for, go on after bad reads */
+    if (bdev_read_lba(disk->fd, job->lba, buf->data, len) == len) {
+        err = scan_chunk(disk, buf->data, job->lba, len);
+    } else if (bdev_failed(disk->fd)) {
+        /* past its deadline, the other disks go on without it */
+        pthread_mutex_lock(&disk->lock);
+        disk->timed_out = 1;
+        pthread_mutex_unlock(&disk->lock);
+    } else {
+        printf("scan: failed to read lba %lu-%lu of %s, skipped\n", job->lba,
+               job->lba + job->sectors - 1, disk->path);
+        pthread_mutex_lock(&disk->lock);
+        disk->skipped += job->sectors;
+        pthread_mutex_unlock(&disk->lock);
+    }
+    put_buffer(buf);
+    chunk_done(disk, err);
+
+    if (!next_chunk(job)) {
+        free(job);
+        return;
+    }
+
+    if (spindle_submit(job->sched, disk->fd, job->lba * disk->sector_size,
+                       scan_job_run, job)) {
+        chunk_done(disk, 1);
+        free(job);
+    }
+}
+
+static int hit_cmp(const void *a, const void *b) {
+    const scan_hit *x = a, *y = b;
+
+    if (x->lba != y->lba)
+        return x->lba < y->lba ? -1 : 1;
+    return x->type - y->type;
+}
+
+static const scan_hit *find_hit(const scan_hits *h, uint64_t lba, int type) {
+    uint32_t lo = 0, hi = h->nr;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (h->hits[mid].lba < lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < h->nr && h->hits[lo].lba == lba; lo++) {
+        if (h->hits[lo].type == type)
+            return &h->hits[lo];
+    }
+
+    return NULL;
+}
+
+static scan_candidate *get_candidate(scan_candidate *cands, int *nr,
+                                     uint64_t config_start) {
+    int i;
+
+    for (i = 0; i < *nr; i++) {
+        if (cands[i].config_start == config_start)
+            return &cands[i];
+    }
+    if (*nr == SCAN_MAX_CANDIDATES)
+        return NULL;
+
+    memset(&cands[*nr], 0, sizeof(scan_candidate));
+    cands[*nr].config_start = config_start;
+    cands[*nr].config_sectors = SCAN_CONFIG_SECTORS;
+    return &cands[(*nr)++];
+}
+
+/*
+ * A database is where a PRIVHEAD points, or two sectors before a TOCBLOCK.
+ * It scores for every structure found where it says the next one is.
+ */
+static int build_candidates(const scan_disk *disk, scan_candidate *cands) {
+    const scan_hits *h = &disk->hits;
+    uint32_t i, j;
+    int nr = 0;
+
+    for (i = 0; i < h->nr; i++) {
+        const scan_hit *hit = &h->hits[i];
+        scan_candidate *cand = NULL;
+
+        if (hit->type == SCAN_PRIVHEAD) {
+            privhead_fields head;
+
+            privhead_decode((const privhead *)hit->data, &head);
+            cand = get_candidate(cands, &nr, head.ldm_config_start);
+            if (cand && !cand->privheads)
+                cand->config_sectors = head.ldm_config_size;
+            if (cand)
+                cand->privheads++;
+        } else if (hit->type == SCAN_TOCBLOCK && hit->lba >= 2) {
+            get_candidate(cands, &nr, hit->lba - 2);
+        }
+    }
+
+    for (i = 0; i < nr; i++) {
+        scan_candidate *cand = &cands[i];
+        uint64_t end;
+
+        if (cand->config_start + cand->config_sectors > disk->sectors) {
+            cand->score = -1;
+            continue;
+        }
+        end = cand->config_start + cand->config_sectors;
+
+        cand->toc = find_hit(h, cand->config_start + 2, SCAN_TOCBLOCK);
+        if (cand->toc) {
+            const tocblock *toc = (const tocblock *)cand->toc->data;
+
+            for (j = 0; j < 2; j++) {
+                if (!memcmp(toc->bitmap[j].name, "config", 6)) {
+                    tocblock_bitmap_fields bitmap;
+
+                    tocblock_bitmap_decode(&toc->bitmap[j], &bitmap);
+                    cand->vmdb = find_hit(h, cand->config_start + bitmap.start,
+                                          SCAN_VMDB);
+                    break;
+                }
+            }
+        }
+
+        for (j = 0; j < h->nr; j++) {
+            const scan_hit *hit = &h->hits[j];
+
+            if (hit->type == SCAN_VBLK && hit->lba > cand->config_start &&
+                hit->lba < end)
+                cand->vblks++;
+        }
+
+        cand->score = (cand->privheads ? 4 : 0) + (cand->toc ? 2 : 0) +
+                      (cand->vmdb ? 2 : 0) + (cand->vblks ? 1 : 0);
+    }
+
+    return nr;
+}
+
+static int candidate_cmp(const void *a, const void *b) {
+    const scan_candidate *x = a, *y = b;
+
+    if (x->score != y->score)
+        return y->score - x->score;
+    if (x->vblks != y->vblks)
+        return x->vblks < y->vblks ? 1 : -1;
+    /* then the database committed last */
+    if (x->vmdb && y->vmdb) {
+        vmdb_fields x_db, y_db;
+
+        vmdb_decode((const vmdb *)x->vmdb->data, &x_db);
+        vmdb_decode((const vmdb *)y->vmdb->data, &y_db);
+        if (x_db.committed_seq != y_db.committed_seq)
+            return x_db.committed_seq < y_db.committed_seq ? 1 : -1;
+    }
+    return 0;
+}
+
+static void print_candidate(int i, const scan_candidate *cand) {
+    printf("candidate %d: database at lba %lu, %lu sectors, score %d\n", i,
+           cand->config_start, cand->config_sectors, cand->score);
+    printf("  PRIVHEAD copies pointing to it: %d\n", cand->privheads);
+    printf("  TOCBLOCK: %s\n", cand->toc ? "found" : "missing");
+    if (cand->vmdb) {
+        const vmdb *db = (const vmdb *)cand->vmdb->data;
+        vmdb_fields f;
+
+        vmdb_decode(db, &f);
+        printf("  VMDB: lba %lu, disk group %.31s, committed sequence %lu\n",
+               cand->vmdb->lba, db->disk_group_name, f.committed_seq);
+    } else {
+        printf("  VMDB: missing\n");
+    }
+    printf("  sectors starting with a VBLK: %u\n", cand->vblks);
+}
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* rank the databases found on a disk and parse the best one */
+static int report_disk(scan_disk *disk) {
+    scan_candidate cands[SCAN_MAX_CANDIDATES];
+    uint32_t counts[NR_SCAN_TYPES] = { 0 };
+    uint64_t bytes = disk->size - disk->skipped * disk->sector_size;
+    double secs = elapsed(&start, &disk->end);
+    int i, nr_cands;
+
+    printf("%s: scanned %lu bytes in %.2f seconds, %.0f MB/s", disk->path,
+           bytes, secs, secs > 0 ? bytes / secs / 1e6 : 0);
+    if (disk->skipped)
+        printf(", %lu unreadable sectors skipped", disk->skipped);
+    printf("\n");
+
+    qsort(disk->hits.hits, disk->hits.nr, sizeof(scan_hit), hit_cmp);
+    for (i = 0; i < disk->hits.nr; i++) {
+        const scan_hit *hit = &disk->hits.hits[i];
+
+        counts[hit->type]++;
+        if (hit->type != SCAN_VBLK)
+            printf("%s at lba %lu\n", type_names[hit->type], hit->lba);
+    }
+    printf("found %u PRIVHEAD, %u TOCBLOCK, %u VMDB and %u VBLK sectors\n",
+           counts[SCAN_PRIVHEAD], counts[SCAN_TOCBLOCK], counts[SCAN_VMDB],
+           counts[SCAN_VBLK]);
+
+    nr_cands = build_candidates(disk, cands);
+    qsort(cands, nr_cands, sizeof(scan_candidate), candidate_cmp);
+    for (i = 0; i < nr_cands; i++) {
+        if (cands[i].score > 0)
+            print_candidate(i, &cands[i]);
+    }
+
+    if (!nr_cands || !cands[0].toc || !cands[0].vmdb) {
+        printf("Error: no database with a TOCBLOCK and a VMDB found\n");
+        return -1;
+    }
+
+    ldm_reset();
+    if (ldm_read_config(disk->fd, cands[0].config_start,
+                        cands[0].config_sectors)) {
+        printf("Error: candidate 0 does not parse\n");
+        return -1;
+    }
+    printf("candidate 0 parses, volumes are:\n");
+    ldm_print_volumes();
+    return 0;
+}
+
+/*
+ * Scan whole disks for LDM structures. The disks are read in parallel, at
+ * most streams chunks at a time on each rotational one, then reported one
+ * after the other.
+ */
+int scan_disks(int *fds, char *paths[], int nr_disks, int nr_threads,
+               int streams) {
+    scan_disk *disks;
+    spindle *sched = NULL;
+    struct timespec now;
+    uint64_t total = 0;
+    double secs;
+    int i, j, ret = -1;
+
+    memcpy(&sig_privhead, "PRIVHEAD", sizeof(sig_privhead));
+    memcpy(&sig_tocblock, "TOCBLOCK", sizeof(sig_tocblock));
+    memcpy(&sig_vmdb, "VMDB", sizeof(sig_vmdb));
+    memcpy(&sig_vblk, "VBLK", sizeof(sig_vblk));
+
+    disks = calloc(nr_disks, sizeof(scan_disk));
+    if (!disks) {
+        printf("scan: failed to malloc\n");
+        return -1;
+    }
+
+    for (i = 0; i < nr_disks; i++) {
+        scan_disk *disk = &disks[i];
+
+        disk->fd = fds[i];
+        disk->path = paths[i];
+        disk->sector_size = bdev_get_sector_size(fds[i]);
+        pthread_mutex_init(&disk->lock, NULL);
+        if (bdev_get_size(fds[i], &disk->size)) {
+            printf("scan: failed to get the size of %s\n", paths[i]);
+            goto out;
+        }
+        disk->sectors = disk->size / disk->sector_size;
+        total += disk->size;
+        posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    /* a worker holds one buffer at most */
+    nr_buffers = nr_threads;
+    buffers = calloc(nr_buffers, sizeof(scan_buffer));
+    if (!buffers) {
+        printf("scan: failed to malloc\n");
+        goto out;
+    }
+    for (i = 0; i < nr_buffers; i++) {
+        buffers[i].data = malloc(SCAN_CHUNK);
+        if (!buffers[i].data) {
+            printf("scan: failed to malloc\n");
+            goto out;
+        }
+    }
+
+    sched = spindle_create(nr_threads, streams);
+    if (!sched)
+        goto out;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nr_disks; i++) {
+        disks[i].end = start;
+        for (j = 0; j < SCAN_QUEUED_CHUNKS; j++) {
+            scan_job *job = calloc(1, sizeof(scan_job));
+
+            if (!job) {
+                printf("scan: failed to malloc\n");
+                break;
+            }
+            job->sched = sched;
+            job->disk = &disks[i];
+            if (!next_chunk(job)) {
+                free(job);
+                break;
+            }
+            if (spindle_submit(sched, fds[i],
+                               job->lba * disks[i].sector_size, scan_job_run,
+                               job)) {
+                chunk_done(&disks[i], 1);
+                free(job);
+                break;
+            }
+        }
+    }
+    spindle_wait(sched);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = elapsed(&start, &now);
+    printf("Info: scanned %d disks on %d spindles, %lu bytes in %.2f "
+           "seconds, %.0f MB/s\n",
+           nr_disks, spindle_nr_disks(sched), total, secs,
+           secs > 0 ? total / secs / 1e6 : 0);
+
+    ret = 0;
+    for (i = 0; i < nr_disks; i++) {
+        if (disks[i].timed_out) {
+            printf("scan: %s did not answer in %u ms, not scanned\n",
+                   paths[i], bdev_get_timeout());
+            ret = -1;
+            continue;
+        }
+        if (disks[i].failed) {
+            printf("scan: failed to scan %s\n", paths[i]);
+            ret = -1;
+            continue;
+        }
+        if (report_disk(&disks[i]))
+            ret = -1;
+    }
+
+out:
+    if (sched)
+        spindle_destroy(sched);
+    for (i = 0; buffers && i < nr_buffers; i++)
+        free(buffers[i].data);
+    free(buffers);
+    buffers = NULL;
+    for (i = 0; i < nr_disks; i++) {
+        free_hits(&disks[i].hits);
+        pthread_mutex_destroy(&disks[i].lock);
+    }
+    free(disks);
+    return ret;
+}
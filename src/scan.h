@@ -0,0 +1,7 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+int scan_disks(int *fds, char *paths[], int nr_disks, int nr_threads,
+               int streams);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __SCHEMA_H__
+#define __SCHEMA_H__
+
+#include <endian.h>
+#include <stdint.h>
+
+/*
+ * Field tables of on-disk headers. A table lists X(bits, field) for every
+ * integer field d2b reads, and SCHEMA_HEADER() turns it into a struct of
+ * host-order copies and a decoder that converts them all in one go, so the
+ * code that uses a header never converts a field itself.
+ */
+#define SCHEMA_HOST_FIELD(bits, field) uint##bits##_t field;
+#define SCHEMA_BE_FIELD(bits, field) f->field = be##bits##toh(raw->field);
+#define SCHEMA_LE_FIELD(bits, field) f->field = le##bits##toh(raw->field);
+
+/* name##_fields and name##_decode() for the raw struct name, order BE or LE */
+#define SCHEMA_HEADER(name, FIELDS, order)                                     \
+    typedef struct _##name##_fields {                                          \
+        FIELDS(SCHEMA_HOST_FIELD)                                              \
+    } name##_fields;                                                           \
+                                                                               \
+    static inline void name##_decode(const name *raw, name##_fields *f) {      \
+        FIELDS(SCHEMA_##order##_FIELD)                                         \
+    }
+
+#endif
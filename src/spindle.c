@@ -0,0 +1,363 @@
+#include "spindle.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "bdev.h"
+#include "list.h"
+
+/*
+ * A work queue that knows which disk each item reads. Items wait in a queue
+ * per physical disk, sorted by offset, and a disk never has more than its
+ * cap of items running: a rotational disk serves a few sequential streams
+ * well and many of them badly. A solid state disk has no cap. The workers
+ * take the disks in turn, so the throughput grows with the number of disks
+ * rather than with the number of threads.
+ */
+typedef struct _spindle_item {
+    struct list_head list;
+    uint64_t offset;
+    spindle_fn fn;
+    void *arg;
+} spindle_item;
+
+typedef struct _spindle_disk {
+    struct list_head list;
+    dev_t dev;              /* the whole disk */
+    struct list_head queue; /* sorted by offset */
+    uint64_t position;      /* offset of the last item started */
+    int running;
+    int cap;
+} spindle_disk;
+
+/* an fd items were queued for, with where it starts on its disk */
+typedef struct _spindle_source {
+    struct list_head list;
+    int fd;
+    uint64_t base; /* bytes */
+    spindle_disk *disk;
+} spindle_source;
+
+struct _spindle {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+
+    struct list_head sources;
+    struct list_head disks;
+    int nr_disks;
+    spindle_disk *next_disk; /* where the round robin resumes */
+    int pending;
+    int running;
+    int streams;
+    int stop;
+
+    int nr_threads;
+    pthread_t *threads;
+};
+
+/*
+ * The disk behind fd: a partition maps to its whole disk, and its offsets
+ * start at base there, a file maps to the disk of its file system.
+ */
+static void disk_of(int fd, dev_t *dev, uint64_t *base, int *rotational) {
+    char path[PATH_MAX], value[64];
+    unsigned int maj, min;
+    struct stat st;
+
+    *dev = 0;
+    *base = 0;
+    *rotational = 1;
+    if (fstat(fd, &st))
+        return;
+
+    *dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/start", major(*dev),
+             minor(*dev));
+    if (S_ISBLK(st.st_mode) && !bdev_read_sysfs_u64(path, base)) {
+        *base *= BDEV_SYSFS_SECTOR_SIZE;
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev",
+                 major(*dev), minor(*dev));
+        if (!bdev_read_sysfs(path, value, sizeof(value)) &&
+            sscanf(value, "%u:%u", &maj, &min) == 2)
+            *dev = makedev(maj, min);
+    }
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational",
+             major(*dev), minor(*dev));
+    if (!bdev_read_sysfs(path, value, sizeof(value)))
+        *rotational = value[0] != '0';
+}
+
+static spindle_source *get_source(spindle *s, int fd) {
+    struct list_head *pos;
+    spindle_source *source;
+    spindle_disk *disk = NULL;
+    int rotational;
+    dev_t dev;
+
+    list_for_each(pos, &s->sources) {
+        source = list_entry(pos, spindle_source, list);
+        if (source->fd == fd)
+            return source;
+    }
+
+    source = calloc(1, sizeof(spindle_source));
+    if (!source) {
+        printf("spindle: failed to malloc\n");
+        return NULL;
+    }
+
+    disk_of(fd, &dev, &source->base, &rotational);
+    list_for_each(pos, &s->disks) {
+        if (list_entry(pos, spindle_disk, list)->dev == dev) {
+            disk = list_entry(pos, spindle_disk, list);
+            break;
+        }
+    }
+
+    if (!disk) {
+        disk = calloc(1, sizeof(spindle_disk));
+        if (!disk) {
+            printf("spindle: failed to malloc\n");
+            free(source);
+            return NULL;
+        }
+
+        disk->dev = dev;
+        disk->cap = rotational ? s->streams : INT_MAX;
+        INIT_LIST_HEAD(&disk->queue);
+        list_add_tail(&disk->list, &s->disks);
+        s->nr_disks++;
+    }
+
+    source->fd = fd;
+    source->disk = disk;
+    list_add_tail(&source->list, &s->sources);
+    return source;
+}
+
+/*
+ * The next item of a disk in elevator order: the first one at or past the
+ * head, or the lowest one once the head reached the end.
+ */
+static spindle_item *next_item(spindle_disk *disk) {
+    struct list_head *pos;
+
+    list_for_each(pos, &disk->queue) {
+        spindle_item *item = list_entry(pos, spindle_item, list);
+
+        if (item->offset >= disk->position)
+            return item;
+    }
+
+    return list_entry(disk->queue.next, spindle_item, list);
+}
+
+/* the next disk, from the round robin position, with work and room */
+static spindle_disk *pick_disk(spindle *s) {
+    struct list_head *pos;
+    int i;
+
+    if (!s->next_disk)
+        return NULL;
+
+    pos = &s->next_disk->list;
+    for (i = 0; i < s->nr_disks; i++) {
+        spindle_disk *disk = list_entry(pos, spindle_disk, list);
+
+        pos = pos->next;
+        if (pos == &s->disks)
+            pos = pos->next;
+
+        if (disk->queue.next != &disk->queue && disk->running < disk->cap) {
+            s->next_disk = list_entry(pos, spindle_disk, list);
+            return disk;
+        }
+    }
+
+    return NULL;
+}
+
+static void *spindle_worker(void *arg) {
+    spindle *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        spindle_disk *disk;
+        spindle_item *item;
+
+        while (!(disk = pick_disk(s)) && !s->stop)
+            pthread_cond_wait(&s->work, &s->lock);
+        if (!disk)
+            break;
+
+        item = next_item(disk);
+        list_del(&item->list);
+        disk->position = item->offset;
+        disk->running++;
+        s->pending--;
+        s->running++;
+        pthread_mutex_unlock(&s->lock);
+
+        item->fn(item->arg);
+        free(item);
+
+        pthread_mutex_lock(&s->lock);
+        disk->running--;
+        s->running--;
+        /* the disk has room again */
+        pthread_cond_signal(&s->work);
+        if (!s->pending && !s->running)
+            pthread_cond_broadcast(&s->idle);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/*
+ * streams_per_disk caps the items running on each rotational disk, 0 for
+ * SPINDLE_DEFAULT_STREAMS.
+ */
+spindle *spindle_create(int nr_threads, int streams_per_disk) {
+    spindle *s;
+    int i;
+
+    s = calloc(1, sizeof(spindle));
+    if (!s) {
+        printf("spindle: failed to malloc\n");
+        return NULL;
+    }
+
+    s->threads = calloc(nr_threads, sizeof(pthread_t));
+    if (!s->threads) {
+        printf("spindle: failed to malloc\n");
+        free(s);
+        return NULL;
+    }
+
+    s->streams = streams_per_disk > 0 ? streams_per_disk
+                                      : SPINDLE_DEFAULT_STREAMS;
+    INIT_LIST_HEAD(&s->sources);
+    INIT_LIST_HEAD(&s->disks);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->idle, NULL);
+
+    for (i = 0; i < nr_threads; i++) {
+        if (pthread_create(&s->threads[i], NULL, spindle_worker, s)) {
+            printf("spindle: failed to create thread\n");
+            break;
+        }
+        s->nr_threads++;
+    }
+
+    if (!s->nr_threads) {
+        spindle_destroy(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+/*
+ * Queue fn to read around offset of fd. Items of a disk run in offset order
+ * whatever order they are queued in.
+ */
+int spindle_submit(spindle *s, int fd, uint64_t offset, spindle_fn fn,
+                   void *arg) {
+    spindle_source *source;
+    spindle_item *item;
+    spindle_disk *disk;
+    struct list_head *pos;
+
+    item = malloc(sizeof(spindle_item));
+    if (!item) {
+        printf("spindle: failed to malloc\n");
+        return -1;
+    }
+    item->fn = fn;
+    item->arg = arg;
+
+    pthread_mutex_lock(&s->lock);
+    source = get_source(s, fd);
+    if (!source || s->stop) {
+        pthread_mutex_unlock(&s->lock);
+        free(item);
+        return -1;
+    }
+    disk = source->disk;
+    item->offset = source->base + offset;
+
+    /* items mostly come in order, look for their place from the end */
+    for (pos = disk->queue.prev; pos != &disk->queue; pos = pos->prev) {
+        if (list_entry(pos, spindle_item, list)->offset <= item->offset)
+            break;
+    }
+    __list_add(&item->list, pos, pos->next);
+
+    if (!s->next_disk)
+        s->next_disk = disk;
+    s->pending++;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+
+    return 0;
+}
+
+void spindle_wait(spindle *s) {
+    pthread_mutex_lock(&s->lock);
+    while (s->pending || s->running)
+        pthread_cond_wait(&s->idle, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+int spindle_nr_disks(spindle *s) {
+    int nr;
+
+    pthread_mutex_lock(&s->lock);
+    nr = s->nr_disks;
+    pthread_mutex_unlock(&s->lock);
+
+    return nr;
+}
+
+/* The items still queued run before the workers exit. */
+void spindle_destroy(spindle *s) {
+    struct list_head *pos, *next, *ipos, *inext;
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+
+    for (i = 0; i < s->nr_threads; i++)
+        pthread_join(s->threads[i], NULL);
+
+    list_for_each_safe(pos, next, &s->sources) {
+        free(list_entry(pos, spindle_source, list));
+    }
+    list_for_each_safe(pos, next, &s->disks) {
+        spindle_disk *disk = list_entry(pos, spindle_disk, list);
+
+        list_for_each_safe(ipos, inext, &disk->queue) {
+            free(list_entry(ipos, spindle_item, list));
+        }
+        free(disk);
+    }
+
+    pthread_cond_destroy(&s->idle);
+    pthread_cond_destroy(&s->work);
+    pthread_mutex_destroy(&s->lock);
+    free(s->threads);
+    free(s);
+}
@@ -0,0 +1,20 @@
+#ifndef __SPINDLE_H__
+#define __SPINDLE_H__
+
+#include <stdint.h>
+
+/* sequential streams in flight on one rotational disk */
+#define SPINDLE_DEFAULT_STREAMS 2
+
+typedef void (*spindle_fn)(void *arg);
+
+typedef struct _spindle spindle;
+
+spindle *spindle_create(int nr_threads, int streams_per_disk);
+int spindle_submit(spindle *s, int fd, uint64_t offset, spindle_fn fn,
+                   void *arg);
+void spindle_wait(spindle *s);
+void spindle_destroy(spindle *s);
+int spindle_nr_disks(spindle *s);
+
+#endif
@@ -0,0 +1,169 @@
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ldm.h"
+
+typedef struct _phase_stats {
+    uint64_t calls;
+    uint64_t nsec;
+    uint64_t allocs;
+    bdev_stats io;
+} phase_stats;
+
+static const char *phase_names[NR_STATS_PHASES] = {
+    "probe", "gpt", "privhead", "config", "vblk", "resolve", "write",
+};
+
+/* indexed by the type of the VBLK record */
+static const char *vblk_names[STATS_VBLK_TYPES] = {
+    [VBLK_BLACK] = "blank",          [VBLK_VOLUME] = "volume",
+    [VBLK_COMPONENT] = "component",  [VBLK_PARTITION] = "partition",
+    [VBLK_DISK] = "disk",            [VBLK_DISK_GROUP] = "disk_group",
+};
+
+int stats_enabled = 0;
+
+static uint64_t start_nsec;
+static phase_stats phases[NR_STATS_PHASES];
+static uint64_t vblks[STATS_VBLK_TYPES];
+static uint64_t extended_vblks;
+
+/*
+ * Heap usage, counted through the --wrap linker flags of the Makefile. The
+ * __real_ symbols are weak so that programs linked without them still link.
+ */
+static uint64_t heap_allocs;
+static uint64_t heap_frees;
+static uint64_t heap_bytes;
+
+void *__real_malloc(size_t size) __attribute__((weak));
+void *__real_calloc(size_t nmemb, size_t size) __attribute__((weak));
+void *__real_realloc(void *ptr, size_t size) __attribute__((weak));
+void __real_free(void *ptr) __attribute__((weak));
+
+static void count_alloc(size_t size) {
+    if (stats_enabled) {
+        __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&heap_bytes, size, __ATOMIC_RELAXED);
+    }
+}
+
+void *__wrap_malloc(size_t size) {
+    count_alloc(size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    count_alloc(nmemb * size);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    count_alloc(size);
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    if (stats_enabled && ptr)
+        __atomic_add_fetch(&heap_frees, 1, __ATOMIC_RELAXED);
+    __real_free(ptr);
+}
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_enable(void) {
+    start_nsec = now_nsec();
+    stats_enabled = 1;
+}
+
+void stats_timer_start(stats_timer *timer) {
+    bdev_get_stats(&timer->io);
+    timer->allocs = heap_allocs;
+    timer->start = now_nsec();
+}
+
+void stats_timer_stop(stats_timer *timer, int phase) {
+    phase_stats *p = &phases[phase];
+    bdev_stats io;
+
+    p->nsec += now_nsec() - timer->start;
+    p->calls++;
+    p->allocs += heap_allocs - timer->allocs;
+
+    bdev_get_stats(&io);
+    p->io.ioctls += io.ioctls - timer->io.ioctls;
+    p->io.reads += io.reads - timer->io.reads;
+    p->io.writes += io.writes - timer->io.writes;
+    p->io.bytes_read += io.bytes_read - timer->io.bytes_read;
+    p->io.bytes_written += io.bytes_written - timer->io.bytes_written;
+    p->io.sectors_unchanged +=
+        io.sectors_unchanged - timer->io.sectors_unchanged;
+}
+
+void stats_add_vblk(int type, int extended) {
+    vblks[type & (STATS_VBLK_TYPES - 1)]++;
+    if (extended)
+        extended_vblks++;
+}
+
+static void print_io(FILE *out, const bdev_stats *io) {
+    fprintf(out,
+            "\"ioctls\": %lu, \"reads\": %lu, \"writes\": %lu, "
+            "\"bytes_read\": %lu, \"bytes_written\": %lu, "
+            "\"sectors_unchanged\": %lu",
+            io->ioctls, io->reads, io->writes, io->bytes_read,
+            io->bytes_written, io->sectors_unchanged);
+}
+
+/*
+ * One JSON object with the totals, the phases in the order they run and the
+ * VBLK records by type. Types without a name are reported by number.
+ */
+void stats_print_json(FILE *out) {
+    bdev_stats io;
+    int i, first = 1;
+
+    bdev_get_stats(&io);
+
+    fprintf(out, "{\n  \"wall_nsec\": %lu,\n  \"io\": { ",
+            now_nsec() - start_nsec);
+    print_io(out, &io);
+    fprintf(out, " },\n  \"heap\": { \"allocs\": %lu, \"frees\": %lu, "
+                 "\"bytes\": %lu },\n",
+            heap_allocs, heap_frees, heap_bytes);
+
+    fprintf(out, "  \"phases\": {\n");
+    for (i = 0; i < NR_STATS_PHASES; i++) {
+        const phase_stats *p = &phases[i];
+
+        fprintf(out,
+                "    \"%s\": { \"calls\": %lu, \"nsec\": %lu, "
+                "\"allocs\": %lu, ",
+                phase_names[i], p->calls, p->nsec, p->allocs);
+        print_io(out, &p->io);
+        fprintf(out, " }%s\n", i < NR_STATS_PHASES - 1 ? "," : "");
+    }
+
+    fprintf(out, "  },\n  \"vblks\": { ");
+    for (i = 0; i < STATS_VBLK_TYPES; i++) {
+        if (!vblks[i] && !vblk_names[i])
+            continue;
+        if (vblk_names[i])
+            fprintf(out, "%s\"%s\": %lu", first ? "" : ", ", vblk_names[i],
+                    vblks[i]);
+        else
+            fprintf(out, "%s\"type_%d\": %lu", first ? "" : ", ", i,
+                    vblks[i]);
+        first = 0;
+    }
+    fprintf(out, ", \"extended\": %lu }\n}\n", extended_vblks);
+    fflush(out);
+}
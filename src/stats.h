@@ -0,0 +1,53 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bdev.h"
+
+/* phases of a conversion, each timed in the layer that runs it */
+enum {
+    STATS_PROBE = 0,
+    STATS_GPT,
+    STATS_PRIVHEAD,
+    STATS_CONFIG,
+    STATS_VBLK,
+    STATS_RESOLVE,
+    STATS_WRITE,
+    NR_STATS_PHASES,
+};
+
+#define STATS_VBLK_TYPES 16
+
+typedef struct _stats_timer {
+    uint64_t start;
+    uint64_t allocs;
+    bdev_stats io;
+} stats_timer;
+
+/* everything is a no-op until stats_enable() */
+extern int stats_enabled;
+
+void stats_enable(void);
+void stats_timer_start(stats_timer *timer);
+void stats_timer_stop(stats_timer *timer, int phase);
+void stats_add_vblk(int type, int extended);
+void stats_print_json(FILE *out);
+
+static inline void stats_phase_begin(stats_timer *timer) {
+    if (stats_enabled)
+        stats_timer_start(timer);
+}
+
+static inline void stats_phase_end(stats_timer *timer, int phase) {
+    if (stats_enabled)
+        stats_timer_stop(timer, phase);
+}
+
+static inline void stats_count_vblk(int type, int extended) {
+    if (stats_enabled)
+        stats_add_vblk(type, extended);
+}
+
+#endif
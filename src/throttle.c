@@ -0,0 +1,201 @@
+#include "throttle.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* from linux/ioprio.h, which older kernel headers do not export */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/* longest sleep before the limits are looked at again */
+#define THROTTLE_MAX_SLEEP_NS (100 * 1000 * 1000)
+
+/*
+ * Token buckets shared by every bulk reader of the process, holding up to
+ * one second of bandwidth and of operations. An I/O may take more tokens
+ * than are left, it then waits for the debt to be paid before the next one,
+ * so large chunks are never split to fit the limit.
+ */
+static struct {
+    pthread_mutex_t lock;
+    uint64_t bytes_per_sec;
+    uint32_t iops;
+    double bytes;
+    double ops;
+    struct timespec last;
+} bucket = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static volatile sig_atomic_t paused;
+
+static double since(const struct timespec *last, struct timespec *now) {
+    clock_gettime(CLOCK_MONOTONIC, now);
+    return (now->tv_sec - last->tv_sec) + (now->tv_nsec - last->tv_nsec) / 1e9;
+}
+
+static void refill(void) {
+    struct timespec now;
+    double elapsed = since(&bucket.last, &now);
+
+    bucket.last = now;
+    bucket.bytes += elapsed * bucket.bytes_per_sec;
+    if (bucket.bytes > bucket.bytes_per_sec)
+        bucket.bytes = bucket.bytes_per_sec;
+    bucket.ops += elapsed * bucket.iops;
+    if (bucket.ops > bucket.iops)
+        bucket.ops = bucket.iops;
+}
+
+/* Change the limits, also while a move is running. */
+void throttle_set(uint64_t bytes_per_sec, uint32_t iops) {
+    pthread_mutex_lock(&bucket.lock);
+    refill();
+    bucket.bytes_per_sec = bytes_per_sec;
+    bucket.iops = iops;
+    if (bucket.bytes > bytes_per_sec)
+        bucket.bytes = bytes_per_sec;
+    if (bucket.ops > iops)
+        bucket.ops = iops;
+    pthread_mutex_unlock(&bucket.lock);
+}
+
+void throttle_get(uint64_t *bytes_per_sec, uint32_t *iops) {
+    pthread_mutex_lock(&bucket.lock);
+    *bytes_per_sec = bucket.bytes_per_sec;
+    *iops = bucket.iops;
+    pthread_mutex_unlock(&bucket.lock);
+}
+
+/* Wait until one I/O of bytes is allowed, and account for it. */
+void throttle_wait(uint64_t bytes) {
+    struct timespec ts;
+    double wait;
+
+    for (;;) {
+        pthread_mutex_lock(&bucket.lock);
+        if (paused || (!bucket.bytes_per_sec && !bucket.iops)) {
+            pthread_mutex_unlock(&bucket.lock);
+            return;
+        }
+
+        refill();
+        wait = 0;
+        if (bucket.bytes_per_sec && bucket.bytes < 0)
+            wait = -bucket.bytes / bucket.bytes_per_sec;
+        if (bucket.iops && bucket.ops < 0 && -bucket.ops / bucket.iops > wait)
+            wait = -bucket.ops / bucket.iops;
+
+        if (wait == 0) {
+            if (bucket.bytes_per_sec)
+                bucket.bytes -= bytes;
+            if (bucket.iops)
+                bucket.ops -= 1;
+            pthread_mutex_unlock(&bucket.lock);
+            return;
+        }
+        pthread_mutex_unlock(&bucket.lock);
+
+        if (wait * 1e9 > THROTTLE_MAX_SLEEP_NS)
+            wait = THROTTLE_MAX_SLEEP_NS / 1e9;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Parse a bandwidth such as 50M, with a K, M or G suffix in powers of 1024. */
+int throttle_parse_rate(const char *str, uint64_t *bytes_per_sec) {
+    char *end;
+    uint64_t value;
+
+    errno = 0;
+    value = strtoull(str, &end, 10);
+    if (errno || end == str)
+        return -1;
+
+    switch (*end) {
+    case 'G':
+    case 'g':
+        value <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        value <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+
+    if (*end)
+        return -1;
+
+    *bytes_per_sec = value;
+    return 0;
+}
+
+/*
+ * Put the I/O of the process in the idle class, or best-effort at a level
+ * from 0 (highest) to 7, e.g. "idle", "be" or "be:7". Threads created later
+ * inherit it. Only the BFQ scheduler acts on it.
+ */
+int throttle_set_ioprio(const char *spec) {
+    int class, level = 4;
+
+    if (!strcmp(spec, "idle")) {
+        class = IOPRIO_CLASS_IDLE;
+        level = 0;
+    } else if (!strncmp(spec, "be", 2) &&
+               (!spec[2] || (spec[2] == ':' && spec[3] >= '0' &&
+                             spec[3] <= '7' && !spec[4]))) {
+        class = IOPRIO_CLASS_BE;
+        if (spec[2])
+            level = spec[3] - '0';
+    } else {
+        printf("Error: unknown I/O priority %s, use idle, be or be:0-7\n",
+               spec);
+        return -1;
+    }
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                class << IOPRIO_CLASS_SHIFT | level)) {
+        printf("Error: failed to set the I/O priority, errno is %d\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void throttle_signal(int sig) {
+    static const char lifted[] = "Info: throttle lifted\n";
+    static const char restored[] = "Info: throttle restored\n";
+
+    paused = !paused;
+    if (write(STDERR_FILENO, paused ? lifted : restored,
+              paused ? sizeof(lifted) - 1 : sizeof(restored) - 1) < 0)
+        return;
+}
+
+/*
+ * SIGUSR2 lifts the limits until the next SIGUSR2, e.g. to let a move run
+ * at full speed once the array is quiet.
+ */
+void throttle_install(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = throttle_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+}
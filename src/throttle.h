@@ -0,0 +1,14 @@
+#ifndef __THROTTLE_H__
+#define __THROTTLE_H__
+
+#include <stdint.h>
+
+/* 0 means no limit */
+void throttle_set(uint64_t bytes_per_sec, uint32_t iops);
+void throttle_get(uint64_t *bytes_per_sec, uint32_t *iops);
+void throttle_wait(uint64_t bytes);
+int throttle_parse_rate(const char *str, uint64_t *bytes_per_sec);
+int throttle_set_ioprio(const char *spec);
+void throttle_install(void);
+
+#endif
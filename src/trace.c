@@ -0,0 +1,426 @@
+#include "trace.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bdev.h"
+
+#define TRACE_MAGIC "D2BTRACE"
+#define TRACE_VERSION 1
+
+enum {
+    TRACE_READ = 'R',
+    TRACE_WRITE = 'W',
+};
+
+typedef struct _trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t sector_size;
+    uint32_t physical_block_size;
+    uint32_t optimal_io_size;
+    uint64_t size;
+} __attribute__((__packed__)) trace_header;
+
+/* followed by count bytes of data */
+typedef struct _trace_record {
+    uint8_t op;
+    uint64_t offset;
+    uint32_t count;
+} __attribute__((__packed__)) trace_record;
+
+typedef struct _trace_sector {
+    uint64_t lba;
+    uint32_t valid; /* bytes known from the start of the sector */
+    uint32_t seq;   /* order in the trace */
+    uint8_t *data;
+} trace_sector;
+
+typedef struct _trace {
+    bdev_backend backend;
+    int fd;
+
+    /* capture */
+    gzFile gz;
+
+    /* replay */
+    trace_sector *sectors;
+    uint32_t nr_sectors;
+    uint32_t max_sectors;
+} trace;
+
+static int put_record(trace *t, uint8_t op, const uint8_t *buffer,
+                      size_t count, uint64_t offset) {
+    trace_record rec;
+
+    rec.op = op;
+    rec.offset = htole64(offset);
+    rec.count = htole32(count);
+    if (gzwrite(t->gz, &rec, sizeof(rec)) != sizeof(rec) ||
+        gzwrite(t->gz, buffer, count) != count) {
+        printf("trace: failed to write trace\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static ssize_t capture_pread(void *priv, uint8_t *buffer, size_t count,
+                             uint64_t offset) {
+    trace *t = priv;
+    ssize_t ret = pread(t->fd, buffer, count, offset);
+
+    if (ret > 0 && put_record(t, TRACE_READ, buffer, ret, offset))
+        return -1;
+    return ret;
+}
+
+static ssize_t capture_pwrite(void *priv, const uint8_t *buffer, size_t count,
+                              uint64_t offset) {
+    trace *t = priv;
+    ssize_t ret = pwrite(t->fd, buffer, count, offset);
+
+    if (ret > 0 && put_record(t, TRACE_WRITE, buffer, ret, offset))
+        return -1;
+    return ret;
+}
+
+/*
+ * Record every sector read or written through fd from now on. The geometry
+ * is probed once and stored in the trace header.
+ */
+int trace_capture(int fd, const char *path) {
+    trace_header header;
+    trace *t;
+    uint64_t size;
+
+    if (bdev_get_size(fd, &size)) {
+        printf("trace: failed to get the size of the device\n");
+        return -1;
+    }
+
+    t = calloc(1, sizeof(trace));
+    if (!t) {
+        printf("trace: failed to malloc\n");
+        return -1;
+    }
+
+    t->fd = fd;
+    t->backend.sector_size = bdev_get_sector_size(fd);
+    t->backend.physical_block_size = bdev_get_physical_block_size(fd);
+    t->backend.optimal_io_size = bdev_get_optimal_io_size(fd);
+    t->backend.size = size;
+    t->backend.pread = capture_pread;
+    t->backend.pwrite = capture_pwrite;
+    t->backend.priv = t;
+
+    t->gz = gzopen(path, "wb");
+    if (!t->gz) {
+        printf("trace: failed to create %s, errno is %d\n", path, errno);
+        free(t);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = htole32(TRACE_VERSION);
+    header.sector_size = htole32(t->backend.sector_size);
+    header.physical_block_size = htole32(t->backend.physical_block_size);
+    header.optimal_io_size = htole32(t->backend.optimal_io_size);
+    header.size = htole64(size);
+
+    if (gzwrite(t->gz, &header, sizeof(header)) != sizeof(header) ||
+        bdev_attach(fd, &t->backend)) {
+        printf("trace: failed to write %s\n", path);
+        gzclose(t->gz);
+        free(t);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int sector_cmp(const void *a, const void *b) {
+    const trace_sector *x = a, *y = b;
+
+    if (x->lba != y->lba)
+        return x->lba < y->lba ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* index of the first sector at or after lba */
+static uint32_t sector_index(const trace *t, uint64_t lba) {
+    uint32_t lo = 0, hi = t->nr_sectors;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (t->sectors[mid].lba < lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static trace_sector *find_sector(trace *t, uint64_t lba) {
+    uint32_t i = sector_index(t, lba);
+
+    return i < t->nr_sectors && t->sectors[i].lba == lba ? &t->sectors[i]
+                                                         : NULL;
+}
+
+/* a new sector at index pos, which keeps the array sorted */
+static trace_sector *insert_sector(trace *t, uint32_t pos, uint64_t lba) {
+    trace_sector *sector;
+
+    if (t->nr_sectors == t->max_sectors) {
+        uint32_t max = t->max_sectors ? t->max_sectors * 2 : 256;
+        trace_sector *sectors = realloc(t->sectors, max * sizeof(*sectors));
+
+        if (!sectors)
+            return NULL;
+        t->sectors = sectors;
+        t->max_sectors = max;
+    }
+
+    sector = &t->sectors[pos];
+    memmove(sector + 1, sector, (t->nr_sectors - pos) * sizeof(*sector));
+    memset(sector, 0, sizeof(*sector));
+    sector->lba = lba;
+    sector->seq = t->nr_sectors++;
+    sector->data = calloc(1, t->backend.sector_size);
+
+    return sector->data ? sector : NULL;
+}
+
+static ssize_t replay_pread(void *priv, uint8_t *buffer, size_t count,
+                            uint64_t offset) {
+    const uint32_t sector_size = ((trace *)priv)->backend.sector_size;
+    size_t done = 0;
+
+    while (done < count) {
+        uint64_t lba = (offset + done) / sector_size;
+        uint32_t in = (offset + done) % sector_size;
+        uint32_t len = sector_size - in;
+        trace_sector *sector = find_sector(priv, lba);
+
+        if (len > count - done)
+            len = count - done;
+
+        if (!sector || sector->valid < in + len) {
+            if (done)
+                break;
+            printf("trace: lba %lu was not captured\n", lba);
+            errno = EIO;
+            return -1;
+        }
+
+        memcpy(buffer + done, sector->data + in, len);
+        done += len;
+    }
+
+    return done;
+}
+
+/* writes stay in memory, so the parse after them sees what was written */
+static ssize_t replay_pwrite(void *priv, const uint8_t *buffer, size_t count,
+                             uint64_t offset) {
+    trace *t = priv;
+    const uint32_t sector_size = t->backend.sector_size;
+    size_t done = 0;
+
+    while (done < count) {
+        uint64_t lba = (offset + done) / sector_size;
+        uint32_t in = (offset + done) % sector_size;
+        uint32_t len = sector_size - in;
+        trace_sector *sector = find_sector(t, lba);
+
+        if (len > count - done)
+            len = count - done;
+
+        if (!sector) {
+            sector = insert_sector(t, sector_index(t, lba), lba);
+            if (!sector) {
+                errno = ENOMEM;
+                return done ? done : -1;
+            }
+        }
+
+        memcpy(sector->data + in, buffer + done, len);
+        if (sector->valid < in + len)
+            sector->valid = in + len;
+        done += len;
+    }
+
+    return done;
+}
+
+/* split a read record into sectors, appended unsorted */
+static int load_record(trace *t, gzFile gz, const trace_record *rec) {
+    const uint32_t sector_size = t->backend.sector_size;
+    uint64_t lba = le64toh(rec->offset) / sector_size;
+    uint32_t left = le32toh(rec->count);
+
+    if (le64toh(rec->offset) % sector_size)
+        return -1;
+
+    for (; left; lba++) {
+        uint32_t len = left < sector_size ? left : sector_size;
+        trace_sector *sector = insert_sector(t, t->nr_sectors, lba);
+
+        if (!sector || gzread(gz, sector->data, len) != len)
+            return -1;
+        sector->valid = len;
+        left -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Keep one sector per LBA. The first capture of a sector is the content the
+ * disk had before d2b wrote to it, later reads may only extend it.
+ */
+static void merge_sectors(trace *t) {
+    uint32_t i, n = 0;
+
+    qsort(t->sectors, t->nr_sectors, sizeof(trace_sector), sector_cmp);
+
+    for (i = 0; i < t->nr_sectors; i++) {
+        trace_sector *cur = &t->sectors[i];
+        trace_sector *last = n ? &t->sectors[n - 1] : NULL;
+
+        if (last && last->lba == cur->lba) {
+            if (cur->valid > last->valid) {
+                memcpy(last->data + last->valid, cur->data + last->valid,
+                       cur->valid - last->valid);
+                last->valid = cur->valid;
+            }
+            free(cur->data);
+            continue;
+        }
+
+        t->sectors[n++] = *cur;
+    }
+
+    t->nr_sectors = n;
+}
+
+static void free_trace(trace *t) {
+    uint32_t i;
+
+    for (i = 0; i < t->nr_sectors; i++)
+        free(t->sectors[i].data);
+    free(t->sectors);
+    free(t);
+}
+
+/*
+ * Load a trace and return an fd whose bdev calls are served from it. The fd
+ * refers to /dev/null, trace_close() releases the trace behind it.
+ */
+int trace_replay(const char *path) {
+    trace_header header;
+    trace_record rec;
+    uint8_t *skip = NULL;
+    gzFile gz;
+    trace *t;
+    int ret;
+
+    gz = gzopen(path, "rb");
+    if (!gz) {
+        printf("trace: failed to open %s, errno is %d\n", path, errno);
+        return -1;
+    }
+
+    t = calloc(1, sizeof(trace));
+    if (!t) {
+        printf("trace: failed to malloc\n");
+        gzclose(gz);
+        return -1;
+    }
+    t->fd = -1;
+
+    if (gzread(gz, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+        le32toh(header.version) != TRACE_VERSION ||
+        !le32toh(header.sector_size)) {
+        printf("trace: %s is not a d2b trace\n", path);
+        goto error;
+    }
+
+    t->backend.sector_size = le32toh(header.sector_size);
+    t->backend.physical_block_size = le32toh(header.physical_block_size);
+    t->backend.optimal_io_size = le32toh(header.optimal_io_size);
+    t->backend.size = le64toh(header.size);
+    t->backend.pread = replay_pread;
+    t->backend.pwrite = replay_pwrite;
+    t->backend.priv = t;
+
+    while ((ret = gzread(gz, &rec, sizeof(rec))) == sizeof(rec)) {
+        if (rec.op == TRACE_READ) {
+            if (load_record(t, gz, &rec))
+                break;
+            continue;
+        }
+
+        /* the writes of the capture are made again by the replay */
+        skip = realloc(skip, le32toh(rec.count));
+        if (!skip || gzread(gz, skip, le32toh(rec.count)) !=
+                         (int)le32toh(rec.count))
+            break;
+    }
+    free(skip);
+
+    if (ret != 0) {
+        printf("trace: %s is truncated or corrupted\n", path);
+        goto error;
+    }
+    gzclose(gz);
+    gz = NULL;
+
+    merge_sectors(t);
+
+    t->fd = open("/dev/null", O_RDWR);
+    if (t->fd < 0 || bdev_attach(t->fd, &t->backend)) {
+        printf("trace: failed to open /dev/null\n");
+        goto error;
+    }
+
+    printf("Info: replaying %u sectors of %lu bytes from %s\n", t->nr_sectors,
+           t->backend.size, path);
+    return t->fd;
+
+error:
+    if (gz)
+        gzclose(gz);
+    if (t->fd >= 0)
+        close(t->fd);
+    free_trace(t);
+    return -1;
+}
+
+/*
+ * Stop a capture and flush its trace, or release a replay. The fd itself is
+ * left to the caller.
+ */
+void trace_close(int fd) {
+    bdev_backend *backend = bdev_detach(fd);
+    trace *t;
+
+    if (!backend)
+        return;
+
+    t = backend->priv;
+    if (t->gz && gzclose(t->gz) != Z_OK)
+        printf("trace: failed to flush trace\n");
+    free_trace(t);
+}
@@ -0,0 +1,13 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * Capture of the sectors d2b reads and writes through bdev, with the probed
+ * geometry, into a gzip compressed trace; and replay of such a trace as a
+ * device held in memory.
+ */
+int trace_capture(int fd, const char *path);
+int trace_replay(const char *path);
+void trace_close(int fd);
+
+#endif
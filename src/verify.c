@@ -0,0 +1,606 @@
+#define _GNU_SOURCE
+#include "verify.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bdev.h"
+#include "workq.h"
+
+#define VERIFY_MAGIC "D2BVERIF"
+#define VERIFY_VERSION 1
+/* interior nodes of the tree are hashed with another seed than the data */
+#define VERIFY_NODE_SEED 1
+#define VERIFY_ALIGN 4096
+
+/*
+ * A manifest is the head, then one leaf for every chunk of the target in
+ * offset order. The root is the Merkle tree of the leaf hashes: pairs of
+ * hashes are hashed together level by level, an odd last one goes up as is.
+ */
+typedef struct _verify_head {
+    char magic[8]; // "D2BVERIF"
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t nr_leaves;
+    uint64_t root;
+} __attribute__((__packed__)) verify_head;
+
+typedef struct _verify_entry {
+    uint64_t offset; /* bytes into the target */
+    uint64_t length;
+    uint64_t hash;
+} __attribute__((__packed__)) verify_entry;
+
+enum {
+    VERIFY_PENDING = 0,
+    VERIFY_HASHED, /* the source hash is known */
+    VERIFY_DONE,   /* the target was read back */
+};
+
+typedef struct _verify_leaf {
+    uint64_t offset;
+    uint64_t length;
+    int state;
+    int has_source; /* no source for the chunks moved before a resume */
+    uint64_t source;
+    uint64_t target;
+} verify_leaf;
+
+struct _verify {
+    int fd;          /* O_DIRECT when the target allows it */
+    int buffered_fd; /* for the ranges O_DIRECT refuses */
+    workq *wq;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    verify_leaf *leaves;
+    uint64_t nr_leaves;
+    uint64_t max_leaves;
+    int error;
+};
+
+typedef struct _verify_task {
+    verify *v;
+    uint64_t leaf;
+    const uint8_t *data;
+    uint64_t length;
+} verify_task;
+
+/*
+ * XXH64, a non-cryptographic hash that runs at memory speed. A chunk is
+ * hashed by one worker, the chunks of a move by all of them.
+ */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t verify_xxh64(const uint8_t *data, size_t length, uint64_t seed) {
+    const uint8_t *p = data, *end = data + length;
+    uint64_t h;
+
+    if (length >= 32) {
+        const uint8_t *limit = end - 32;
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+
+    h += length;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* hashes is overwritten */
+static uint64_t merkle_root(uint64_t *hashes, uint64_t nr) {
+    uint64_t i, pair[2];
+
+    if (!nr)
+        return 0;
+
+    while (nr > 1) {
+        for (i = 0; i + 1 < nr; i += 2) {
+            pair[0] = htole64(hashes[i]);
+            pair[1] = htole64(hashes[i + 1]);
+            hashes[i / 2] = verify_xxh64((const uint8_t *)pair, sizeof(pair),
+                                         VERIFY_NODE_SEED);
+        }
+        if (nr % 2)
+            hashes[nr / 2] = hashes[nr - 1];
+        nr = (nr + 1) / 2;
+    }
+
+    return hashes[0];
+}
+
+static int pread_full(int fd, uint8_t *buffer, size_t count, uint64_t offset) {
+    while (count) {
+        ssize_t ret = bdev_timed_pread(fd, buffer, count, offset);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        /* past the end of an image file reads as a hole */
+        if (ret == 0) {
+            memset(buffer, 0, count);
+            return 0;
+        }
+        buffer += ret;
+        offset += ret;
+        count -= ret;
+    }
+
+    return 0;
+}
+
+static void hash_source(void *arg) {
+    verify_task *task = arg;
+    verify *v = task->v;
+    uint64_t hash = verify_xxh64(task->data, task->length, 0);
+
+    pthread_mutex_lock(&v->lock);
+    v->leaves[task->leaf].source = hash;
+    v->leaves[task->leaf].state = VERIFY_HASHED;
+    pthread_cond_broadcast(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+
+    free(task);
+}
+
+/* read the chunk back from the target, past the page cache if possible */
+static void hash_target(void *arg) {
+    verify_task *task = arg;
+    verify *v = task->v;
+    uint64_t offset, hash = 0;
+    uint8_t *buffer = NULL;
+    size_t size = (task->length + VERIFY_ALIGN - 1) & ~(VERIFY_ALIGN - 1);
+    int err = 0;
+
+    pthread_mutex_lock(&v->lock);
+    offset = v->leaves[task->leaf].offset;
+    pthread_mutex_unlock(&v->lock);
+
+    if (posix_memalign((void **)&buffer, VERIFY_ALIGN, size)) {
+        err = ENOMEM;
+    } else if (pread_full(v->fd, buffer, task->length, offset) &&
+               (errno != EINVAL || v->fd == v->buffered_fd ||
+                pread_full(v->buffered_fd, buffer, task->length, offset))) {
+        err = errno;
+    } else {
+        hash = verify_xxh64(buffer, task->length, 0);
+    }
+    free(buffer);
+
+    pthread_mutex_lock(&v->lock);
+    if (err) {
+        printf("verify: failed to read back offset %lu, errno is %d\n",
+               offset, err);
+        v->error = err;
+    }
+    v->leaves[task->leaf].target = hash;
+    v->leaves[task->leaf].state = VERIFY_DONE;
+    pthread_mutex_unlock(&v->lock);
+
+    free(task);
+}
+
+static int submit(verify *v, workq_fn fn, uint64_t leaf, const uint8_t *data,
+                  uint64_t length) {
+    verify_task *task = malloc(sizeof(verify_task));
+
+    if (!task) {
+        printf("verify: failed to malloc\n");
+        return -1;
+    }
+
+    task->v = v;
+    task->leaf = leaf;
+    task->data = data;
+    task->length = length;
+    if (workq_submit(v->wq, fn, task)) {
+        free(task);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int add_leaf(verify *v, uint64_t offset, uint64_t length,
+                    uint64_t *leaf) {
+    verify_leaf *l;
+
+    pthread_mutex_lock(&v->lock);
+    if (v->nr_leaves == v->max_leaves) {
+        uint64_t max = v->max_leaves ? v->max_leaves * 2 : 256;
+        verify_leaf *leaves = realloc(v->leaves, max * sizeof(verify_leaf));
+
+        if (!leaves) {
+            pthread_mutex_unlock(&v->lock);
+            printf("verify: failed to malloc\n");
+            return -1;
+        }
+        v->leaves = leaves;
+        v->max_leaves = max;
+    }
+
+    *leaf = v->nr_leaves++;
+    l = &v->leaves[*leaf];
+    memset(l, 0, sizeof(*l));
+    l->offset = offset;
+    l->length = length;
+    pthread_mutex_unlock(&v->lock);
+
+    return 0;
+}
+
+/*
+ * Verify the chunks written to dst_fd. The target is reopened with O_DIRECT
+ * so what is read back comes from the device, not from the page cache.
+ */
+verify *verify_create(int dst_fd, int nr_threads) {
+    char path[64];
+    verify *v;
+
+    v = calloc(1, sizeof(verify));
+    if (!v) {
+        printf("verify: failed to malloc\n");
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", dst_fd);
+    v->buffered_fd = open(path, O_RDONLY);
+    if (v->buffered_fd < 0) {
+        printf("verify: failed to reopen the target, errno is %d\n", errno);
+        free(v);
+        return NULL;
+    }
+
+    v->fd = open(path, O_RDONLY | O_DIRECT);
+    if (v->fd < 0) {
+        printf("Warning: the target does not support O_DIRECT, chunks are "
+               "read back through the page cache\n");
+        v->fd = v->buffered_fd;
+    }
+
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->cond, NULL);
+    v->wq = workq_create(nr_threads, 0);
+    if (!v->wq) {
+        verify_destroy(v);
+        return NULL;
+    }
+
+    return v;
+}
+
+/*
+ * Start hashing a chunk that is about to be written at dst_offset. data must
+ * stay valid until verify_end_chunk(). Without data, for a chunk written
+ * earlier, the leaf takes the hash read back from the target.
+ */
+int verify_begin_chunk(verify *v, uint64_t dst_offset, const uint8_t *data,
+                       uint32_t length, uint64_t *leaf) {
+    if (add_leaf(v, dst_offset, length, leaf))
+        return -1;
+
+    if (!data) {
+        pthread_mutex_lock(&v->lock);
+        v->leaves[*leaf].state = VERIFY_HASHED;
+        pthread_mutex_unlock(&v->lock);
+        return 0;
+    }
+
+    pthread_mutex_lock(&v->lock);
+    v->leaves[*leaf].has_source = 1;
+    pthread_mutex_unlock(&v->lock);
+
+    return submit(v, hash_source, *leaf, data, length);
+}
+
+/* Wait for the hash of the data, then read the chunk back from the target. */
+int verify_end_chunk(verify *v, uint64_t leaf) {
+    uint64_t length;
+
+    pthread_mutex_lock(&v->lock);
+    while (v->leaves[leaf].state == VERIFY_PENDING)
+        pthread_cond_wait(&v->cond, &v->lock);
+    length = v->leaves[leaf].length;
+    pthread_mutex_unlock(&v->lock);
+
+    return submit(v, hash_target, leaf, NULL, length);
+}
+
+static int leaf_cmp(const void *a, const void *b) {
+    const verify_leaf *x = a, *y = b;
+
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return 0;
+}
+
+static int write_manifest(const char *path, const verify_leaf *leaves,
+                          uint64_t nr, uint64_t root) {
+    verify_head head;
+    verify_entry entry;
+    uint64_t i;
+    FILE *file;
+    int ret = 0;
+
+    file = fopen(path, "w");
+    if (!file) {
+        printf("Error: failed to create %s, errno is %d\n", path, errno);
+        return -1;
+    }
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, VERIFY_MAGIC, sizeof(head.magic));
+    head.version = htole32(VERIFY_VERSION);
+    head.nr_leaves = htole64(nr);
+    head.root = htole64(root);
+    if (fwrite(&head, sizeof(head), 1, file) != 1)
+        ret = -1;
+
+    for (i = 0; i < nr && !ret; i++) {
+        entry.offset = htole64(leaves[i].offset);
+        entry.length = htole64(leaves[i].length);
+        entry.hash = htole64(leaves[i].target);
+        if (fwrite(&entry, sizeof(entry), 1, file) != 1)
+            ret = -1;
+    }
+
+    if (fflush(file) || fsync(fileno(file)))
+        ret = -1;
+    if (fclose(file))
+        ret = -1;
+    if (ret)
+        printf("Error: failed to write %s, errno is %d\n", path, errno);
+
+    return ret;
+}
+
+/*
+ * Wait for every chunk to be read back and compare it with its source. The
+ * manifest is written, if asked, only when all of them match.
+ */
+int verify_finish(verify *v, const char *manifest) {
+    uint64_t i, *hashes, bytes = 0, bad = 0, root;
+    int ret = -1;
+
+    workq_wait(v->wq);
+    if (v->error)
+        return -1;
+
+    qsort(v->leaves, v->nr_leaves, sizeof(verify_leaf), leaf_cmp);
+    for (i = 0; i < v->nr_leaves; i++) {
+        const verify_leaf *leaf = &v->leaves[i];
+
+        bytes += leaf->length;
+        if (leaf->has_source && leaf->source != leaf->target) {
+            printf("Error: %lu bytes at offset %lu differ from the source\n",
+                   leaf->length, leaf->offset);
+            bad++;
+        }
+    }
+
+    hashes = malloc((v->nr_leaves ? v->nr_leaves : 1) * sizeof(uint64_t));
+    if (!hashes) {
+        printf("verify: failed to malloc\n");
+        return -1;
+    }
+    for (i = 0; i < v->nr_leaves; i++)
+        hashes[i] = v->leaves[i].target;
+    root = merkle_root(hashes, v->nr_leaves);
+    free(hashes);
+
+    if (bad) {
+        printf("Error: %lu of %lu chunks differ\n", bad, v->nr_leaves);
+        return -1;
+    }
+
+    printf("Info: %lu chunks, %lu MiB read back and verified\n",
+           v->nr_leaves, bytes >> 20);
+
+    ret = 0;
+    if (manifest) {
+        ret = write_manifest(manifest, v->leaves, v->nr_leaves, root);
+        if (!ret)
+            printf("Info: manifest written to %s, root %016lx\n", manifest,
+                   root);
+    }
+
+    return ret;
+}
+
+void verify_destroy(verify *v) {
+    if (!v)
+        return;
+
+    if (v->wq)
+        workq_destroy(v->wq);
+    if (v->fd != v->buffered_fd)
+        close(v->fd);
+    close(v->buffered_fd);
+    pthread_cond_destroy(&v->cond);
+    pthread_mutex_destroy(&v->lock);
+    free(v->leaves);
+    free(v);
+}
+
+static verify_entry *read_manifest(const char *path, uint64_t *nr,
+                                   uint64_t *root) {
+    verify_entry *entries = NULL;
+    verify_head head;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file) {
+        printf("Error: failed to open %s, errno is %d\n", path, errno);
+        return NULL;
+    }
+
+    if (fread(&head, sizeof(head), 1, file) != 1 ||
+        memcmp(head.magic, VERIFY_MAGIC, sizeof(head.magic)) ||
+        le32toh(head.version) != VERIFY_VERSION) {
+        printf("Error: %s is not a manifest\n", path);
+        goto out;
+    }
+
+    *nr = le64toh(head.nr_leaves);
+    *root = le64toh(head.root);
+    entries = malloc((*nr ? *nr : 1) * sizeof(verify_entry));
+    if (!entries) {
+        printf("verify: failed to malloc\n");
+        goto out;
+    }
+    if (fread(entries, sizeof(verify_entry), *nr, file) != *nr) {
+        printf("Error: %s is truncated\n", path);
+        free(entries);
+        entries = NULL;
+    }
+
+out:
+    fclose(file);
+    return entries;
+}
+
+/*
+ * Check the target against a manifest. The leaves must rebuild the root, then
+ * the chunks from first on, count of them or all with 0, are read and hashed
+ * in parallel, so a large target can be audited a slice at a time.
+ */
+int verify_audit(int fd, const char *manifest, int nr_threads, uint64_t first,
+                 uint64_t count) {
+    verify_entry *entries;
+    uint64_t nr, root, i, leaf, *hashes;
+    verify *v = NULL;
+    int ret = -1;
+
+    entries = read_manifest(manifest, &nr, &root);
+    if (!entries)
+        return -1;
+
+    hashes = malloc((nr ? nr : 1) * sizeof(uint64_t));
+    if (!hashes) {
+        printf("verify: failed to malloc\n");
+        goto out;
+    }
+    for (i = 0; i < nr; i++)
+        hashes[i] = le64toh(entries[i].hash);
+    if (merkle_root(hashes, nr) != root) {
+        printf("Error: the chunks of %s do not match its root\n", manifest);
+        free(hashes);
+        goto out;
+    }
+    free(hashes);
+
+    if (first >= nr) {
+        printf("Error: %s has %lu chunks\n", manifest, nr);
+        goto out;
+    }
+    if (!count || count > nr - first)
+        count = nr - first;
+
+    v = verify_create(fd, nr_threads);
+    if (!v)
+        goto out;
+
+    for (i = first; i < first + count; i++) {
+        if (add_leaf(v, le64toh(entries[i].offset), le64toh(entries[i].length),
+                     &leaf))
+            goto out;
+
+        pthread_mutex_lock(&v->lock);
+        v->leaves[leaf].has_source = 1;
+        v->leaves[leaf].source = le64toh(entries[i].hash);
+        v->leaves[leaf].state = VERIFY_HASHED;
+        pthread_mutex_unlock(&v->lock);
+
+        if (submit(v, hash_target, leaf, NULL, v->leaves[leaf].length))
+            goto out;
+    }
+
+    printf("Info: auditing chunks %lu to %lu of %lu\n", first,
+           first + count - 1, nr);
+    ret = verify_finish(v, NULL);
+
+out:
+    if (v) {
+        workq_wait(v->wq);
+        verify_destroy(v);
+    }
+    free(entries);
+    return ret;
+}
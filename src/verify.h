@@ -0,0 +1,21 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _verify verify;
+
+uint64_t verify_xxh64(const uint8_t *data, size_t length, uint64_t seed);
+
+verify *verify_create(int dst_fd, int nr_threads);
+int verify_begin_chunk(verify *v, uint64_t dst_offset, const uint8_t *data,
+                       uint32_t length, uint64_t *leaf);
+int verify_end_chunk(verify *v, uint64_t leaf);
+int verify_finish(verify *v, const char *manifest);
+void verify_destroy(verify *v);
+
+int verify_audit(int fd, const char *manifest, int nr_threads, uint64_t first,
+                 uint64_t count);
+
+#endif
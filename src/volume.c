@@ -0,0 +1,119 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bdev.h"
+#include "ldm.h"
+#include "volume.h"
+
+static int volume_extent_cmp(const void *a, const void *b) {
+    const volume_extent *x = a, *y = b;
+
+    if (x->offset < y->offset)
+        return -1;
+    return x->offset > y->offset;
+}
+
+/*
+ * Collect the extents of a volume from the partitions found on the disk. The
+ * data is read from the location it had before any realignment.
+ */
+int volume_open(int fd, struct list_head *new_entries, uint32_t volume_id,
+                volume *vol) {
+    struct list_head *pos;
+    uint32_t i = 0;
+
+    memset(vol, 0, sizeof(*vol));
+    vol->fd = fd;
+    vol->id = volume_id;
+    vol->sector_size = bdev_get_sector_size(fd);
+
+    list_for_each(pos, new_entries) {
+        partition_data *part = list_entry(pos, partition_data, list);
+        if (part->volume_id == volume_id)
+            vol->nr_extents++;
+    }
+
+    if (!vol->nr_extents) {
+        printf("volume: not found volume, id: %u\n", volume_id);
+        return -1;
+    }
+
+    vol->extents = calloc(vol->nr_extents, sizeof(volume_extent));
+    if (!vol->extents) {
+        printf("volume: failed to malloc\n");
+        return -1;
+    }
+
+    list_for_each(pos, new_entries) {
+        partition_data *part = list_entry(pos, partition_data, list);
+        if (part->volume_id != volume_id)
+            continue;
+
+        vol->extents[i].offset = part->offset;
+        vol->extents[i].start = part->old_start;
+        vol->extents[i].size = part->size;
+        if (part->offset + part->size > vol->size)
+            vol->size = part->offset + part->size;
+        i++;
+    }
+
+    qsort(vol->extents, vol->nr_extents, sizeof(volume_extent),
+          volume_extent_cmp);
+
+    return 0;
+}
+
+void volume_close(volume *vol) {
+    free(vol->extents);
+    vol->extents = NULL;
+    vol->nr_extents = 0;
+}
+
+int volume_read(const volume *vol, uint64_t offset, uint8_t *buffer,
+                size_t count) {
+    uint64_t sector_size = vol->sector_size;
+    uint32_t i;
+
+    for (i = 0; i < vol->nr_extents && count > 0; i++) {
+        const volume_extent *ext = &vol->extents[i];
+        uint64_t ext_start = ext->offset * sector_size;
+        uint64_t ext_end = ext_start + ext->size * sector_size;
+
+        if (offset < ext_start) {
+            printf("volume: offset %lu is not mapped\n", offset);
+            return -1;
+        }
+
+        while (offset < ext_end && count > 0) {
+            size_t len = count;
+            ssize_t ret;
+
+            if (len > ext_end - offset)
+                len = ext_end - offset;
+
+            ret = bdev_timed_pread(vol->fd, buffer, len,
+                                   ext->start * sector_size + offset -
+                                       ext_start);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0) {
+                printf("volume: failed to read, errno is %d\n", errno);
+                return -1;
+            }
+
+            buffer += ret;
+            offset += ret;
+            count -= ret;
+        }
+    }
+
+    if (count > 0) {
+        printf("volume: read beyond the end of volume %u\n", vol->id);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __VOLUME_H__
+#define __VOLUME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "list.h"
+
+typedef struct _volume_extent {
+    uint64_t offset; /* offset in the volume, sectors */
+    uint64_t start;  /* lba on the disk */
+    uint64_t size;   /* sectors */
+} volume_extent;
+
+typedef struct _volume {
+    int fd;
+    uint32_t id;
+    uint32_t sector_size;
+    uint64_t size; /* sectors */
+    uint32_t nr_extents;
+    volume_extent *extents;
+} volume;
+
+int volume_open(int fd, struct list_head *new_entries, uint32_t volume_id,
+                volume *vol);
+void volume_close(volume *vol);
+int volume_read(const volume *vol, uint64_t offset, uint8_t *buffer,
+                size_t count);
+
+#endif
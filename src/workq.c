@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "workq.h"
+
+typedef struct _workq_item {
+    workq_fn fn;
+    void *arg;
+} workq_item;
+
+struct _workq {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t idle;
+
+    workq_item *items; /* ring of pending work */
+    int max_pending;
+    int head, count;
+    int running;
+    int stop;
+
+    int nr_threads;
+    pthread_t *threads;
+};
+
+static void *workq_worker(void *arg) {
+    workq *wq = arg;
+
+    pthread_mutex_lock(&wq->lock);
+    for (;;) {
+        workq_item item;
+
+        while (!wq->count && !wq->stop)
+            pthread_cond_wait(&wq->not_empty, &wq->lock);
+        if (!wq->count && wq->stop)
+            break;
+
+        item = wq->items[wq->head];
+        wq->head = (wq->head + 1) % wq->max_pending;
+        wq->count--;
+        wq->running++;
+        pthread_cond_signal(&wq->not_full);
+        pthread_mutex_unlock(&wq->lock);
+
+        item.fn(item.arg);
+
+        pthread_mutex_lock(&wq->lock);
+        wq->running--;
+        if (!wq->count && !wq->running)
+            pthread_cond_broadcast(&wq->idle);
+    }
+    pthread_mutex_unlock(&wq->lock);
+
+    return NULL;
+}
+
+workq *workq_create(int nr_threads, int max_pending) {
+    workq *wq;
+    int i;
+
+    wq = calloc(1, sizeof(workq));
+    if (!wq) {
+        printf("workq: failed to malloc\n");
+        return NULL;
+    }
+
+    wq->max_pending = max_pending > 0 ? max_pending : nr_threads * 2;
+    wq->items = calloc(wq->max_pending, sizeof(workq_item));
+    wq->threads = calloc(nr_threads, sizeof(pthread_t));
+    if (!wq->items || !wq->threads) {
+        printf("workq: failed to malloc\n");
+        free(wq->items);
+        free(wq->threads);
+        free(wq);
+        return NULL;
+    }
+
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->not_empty, NULL);
+    pthread_cond_init(&wq->not_full, NULL);
+    pthread_cond_init(&wq->idle, NULL);
+
+    for (i = 0; i < nr_threads; i++) {
+        if (pthread_create(&wq->threads[i], NULL, workq_worker, wq)) {
+            printf("workq: failed to create thread\n");
+            break;
+        }
+        wq->nr_threads++;
+    }
+
+    if (!wq->nr_threads) {
+        workq_destroy(wq);
+        return NULL;
+    }
+
+    return wq;
+}
+
+/*
+ * Queue work, blocking while max_pending items wait for a worker.
+ */
+int workq_submit(workq *wq, workq_fn fn, void *arg) {
+    pthread_mutex_lock(&wq->lock);
+    while (wq->count == wq->max_pending && !wq->stop)
+        pthread_cond_wait(&wq->not_full, &wq->lock);
+
+    if (wq->stop) {
+        pthread_mutex_unlock(&wq->lock);
+        return -1;
+    }
+
+    wq->items[(wq->head + wq->count) % wq->max_pending].fn = fn;
+    wq->items[(wq->head + wq->count) % wq->max_pending].arg = arg;
+    wq->count++;
+    pthread_cond_signal(&wq->not_empty);
+    pthread_mutex_unlock(&wq->lock);
+
+    return 0;
+}
+
+void workq_wait(workq *wq) {
+    pthread_mutex_lock(&wq->lock);
+    while (wq->count || wq->running)
+        pthread_cond_wait(&wq->idle, &wq->lock);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+void workq_destroy(workq *wq) {
+    int i;
+
+    pthread_mutex_lock(&wq->lock);
+    wq->stop = 1;
+    pthread_cond_broadcast(&wq->not_empty);
+    pthread_cond_broadcast(&wq->not_full);
+    pthread_mutex_unlock(&wq->lock);
+
+    for (i = 0; i < wq->nr_threads; i++)
+        pthread_join(wq->threads[i], NULL);
+
+    pthread_cond_destroy(&wq->idle);
+    pthread_cond_destroy(&wq->not_full);
+    pthread_cond_destroy(&wq->not_empty);
+    pthread_mutex_destroy(&wq->lock);
+    free(wq->threads);
+    free(wq->items);
+    free(wq);
+}
+
+int workq_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? n : 1;
+}
@@ -0,0 +1,14 @@
+#ifndef __WORKQ_H__
+#define __WORKQ_H__
+
+typedef void (*workq_fn)(void *arg);
+
+typedef struct _workq workq;
+
+workq *workq_create(int nr_threads, int max_pending);
+int workq_submit(workq *wq, workq_fn fn, void *arg);
+void workq_wait(workq *wq);
+void workq_destroy(workq *wq);
+int workq_default_threads(void);
+
+#endif